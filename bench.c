@@ -0,0 +1,1646 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eval.h"
+#include "eval_parallel.h"
+#include "eval_port.h"
+
+#ifndef _WIN32
+#include <regex.h>
+#endif
+
+/*
+ * eval_bench - benchmarks for the eval library.
+ *
+ * Usage: eval_bench [--json] [--samples N] [case...]
+ *
+ * All inputs are generated from a fixed seed so numbers are comparable
+ * between runs and between builds.
+ */
+
+#define BENCH_SEED                  20161108u
+#define BENCH_NR_RULES              50000
+
+typedef struct
+{
+    const char *name;
+    void (*run)(void);
+    int micro;
+} BenchCase;
+
+static unsigned int bench_rand_state = BENCH_SEED;
+
+static unsigned int bench_rand(void)
+{
+    /* xorshift32, fixed across platforms unlike rand() */
+    unsigned int x = bench_rand_state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    bench_rand_state = x;
+
+    return x;
+}
+
+static void bench_seed(void)
+{
+    bench_rand_state = BENCH_SEED;
+}
+
+static size_t bench_append(char *buff, size_t size, size_t len, const char *str)
+{
+    size_t n = strlen(str);
+
+    if (len + n < size)
+    {
+        memcpy(buff + len, str, n + 1);
+        return len + n;
+    }
+
+    return len;
+}
+
+/* a random rule in the style of binding/alert rules */
+static size_t bench_gen_term(char *buff, size_t size, size_t len, int depth)
+{
+    static const char *VARS[] = {"$temp", "$width", "$height", "$state", "$name", "$ratio", "$PI"};
+    static const char *FUNCS[] = {"floor", "sqrt", "strlen", "toupper", "number", "round"};
+    static const char *OPS[] = {" + ", " - ", " * ", " / ", " > ", " < ", " == ", " && ", " || ", " != "};
+    char num[32];
+    unsigned int r = bench_rand() % 10;
+
+    if (depth > 0 && r < 3)
+    {
+        len = bench_append(buff, size, len, "(");
+        len = bench_gen_term(buff, size, len, depth - 1);
+        len = bench_append(buff, size, len, OPS[bench_rand() % 10]);
+        len = bench_gen_term(buff, size, len, depth - 1);
+        return bench_append(buff, size, len, ")");
+    }
+    else if (depth > 0 && r < 4)
+    {
+        len = bench_append(buff, size, len, FUNCS[bench_rand() % 6]);
+        len = bench_append(buff, size, len, "(");
+        len = bench_gen_term(buff, size, len, depth - 1);
+        return bench_append(buff, size, len, ")");
+    }
+    else if (r < 6)
+    {
+        return bench_append(buff, size, len, VARS[bench_rand() % 7]);
+    }
+    else if (r < 7)
+    {
+        sprintf(num, "\"s%u\"", bench_rand() % 100);
+        return bench_append(buff, size, len, num);
+    }
+
+    sprintf(num, "%u.%u", bench_rand() % 1000, bench_rand() % 100);
+    return bench_append(buff, size, len, num);
+}
+
+static char *bench_gen_rule(void)
+{
+    char buff[512];
+    size_t len = 0;
+    int i;
+    int n = 1 + (int)(bench_rand() % 4);
+
+    buff[0] = '\0';
+    for (i = 0; i < n; i++)
+    {
+        if (i)
+            len = bench_append(buff, sizeof(buff), len, (bench_rand() & 1) ? " && " : " + ");
+        len = bench_gen_term(buff, sizeof(buff), len, 3);
+    }
+
+    return strdup(buff);
+}
+
+static char **bench_gen_rules(size_t n)
+{
+    char **rules = (char **)malloc(n * sizeof(char *));
+    size_t i;
+
+    bench_seed();
+    for (i = 0; i < n; i++)
+    {
+        rules[i] = bench_gen_rule();
+    }
+
+    return rules;
+}
+
+static void bench_free_rules(char **rules, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        free(rules[i]);
+    }
+    free(rules);
+}
+
+static void bench_free_programs(EvalProgram **programs, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        eval_program_destroy(programs[i]);
+        programs[i] = NULL;
+    }
+}
+
+static int bench_same_programs(EvalProgram **a, EvalProgram **b, size_t n)
+{
+    ExprValue x;
+    ExprValue y;
+    size_t i;
+    int same = 1;
+
+    expr_value_init(&x);
+    expr_value_init(&y);
+    for (i = 0; i < n && same; i++)
+    {
+        if ((a[i] == NULL) != (b[i] == NULL))
+            same = 0;
+        else if (a[i] && (eval_program_to_string(a[i], &x) != EVAL_RESULT_OK ||
+                          eval_program_to_string(b[i], &y) != EVAL_RESULT_OK ||
+                          strcmp(expr_value_get_string(&x), expr_value_get_string(&y)) != 0))
+            same = 0;
+    }
+    expr_value_clear(&x);
+    expr_value_clear(&y);
+
+    return same;
+}
+
+static void bench_compile_scaling(void)
+{
+    static const size_t THREADS[] = {1, 2, 4, 8, 16};
+    char **rules = bench_gen_rules(BENCH_NR_RULES);
+    EvalProgram **base = (EvalProgram **)calloc(BENCH_NR_RULES, sizeof(EvalProgram *));
+    EvalProgram **programs = (EvalProgram **)calloc(BENCH_NR_RULES, sizeof(EvalProgram *));
+    EvalResult *base_results = (EvalResult *)calloc(BENCH_NR_RULES, sizeof(EvalResult));
+    EvalResult *results = (EvalResult *)calloc(BENCH_NR_RULES, sizeof(EvalResult));
+    double base_ms = 0;
+    size_t i;
+
+    printf("compile_scaling: %d rules\n", BENCH_NR_RULES);
+    printf("  %8s %10s %12s %8s %s\n", "threads", "ms", "rules/s", "speedup", "deterministic");
+
+    for (i = 0; i < sizeof(THREADS) / sizeof(*THREADS); i++)
+    {
+        EvalThreadPool *pool = NULL;
+        unsigned long long start;
+        double ms;
+        int same = 1;
+
+        eval_thread_pool_create(THREADS[i], &pool);
+
+        start = eval_port_now_ns();
+        eval_compile_batch(pool, (const char *const *)rules, BENCH_NR_RULES, i ? programs : base,
+                           i ? results : base_results);
+        ms = (double)(eval_port_now_ns() - start) / 1e6;
+
+        eval_thread_pool_destroy(pool);
+
+        if (i == 0)
+        {
+            base_ms = ms;
+        }
+        else
+        {
+            same = memcmp(base_results, results, BENCH_NR_RULES * sizeof(EvalResult)) == 0 &&
+                   bench_same_programs(base, programs, BENCH_NR_RULES);
+            bench_free_programs(programs, BENCH_NR_RULES);
+        }
+
+        printf("  %8u %10.2f %12.0f %8.2f %s\n", (unsigned int)THREADS[i], ms,
+               BENCH_NR_RULES / (ms / 1e3), base_ms / ms, same ? "yes" : "NO");
+    }
+
+    bench_free_programs(base, BENCH_NR_RULES);
+    free(base);
+    free(programs);
+    free(base_results);
+    free(results);
+    bench_free_rules(rules, BENCH_NR_RULES);
+}
+
+/* telemetry style rows: numeric columns plus one string column */
+typedef struct
+{
+    size_t nr_rows;
+    double *temp;
+    double *limit;
+    double *ratio;
+    const char **state;
+    EvalColumn columns[4];
+    EvalRowSet rows;
+} BenchRows;
+
+static void bench_rows_init(BenchRows *r, size_t nr_rows)
+{
+    static const char *STATES[] = {"ok", "maint", "alarm", "idle"};
+    size_t i;
+
+    bench_seed();
+    r->nr_rows = nr_rows;
+    r->temp = (double *)malloc(nr_rows * sizeof(double));
+    r->limit = (double *)malloc(nr_rows * sizeof(double));
+    r->ratio = (double *)malloc(nr_rows * sizeof(double));
+    r->state = (const char **)malloc(nr_rows * sizeof(char *));
+
+    for (i = 0; i < nr_rows; i++)
+    {
+        r->temp[i] = (double)(bench_rand() % 12000) / 100.0;
+        r->limit[i] = 60 + (double)(bench_rand() % 40);
+        r->ratio[i] = (double)(bench_rand() % 1000) / 1000.0;
+        r->state[i] = STATES[bench_rand() % 4];
+    }
+
+    r->columns[0].name = "temp";
+    r->columns[0].type = EXPR_VALUE_TYPE_NUMBER;
+    r->columns[0].numbers = r->temp;
+    r->columns[0].strings = NULL;
+    r->columns[1].name = "limit";
+    r->columns[1].type = EXPR_VALUE_TYPE_NUMBER;
+    r->columns[1].numbers = r->limit;
+    r->columns[1].strings = NULL;
+    r->columns[2].name = "ratio";
+    r->columns[2].type = EXPR_VALUE_TYPE_NUMBER;
+    r->columns[2].numbers = r->ratio;
+    r->columns[2].strings = NULL;
+    r->columns[3].name = "state";
+    r->columns[3].type = EXPR_VALUE_TYPE_STRING;
+    r->columns[3].numbers = NULL;
+    r->columns[3].strings = r->state;
+    r->rows.nr_rows = nr_rows;
+    r->rows.nr_columns = 4;
+    r->rows.columns = r->columns;
+}
+
+static void bench_rows_deinit(BenchRows *r)
+{
+    free(r->temp);
+    free(r->limit);
+    free(r->ratio);
+    free((void *)r->state);
+}
+
+typedef struct
+{
+    const BenchRows *rows;
+    size_t row;
+} BenchRowCursor;
+
+/* what a host does without row sets: look the column up by name on every access */
+static EvalResult bench_row_get_variable(const char *name, void *user_data, ExprValue *output)
+{
+    BenchRowCursor *cursor = (BenchRowCursor *)user_data;
+    const EvalRowSet *rows = &cursor->rows->rows;
+    size_t i;
+
+    for (i = 0; i < rows->nr_columns; i++)
+    {
+        const EvalColumn *c = rows->columns + i;
+
+        if (strcmp(c->name, name) == 0)
+        {
+            if (c->type == EXPR_VALUE_TYPE_NUMBER)
+                return expr_value_set_number(output, c->numbers[cursor->row]);
+            return expr_value_set_string(output, c->strings[cursor->row], strlen(c->strings[cursor->row]));
+        }
+    }
+
+    return eval_default_hooks()->get_variable(name, NULL, output);
+}
+
+static const EvalHooks *bench_row_hooks(void)
+{
+    static EvalHooks hooks;
+
+    hooks.get_func = eval_default_hooks()->get_func;
+    hooks.get_variable = bench_row_get_variable;
+
+    return &hooks;
+}
+
+#define BENCH_NR_ROWS               1000000
+#define BENCH_ROWS_RULE             "($temp * 1.8 + 32 > $limit * 1.8 + 32) && ($ratio < 0.5) + floor($temp / 10)"
+
+static void bench_clear_outputs(ExprValue *outputs, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        expr_value_clear(outputs + i);
+    }
+}
+
+static void bench_rows_scaling(void)
+{
+    static const size_t THREADS[] = {1, 2, 4, 8, 16};
+    ExprValue *outputs = (ExprValue *)calloc(BENCH_NR_ROWS, sizeof(ExprValue));
+    EvalProgram *program = NULL;
+    BenchRows rows;
+    BenchRowCursor cursor;
+    unsigned long long start;
+    double base_ms;
+    size_t i;
+
+    bench_rows_init(&rows, BENCH_NR_ROWS);
+    eval_compile(BENCH_ROWS_RULE, &program);
+
+    printf("rows_scaling: %d rows, %s\n", BENCH_NR_ROWS, BENCH_ROWS_RULE);
+    printf("  %-24s %10s %12s %8s\n", "mode", "ms", "rows/s", "speedup");
+
+    cursor.rows = &rows;
+    start = eval_port_now_ns();
+    for (i = 0; i < BENCH_NR_ROWS; i++)
+    {
+        cursor.row = i;
+        eval_program_execute(program, bench_row_hooks(), &cursor, outputs + i);
+    }
+    base_ms = (double)(eval_port_now_ns() - start) / 1e6;
+    bench_clear_outputs(outputs, BENCH_NR_ROWS);
+    printf("  %-24s %10.2f %12.0f %8.2f\n", "per-row hooks", base_ms, BENCH_NR_ROWS / (base_ms / 1e3), 1.0);
+
+    for (i = 0; i < sizeof(THREADS) / sizeof(*THREADS); i++)
+    {
+        EvalThreadPool *pool = NULL;
+        char mode[32];
+        double ms;
+
+        eval_thread_pool_create(THREADS[i], &pool);
+        start = eval_port_now_ns();
+        eval_rows_execute(pool, program, &rows.rows, eval_default_hooks(), NULL, outputs, NULL);
+        ms = (double)(eval_port_now_ns() - start) / 1e6;
+        eval_thread_pool_destroy(pool);
+        bench_clear_outputs(outputs, BENCH_NR_ROWS);
+
+        sprintf(mode, "eval_rows_execute x%u", (unsigned int)THREADS[i]);
+        printf("  %-24s %10.2f %12.0f %8.2f\n", mode, ms, BENCH_NR_ROWS / (ms / 1e3), base_ms / ms);
+    }
+
+    eval_program_destroy(program);
+    bench_rows_deinit(&rows);
+    free(outputs);
+}
+
+#define BENCH_AGGREGATE_RULE        "$temp * 1.8 + 32"
+
+static void bench_aggregate(void)
+{
+    static const size_t THREADS[] = {1, 2, 4, 8, 16};
+    ExprValue *outputs = (ExprValue *)calloc(BENCH_NR_ROWS, sizeof(ExprValue));
+    EvalProgram *program = NULL;
+    EvalAggregate aggregate;
+    BenchRows rows;
+    BenchRowCursor cursor;
+    unsigned long long start;
+    double sum = 0;
+    double min = HUGE_VAL;
+    double max = -HUGE_VAL;
+    double base_ms;
+    size_t i;
+
+    bench_rows_init(&rows, BENCH_NR_ROWS);
+    eval_compile(BENCH_AGGREGATE_RULE, &program);
+
+    printf("aggregate: %d rows, sum/mean/min/max/count/variance of %s\n", BENCH_NR_ROWS, BENCH_AGGREGATE_RULE);
+    printf("  %-24s %10s %12s %8s %s\n", "mode", "ms", "rows/s", "speedup", "mean");
+
+    /* the host side approach: one ExprValue per row, then a second pass */
+    cursor.rows = &rows;
+    start = eval_port_now_ns();
+    for (i = 0; i < BENCH_NR_ROWS; i++)
+    {
+        cursor.row = i;
+        eval_program_execute(program, bench_row_hooks(), &cursor, outputs + i);
+    }
+    for (i = 0; i < BENCH_NR_ROWS; i++)
+    {
+        double x = expr_value_get_number(outputs + i);
+
+        sum += x;
+        min = x < min ? x : min;
+        max = x > max ? x : max;
+    }
+    base_ms = (double)(eval_port_now_ns() - start) / 1e6;
+    bench_clear_outputs(outputs, BENCH_NR_ROWS);
+    printf("  %-24s %10.2f %12.0f %8.2f %.6f\n", "per-row + host reduce", base_ms, BENCH_NR_ROWS / (base_ms / 1e3),
+           1.0, sum / BENCH_NR_ROWS);
+
+    for (i = 0; i < sizeof(THREADS) / sizeof(*THREADS); i++)
+    {
+        EvalThreadPool *pool = NULL;
+        char mode[32];
+        double ms;
+
+        eval_thread_pool_create(THREADS[i], &pool);
+        start = eval_port_now_ns();
+        eval_rows_aggregate(pool, program, &rows.rows, eval_default_hooks(), NULL, &aggregate);
+        ms = (double)(eval_port_now_ns() - start) / 1e6;
+        eval_thread_pool_destroy(pool);
+
+        sprintf(mode, "eval_rows_aggregate x%u", (unsigned int)THREADS[i]);
+        printf("  %-24s %10.2f %12.0f %8.2f %.6f\n", mode, ms, BENCH_NR_ROWS / (ms / 1e3), base_ms / ms,
+               aggregate.mean);
+    }
+
+    eval_program_destroy(program);
+    bench_rows_deinit(&rows);
+    free(outputs);
+}
+
+static void bench_filter(void)
+{
+    static const char *RULES[] = {"($temp > 118.8) && ($ratio >= 0)", "($temp > 60) && ($ratio >= 0)",
+                                  "($temp > 1.2) && ($ratio >= 0)", "($temp > 60) && ($state != \"maint\")"};
+    static const size_t THREADS[] = {1, 4, 16};
+    ExprValue *outputs = (ExprValue *)calloc(BENCH_NR_ROWS, sizeof(ExprValue));
+    EvalMask *bitmap = (EvalMask *)calloc((BENCH_NR_ROWS + 63) / 64, sizeof(EvalMask));
+    BenchRows rows;
+    size_t r;
+
+    bench_rows_init(&rows, BENCH_NR_ROWS);
+    printf("filter: %d rows, scalar truthiness vs selection bitmap\n", BENCH_NR_ROWS);
+    printf("  %-40s %-20s %10s %12s %8s %9s\n", "rule", "mode", "ms", "rows/s", "speedup", "selected");
+
+    for (r = 0; r < sizeof(RULES) / sizeof(*RULES); r++)
+    {
+        EvalProgram *program = NULL;
+        unsigned long long start;
+        size_t nr_selected = 0;
+        double base_ms;
+        size_t i;
+
+        eval_compile(RULES[r], &program);
+
+        /* baseline: one ExprValue per row, truthiness tested by the host */
+        start = eval_port_now_ns();
+        eval_rows_execute(NULL, program, &rows.rows, eval_default_hooks(), NULL, outputs, NULL);
+        for (i = 0; i < BENCH_NR_ROWS; i++)
+        {
+            if (outputs[i].type == EXPR_VALUE_TYPE_STRING ? outputs[i].v.str.size != 0 : outputs[i].v.val != 0)
+                nr_selected++;
+        }
+        base_ms = (double)(eval_port_now_ns() - start) / 1e6;
+        bench_clear_outputs(outputs, BENCH_NR_ROWS);
+        printf("  %-40s %-20s %10.2f %12.0f %8.2f %8.2f%%\n", RULES[r], "execute + test", base_ms,
+               BENCH_NR_ROWS / (base_ms / 1e3), 1.0, 100.0 * nr_selected / BENCH_NR_ROWS);
+
+        for (i = 0; i < sizeof(THREADS) / sizeof(*THREADS); i++)
+        {
+            EvalThreadPool *pool = NULL;
+            char mode[32];
+            double ms;
+
+            eval_thread_pool_create(THREADS[i], &pool);
+            start = eval_port_now_ns();
+            eval_rows_filter(pool, program, &rows.rows, eval_default_hooks(), NULL, bitmap, &nr_selected);
+            ms = (double)(eval_port_now_ns() - start) / 1e6;
+            eval_thread_pool_destroy(pool);
+
+            sprintf(mode, "eval_rows_filter x%u", (unsigned int)THREADS[i]);
+            printf("  %-40s %-20s %10.2f %12.0f %8.2f %8.2f%%\n", "", mode, ms, BENCH_NR_ROWS / (ms / 1e3),
+                   base_ms / ms, 100.0 * nr_selected / BENCH_NR_ROWS);
+        }
+
+        eval_program_destroy(program);
+    }
+
+    bench_rows_deinit(&rows);
+    free(bitmap);
+    free(outputs);
+}
+
+/* "($state == "s0") || ... || ($state == "alarm")" or "$state in ("s0", ..., "alarm")" with n alternatives */
+static char *bench_membership_rule(size_t n, int in)
+{
+    size_t size = n * 32 + 32;
+    char *buff = (char *)malloc(size);
+    size_t len = 0;
+    size_t i;
+
+    buff[0] = '\0';
+    if (in)
+        len = bench_append(buff, size, len, "$state in (");
+    for (i = 0; i < n; i++)
+    {
+        char item[16];
+
+        if (i + 1 < n)
+            sprintf(item, "\"s%u\"", (unsigned int)i);
+        else
+            strcpy(item, "\"alarm\"");
+
+        if (i)
+            len = bench_append(buff, size, len, in ? ", " : " || ");
+        if (!in)
+            len = bench_append(buff, size, len, "($state == ");
+        len = bench_append(buff, size, len, item);
+        if (!in)
+            len = bench_append(buff, size, len, ")");
+    }
+    if (in)
+        len = bench_append(buff, size, len, ")");
+
+    return buff;
+}
+
+static void bench_membership(void)
+{
+    static const size_t ALTERNATIVES[] = {5, 20, 50};
+    ExprValue *outputs = (ExprValue *)calloc(BENCH_NR_ROWS, sizeof(ExprValue));
+    EvalMask *bitmap = (EvalMask *)calloc((BENCH_NR_ROWS + 63) / 64, sizeof(EvalMask));
+    BenchRows rows;
+    size_t a;
+
+    bench_rows_init(&rows, BENCH_NR_ROWS);
+    printf("membership: %d rows, an || chain of == vs in, the match last\n", BENCH_NR_ROWS);
+    printf("  %-14s %-20s %10s %12s %8s %9s\n", "rule", "mode", "ms", "rows/s", "speedup", "selected");
+
+    for (a = 0; a < sizeof(ALTERNATIVES) / sizeof(*ALTERNATIVES); a++)
+    {
+        double base_ms[2] = {0, 0};
+        int in;
+
+        for (in = 0; in < 2; in++)
+        {
+            char *rule = bench_membership_rule(ALTERNATIVES[a], in);
+            EvalProgram *program = NULL;
+            unsigned long long start;
+            size_t nr_selected = 0;
+            char name[32];
+            double ms;
+            size_t i;
+
+            eval_compile(rule, &program);
+            sprintf(name, "%s %u", in ? "in" : "||", (unsigned int)ALTERNATIVES[a]);
+
+            start = eval_port_now_ns();
+            eval_rows_execute(NULL, program, &rows.rows, eval_default_hooks(), NULL, outputs, NULL);
+            ms = (double)(eval_port_now_ns() - start) / 1e6;
+            for (i = 0; i < BENCH_NR_ROWS; i++)
+                nr_selected += outputs[i].v.val != 0;
+            bench_clear_outputs(outputs, BENCH_NR_ROWS);
+            base_ms[0] = in ? base_ms[0] : ms;
+            printf("  %-14s %-20s %10.2f %12.0f %8.2f %8.2f%%\n", name, "eval_rows_execute", ms,
+                   BENCH_NR_ROWS / (ms / 1e3), base_ms[0] / ms, 100.0 * nr_selected / BENCH_NR_ROWS);
+
+            start = eval_port_now_ns();
+            eval_rows_filter(NULL, program, &rows.rows, eval_default_hooks(), NULL, bitmap, &nr_selected);
+            ms = (double)(eval_port_now_ns() - start) / 1e6;
+            base_ms[1] = in ? base_ms[1] : ms;
+            printf("  %-14s %-20s %10.2f %12.0f %8.2f %8.2f%%\n", "", "eval_rows_filter", ms,
+                   BENCH_NR_ROWS / (ms / 1e3), base_ms[1] / ms, 100.0 * nr_selected / BENCH_NR_ROWS);
+
+            eval_program_destroy(program);
+            free(rule);
+        }
+    }
+
+    bench_rows_deinit(&rows);
+    free(bitmap);
+    free(outputs);
+}
+
+#define BENCH_LOCALS_TERM           "($temp - 2 * $limit / 10)"
+
+/* "(t > 0) * t + (t > 10) * t + ..." with n terms, t either spelled out every time or bound once as a local */
+static char *bench_locals_rule(size_t n, int local)
+{
+    size_t size = n * 96 + 64;
+    char *buff = (char *)malloc(size);
+    const char *t = local ? "w" : BENCH_LOCALS_TERM;
+    size_t len = 0;
+    size_t i;
+
+    buff[0] = '\0';
+    if (local)
+        len = bench_append(buff, size, len, "w = " BENCH_LOCALS_TERM "; ");
+    for (i = 0; i < n; i++)
+    {
+        char term[128];
+
+        sprintf(term, "%s(%s > %u) * %s", i ? " + " : "", t, (unsigned int)i * 10, t);
+        len = bench_append(buff, size, len, term);
+    }
+
+    return buff;
+}
+
+static void bench_locals(void)
+{
+    static const size_t USES[] = {2, 4, 8};
+    ExprValue *outputs = (ExprValue *)calloc(BENCH_NR_ROWS, sizeof(ExprValue));
+    BenchRows rows;
+    BenchRowCursor cursor;
+    size_t u;
+
+    bench_rows_init(&rows, BENCH_NR_ROWS);
+    cursor.rows = &rows;
+    printf("locals: %d rows, n terms reading %s twice each, spelled out vs bound once\n", BENCH_NR_ROWS,
+           BENCH_LOCALS_TERM);
+    printf("  %-10s %-20s %10s %12s %8s %16s\n", "rule", "mode", "ms", "rows/s", "speedup", "sum");
+
+    for (u = 0; u < sizeof(USES) / sizeof(*USES); u++)
+    {
+        double base_ms[2] = {0, 0};
+        int local;
+
+        for (local = 0; local < 2; local++)
+        {
+            char *rule = bench_locals_rule(USES[u], local);
+            EvalProgram *program = NULL;
+            unsigned long long start;
+            double sum = 0;
+            char name[32];
+            double ms;
+            size_t i;
+
+            eval_compile(rule, &program);
+            sprintf(name, "%s %u", local ? "local" : "repeat", (unsigned int)USES[u]);
+
+            start = eval_port_now_ns();
+            for (i = 0; i < BENCH_NR_ROWS; i++)
+            {
+                cursor.row = i;
+                eval_program_execute(program, bench_row_hooks(), &cursor, outputs + i);
+            }
+            ms = (double)(eval_port_now_ns() - start) / 1e6;
+            for (i = 0; i < BENCH_NR_ROWS; i++)
+                sum += outputs[i].v.val;
+            bench_clear_outputs(outputs, BENCH_NR_ROWS);
+            base_ms[0] = local ? base_ms[0] : ms;
+            printf("  %-10s %-20s %10.2f %12.0f %8.2f %16.0f\n", name, "per-row hooks", ms,
+                   BENCH_NR_ROWS / (ms / 1e3), base_ms[0] / ms, sum);
+
+            start = eval_port_now_ns();
+            eval_rows_execute(NULL, program, &rows.rows, eval_default_hooks(), NULL, outputs, NULL);
+            ms = (double)(eval_port_now_ns() - start) / 1e6;
+            sum = 0;
+            for (i = 0; i < BENCH_NR_ROWS; i++)
+                sum += outputs[i].v.val;
+            bench_clear_outputs(outputs, BENCH_NR_ROWS);
+            base_ms[1] = local ? base_ms[1] : ms;
+            printf("  %-10s %-20s %10.2f %12.0f %8.2f %16.0f\n", "", "eval_rows_execute", ms,
+                   BENCH_NR_ROWS / (ms / 1e3), base_ms[1] / ms, sum);
+
+            eval_program_destroy(program);
+            free(rule);
+        }
+    }
+
+    bench_rows_deinit(&rows);
+    free(outputs);
+}
+
+#define BENCH_STREAM_LINES          10000000
+
+/* a sink that discards everything, so only formatting and stdio are measured */
+static FILE *bench_null_output(void)
+{
+#ifdef _WIN32
+    return fopen("NUL", "wb");
+#else
+    return fopen("/dev/null", "wb");
+#endif
+}
+
+static FILE *bench_stream_input(void)
+{
+    FILE *fp = tmpfile();
+    size_t i;
+
+    bench_seed();
+    for (i = 0; i < BENCH_STREAM_LINES; i++)
+    {
+        unsigned int a = bench_rand() % 1000;
+        unsigned int b = bench_rand() % 100;
+
+        switch (bench_rand() % 4)
+        {
+        case 0:
+            fprintf(fp, "%u.%u * ($PI + %u) / 7\n", a, b, a % 13);
+            break;
+        case 1:
+            fprintf(fp, "(%u > %u) && (%u.5 < %u)\n", a, b, b, a);
+            break;
+        case 2:
+            fprintf(fp, "toupper(\"s%u\") + \"-\" + %u\n", a, b);
+            break;
+        default:
+            fprintf(fp, "floor(sqrt(%u)) + round(%u.%u)\n", a * 31, b, a);
+            break;
+        }
+    }
+    rewind(fp);
+
+    return fp;
+}
+
+static void bench_stream(void)
+{
+    static const size_t THREADS[] = {1, 2, 4, 8};
+    FILE *in = bench_stream_input();
+    FILE *out = bench_null_output();
+    unsigned long long start;
+    char line[256];
+    double base_ms;
+    long size;
+    size_t i;
+
+    fseek(in, 0, SEEK_END);
+    size = ftell(in);
+    rewind(in);
+
+    printf("stream: %d lines, %.1f MB of expressions\n", BENCH_STREAM_LINES, (double)size / 1e6);
+    printf("  %-24s %10s %12s %8s\n", "mode", "ms", "lines/s", "speedup");
+
+    /* a host loop around eval_execute() with line reads and printf style output */
+    start = eval_port_now_ns();
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        ExprValue output;
+
+        line[strcspn(line, "\r\n")] = '\0';
+        expr_value_set_number(&output, 0);
+        if (eval_execute(line, eval_default_hooks(), NULL, &output) != EVAL_RESULT_OK)
+            fprintf(out, "error\n");
+        else if (output.type == EXPR_VALUE_TYPE_STRING)
+            fprintf(out, "string: %s\n", output.v.str.str);
+        else
+            fprintf(out, "number: %lf\n", output.v.val);
+        expr_value_clear(&output);
+    }
+    fflush(out);
+    base_ms = (double)(eval_port_now_ns() - start) / 1e6;
+    printf("  %-24s %10.2f %12.0f %8.2f\n", "fgets + eval_execute", base_ms, BENCH_STREAM_LINES / (base_ms / 1e3), 1.0);
+
+    for (i = 0; i < sizeof(THREADS) / sizeof(*THREADS); i++)
+    {
+        EvalThreadPool *pool = NULL;
+        char mode[32];
+        double ms;
+
+        rewind(in);
+        eval_thread_pool_create(THREADS[i], &pool);
+        start = eval_port_now_ns();
+        eval_stream(pool, in, out, eval_default_hooks(), NULL, NULL);
+        ms = (double)(eval_port_now_ns() - start) / 1e6;
+        eval_thread_pool_destroy(pool);
+
+        sprintf(mode, "eval_stream x%u", (unsigned int)THREADS[i]);
+        printf("  %-24s %10.2f %12.0f %8.2f\n", mode, ms, BENCH_STREAM_LINES / (ms / 1e3), base_ms / ms);
+    }
+
+    fclose(out);
+    fclose(in);
+}
+
+#define BENCH_CSV_ROWS              2000000
+#define BENCH_CSV_FILE              "eval_bench.csv"
+
+static void bench_csv(void)
+{
+    static const char *STATES[] = {"ok", "maint", "alarm", "idle"};
+    static const struct
+    {
+        const char *rule;
+        EvalCsvMode mode;
+    } RULES[] = {{"$temp * 1.8 + 32", EVAL_CSV_RESULTS},
+                 {"($temp > 60) && ($state != \"maint\")", EVAL_CSV_FILTER},
+                 {"$comment + \"!\"", EVAL_CSV_RESULTS}};
+    static const size_t THREADS[] = {1, 2, 4, 8};
+    FILE *fp = fopen(BENCH_CSV_FILE, "wb");
+    FILE *out = bench_null_output();
+    EvalMappedFile file;
+    size_t r;
+    size_t i;
+
+    bench_seed();
+    fprintf(fp, "id,temp,limit,ratio,state,site,owner,comment\n");
+    for (i = 0; i < BENCH_CSV_ROWS; i++)
+    {
+        fprintf(fp, "%u,%u.%02u,%u,0.%03u,%s,site-%u,\"user %u\",\"note, %u\"\n", (unsigned int)i,
+                bench_rand() % 120, bench_rand() % 100, 60 + bench_rand() % 40, bench_rand() % 1000,
+                STATES[bench_rand() % 4], bench_rand() % 500, bench_rand() % 10000, bench_rand());
+    }
+    fclose(fp);
+    eval_file_map(BENCH_CSV_FILE, &file);
+
+    printf("csv: %d rows, %.1f MB, the last rule reads the last column\n", BENCH_CSV_ROWS, (double)file.size / 1e6);
+    printf("  %-40s %-14s %10s %10s %8s\n", "rule", "mode", "ms", "MB/s", "speedup");
+
+    for (r = 0; r < sizeof(RULES) / sizeof(*RULES); r++)
+    {
+        EvalProgram *program = NULL;
+        double base_ms = 0;
+
+        eval_compile(RULES[r].rule, &program);
+        for (i = 0; i < sizeof(THREADS) / sizeof(*THREADS); i++)
+        {
+            EvalThreadPool *pool = NULL;
+            unsigned long long start;
+            char mode[32];
+            double ms;
+
+            eval_thread_pool_create(THREADS[i], &pool);
+            start = eval_port_now_ns();
+            eval_csv(pool, file.data, file.size, program, RULES[r].mode, out, NULL);
+            ms = (double)(eval_port_now_ns() - start) / 1e6;
+            eval_thread_pool_destroy(pool);
+            if (i == 0)
+                base_ms = ms;
+
+            sprintf(mode, "%s x%u", RULES[r].mode == EVAL_CSV_FILTER ? "filter" : "results", (unsigned int)THREADS[i]);
+            printf("  %-40s %-14s %10.2f %10.1f %8.2f\n", i ? "" : RULES[r].rule, mode, ms,
+                   (double)file.size / 1e6 / (ms / 1e3), base_ms / ms);
+        }
+        eval_program_destroy(program);
+    }
+
+    eval_file_unmap(&file);
+    fclose(out);
+    remove(BENCH_CSV_FILE);
+}
+
+/*
+ * Microbenchmarks.
+ *
+ * Each microbenchmark is one eval_execute() call on a fixed input. The number
+ * of calls per sample is calibrated so a sample takes about BENCH_SAMPLE_NS,
+ * the ns/op percentiles are taken over the samples and allocations are
+ * counted through eval_set_allocator() while sampling.
+ */
+
+#define BENCH_SAMPLE_NS             200000ull
+#define BENCH_DEFAULT_SAMPLES       31
+#define BENCH_MAX_ITERATIONS        (1u << 24)
+
+static int bench_json = 0;
+static size_t bench_samples = BENCH_DEFAULT_SAMPLES;
+static size_t bench_nr_results = 0;
+static size_t bench_nr_allocs = 0;
+static size_t bench_alloc_bytes = 0;
+static const EvalOptions *bench_options = NULL;
+
+static void *bench_alloc(size_t size, void *user_data)
+{
+    (void)user_data;
+    bench_nr_allocs++;
+    bench_alloc_bytes += size;
+
+    return malloc(size);
+}
+
+static void *bench_realloc(void *ptr, size_t size, void *user_data)
+{
+    (void)user_data;
+    bench_nr_allocs++;
+    bench_alloc_bytes += size;
+
+    return realloc(ptr, size);
+}
+
+static void bench_free(void *ptr, void *user_data)
+{
+    (void)user_data;
+    free(ptr);
+}
+
+static int bench_compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static EvalResult bench_execute(const char *expr, const EvalHooks *hooks)
+{
+    ExprValue output;
+    EvalResult result;
+
+    expr_value_init(&output);
+    if (bench_options)
+        result = eval_execute_ex(expr, hooks, NULL, bench_options, &output);
+    else
+        result = eval_execute(expr, hooks, NULL, &output);
+    if (result == EVAL_RESULT_OK)
+        expr_value_clear(&output);
+
+    return result;
+}
+
+static void bench_micro_header(const char *group)
+{
+    if (bench_json)
+        return;
+
+    printf("%s: ns/op over %u samples\n", group, (unsigned int)bench_samples);
+    printf("  %-20s %10s %10s %10s %10s %10s %10s %10s\n", "name", "min", "p50", "p90", "p99", "mean",
+           "allocs/op", "bytes/op");
+}
+
+static void bench_micro(const char *group, const char *name, const char *expr, const EvalHooks *hooks)
+{
+    static const EvalAllocator COUNTING = {bench_alloc, bench_realloc, bench_free, NULL};
+    double *samples = (double *)malloc(bench_samples * sizeof(double));
+    unsigned long long start;
+    unsigned long long elapsed;
+    size_t iterations = 1;
+    double allocs;
+    double bytes;
+    double mean = 0;
+    size_t ops;
+    size_t i;
+    size_t j;
+
+    if (bench_execute(expr, hooks) != EVAL_RESULT_OK)
+    {
+        fprintf(stderr, "%s/%s: %s\n", group, name, eval_result_to_string(bench_execute(expr, hooks)));
+        free(samples);
+        return;
+    }
+
+    for (;;)
+    {
+        start = eval_port_now_ns();
+        for (j = 0; j < iterations; j++)
+            bench_execute(expr, hooks);
+        elapsed = eval_port_now_ns() - start;
+
+        if (elapsed >= BENCH_SAMPLE_NS || iterations >= BENCH_MAX_ITERATIONS)
+            break;
+        iterations *= 2;
+    }
+
+    bench_nr_allocs = 0;
+    bench_alloc_bytes = 0;
+    eval_set_allocator(&COUNTING);
+    for (i = 0; i < bench_samples; i++)
+    {
+        start = eval_port_now_ns();
+        for (j = 0; j < iterations; j++)
+            bench_execute(expr, hooks);
+        samples[i] = (double)(eval_port_now_ns() - start) / (double)iterations;
+        mean += samples[i] / (double)bench_samples;
+    }
+    eval_set_allocator(NULL);
+
+    ops = iterations * bench_samples;
+    allocs = (double)bench_nr_allocs / (double)ops;
+    bytes = (double)bench_alloc_bytes / (double)ops;
+    qsort(samples, bench_samples, sizeof(double), bench_compare_doubles);
+
+#define BENCH_PERCENTILE(q) samples[(size_t)((q) * (double)(bench_samples - 1) + 0.5)]
+    if (bench_json)
+    {
+        printf("%s\n    {\"group\": \"%s\", \"name\": \"%s\", \"ops\": %lu, \"ns_per_op\": {\"min\": %.2f, \"p50\": %.2f, "
+               "\"p90\": %.2f, \"p99\": %.2f, \"mean\": %.2f}, \"allocs_per_op\": %.3f, \"bytes_per_op\": %.1f}",
+               bench_nr_results ? "," : "", group, name, (unsigned long)ops, samples[0], BENCH_PERCENTILE(0.5),
+               BENCH_PERCENTILE(0.9), BENCH_PERCENTILE(0.99), mean, allocs, bytes);
+    }
+    else
+    {
+        printf("  %-20s %10.1f %10.1f %10.1f %10.1f %10.1f %10.2f %10.1f\n", name, samples[0], BENCH_PERCENTILE(0.5),
+               BENCH_PERCENTILE(0.9), BENCH_PERCENTILE(0.99), mean, allocs, bytes);
+    }
+#undef BENCH_PERCENTILE
+
+    bench_nr_results++;
+    free(samples);
+}
+
+/* "first op first op ... first" with n terms */
+static char *bench_chain(const char *term, const char *op, size_t n)
+{
+    size_t size = n * (strlen(term) + strlen(op)) + 1;
+    char *buff = (char *)malloc(size);
+    size_t len = 0;
+    size_t i;
+
+    buff[0] = '\0';
+    for (i = 0; i < n; i++)
+    {
+        if (i)
+            len = bench_append(buff, size, len, op);
+        len = bench_append(buff, size, len, term);
+    }
+
+    return buff;
+}
+
+static void bench_lexer(void)
+{
+    char *numbers = (char *)malloc(16 * 1024);
+    char *spaces = (char *)malloc(4200);
+    char *string = (char *)malloc(4200);
+    char *escapes = (char *)malloc(4200);
+    char *mixed = (char *)malloc(10 * 1024 + 256);
+    size_t len = 0;
+    size_t i;
+
+    bench_seed();
+    numbers[0] = '\0';
+    for (i = 0; i < 1000; i++)
+    {
+        char num[32];
+
+        sprintf(num, "%s%u.%u", i ? " + " : "", bench_rand() % 10000, bench_rand() % 1000);
+        len = bench_append(numbers, 16 * 1024, len, num);
+    }
+
+    memset(spaces, ' ', 4100);
+    memcpy(spaces, "1 +", 3);
+    memcpy(spaces + 4097, "2", 2);
+
+    memset(string, 'a', 4098);
+    string[0] = string[4097] = '"';
+    string[4098] = '\0';
+
+    for (i = 1; i + 1 < 4097; i += 2)
+    {
+        escapes[i] = '\\';
+        escapes[i + 1] = (i % 8 == 1) ? '"' : 'n';
+    }
+    escapes[0] = escapes[4097] = '"';
+    escapes[4098] = '\0';
+
+    /* 10k of what rules are made of: names, literals, strings and operators */
+    len = 0;
+    mixed[0] = '\0';
+    while (len < 10 * 1024)
+        len = bench_append(mixed, 10 * 1024 + 256, len,
+                           "strlen(\"status/enabled\") * 2.5 >= $PI && \"dark\" != \"light\\\"s\" || ");
+    len = bench_append(mixed, 10 * 1024 + 256, len, "1");
+
+    bench_micro_header("lexer");
+    bench_micro("lexer", "numbers_1k", numbers, eval_default_hooks());
+    bench_micro("lexer", "whitespace_4k", spaces, eval_default_hooks());
+    bench_micro("lexer", "string_4k", string, eval_default_hooks());
+    bench_micro("lexer", "escapes_4k", escapes, eval_default_hooks());
+    bench_micro("lexer", "mixed_10k", mixed, eval_default_hooks());
+    bench_micro("lexer", "string_rule", "\"theme/dark/button\" == \"theme/\" + \"dark\" + \"/button\"",
+                eval_default_hooks());
+
+    free(numbers);
+    free(spaces);
+    free(string);
+    free(escapes);
+    free(mixed);
+}
+
+static void bench_parser(void)
+{
+    char *wide_16 = bench_chain("1 * 2", " + ", 16);
+    char *wide_256 = bench_chain("1 * 2", " + ", 256);
+    char *flat_256 = bench_chain("3", " * ", 256);
+    char *nested_1k = (char *)malloc(2002);
+
+    bench_micro_header("parser");
+    bench_micro("parser", "single", "1", eval_default_hooks());
+    bench_micro("parser", "deep_6", "((((((1 + 2) * 3) + 4) * 5) + 6) * 7) + 8", eval_default_hooks());
+    bench_micro("parser", "wide_16", wide_16, eval_default_hooks());
+    bench_micro("parser", "wide_256", wide_256, eval_default_hooks());
+    bench_micro("parser", "product_256", flat_256, eval_default_hooks());
+    bench_micro("parser", "unary", "-!~-!~1", eval_default_hooks());
+
+    /* past the default limit the nesting only costs stack entries */
+    memset(nested_1k, '(', 1000);
+    nested_1k[1000] = '1';
+    memset(nested_1k + 1001, ')', 1000);
+    nested_1k[2001] = '\0';
+    eval_set_max_depth(0);
+    bench_micro("parser", "nested_1k", nested_1k, eval_default_hooks());
+    eval_set_max_depth(EVAL_MAX_STACK_DEPTH);
+
+    free(wide_16);
+    free(wide_256);
+    free(flat_256);
+    free(nested_1k);
+}
+
+static void bench_values(void)
+{
+    bench_micro_header("values");
+    bench_micro("values", "number_arith", "1.5 * 2 + 3 / 4 - 5", eval_default_hooks());
+    bench_micro("values", "number_compare", "(1 < 2) && (3 >= 3) || (4 != 5)", eval_default_hooks());
+    bench_micro("values", "number_bits", "(12 | 3) & ~1", eval_default_hooks());
+    bench_micro("values", "string_compare", "(\"abc\" < \"abd\") && (\"x\" == \"x\")", eval_default_hooks());
+    bench_micro("values", "string_number", "\"12\" * \"3\" + 1", eval_default_hooks());
+    bench_micro("values", "mixed_concat", "\"n\" + 42 + 3.5", eval_default_hooks());
+}
+
+static void bench_strings(void)
+{
+    char *concat_4 = bench_chain("\"ab\"", " + ", 4);
+    char *concat_16 = bench_chain("\"ab\"", " + ", 16);
+    char *concat_256 = bench_chain("\"ab\"", " + ", 256);
+    char *long_concat = bench_chain("\"abcdefghijklmnopqrstuvwxyz0123456789\"", " + ", 64);
+
+    bench_micro_header("strings");
+    bench_micro("strings", "concat_4", concat_4, eval_default_hooks());
+    bench_micro("strings", "concat_16", concat_16, eval_default_hooks());
+    bench_micro("strings", "concat_256", concat_256, eval_default_hooks());
+    bench_micro("strings", "concat_64x36", long_concat, eval_default_hooks());
+
+    free(concat_4);
+    free(concat_16);
+    free(concat_256);
+    free(long_concat);
+}
+
+#define BENCH_NR_TRANSFORM_SIZES    4
+
+static const size_t BENCH_TRANSFORM_SIZES[BENCH_NR_TRANSFORM_SIZES] = {8, 64, 1024, 65536};
+static char *bench_transform_texts[BENCH_NR_TRANSFORM_SIZES];
+
+/* $t0 to $t3: a mixed case path with both separators, 8 bytes to 64K long */
+static EvalResult bench_transform_get_variable(const char *name, void *user_data, ExprValue *output)
+{
+    size_t i = (size_t)(name[1] - '0');
+
+    (void)user_data;
+    if (name[0] != 't' || i >= BENCH_NR_TRANSFORM_SIZES)
+        return EVAL_RESULT_UNDEFINED_VARIABLE;
+
+    return expr_value_set_string(output, bench_transform_texts[i], BENCH_TRANSFORM_SIZES[i]);
+}
+
+static void bench_transform_texts_create(void)
+{
+    static const char TEXT[] = "Settings/Display\\Night Mode ";
+    size_t s;
+    size_t i;
+
+    for (s = 0; s < BENCH_NR_TRANSFORM_SIZES; s++)
+    {
+        bench_transform_texts[s] = (char *)malloc(BENCH_TRANSFORM_SIZES[s] + 1);
+        for (i = 0; i < BENCH_TRANSFORM_SIZES[s]; i++)
+            bench_transform_texts[s][i] = TEXT[i % (sizeof(TEXT) - 1)];
+        bench_transform_texts[s][i] = '\0';
+    }
+}
+
+static void bench_transform_texts_destroy(void)
+{
+    size_t s;
+
+    for (s = 0; s < BENCH_NR_TRANSFORM_SIZES; s++)
+        free(bench_transform_texts[s]);
+}
+
+/* name_8 to name_64k, by the size of text s */
+static void bench_sized_name(char *name, const char *prefix, size_t s)
+{
+    if (BENCH_TRANSFORM_SIZES[s] >= 1024)
+        sprintf(name, "%s_%uk", prefix, (unsigned int)(BENCH_TRANSFORM_SIZES[s] / 1024));
+    else
+        sprintf(name, "%s_%u", prefix, (unsigned int)BENCH_TRANSFORM_SIZES[s]);
+}
+
+static void bench_transforms(void)
+{
+    static const char *FUNCS[] = {"toupper", "tolower", "path"};
+    static EvalHooks hooks;
+    char expr[32];
+    char name[32];
+    size_t f;
+    size_t s;
+
+    hooks.get_func = eval_default_hooks()->get_func;
+    hooks.get_variable = bench_transform_get_variable;
+    bench_transform_texts_create();
+
+    bench_micro_header("transforms");
+    for (f = 0; f < sizeof(FUNCS) / sizeof(*FUNCS); f++)
+    {
+        for (s = 0; s < BENCH_NR_TRANSFORM_SIZES; s++)
+        {
+            sprintf(expr, "%s($t%u)", FUNCS[f], (unsigned int)s);
+            bench_sized_name(name, FUNCS[f], s);
+            bench_micro("transforms", name, expr, &hooks);
+        }
+    }
+
+    bench_transform_texts_destroy();
+}
+
+/* what rules did before the builtins: a host function around strstr() */
+static EvalResult bench_has_night_moda(const ExprValue *input, void *user_data, ExprValue *output)
+{
+    (void)user_data;
+    return expr_value_set_number(output, input->type == EXPR_VALUE_TYPE_STRING &&
+                                             strstr(input->v.str.str, "Night Moda") != NULL);
+}
+
+static EvalFunc bench_search_get_func(const char *name, void *user_data)
+{
+    if (strcmp(name, "has_night_moda") == 0)
+        return bench_has_night_moda;
+
+    return eval_default_hooks()->get_func(name, user_data);
+}
+
+static void bench_search(void)
+{
+    /* a near miss that is never found, so every search reads the whole text */
+    static const char *CALLS[][2] = {
+        {"contains", "contains($t%u, \"Night Moda\")"},
+        {"hook_strstr", "has_night_moda($t%u)"},
+        {"find", "find($t%u, \"Night Moda\")"},
+        {"endswith", "endswith($t%u, \"Mode \")"},
+        {"replace", "replace($t%u, \"/\", \"::\")"},
+        {"substr", "substr($t%u, 3, 5)"}};
+    static EvalHooks hooks;
+    char expr[64];
+    char name[32];
+    size_t c;
+    size_t s;
+
+    hooks.get_func = bench_search_get_func;
+    hooks.get_variable = bench_transform_get_variable;
+    bench_transform_texts_create();
+
+    bench_micro_header("search");
+    for (c = 0; c < sizeof(CALLS) / sizeof(*CALLS); c++)
+    {
+        for (s = 0; s < BENCH_NR_TRANSFORM_SIZES; s++)
+        {
+            sprintf(expr, CALLS[c][1], (unsigned int)s);
+            bench_sized_name(name, CALLS[c][0], s);
+            bench_micro("search", name, expr, &hooks);
+        }
+    }
+
+    bench_transform_texts_destroy();
+}
+
+/* identifiers as binding rules see them */
+static const char *BENCH_IDENTIFIERS[][2] = {
+    {"button", "btn_1024"},
+    {"label", "menu_item_label"},
+    {"setting", "settings.display.brightness"},
+    {"action", "dialog_apply"},
+    {"bits", "abababbbaabbabaabbbababaaabbbabbabababbbaaabababbbabaabbabbbabba"}};
+
+static EvalResult bench_regex_get_variable(const char *name, void *user_data, ExprValue *output)
+{
+    size_t i;
+
+    (void)user_data;
+    for (i = 0; i < sizeof(BENCH_IDENTIFIERS) / sizeof(*BENCH_IDENTIFIERS); i++)
+    {
+        if (strcmp(name, BENCH_IDENTIFIERS[i][0]) == 0)
+            return expr_value_set_string(output, BENCH_IDENTIFIERS[i][1], strlen(BENCH_IDENTIFIERS[i][1]));
+    }
+
+    return EVAL_RESULT_UNDEFINED_VARIABLE;
+}
+
+#ifndef _WIN32
+/* what a hook has to do without a place to keep the compiled pattern */
+static EvalResult bench_is_button(const ExprValue *input, void *user_data, ExprValue *output)
+{
+    regex_t re;
+    int matched;
+
+    (void)user_data;
+    if (input->type != EXPR_VALUE_TYPE_STRING || regcomp(&re, "^btn_[0-9]+$", REG_EXTENDED | REG_NOSUB) != 0)
+        return expr_value_set_number(output, 0);
+
+    matched = regexec(&re, input->v.str.str, 0, NULL, 0) == 0;
+    regfree(&re);
+
+    return expr_value_set_number(output, matched);
+}
+#endif
+
+static EvalFunc bench_regex_get_func(const char *name, void *user_data)
+{
+#ifndef _WIN32
+    if (strcmp(name, "is_button") == 0)
+        return bench_is_button;
+#endif
+
+    return eval_default_hooks()->get_func(name, user_data);
+}
+
+static void bench_regex(void)
+{
+    static EvalHooks hooks;
+
+    hooks.get_func = bench_regex_get_func;
+    hooks.get_variable = bench_regex_get_variable;
+
+    bench_micro_header("regex");
+    bench_micro("regex", "button", "matches($button, \"^btn_[0-9]+$\")", &hooks);
+    bench_micro("regex", "button_miss", "matches($label, \"^btn_[0-9]+$\")", &hooks);
+#ifndef _WIN32
+    bench_micro("regex", "hook_regcomp", "is_button($button)", &hooks);
+#endif
+    bench_micro("regex", "snake_case", "matches($label, \"^[a-z]+(_[a-z0-9]+)*$\")", &hooks);
+    bench_micro("regex", "dotted", "matches($setting, \"^settings[.][a-z_.]+$\")", &hooks);
+    bench_micro("regex", "suffixes", "matches($action, \"(^|_)(ok|cancel|apply)$\")", &hooks);
+    bench_micro("regex", "dynamic", "matches($action, \"_\" + \"apply$\")", &hooks);
+    bench_micro("regex", "nfa_64", "matches($bits, \"a(a|b){12}$\")", &hooks);
+}
+
+static void bench_builtins(void)
+{
+    static const char *CALLS[][2] = {
+        {"number", "number(\"42.5\")"}, {"strlen", "strlen(\"hello world\")"},
+        {"path", "path(\"a/b\\\\c/d.txt\")"}, {"string", "string(3.25)"},
+        {"toupper", "toupper(\"Hello World\")"}, {"tolower", "tolower(\"Hello World\")"},
+        {"cos", "cos(0.5)"}, {"sin", "sin(0.5)"}, {"tan", "tan(0.5)"}, {"acos", "acos(0.5)"},
+        {"asin", "asin(0.5)"}, {"atan", "atan(0.5)"}, {"exp", "exp(0.5)"}, {"log", "log(2.5)"},
+        {"log10", "log10(2.5)"}, {"sqrt", "sqrt(2.5)"}, {"ceil", "ceil(2.5)"}, {"floor", "floor(2.5)"},
+        {"round", "round(2.5)"}};
+    size_t i;
+
+    bench_micro_header("builtins");
+    for (i = 0; i < sizeof(CALLS) / sizeof(*CALLS); i++)
+    {
+        bench_micro("builtins", CALLS[i][0], CALLS[i][1], eval_default_hooks());
+    }
+}
+
+#define BENCH_NR_HOST_VARIABLES     64
+#define BENCH_NR_HOST_SYMBOLS       4096
+
+/* a host with a table of variables searched by name, the common way hooks are written */
+static EvalResult bench_host_get_variable(const char *name, void *user_data, ExprValue *output)
+{
+    static char names[BENCH_NR_HOST_VARIABLES * 2][8];
+    static int initialized = 0;
+    size_t i;
+
+    (void)user_data;
+    if (!initialized)
+    {
+        for (i = 0; i < BENCH_NR_HOST_VARIABLES; i++)
+        {
+            sprintf(names[i], "v%u", (unsigned int)i);
+            sprintf(names[BENCH_NR_HOST_VARIABLES + i], "s%u", (unsigned int)i);
+        }
+        initialized = 1;
+    }
+
+    for (i = 0; i < BENCH_NR_HOST_VARIABLES * 2; i++)
+    {
+        if (strcmp(names[i], name) == 0)
+        {
+            if (i < BENCH_NR_HOST_VARIABLES)
+                return expr_value_set_number(output, (double)i * 0.5);
+            return expr_value_set_string(output, "value", 5);
+        }
+    }
+
+    return eval_default_hooks()->get_variable(name, NULL, output);
+}
+
+static const EvalHooks *bench_host_hooks(void)
+{
+    static EvalHooks hooks;
+
+    hooks.get_func = eval_default_hooks()->get_func;
+    hooks.get_variable = bench_host_get_variable;
+
+    return &hooks;
+}
+
+/* the host resolves its names to symbols once and then indexes by symbol */
+static EvalResult bench_host_get_variable_symbol(EvalSymbol symbol, void *user_data, ExprValue *output)
+{
+    static unsigned char slots[BENCH_NR_HOST_SYMBOLS];
+    static int initialized = 0;
+    EvalSymbol v;
+    char name[8];
+    size_t i;
+
+    (void)user_data;
+    if (!initialized)
+    {
+        for (i = 0; i < BENCH_NR_HOST_VARIABLES; i++)
+        {
+            sprintf(name, "v%u", (unsigned int)i);
+            if (eval_symbol_intern(name, strlen(name), &v) != EVAL_RESULT_OK || v >= BENCH_NR_HOST_SYMBOLS)
+                return EVAL_RESULT_OOM;
+            slots[v] = (unsigned char)(i + 1);
+        }
+        initialized = 1;
+    }
+
+    if (symbol < BENCH_NR_HOST_SYMBOLS && slots[symbol])
+        return expr_value_set_number(output, (double)(slots[symbol] - 1) * 0.5);
+
+    return eval_default_hooks()->get_variable_symbol(symbol, NULL, output);
+}
+
+static const EvalHooks *bench_symbol_hooks(void)
+{
+    static EvalHooks hooks;
+
+    hooks.get_func_symbol = eval_default_hooks()->get_func_symbol;
+    hooks.get_variable_symbol = bench_host_get_variable_symbol;
+
+    return &hooks;
+}
+
+static void bench_hooks(void)
+{
+    bench_micro_header("hooks");
+    bench_micro("hooks", "default_variable", "$PI * 2", eval_default_hooks());
+    bench_micro("hooks", "numbers_4", "$v3 + $v17 + $v42 + $v63", bench_host_hooks());
+    bench_micro("hooks", "numbers_16",
+                "$v0 + $v4 + $v8 + $v12 + $v16 + $v20 + $v24 + $v28 + $v32 + $v36 + $v40 + $v44 + $v48 + $v52 + "
+                "$v56 + $v60",
+                bench_host_hooks());
+    bench_micro("hooks", "symbols_16",
+                "$v0 + $v4 + $v8 + $v12 + $v16 + $v20 + $v24 + $v28 + $v32 + $v36 + $v40 + $v44 + $v48 + $v52 + "
+                "$v56 + $v60",
+                bench_symbol_hooks());
+    bench_micro("hooks", "strings_4", "$s1 + $s2 + $s30 + $s63", bench_host_hooks());
+    bench_micro("hooks", "call_on_variable", "floor($v7) + strlen($s7)", bench_host_hooks());
+}
+
+/* an expensive pure function, like measuring the width of a label */
+static EvalResult bench_measure(const ExprValue *input, void *user_data, ExprValue *output)
+{
+    const char *str = expr_value_get_string(input);
+    double width = 0;
+
+    (void)user_data;
+    for (; str && *str; str++)
+        width += 6 + 2 * sin((double)(unsigned char)*str);
+
+    return expr_value_set_number(output, ceil(width));
+}
+
+static EvalFunc bench_memo_get_func(const char *name, void *user_data)
+{
+    if (strcmp(name, "measure") == 0)
+        return bench_measure;
+
+    return eval_default_hooks()->get_func(name, user_data);
+}
+
+static void bench_memo(void)
+{
+    static const char *EXPR = "measure(\"Display brightness\") + measure(\"Night mode\") + measure($s7)";
+    static EvalHooks hooks;
+
+    hooks.get_func = bench_memo_get_func;
+    hooks.get_variable = bench_host_get_variable;
+
+    bench_micro_header("memo");
+    bench_micro("memo", "plain", EXPR, &hooks);
+    if (eval_func_set_pure(bench_measure, 64) != EVAL_RESULT_OK)
+        return;
+    bench_micro("memo", "pure", EXPR, &hooks);
+    eval_func_set_pure(bench_measure, 0);
+}
+
+static void bench_trace(EvalEvent event, const char *name, size_t value, void *user_data)
+{
+    (void)event;
+    (void)name;
+    (*(size_t *)user_data) += value;
+}
+
+/* run under eval_bench and eval_bench_stats: "off" must match between the two builds */
+static void bench_stats(void)
+{
+    static const char *NAMES[] = {"off", "ex_no_options", "stats", "stats_trace"};
+    static const char *EXPRS[][2] = {
+        {"number_arith", "1.5 * 2 + 3 / 4 - 5"},
+        {"concat_4", "\"ab\" + \"ab\" + \"ab\" + \"ab\""},
+        {"call_on_variable", "floor($v7) + strlen($s7)"}};
+    static const EvalOptions NO_OPTIONS = {NULL, NULL, NULL, NULL};
+    EvalStats stats;
+    EvalOptions with_stats;
+    EvalOptions with_trace;
+    size_t trace_sum = 0;
+    size_t i;
+    size_t j;
+
+    with_stats.stats = &stats;
+    with_stats.trace = NULL;
+    with_stats.trace_data = NULL;
+    with_trace.stats = &stats;
+    with_trace.trace = bench_trace;
+    with_trace.trace_data = &trace_sum;
+
+    if (!bench_json)
+        printf("stats: instrumentation %s\n", eval_stats_enabled() ? "compiled in" : "compiled out");
+
+    for (i = 0; i < sizeof(EXPRS) / sizeof(*EXPRS); i++)
+    {
+        char group[64];
+
+        sprintf(group, "stats/%s", EXPRS[i][0]);
+        bench_micro_header(group);
+        for (j = 0; j < sizeof(NAMES) / sizeof(*NAMES); j++)
+        {
+            bench_options = j == 0 ? NULL : j == 1 ? &NO_OPTIONS : j == 2 ? &with_stats : &with_trace;
+            bench_micro(group, NAMES[j], EXPRS[i][1], bench_host_hooks());
+        }
+        bench_options = NULL;
+    }
+}
+
+/* recording cost per call, the table is big enough for every expression */
+static void bench_histograms(void)
+{
+    static const char *EXPRS[][2] = {
+        {"number_arith", "1.5 * 2 + 3 / 4 - 5"},
+        {"call_on_variable", "floor($v7) + strlen($s7)"}};
+    size_t i;
+
+    for (i = 0; i < sizeof(EXPRS) / sizeof(*EXPRS); i++)
+    {
+        char group[64];
+
+        sprintf(group, "histograms/%s", EXPRS[i][0]);
+        bench_micro_header(group);
+        bench_micro(group, "off", EXPRS[i][1], bench_host_hooks());
+        if (eval_histograms_enable(64) != EVAL_RESULT_OK)
+            return;
+        bench_micro(group, "on", EXPRS[i][1], bench_host_hooks());
+        eval_histograms_disable();
+    }
+}
+
+static const BenchCase CASES[] = {
+    {"compile_scaling", bench_compile_scaling, 0},
+    {"rows_scaling", bench_rows_scaling, 0},
+    {"aggregate", bench_aggregate, 0},
+    {"filter", bench_filter, 0},
+    {"membership", bench_membership, 0},
+    {"locals", bench_locals, 0},
+    {"stream", bench_stream, 0},
+    {"csv", bench_csv, 0},
+    {"lexer", bench_lexer, 1},
+    {"parser", bench_parser, 1},
+    {"values", bench_values, 1},
+    {"strings", bench_strings, 1},
+    {"builtins", bench_builtins, 1},
+    {"transforms", bench_transforms, 1},
+    {"search", bench_search, 1},
+    {"regex", bench_regex, 1},
+    {"hooks", bench_hooks, 1},
+    {"memo", bench_memo, 1},
+    {"stats", bench_stats, 1},
+    {"histograms", bench_histograms, 1}};
+
+int main(int argc, char *argv[])
+{
+    size_t nr_cases = sizeof(CASES) / sizeof(*CASES);
+    int nr_names = 0;
+    size_t i;
+    int j;
+
+    for (j = 1; j < argc; j++)
+    {
+        if (strcmp(argv[j], "--json") == 0)
+            bench_json = 1;
+        else if (strcmp(argv[j], "--samples") == 0 && j + 1 < argc && atoi(argv[j + 1]) > 0)
+            bench_samples = (size_t)atoi(argv[++j]);
+        else
+            nr_names++;
+    }
+
+    if (bench_json)
+        printf("{\n  \"seed\": %u,\n  \"samples\": %u,\n  \"results\": [", BENCH_SEED, (unsigned int)bench_samples);
+
+    for (i = 0; i < nr_cases; i++)
+    {
+        int selected = nr_names == 0;
+
+        for (j = 1; j < argc; j++)
+        {
+            if (strcmp(argv[j], CASES[i].name) == 0)
+                selected = 1;
+        }
+
+        /* only the microbenchmarks have a JSON form */
+        if (selected && (CASES[i].micro || !bench_json))
+            CASES[i].run();
+    }
+
+    if (bench_json)
+        printf("\n  ]\n}\n");
+
+    return 0;
+}
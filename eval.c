@@ -28,15 +28,20 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <ctype.h>
 #include <assert.h>
 
 #include "eval.h"
+#include "eval_port.h"
 
 #ifdef WIN32
+#   include <windows.h>
 #   define snprintf _snprintf
 #   define DIRECTORY_SEPARATOR_CHAR '\\'
 #else
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
 #   define DIRECTORY_SEPARATOR_CHAR '/'
 #endif
 
@@ -63,7 +68,9 @@ typedef enum {
     EVAL_TOKEN_TYPE_NUMBER,
     EVAL_TOKEN_TYPE_FUNC,
     EVAL_TOKEN_TYPE_STRING,
-    EVAL_TOKEN_TYPE_VARIABLE
+    EVAL_TOKEN_TYPE_VARIABLE,
+    EVAL_TOKEN_TYPE_COMMA,
+    EVAL_TOKEN_TYPE_SEMICOLON
 
 } EvalTokenType;
 
@@ -71,10 +78,15 @@ typedef struct
 {
     EvalTokenType type;
 
+    /* names and string literals: a slice of the input, or of str once unescaped */
     union {
         double number;
-        char name[EVAL_MAX_NAME_LENGTH];
-    } value;
+        struct
+        {
+            const char *text;
+            size_t length;
+        } slice;
+    } v;
 
 } EvalToken;
 
@@ -92,1005 +104,9042 @@ typedef struct
 
 } EvalVariableEntry;
 
+typedef struct
+{
+    size_t steps;
+    int limited;
+    unsigned long long deadline;
+    unsigned int until_clock;
+    EvalResult result;
+    size_t bytes;
+    size_t peak_bytes;
+    size_t max_bytes;
+} EvalMeter;
+
 typedef struct
 {
     const EvalHooks *hooks;
     void *user_data;
     const char *input;
+    const char *end;
     size_t stack_level;
+    EvalMeter *meter;
     EvalToken token;
     ExprStr str;
 } EvalContext;
 
-static EvalResult parse_expr(EvalContext *ctx, ExprValue *output);
+struct _EvalBuilder;
 
-static int is_digit(char c)
-{
-    return (c >= '0') && (c <= '9');
-}
+static EvalResult parse(EvalContext *ctx, struct _EvalBuilder *b, ExprValue *output);
 
-static int is_name_start(char c)
+static void *default_alloc(size_t size, void *user_data)
 {
-    return ((c >= 'A') && (c <= 'Z')) ||
-           ((c >= 'a') && (c <= 'z')) ||
-           (c == '_');
+    (void)user_data;
+    return malloc(size);
 }
 
-static int is_name(char c)
+static void *default_realloc(void *ptr, size_t size, void *user_data)
 {
-    return is_name_start(c) || is_digit(c);
+    (void)user_data;
+    return realloc(ptr, size);
 }
 
-static int is_exp(char c)
+static void default_free(void *ptr, void *user_data)
 {
-    return (c == 'e') || (c == 'E');
+    (void)user_data;
+    free(ptr);
 }
 
-static int is_dp(char c)
+static EvalAllocator eval_allocator = {default_alloc, default_realloc, default_free, NULL};
+
+#define EVAL_MALLOC(size)           eval_allocator.alloc((size), eval_allocator.user_data)
+#define EVAL_REALLOC(ptr, size)     eval_allocator.realloc((ptr), (size), eval_allocator.user_data)
+#define EVAL_FREE(ptr)              eval_allocator.free((ptr), eval_allocator.user_data)
+
+static void *eval_calloc(size_t n, size_t size)
 {
-    return (c == '.');
+    void *p = EVAL_MALLOC(n * size);
+
+    if (p != NULL)
+        memset(p, 0x00, n * size);
+
+    return p;
 }
 
-static char get_char(EvalContext *ctx)
+void eval_set_allocator(const EvalAllocator *allocator)
 {
-    return *(ctx->input++);
+    if (allocator == NULL)
+    {
+        eval_allocator.alloc = default_alloc;
+        eval_allocator.realloc = default_realloc;
+        eval_allocator.free = default_free;
+        eval_allocator.user_data = NULL;
+    }
+    else
+    {
+        eval_allocator = *allocator;
+    }
 }
 
-static void put_char(EvalContext *ctx)
+/*
+ * Budgets.
+ *
+ * An evaluation with a budget keeps a meter in a thread local, like the
+ * tracer, so hooks and nested evaluations without options are charged to the
+ * evaluation that runs them. Once a limit is hit every later charge fails
+ * too, whatever path is unwinding. String memory is counted where strings
+ * are allocated, resized and freed; a string over the limit is not allocated
+ * and its owner fails with EVAL_RESULT_OOM like on a real shortage.
+ */
+
+static EVAL_THREAD_LOCAL EvalMeter *eval_meter = NULL;
+
+static EvalResult meter_check_clock(EvalMeter *meter)
 {
-    ctx->input--;
+    meter->until_clock = EVAL_BUDGET_CLOCK_STEPS;
+    if (meter->deadline && eval_port_now_ns() >= meter->deadline)
+        meter->result = EVAL_RESULT_BUDGET_EXCEEDED;
+
+    return meter->result;
 }
 
-static EvalResult expr_str_init(ExprStr *str, size_t capacity)
+static EvalResult meter_charge(EvalMeter *meter)
 {
-    if(capacity < 31) {
-        capacity = 31;
+    if (meter->result != EVAL_RESULT_OK)
+        return meter->result;
+
+    if (meter->limited)
+    {
+        if (meter->steps == 0)
+            return meter->result = EVAL_RESULT_BUDGET_EXCEEDED;
+        meter->steps--;
     }
 
-    str->size = 0;
-    str->capacity = capacity;
-    str->str = (char *)malloc(capacity + 1);
+    if (--meter->until_clock == 0)
+        return meter_check_clock(meter);
 
-    return str->str ? EVAL_RESULT_OK : EVAL_RESULT_OOM;
+    return EVAL_RESULT_OK;
 }
 
-static void expr_str_clear(ExprStr *str) 
+/* strings allocated before the evaluation may be resized or freed during it, bytes never go below zero */
+static int meter_resize(EvalMeter *meter, size_t old_size, size_t size)
 {
-    if(str->str) 
-    {
-        free(str->str);
-        memset(str, 0x00, sizeof(ExprStr));
-    }
+    size_t bytes = meter->bytes;
+
+    if (size >= old_size)
+        bytes += size - old_size;
+    else
+        bytes -= (old_size - size < bytes) ? old_size - size : bytes;
+
+    if (meter->max_bytes && size > old_size && bytes > meter->max_bytes)
+        return 0;
+
+    meter->bytes = bytes;
+    if (bytes > meter->peak_bytes)
+        meter->peak_bytes = bytes;
+
+    return 1;
 }
 
-static EvalResult expr_str_append_str(ExprStr *str, const char *other, size_t len)
+static EvalMeter *meter_begin(EvalMeter *meter, const EvalOptions *options)
 {
-    size_t size = str->size + len;
-    if (size >= str->capacity)
+    EvalMeter *previous = eval_meter;
+    const EvalBudget *budget = options ? options->budget : NULL;
+
+    if (budget != NULL)
     {
-        size_t capacity = size;
-        char *s = (char *)realloc(str->str, capacity + 1);
-        if (s == NULL)
-        {
-            return EVAL_RESULT_OOM;
-        }
-        str->str = s;
-        str->capacity = capacity;
+        meter->steps = budget->max_steps;
+        meter->limited = budget->max_steps != 0;
+        meter->deadline = budget->timeout_ns ? eval_port_now_ns() + budget->timeout_ns : 0;
+        meter->until_clock = EVAL_BUDGET_CLOCK_STEPS;
+        meter->result = EVAL_RESULT_OK;
+        meter->bytes = 0;
+        meter->peak_bytes = 0;
+        meter->max_bytes = budget->max_bytes;
+        eval_meter = meter;
     }
 
-    memcpy(str->str + str->size, other, len);
-    str->size = size;
-    str->str[size] = '\0';
+    return previous;
+}
 
-    return EVAL_RESULT_OK;
+static void meter_end(EvalMeter *meter, EvalMeter *previous, const EvalOptions *options)
+{
+    EvalBudget *budget = options ? options->budget : NULL;
+    unsigned long long now;
+
+    if (budget == NULL)
+        return;
+
+    budget->steps_left = meter->limited ? meter->steps : 0;
+    budget->peak_bytes = meter->peak_bytes;
+    budget->ns_left = 0;
+    if (meter->deadline && (now = eval_port_now_ns()) < meter->deadline)
+        budget->ns_left = meter->deadline - now;
+    eval_meter = previous;
 }
 
-static EvalResult expr_str_append_char(ExprStr *str, char c)
+/*
+ * Instrumentation.
+ *
+ * With EVAL_ENABLE_STATS the evaluation running on a thread keeps its tracer
+ * in a thread local, so string allocations deep inside value operations and
+ * functions are counted too. Without it the helpers below are plain calls.
+ * Phase times nest: string allocation during lexing counts for both.
+ */
+
+#ifdef EVAL_ENABLE_STATS
+typedef struct
 {
-    return expr_str_append_str(str, &c, 1);
+    EvalStats stats;
+    const EvalOptions *options;
+    unsigned long long start;
+} EvalTracer;
+
+static EVAL_THREAD_LOCAL EvalTracer *eval_tracer = NULL;
+
+static void trace_event(EvalEvent event, const char *name, size_t value)
+{
+    if (eval_tracer->options->trace)
+        eval_tracer->options->trace(event, name, value, eval_tracer->options->trace_data);
 }
 
-static const char *number_to_string(double v, char *str, size_t capacity)
+/* evaluations without options count into the one that runs them, if any */
+static EvalTracer *trace_begin(EvalTracer *tracer, const EvalOptions *options)
 {
-    if (ceilf(v) == v)
+    EvalTracer *previous = eval_tracer;
+
+    if (options != NULL)
     {
-        snprintf(str, capacity, "%d", (unsigned int)v);
+        memset(&tracer->stats, 0x00, sizeof(EvalStats));
+        tracer->options = options;
+        tracer->start = eval_port_now_ns();
+        eval_tracer = tracer;
     }
-    else
+
+    return previous;
+}
+
+static void trace_end(EvalTracer *tracer, EvalTracer *previous, const EvalOptions *options)
+{
+    if (options != NULL)
     {
-        snprintf(str, capacity, "%lf", v);
+        tracer->stats.total_ns = eval_port_now_ns() - tracer->start;
+        if (options->stats)
+            *options->stats = tracer->stats;
+        eval_tracer = previous;
     }
+}
+#endif
 
-    return str;
+int eval_stats_enabled(void)
+{
+#ifdef EVAL_ENABLE_STATS
+    return 1;
+#else
+    return 0;
+#endif
 }
 
-static EvalResult expr_value_to_string(ExprValue *v)
+static void *traced_string_alloc(void *ptr, size_t size)
 {
-    if (v->type == EXPR_VALUE_TYPE_NUMBER)
+#ifdef EVAL_ENABLE_STATS
+    if (eval_tracer)
     {
-        double val = v->v.val;
+        unsigned long long start = eval_port_now_ns();
+        void *p = ptr ? EVAL_REALLOC(ptr, size) : EVAL_MALLOC(size);
 
-        if(expr_str_init(&(v->v.str), 63) != EVAL_RESULT_OK) {
-            assert(0);
-            return EVAL_RESULT_OOM;
-        }
+        eval_tracer->stats.string_ns += eval_port_now_ns() - start;
+        eval_tracer->stats.string_bytes += size;
+        if (ptr)
+            eval_tracer->stats.nr_string_reallocs++;
+        else
+            eval_tracer->stats.nr_string_allocs++;
+        trace_event(ptr ? EVAL_EVENT_STRING_REALLOC : EVAL_EVENT_STRING_ALLOC, NULL, size);
 
-        v->type = EXPR_VALUE_TYPE_STRING;
-        number_to_string(val, v->v.str.str, v->v.str.capacity);
-        v->v.str.size = strlen(v->v.str.str);
+        return p;
     }
-
-    return EVAL_RESULT_OK;
+#endif
+    return ptr ? EVAL_REALLOC(ptr, size) : EVAL_MALLOC(size);
 }
 
-static EvalResult expr_value_append_string(ExprValue *v, const char *str, size_t len)
+static void *string_alloc(void *ptr, size_t old_size, size_t size)
 {
-    if (expr_value_to_string(v) == EVAL_RESULT_OK)
+    EvalMeter *meter = eval_meter;
+
+    if (meter)
     {
-        return expr_str_append_str(&(v->v.str), str, len);
+        void *p;
+
+        if (!meter_resize(meter, old_size, size))
+            return NULL;
+
+        p = traced_string_alloc(ptr, size);
+        if (p == NULL)
+            meter_resize(meter, size, old_size);
+
+        return p;
     }
 
-    return EVAL_RESULT_OOM;
+    return traced_string_alloc(ptr, size);
 }
 
-void expr_value_init(ExprValue *v)
+static void string_free(void *ptr, size_t size)
 {
-    memset(v, 0x00, sizeof(ExprValue));
-    v->type = EXPR_VALUE_TYPE_NUMBER;
+    if (eval_meter)
+        meter_resize(eval_meter, size, 0);
 
-    return;
+    EVAL_FREE(ptr);
 }
 
-EvalResult expr_value_set_number(ExprValue *v, double val)
+/*
+ * Symbols.
+ *
+ * Every identifier is interned once into a process-wide table and known by a
+ * small integer from then on: ids count up from 1, the builtin functions and
+ * variables first, and entries never move or go away. Lookups take no lock:
+ * a slot of the open addressed index is published with a release store after
+ * its entry is written, and an index half full is replaced by a copy twice
+ * the size while readers may still walk the old one, which is kept. Interning
+ * a new name takes a spin lock. Literal regex patterns are interned the same
+ * way into a table of their own, so they do not use up identifier ids.
+ */
+
+#define EVAL_SYMBOL_PAGE_BITS       10
+#define EVAL_SYMBOL_PAGE            (1 << EVAL_SYMBOL_PAGE_BITS)
+#define EVAL_SYMBOL_MAX_PAGES       1024
+#define EVAL_SYMBOL_INDEX_SIZE      256
+#define EVAL_SYMBOL_BLOCK           4096
+#define EVAL_SYMBOL_ALIGN           8
+
+typedef struct
 {
-    if (v->type == EXPR_VALUE_TYPE_STRING)
+    unsigned long long hash;
+    size_t length;
+    EvalSymbol symbol;
+    char name[EVAL_SYMBOL_ALIGN];
+} EvalSymbolEntry;
+
+typedef struct _EvalSymbolIndex
+{
+    struct _EvalSymbolIndex *previous;
+    size_t mask;
+    EvalSymbolEntry *entries[1];
+} EvalSymbolIndex;
+
+typedef struct
+{
+    EvalSymbolEntry **pages[EVAL_SYMBOL_MAX_PAGES];
+    EvalSymbolIndex *index;
+    unsigned int nr_symbols;
+    unsigned int lock;
+
+    /* entries are carved from blocks chained through their first word */
+    char *blocks;
+    size_t block_used;
+    size_t block_size;
+
+    /* the names interned first, in order, NULL past the last */
+    const char *(*preset)(size_t i);
+} EvalSymbolTable;
+
+static const char *default_symbol_name(size_t i);
+
+static EvalSymbolTable eval_symbols = { { NULL }, NULL, 0, 0, NULL, 0, 0, default_symbol_name };
+static EvalSymbolTable eval_patterns = { { NULL }, NULL, 0, 0, NULL, 0, 0, NULL };
+
+static unsigned long long eval_hash(const char *str, size_t len)
+{
+    unsigned long long h = 0x9e3779b97f4a7c15ull ^ (unsigned long long)len;
+    unsigned long long w;
+
+    for (; len >= 8; str += 8, len -= 8)
     {
-        expr_str_clear(&(v->v.str));
+        memcpy(&w, str, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
     }
 
-    v->v.val = val;
-    v->type = EXPR_VALUE_TYPE_NUMBER;
+    /* the tail a byte at a time: a short memcpy costs more than the hash */
+    if (len)
+    {
+        for (w = 0; len; len--)
+            w = (w << 8) | (unsigned char)str[len - 1];
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+    }
 
-    return EVAL_RESULT_OK;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+
+    /* 0 marks a free slot */
+    return h ? h : 1;
 }
 
-EvalResult expr_value_set_string(ExprValue *v, const char *str, size_t len)
+static const EvalSymbolEntry *symbol_entry(EvalSymbol symbol)
 {
-    if (v->type == EXPR_VALUE_TYPE_NUMBER)
+    return eval_symbols.pages[(symbol - 1) >> EVAL_SYMBOL_PAGE_BITS][(symbol - 1) & (EVAL_SYMBOL_PAGE - 1)];
+}
+
+/* the slots point at the entries themselves, a hit costs one load past the index */
+static const EvalSymbolEntry *symbol_find(const EvalSymbolIndex *index, const char *name, size_t length,
+                                          unsigned long long hash)
+{
+    size_t i = (size_t)hash & index->mask;
+
+    for (;; i = (i + 1) & index->mask)
     {
-        expr_str_init(&(v->v.str), len);
-        v->type = EXPR_VALUE_TYPE_STRING;
+        const EvalSymbolEntry *entry = (const EvalSymbolEntry *)EVAL_ATOMIC_LOAD_ACQUIRE_PTR(index->entries + i);
+
+        if (entry == NULL)
+            return NULL;
+
+        if (entry->hash == hash && entry->length == length && memcmp(entry->name, name, length) == 0)
+            return entry;
     }
+}
 
-    v->v.str.size = 0;
-    expr_value_append_string(v, str, len);
+static void symbol_index_put(EvalSymbolIndex *index, EvalSymbolEntry *entry)
+{
+    size_t i = (size_t)entry->hash & index->mask;
 
-    return EVAL_RESULT_OK;
+    while (index->entries[i] != NULL)
+        i = (i + 1) & index->mask;
+
+    EVAL_ATOMIC_STORE_RELEASE_PTR(index->entries + i, entry);
 }
 
-static EvalResult expr_value_to_number(ExprValue *v)
+static EvalSymbolIndex *symbol_index_create(size_t size)
 {
-    if (v->type == EXPR_VALUE_TYPE_STRING)
+    EvalSymbolIndex *index = (EvalSymbolIndex *)eval_calloc(1, sizeof(EvalSymbolIndex) + (size - 1) * sizeof(EvalSymbolEntry *));
+
+    if (index != NULL)
+        index->mask = size - 1;
+
+    return index;
+}
+
+static EvalSymbolEntry *symbol_store(EvalSymbolTable *table, const char *name, size_t length, unsigned long long hash)
+{
+    size_t size = (offsetof(EvalSymbolEntry, name) + length + 1 + EVAL_SYMBOL_ALIGN - 1) & ~(size_t)(EVAL_SYMBOL_ALIGN - 1);
+    EvalSymbolEntry *entry;
+
+    if (size > table->block_size - table->block_used)
     {
-        double val = atof(v->v.str.str);
-        return expr_value_set_number(v, val);
+        size_t block_size = EVAL_SYMBOL_ALIGN + size > EVAL_SYMBOL_BLOCK ? EVAL_SYMBOL_ALIGN + size : EVAL_SYMBOL_BLOCK;
+        char *block = (char *)EVAL_MALLOC(block_size);
+
+        if (block == NULL)
+            return NULL;
+
+        memcpy(block, &table->blocks, sizeof(char *));
+        table->blocks = block;
+        table->block_used = EVAL_SYMBOL_ALIGN;
+        table->block_size = block_size;
     }
 
-    return EVAL_RESULT_OK;
+    entry = (EvalSymbolEntry *)(table->blocks + table->block_used);
+    table->block_used += size;
+
+    entry->hash = hash;
+    entry->length = length;
+    memcpy(entry->name, name, length);
+    *(entry->name + length) = '\0';
+
+    return entry;
 }
 
-double expr_value_get_number(const ExprValue *v)
+/* under the lock, NULL when out of memory */
+static const EvalSymbolEntry *symbol_insert(EvalSymbolTable *table, const char *name, size_t length,
+                                            unsigned long long hash)
 {
-    if (v->type == EXPR_VALUE_TYPE_STRING)
+    EvalSymbolIndex *index = table->index;
+    const EvalSymbolEntry *found;
+    EvalSymbolEntry *entry;
+    size_t page = table->nr_symbols >> EVAL_SYMBOL_PAGE_BITS;
+    size_t i;
+
+    /* another thread may have got there first */
+    found = symbol_find(index, name, length, hash);
+    if (found != NULL)
+        return found;
+
+    if (page == EVAL_SYMBOL_MAX_PAGES)
+        return NULL;
+
+    if (table->pages[page] == NULL)
     {
-        return atof(v->v.str.str);
+        table->pages[page] = (EvalSymbolEntry **)EVAL_MALLOC(EVAL_SYMBOL_PAGE * sizeof(EvalSymbolEntry *));
+        if (table->pages[page] == NULL)
+            return NULL;
     }
-    else
+
+    if ((table->nr_symbols + 1) * 2 > index->mask + 1)
     {
-        return v->v.val;
+        EvalSymbolIndex *bigger = symbol_index_create((index->mask + 1) * 2);
+
+        if (bigger == NULL)
+            return NULL;
+
+        for (i = 0; i < table->nr_symbols; i++)
+            symbol_index_put(bigger, table->pages[i >> EVAL_SYMBOL_PAGE_BITS][i & (EVAL_SYMBOL_PAGE - 1)]);
+
+        bigger->previous = index;
+        EVAL_ATOMIC_STORE_RELEASE_PTR(&table->index, bigger);
+        index = bigger;
     }
+
+    entry = symbol_store(table, name, length, hash);
+    if (entry == NULL)
+        return NULL;
+
+    entry->symbol = table->nr_symbols + 1;
+    table->pages[page][table->nr_symbols & (EVAL_SYMBOL_PAGE - 1)] = entry;
+    EVAL_ATOMIC_STORE_RELEASE_U32(&table->nr_symbols, entry->symbol);
+    symbol_index_put(index, entry);
+
+    return entry;
 }
 
-const char *expr_value_get_string(const ExprValue *v)
+/* the preset names are interned first, so the builtins' symbols are known */
+static EvalSymbolIndex *symbol_index(EvalSymbolTable *table)
 {
-    if (v->type == EXPR_VALUE_TYPE_STRING)
+    EvalSymbolIndex *index = (EvalSymbolIndex *)EVAL_ATOMIC_LOAD_ACQUIRE_PTR(&table->index);
+    const EvalSymbolEntry *entry;
+    const char *name;
+    size_t i;
+
+    if (index != NULL)
+        return index;
+
+    while (!EVAL_SPIN_TRY_LOCK(&table->lock))
     {
-        return (v->v.str.str);
     }
-    else
+
+    if (table->index == NULL)
     {
+        index = symbol_index_create(EVAL_SYMBOL_INDEX_SIZE);
+        if (index != NULL)
+        {
+            EVAL_ATOMIC_STORE_RELEASE_PTR(&table->index, index);
+            for (i = 0; table->preset != NULL && (name = table->preset(i)) != NULL; i++)
+            {
+                entry = symbol_insert(table, name, strlen(name), eval_hash(name, strlen(name)));
+                assert(entry == NULL || entry->symbol == i + 1);
+                if (entry == NULL)
+                    break;
+            }
+        }
+    }
+    index = table->index;
+
+    EVAL_SPIN_UNLOCK(&table->lock);
+
+    return index;
+}
+
+/* EVAL_SYMBOL_NONE if the name was never interned */
+static EvalSymbol symbol_lookup(const char *name, size_t length)
+{
+    const EvalSymbolIndex *index = symbol_index(&eval_symbols);
+    const EvalSymbolEntry *entry = index ? symbol_find(index, name, length, eval_hash(name, length)) : NULL;
+
+    return entry ? entry->symbol : EVAL_SYMBOL_NONE;
+}
+
+/* the entry of the name, interned if it is new; NULL when out of memory */
+static const EvalSymbolEntry *symbol_intern(EvalSymbolTable *table, const char *name, size_t length)
+{
+    const EvalSymbolIndex *index = symbol_index(table);
+    unsigned long long hash = eval_hash(name, length);
+    const EvalSymbolEntry *entry;
+
+    if (index == NULL)
         return NULL;
+
+    entry = symbol_find(index, name, length, hash);
+    if (entry != NULL)
+        return entry;
+
+    while (!EVAL_SPIN_TRY_LOCK(&table->lock))
+    {
     }
+    entry = symbol_insert(table, name, length, hash);
+    EVAL_SPIN_UNLOCK(&table->lock);
+
+    return entry;
 }
 
-static EvalResult expr_value_op(ExprValue *a, ExprValue *b, EvalTokenType op)
+EvalResult eval_symbol_intern(const char *name, size_t length, EvalSymbol *symbol)
 {
-    if (a->type == EXPR_VALUE_TYPE_STRING || b->type == EXPR_VALUE_TYPE_STRING)
+    const EvalSymbolEntry *entry = symbol_intern(&eval_symbols, name, length);
+
+    *symbol = entry ? entry->symbol : EVAL_SYMBOL_NONE;
+
+    return entry ? EVAL_RESULT_OK : EVAL_RESULT_OOM;
+}
+
+const char *eval_symbol_name(EvalSymbol symbol)
+{
+    if (symbol == EVAL_SYMBOL_NONE || symbol > EVAL_ATOMIC_LOAD_ACQUIRE_U32(&eval_symbols.nr_symbols))
+        return NULL;
+
+    return symbol_entry(symbol)->name;
+}
+
+/*
+ * Capture.
+ *
+ * While a capture runs every eval_execute() call becomes one record: the
+ * expression, each get_variable answer, each get_func answer, the output of
+ * every host function and the result. A record is built in a buffer owned by
+ * the call and appended to the file whole, under a spin lock. Hooks are run
+ * with capture off on their thread, evaluations they start are records of
+ * their own.
+ *
+ * File: magic, version, byte order tag, then records of a u32 size and that
+ * many bytes: u32 length, the expression and its '\0', events, the result.
+ * Numbers, sizes and doubles are in host byte order.
+ */
+
+#define EVAL_CAPTURE_MAGIC          "EVALCAP"
+#define EVAL_CAPTURE_VERSION        1
+#define EVAL_CAPTURE_BYTE_ORDER     0x01020304u
+#define EVAL_CAPTURE_FILE_BUFFER    (256 * 1024)
+#define EVAL_CAPTURE_CALLS          64
+
+typedef enum
+{
+    EVAL_CAPTURE_VARIABLE = 'V',    /* name, result, value when ok */
+    EVAL_CAPTURE_GET_FUNC = 'G',    /* name, EvalCaptureFunc */
+    EVAL_CAPTURE_CALL = 'C',        /* result, value when ok; host functions only */
+    EVAL_CAPTURE_RESULT = 'R'       /* result, value when ok */
+} EvalCaptureEvent;
+
+typedef enum
+{
+    EVAL_CAPTURE_FUNC_UNDEFINED,
+    EVAL_CAPTURE_FUNC_BUILTIN,
+    EVAL_CAPTURE_FUNC_HOST
+} EvalCaptureFunc;
+
+typedef struct
+{
+    FILE *file;
+    unsigned int lock;
+    EvalResult result;
+} EvalCapture;
+
+typedef struct
+{
+    char *data;
+    size_t size;
+    size_t capacity;
+    int failed;
+    /* one byte per function looked up and not called yet, set for host functions; grows with the nesting */
+    unsigned char *calls;
+    size_t nr_calls;
+    size_t calls_capacity;
+} EvalCaptureBuffer;
+
+static EvalCapture *eval_capture = NULL;
+static EVAL_THREAD_LOCAL EvalCaptureBuffer *capture_buffer = NULL;
+
+static EvalFunc default_get_func(const char *name, void *user_data);
+
+static void capture_put(EvalCaptureBuffer *buffer, const void *data, size_t size)
+{
+    if (buffer->size + size > buffer->capacity)
     {
-        expr_value_to_string(a);
-        expr_value_to_string(b);
-        switch (op)
-        {
-        case EVAL_TOKEN_TYPE_MULTIPLY:
-        {
-            expr_value_append_string(a, "*", 1);
-            expr_value_append_string(a, b->v.str.str, b->v.str.size);
-            break;
-        }
-        case EVAL_TOKEN_TYPE_OR:
-        {
-            int ret = a->v.str.size || b->v.str.size;
-            expr_value_set_number(a, ret);
-            break;
-        }
-        case EVAL_TOKEN_TYPE_AND:
-        {
-            int ret = a->v.str.size && b->v.str.size;
-            expr_value_set_number(a, ret);
-            break;
-        }
-        case EVAL_TOKEN_TYPE_BITS_OR:
-        {
-            expr_value_append_string(a, "|", 1);
-            expr_value_append_string(a, b->v.str.str, b->v.str.size);
-            break;
-        }
-        case EVAL_TOKEN_TYPE_BITS_AND:
-        {
-            expr_value_append_string(a, "&", 1);
-            expr_value_append_string(a, b->v.str.str, b->v.str.size);
-            break;
-        }
-        case EVAL_TOKEN_TYPE_DIVIDE:
+        size_t capacity = buffer->capacity ? buffer->capacity : 256;
+        char *p;
+
+        while (capacity < buffer->size + size)
+            capacity *= 2;
+
+        p = (char *)EVAL_REALLOC(buffer->data, capacity);
+        if (p == NULL)
         {
-            expr_value_append_string(a, "/", 1);
-            expr_value_append_string(a, b->v.str.str, b->v.str.size);
-            break;
+            buffer->failed = 1;
+            return;
         }
-        case EVAL_TOKEN_TYPE_SUBTRACT:
-        {
-            expr_value_append_string(a, "-", 1);
-            expr_value_append_string(a, b->v.str.str, b->v.str.size);
+        buffer->data = p;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+static void capture_put_byte(EvalCaptureBuffer *buffer, int c)
+{
+    unsigned char byte = (unsigned char)c;
+
+    capture_put(buffer, &byte, 1);
+}
+
+static void capture_put_u32(EvalCaptureBuffer *buffer, size_t value)
+{
+    unsigned int u32 = (unsigned int)value;
+
+    capture_put(buffer, &u32, sizeof(u32));
+}
+
+static void capture_put_string(EvalCaptureBuffer *buffer, const char *str, size_t size)
+{
+    capture_put_u32(buffer, size);
+    capture_put(buffer, str, size);
+}
+
+static void capture_put_result(EvalCaptureBuffer *buffer, EvalResult result, const ExprValue *value)
+{
+    capture_put_byte(buffer, result);
+    if (result != EVAL_RESULT_OK)
+        return;
+
+    capture_put_byte(buffer, value->type);
+    if (value->type == EXPR_VALUE_TYPE_STRING)
+        capture_put_string(buffer, value->v.str.str, value->v.str.size);
+    else
+        capture_put(buffer, &value->v.val, sizeof(double));
+}
+
+static void capture_variable(EvalCaptureBuffer *buffer, const char *name, EvalResult result, const ExprValue *value)
+{
+    capture_put_byte(buffer, EVAL_CAPTURE_VARIABLE);
+    capture_put_string(buffer, name, strlen(name));
+    capture_put_result(buffer, result, value);
+}
+
+static void capture_get_func(EvalCaptureBuffer *buffer, const char *name, EvalFunc func)
+{
+    int host = func != NULL && func != default_get_func(name, NULL);
+
+    capture_put_byte(buffer, EVAL_CAPTURE_GET_FUNC);
+    capture_put_string(buffer, name, strlen(name));
+    capture_put_byte(buffer, func == NULL ? EVAL_CAPTURE_FUNC_UNDEFINED : host ? EVAL_CAPTURE_FUNC_HOST
+                                                                                : EVAL_CAPTURE_FUNC_BUILTIN);
+
+    /* calls come in the reverse order of lookups */
+    if (func == NULL)
+        return;
+    if (buffer->nr_calls == buffer->calls_capacity)
+    {
+        size_t capacity = buffer->calls_capacity ? buffer->calls_capacity * 2 : EVAL_CAPTURE_CALLS;
+        unsigned char *p = (unsigned char *)EVAL_REALLOC(buffer->calls, capacity);
+
+        if (p == NULL)
+        {
+            buffer->failed = 1;
+            return;
+        }
+        buffer->calls = p;
+        buffer->calls_capacity = capacity;
+    }
+    buffer->calls[buffer->nr_calls++] = (unsigned char)host;
+}
+
+static void capture_call(EvalCaptureBuffer *buffer, EvalResult result, const ExprValue *value)
+{
+    int host;
+
+    if (buffer->nr_calls == 0)
+        return;
+
+    host = buffer->calls[--buffer->nr_calls];
+
+    if (host)
+    {
+        capture_put_byte(buffer, EVAL_CAPTURE_CALL);
+        capture_put_result(buffer, result, value);
+    }
+}
+
+static void capture_begin(EvalCaptureBuffer *buffer, const char *expression)
+{
+    memset(buffer, 0x00, sizeof(EvalCaptureBuffer));
+    capture_put_u32(buffer, 0);
+    capture_put_string(buffer, expression, strlen(expression) + 1);
+}
+
+static void capture_end(EvalCapture *capture, EvalCaptureBuffer *buffer, EvalResult result, const ExprValue *output)
+{
+    capture_put_byte(buffer, EVAL_CAPTURE_RESULT);
+    capture_put_result(buffer, result, output);
+
+    if (buffer->failed)
+    {
+        capture->result = EVAL_RESULT_OOM;
+    }
+    else
+    {
+        unsigned int size = (unsigned int)(buffer->size - sizeof(unsigned int));
+
+        memcpy(buffer->data, &size, sizeof(size));
+        while (!EVAL_SPIN_TRY_LOCK(&capture->lock))
+        {
+        }
+        if (fwrite(buffer->data, 1, buffer->size, capture->file) != buffer->size)
+            capture->result = EVAL_RESULT_IO_ERROR;
+        EVAL_SPIN_UNLOCK(&capture->lock);
+    }
+
+    EVAL_FREE(buffer->data);
+    EVAL_FREE(buffer->calls);
+}
+
+/* the symbol hooks win when set, a symbol they need is interned from the name */
+static EvalResult call_get_variable(const EvalHooks *hooks, EvalSymbol symbol, const char *name, void *user_data,
+                                    ExprValue *output)
+{
+    if (hooks->get_variable_symbol == NULL)
+        return hooks->get_variable(name, user_data, output);
+
+    if (symbol == EVAL_SYMBOL_NONE && eval_symbol_intern(name, strlen(name), &symbol) != EVAL_RESULT_OK)
+        return EVAL_RESULT_OOM;
+
+    return hooks->get_variable_symbol(symbol, user_data, output);
+}
+
+static EvalFunc call_get_func(const EvalHooks *hooks, EvalSymbol symbol, const char *name, void *user_data)
+{
+    if (hooks->get_func_symbol == NULL)
+        return hooks->get_func(name, user_data);
+
+    if (symbol == EVAL_SYMBOL_NONE && eval_symbol_intern(name, strlen(name), &symbol) != EVAL_RESULT_OK)
+        return NULL;
+
+    return hooks->get_func_symbol(symbol, user_data);
+}
+
+static EvalResult traced_get_variable(const EvalHooks *hooks, EvalSymbol symbol, const char *name, void *user_data,
+                                      ExprValue *output)
+{
+#ifdef EVAL_ENABLE_STATS
+    if (eval_tracer)
+    {
+        unsigned long long start = eval_port_now_ns();
+        EvalResult result = call_get_variable(hooks, symbol, name, user_data, output);
+
+        eval_tracer->stats.hook_ns += eval_port_now_ns() - start;
+        eval_tracer->stats.nr_get_variable++;
+        trace_event(EVAL_EVENT_GET_VARIABLE, name, 0);
+
+        return result;
+    }
+#endif
+    return call_get_variable(hooks, symbol, name, user_data, output);
+}
+
+static EvalFunc traced_get_func(const EvalHooks *hooks, EvalSymbol symbol, const char *name, void *user_data)
+{
+#ifdef EVAL_ENABLE_STATS
+    if (eval_tracer)
+    {
+        unsigned long long start = eval_port_now_ns();
+        EvalFunc func = call_get_func(hooks, symbol, name, user_data);
+
+        eval_tracer->stats.hook_ns += eval_port_now_ns() - start;
+        eval_tracer->stats.nr_get_func++;
+        trace_event(EVAL_EVENT_GET_FUNC, name, 0);
+
+        return func;
+    }
+#endif
+    return call_get_func(hooks, symbol, name, user_data);
+}
+
+static EvalResult traced_call(EvalFunc func, const char *name, const ExprValue *input, void *user_data,
+                              ExprValue *output)
+{
+#ifdef EVAL_ENABLE_STATS
+    if (eval_tracer)
+    {
+        unsigned long long start = eval_port_now_ns();
+        EvalResult result = func(input, user_data, output);
+
+        eval_tracer->stats.call_ns += eval_port_now_ns() - start;
+        eval_tracer->stats.nr_calls++;
+        trace_event(EVAL_EVENT_CALL, name, 0);
+
+        return result;
+    }
+#else
+    (void)name;
+#endif
+    return func(input, user_data, output);
+}
+
+/*
+ * The argument of the call being made when the evaluator gives it up: it is
+ * cleared right after the call anyway, so a builtin that returns a changed
+ * copy of a string may take the buffer instead. Memoized calls keep it.
+ */
+static EVAL_THREAD_LOCAL ExprValue *eval_spare_input = NULL;
+
+/* moves a spare string argument to output, non-zero when it did */
+static int take_input(const ExprValue *input, ExprValue *output)
+{
+    if (input != eval_spare_input || input->type != EXPR_VALUE_TYPE_STRING)
+        return 0;
+
+    eval_spare_input = NULL;
+    *output = *input;
+    expr_value_init((ExprValue *)input);
+
+    return 1;
+}
+
+/*
+ * Memoized functions.
+ *
+ * A function registered with eval_func_set_pure() gets a process-wide memo
+ * table with a fixed number of slots in sets of two, picked by the hash of
+ * the argument: numbers hash and compare by their bits, strings by their
+ * bytes. A call whose argument is in its set is answered from the copy of the
+ * output kept there without calling the function, a miss calls it and a
+ * successful output replaces the least recently used slot of the set. Each
+ * table has its own mutex and the copies are allocated outside any
+ * evaluation's memory budget. A kept call is counted: a hit takes a reference
+ * under the mutex and copies the output after letting it go, and whoever
+ * drops the last reference frees it. Registering, invalidating and stats
+ * hold the registry mutex; calls read the list of tables without it, so
+ * registering while evaluating is not thread-safe.
+ */
+
+#define EVAL_MEMO_WAYS              2
+
+typedef struct
+{
+    ExprValueType type;
+    double number;
+    char *str;
+    size_t size;
+} EvalMemoValue;
+
+/* input and output strings follow in the same block */
+typedef struct
+{
+    unsigned int refs;
+    unsigned long long hash;
+    EvalMemoValue input;
+    EvalMemoValue output;
+} EvalMemoEntry;
+
+typedef struct
+{
+    EvalMemoEntry *entry;           /* NULL for a free slot */
+    unsigned long long used;        /* when it was last hit or stored */
+} EvalMemoSlot;
+
+typedef struct
+{
+    EvalFunc func;
+    EvalMutex lock;
+    size_t mask;                    /* of the first slot of a set */
+    unsigned long long clock;
+    EvalMemoStats stats;
+    EvalMemoSlot slots[1];
+} EvalMemo;
+
+static EvalMemo **eval_memos = NULL;
+static size_t eval_nr_memos = 0;
+static EvalMutex eval_memo_lock = EVAL_MUTEX_INITIALIZER;
+
+static EvalMemo *memo_find(EvalFunc func)
+{
+    size_t i;
+
+    for (i = 0; i < eval_nr_memos; i++)
+    {
+        if (eval_memos[i]->func == func)
+            return eval_memos[i];
+    }
+
+    return NULL;
+}
+
+static unsigned long long memo_hash(const ExprValue *value)
+{
+    unsigned long long bits;
+
+    if (value->type == EXPR_VALUE_TYPE_STRING)
+        return eval_hash(value->v.str.str, value->v.str.size);
+
+    memcpy(&bits, &(value->v.val), sizeof(bits));
+
+    return eval_hash((const char *)&bits, sizeof(bits));
+}
+
+static int memo_value_equal(const EvalMemoValue *a, const ExprValue *b)
+{
+    if (a->type != b->type)
+        return 0;
+
+    if (a->type == EXPR_VALUE_TYPE_STRING)
+        return a->size == b->v.str.size && memcmp(a->str, b->v.str.str, a->size) == 0;
+
+    return memcmp(&(a->number), &(b->v.val), sizeof(double)) == 0;
+}
+
+static size_t memo_value_size(const ExprValue *value)
+{
+    return value->type == EXPR_VALUE_TYPE_STRING ? value->v.str.size + 1 : 0;
+}
+
+/* copies value into v, its string at buffer; returns the byte past it */
+static char *memo_value_copy(EvalMemoValue *v, const ExprValue *value, char *buffer)
+{
+    memset(v, 0x00, sizeof(EvalMemoValue));
+    v->type = value->type;
+    if (value->type != EXPR_VALUE_TYPE_STRING)
+    {
+        v->number = value->v.val;
+        return buffer;
+    }
+
+    v->str = buffer;
+    v->size = value->v.str.size;
+    memcpy(v->str, value->v.str.str, v->size + 1);
+
+    return buffer + v->size + 1;
+}
+
+static void memo_entry_release(EvalMemoEntry *entry)
+{
+    if (entry != NULL && EVAL_ATOMIC_RELEASE_REF(&(entry->refs)) == 0)
+        EVAL_FREE(entry);
+}
+
+/* a call that cannot be copied is not kept, it has its output either way */
+static void memo_store(EvalMemo *memo, unsigned long long hash, const ExprValue *input, const ExprValue *output)
+{
+    EvalMemoEntry *entry;
+    EvalMemoEntry *old;
+    EvalMemoSlot *target;
+    char *buffer;
+
+    entry = (EvalMemoEntry *)EVAL_MALLOC(sizeof(EvalMemoEntry) + memo_value_size(input) + memo_value_size(output));
+    if (entry == NULL)
+        return;
+
+    entry->refs = 1;
+    entry->hash = hash;
+    buffer = memo_value_copy(&(entry->input), input, (char *)(entry + 1));
+    memo_value_copy(&(entry->output), output, buffer);
+
+    EVAL_MUTEX_LOCK(&memo->lock);
+    target = memo->slots + (hash & memo->mask);
+    if (target[1].used < target[0].used)
+        target++;
+    if (target->entry != NULL)
+        memo->stats.evictions++;
+    else
+        memo->stats.size++;
+    old = target->entry;
+    target->entry = entry;
+    target->used = ++memo->clock;
+    EVAL_MUTEX_UNLOCK(&memo->lock);
+
+    /* the old copy is freed outside the lock, unless a hit still reads it */
+    memo_entry_release(old);
+}
+
+static EvalResult memo_call(EvalFunc func, const char *name, const ExprValue *input, void *user_data,
+                            ExprValue *output)
+{
+    EvalMemo *memo = eval_nr_memos ? memo_find(func) : NULL;
+    EvalMemoEntry *found = NULL;
+    unsigned long long hash;
+    EvalMemoSlot *slot;
+    EvalResult result;
+    size_t i;
+
+    if (memo == NULL)
+        return traced_call(func, name, input, user_data, output);
+
+    hash = memo_hash(input);
+    EVAL_MUTEX_LOCK(&memo->lock);
+    for (i = 0; i < EVAL_MEMO_WAYS; i++)
+    {
+        slot = memo->slots + (hash & memo->mask) + i;
+        if (slot->entry == NULL || slot->entry->hash != hash || !memo_value_equal(&(slot->entry->input), input))
+            continue;
+
+        found = slot->entry;
+        EVAL_ATOMIC_ADD_U32(&(found->refs), 1);
+        slot->used = ++memo->clock;
+        memo->stats.hits++;
+        break;
+    }
+    if (found == NULL)
+        memo->stats.misses++;
+    EVAL_MUTEX_UNLOCK(&memo->lock);
+
+    if (found != NULL)
+    {
+        if (found->output.type == EXPR_VALUE_TYPE_STRING)
+            result = expr_value_set_string(output, found->output.str, found->output.size);
+        else
+            result = expr_value_set_number(output, found->output.number);
+        memo_entry_release(found);
+        return result;
+    }
+
+    /* the argument is the key of the output */
+    eval_spare_input = NULL;
+    result = traced_call(func, name, input, user_data, output);
+    if (result == EVAL_RESULT_OK)
+        memo_store(memo, hash, input, output);
+
+    return result;
+}
+
+static void memo_destroy(EvalMemo *memo)
+{
+    size_t i;
+
+    for (i = 0; i < memo->stats.capacity; i++)
+        memo_entry_release(memo->slots[i].entry);
+    EVAL_MUTEX_DESTROY(&memo->lock);
+    EVAL_FREE(memo);
+}
+
+/* under the registry lock */
+static EvalResult memo_register(EvalFunc func, EvalMemo *created)
+{
+    EvalMemo *memo = memo_find(func);
+    size_t i;
+
+    if (memo == NULL && created != NULL)
+    {
+        EvalMemo **memos = (EvalMemo **)EVAL_REALLOC(eval_memos, (eval_nr_memos + 1) * sizeof(EvalMemo *));
+        if (memos == NULL)
+        {
+            memo_destroy(created);
+            return EVAL_RESULT_OOM;
+        }
+
+        eval_memos = memos;
+        eval_memos[eval_nr_memos++] = created;
+        return EVAL_RESULT_OK;
+    }
+
+    for (i = 0; i < eval_nr_memos && eval_memos[i] != memo; i++)
+    {
+    }
+    if (i == eval_nr_memos)
+        return EVAL_RESULT_OK;
+
+    /* a new capacity starts empty, 0 forgets the function */
+    if (created != NULL)
+        eval_memos[i] = created;
+    else
+        eval_memos[i] = eval_memos[--eval_nr_memos];
+    memo_destroy(memo);
+
+    if (eval_nr_memos == 0)
+    {
+        EVAL_FREE(eval_memos);
+        eval_memos = NULL;
+    }
+
+    return EVAL_RESULT_OK;
+}
+
+EvalResult eval_func_set_pure(EvalFunc func, size_t capacity)
+{
+    EvalMemo *created = NULL;
+    size_t size = EVAL_MEMO_WAYS;
+    EvalResult result;
+
+    if (capacity)
+    {
+        while (size < capacity)
+            size <<= 1;
+
+        created = (EvalMemo *)eval_calloc(1, sizeof(EvalMemo) + (size - 1) * sizeof(EvalMemoSlot));
+        if (created == NULL)
+            return EVAL_RESULT_OOM;
+
+        created->func = func;
+        created->mask = size - EVAL_MEMO_WAYS;
+        created->stats.capacity = size;
+        EVAL_MUTEX_INIT(&created->lock);
+    }
+
+    EVAL_MUTEX_LOCK(&eval_memo_lock);
+    result = memo_register(func, created);
+    EVAL_MUTEX_UNLOCK(&eval_memo_lock);
+
+    return result;
+}
+
+void eval_func_memo_invalidate(EvalFunc func)
+{
+    size_t i;
+    size_t j;
+
+    EVAL_MUTEX_LOCK(&eval_memo_lock);
+    for (i = 0; i < eval_nr_memos; i++)
+    {
+        EvalMemo *memo = eval_memos[i];
+
+        if (func != NULL && memo->func != func)
+            continue;
+
+        EVAL_MUTEX_LOCK(&memo->lock);
+        for (j = 0; j < memo->stats.capacity; j++)
+        {
+            memo_entry_release(memo->slots[j].entry);
+            memo->slots[j].entry = NULL;
+            memo->slots[j].used = 0;
+        }
+        memo->stats.size = 0;
+        EVAL_MUTEX_UNLOCK(&memo->lock);
+    }
+    EVAL_MUTEX_UNLOCK(&eval_memo_lock);
+}
+
+EvalResult eval_func_memo_stats(EvalFunc func, EvalMemoStats *stats)
+{
+    EvalMemo *memo;
+
+    EVAL_MUTEX_LOCK(&eval_memo_lock);
+    memo = memo_find(func);
+    if (memo != NULL)
+    {
+        EVAL_MUTEX_LOCK(&memo->lock);
+        *stats = memo->stats;
+        EVAL_MUTEX_UNLOCK(&memo->lock);
+    }
+    EVAL_MUTEX_UNLOCK(&eval_memo_lock);
+
+    return memo != NULL ? EVAL_RESULT_OK : EVAL_RESULT_UNDEFINED_FUNCTION;
+}
+
+/*
+ * The hooks as the evaluator calls them: traced, and captured while a capture
+ * runs. The parser knows the symbol, programs the name; the other is derived.
+ */
+static EvalResult expr_value_adopt(ExprValue *v);
+
+static EvalResult hook_get_variable(const EvalHooks *hooks, EvalSymbol symbol, const char *name, void *user_data,
+                                    ExprValue *output)
+{
+    EvalCaptureBuffer *capture = capture_buffer;
+    EvalMeter *meter = eval_meter;
+    EvalResult result;
+
+    if (meter && (result = meter_charge(meter)) != EVAL_RESULT_OK)
+        return result;
+
+    if (capture == NULL)
+    {
+        result = traced_get_variable(hooks, symbol, name, user_data, output);
+    }
+    else
+    {
+        capture_buffer = NULL;
+        result = traced_get_variable(hooks, symbol, name, user_data, output);
+        capture_buffer = capture;
+        capture_variable(capture, name, result, output);
+    }
+
+    if (result == EVAL_RESULT_OK)
+        result = expr_value_adopt(output);
+    if (meter && result == EVAL_RESULT_OK)
+        result = meter_check_clock(meter);
+
+    return result;
+}
+
+/* the lookup is charged, a spent budget fails the next step */
+static EvalFunc hook_get_func(const EvalHooks *hooks, EvalSymbol symbol, const char *name, void *user_data)
+{
+    EvalCaptureBuffer *capture = capture_buffer;
+    EvalFunc func;
+
+    if (eval_meter)
+        meter_charge(eval_meter);
+
+    if (capture == NULL)
+        return traced_get_func(hooks, symbol, name, user_data);
+
+    capture_buffer = NULL;
+    func = traced_get_func(hooks, symbol, name, user_data);
+    capture_buffer = capture;
+    capture_get_func(capture, name, func);
+
+    return func;
+}
+
+static EvalResult hook_call(EvalFunc func, const char *name, const ExprValue *input, void *user_data,
+                            ExprValue *output)
+{
+    EvalCaptureBuffer *capture = capture_buffer;
+    EvalMeter *meter = eval_meter;
+    EvalResult result;
+
+    if (meter && (result = meter_charge(meter)) != EVAL_RESULT_OK)
+        return result;
+
+    if (capture == NULL)
+    {
+        result = memo_call(func, name, input, user_data, output);
+    }
+    else
+    {
+        capture_buffer = NULL;
+        result = memo_call(func, name, input, user_data, output);
+        capture_buffer = capture;
+        capture_call(capture, result, output);
+    }
+
+    if (result == EVAL_RESULT_OK)
+        result = expr_value_adopt(output);
+    if (meter && result == EVAL_RESULT_OK)
+    {
+        result = meter_check_clock(meter);
+        if (result != EVAL_RESULT_OK)
+            expr_value_clear(output);
+    }
+
+    return result;
+}
+
+/* string buffers carry a header in front of them for when the string is held by an EvalValue */
+typedef struct
+{
+    size_t size;
+    size_t capacity;
+} ExprStrHeader;
+
+static EvalResult expr_str_reserve(ExprStr *str, size_t capacity)
+{
+    char *block = str->str ? str->str - sizeof(ExprStrHeader) : NULL;
+    size_t old_size = str->str ? sizeof(ExprStrHeader) + str->capacity + 1 : 0;
+
+    block = (char *)string_alloc(block, old_size, sizeof(ExprStrHeader) + capacity + 1);
+    if (block == NULL)
+    {
+        return EVAL_RESULT_OOM;
+    }
+    str->str = block + sizeof(ExprStrHeader);
+    str->capacity = capacity;
+
+    return EVAL_RESULT_OK;
+}
+
+static EvalResult expr_str_init(ExprStr *str, size_t capacity)
+{
+    if(capacity < 31) {
+        capacity = 31;
+    }
+
+    str->size = 0;
+    str->str = NULL;
+
+    return expr_str_reserve(str, capacity);
+}
+
+static void expr_str_clear(ExprStr *str) 
+{
+    if(str->str) 
+    {
+        string_free(str->str - sizeof(ExprStrHeader), sizeof(ExprStrHeader) + str->capacity + 1);
+        memset(str, 0x00, sizeof(ExprStr));
+    }
+}
+
+static EvalResult expr_str_append_str(ExprStr *str, const char *other, size_t len)
+{
+    size_t size = str->size + len;
+    if (size >= str->capacity && expr_str_reserve(str, size) != EVAL_RESULT_OK)
+    {
+        return EVAL_RESULT_OOM;
+    }
+
+    memcpy(str->str + str->size, other, len);
+    str->size = size;
+    str->str[size] = '\0';
+
+    return EVAL_RESULT_OK;
+}
+
+static EvalResult expr_str_append_char(ExprStr *str, char c)
+{
+    return expr_str_append_str(str, &c, 1);
+}
+
+static const char *number_to_string(double v, char *str, size_t capacity)
+{
+    if (ceilf(v) == v)
+    {
+        snprintf(str, capacity, "%d", (unsigned int)v);
+    }
+    else
+    {
+        snprintf(str, capacity, "%lf", v);
+    }
+
+    return str;
+}
+
+static EvalResult expr_value_to_string(ExprValue *v)
+{
+    if (v->type == EXPR_VALUE_TYPE_NUMBER)
+    {
+        double val = v->v.val;
+
+        if(expr_str_init(&(v->v.str), 63) != EVAL_RESULT_OK) {
+            v->v.val = val;
+            return EVAL_RESULT_OOM;
+        }
+
+        v->type = EXPR_VALUE_TYPE_STRING;
+        v->owned = 1;
+        number_to_string(val, v->v.str.str, v->v.str.capacity);
+        v->v.str.size = strlen(v->v.str.str);
+    }
+
+    return EVAL_RESULT_OK;
+}
+
+static EvalResult expr_value_append_string(ExprValue *v, const char *str, size_t len)
+{
+    if (expr_value_to_string(v) == EVAL_RESULT_OK)
+    {
+        return expr_str_append_str(&(v->v.str), str, len);
+    }
+
+    return EVAL_RESULT_OOM;
+}
+
+void expr_value_init(ExprValue *v)
+{
+    memset(v, 0x00, sizeof(ExprValue));
+    v->type = EXPR_VALUE_TYPE_NUMBER;
+
+    return;
+}
+
+EvalResult expr_value_set_number(ExprValue *v, double val)
+{
+    if (v->type == EXPR_VALUE_TYPE_STRING && v->owned)
+    {
+        expr_str_clear(&(v->v.str));
+    }
+    else if (v->type == EXPR_VALUE_TYPE_STRING)
+    {
+        free(v->v.str.str);
+    }
+
+    v->v.val = val;
+    v->type = EXPR_VALUE_TYPE_NUMBER;
+    v->owned = 0;
+
+    return EVAL_RESULT_OK;
+}
+
+EvalResult expr_value_set_string(ExprValue *v, const char *str, size_t len)
+{
+    if (v->type == EXPR_VALUE_TYPE_STRING && !v->owned)
+        expr_value_set_number(v, 0);
+
+    if (v->type == EXPR_VALUE_TYPE_NUMBER)
+    {
+        if (expr_str_init(&(v->v.str), len) != EVAL_RESULT_OK)
+        {
+            expr_value_init(v);
+            return EVAL_RESULT_OOM;
+        }
+        v->type = EXPR_VALUE_TYPE_STRING;
+        v->owned = 1;
+    }
+
+    v->v.str.size = 0;
+    v->v.str.str[0] = '\0';
+
+    return expr_value_append_string(v, str, len);
+}
+
+/* a string a hook filled in by hand moves to a buffer with a header, the host's is free()d */
+static EvalResult expr_value_adopt(ExprValue *v)
+{
+    ExprStr str;
+    EvalResult result;
+
+    if (v->type != EXPR_VALUE_TYPE_STRING || v->owned)
+        return EVAL_RESULT_OK;
+
+    result = expr_str_init(&str, v->v.str.size);
+    if (result == EVAL_RESULT_OK)
+    {
+        if (v->v.str.size)
+            memcpy(str.str, v->v.str.str, v->v.str.size);
+        str.size = v->v.str.size;
+        str.str[str.size] = '\0';
+    }
+    free(v->v.str.str);
+
+    if (result != EVAL_RESULT_OK)
+    {
+        expr_value_init(v);
+        return result;
+    }
+    v->v.str = str;
+    v->owned = 1;
+
+    return EVAL_RESULT_OK;
+}
+
+static EvalResult expr_value_to_number(ExprValue *v)
+{
+    if (v->type == EXPR_VALUE_TYPE_STRING)
+    {
+        double val = atof(v->v.str.str);
+        return expr_value_set_number(v, val);
+    }
+
+    return EVAL_RESULT_OK;
+}
+
+double expr_value_get_number(const ExprValue *v)
+{
+    if (v->type == EXPR_VALUE_TYPE_STRING)
+    {
+        return atof(v->v.str.str);
+    }
+    else
+    {
+        return v->v.val;
+    }
+}
+
+const char *expr_value_get_string(const ExprValue *v)
+{
+    if (v->type == EXPR_VALUE_TYPE_STRING)
+    {
+        return (v->v.str.str);
+    }
+    else
+    {
+        return NULL;
+    }
+}
+
+/* a, the operator and b in one go, both already strings */
+static EvalResult expr_value_concat(ExprValue *a, char op, const ExprValue *b)
+{
+    EvalResult result = expr_str_append_char(&(a->v.str), op);
+
+    if (result != EVAL_RESULT_OK)
+        return result;
+
+    return expr_str_append_str(&(a->v.str), b->v.str.str, b->v.str.size);
+}
+
+static double number_op(double a, double b, EvalTokenType op)
+{
+    switch (op)
+    {
+    case EVAL_TOKEN_TYPE_MULTIPLY:
+    {
+        a *= b;
+        break;
+    }
+    case EVAL_TOKEN_TYPE_OR:
+    {
+        a = a || b;
+        break;
+    }
+    case EVAL_TOKEN_TYPE_AND:
+    {
+        a = a && b;
+        break;
+    }
+    case EVAL_TOKEN_TYPE_BITS_OR:
+    {
+        a = (unsigned int)a | (unsigned int)b;
+        break;
+    }
+    case EVAL_TOKEN_TYPE_BITS_AND:
+    {
+        a = (unsigned int)a & (unsigned int)b;
+        break;
+    }
+    case EVAL_TOKEN_TYPE_DIVIDE:
+    {
+        a /= b;
+        break;
+    }
+    case EVAL_TOKEN_TYPE_ADD:
+    {
+        a += b;
+        break;
+    }
+    case EVAL_TOKEN_TYPE_SUBTRACT:
+    {
+        a -= b;
+        break;
+    }
+    case EVAL_TOKEN_TYPE_E:
+    {
+        a = a == b;
+        break;
+    }
+    case EVAL_TOKEN_TYPE_G:
+    {
+        a = a > b;
+        break;
+    }
+    case EVAL_TOKEN_TYPE_L:
+    {
+        a = a < b;
+        break;
+    }
+    case EVAL_TOKEN_TYPE_NE:
+    {
+        a = a != b;
+        break;
+    }
+    case EVAL_TOKEN_TYPE_LE:
+    {
+        a = a <= b;
+        break;
+    }
+    case EVAL_TOKEN_TYPE_GE:
+    {
+        a = a >= b;
+        break;
+    }
+    default:
+        break;
+    }
+
+    return a;
+}
+
+static EvalResult expr_value_op(ExprValue *a, ExprValue *b, EvalTokenType op)
+{
+    EvalResult result = EVAL_RESULT_OK;
+
+    if (a->type == EXPR_VALUE_TYPE_STRING || b->type == EXPR_VALUE_TYPE_STRING)
+    {
+        if ((result = expr_value_to_string(a)) != EVAL_RESULT_OK || (result = expr_value_to_string(b)) != EVAL_RESULT_OK)
+            return result;
+
+        switch (op)
+        {
+        case EVAL_TOKEN_TYPE_MULTIPLY:
+        {
+            result = expr_value_concat(a, '*', b);
+            break;
+        }
+        case EVAL_TOKEN_TYPE_OR:
+        {
+            int ret = a->v.str.size || b->v.str.size;
+            expr_value_set_number(a, ret);
+            break;
+        }
+        case EVAL_TOKEN_TYPE_AND:
+        {
+            int ret = a->v.str.size && b->v.str.size;
+            expr_value_set_number(a, ret);
+            break;
+        }
+        case EVAL_TOKEN_TYPE_BITS_OR:
+        {
+            result = expr_value_concat(a, '|', b);
+            break;
+        }
+        case EVAL_TOKEN_TYPE_BITS_AND:
+        {
+            result = expr_value_concat(a, '&', b);
+            break;
+        }
+        case EVAL_TOKEN_TYPE_DIVIDE:
+        {
+            result = expr_value_concat(a, '/', b);
+            break;
+        }
+        case EVAL_TOKEN_TYPE_SUBTRACT:
+        {
+            result = expr_value_concat(a, '-', b);
+            break;
+        }
+        case EVAL_TOKEN_TYPE_ADD:
+        {
+            result = expr_value_append_string(a, b->v.str.str, b->v.str.size);
+            break;
+        }
+        case EVAL_TOKEN_TYPE_E:
+        {
+            int ret = strcmp(a->v.str.str, b->v.str.str) == 0;
+            expr_value_set_number(a, ret);
+            break;
+        }
+        case EVAL_TOKEN_TYPE_G:
+        {
+            int ret = strcmp(a->v.str.str, b->v.str.str) > 0;
+            expr_value_set_number(a, ret);
+            break;
+        }
+        case EVAL_TOKEN_TYPE_L:
+        {
+            int ret = strcmp(a->v.str.str, b->v.str.str) < 0;
+            expr_value_set_number(a, ret);
+            break;
+        }
+        case EVAL_TOKEN_TYPE_LE:
+        {
+            int ret = strcmp(a->v.str.str, b->v.str.str) <= 0;
+            expr_value_set_number(a, ret);
+            break;
+        }
+        case EVAL_TOKEN_TYPE_NE:
+        {
+            int ret = strcmp(a->v.str.str, b->v.str.str) != 0;
+            expr_value_set_number(a, ret);
+            break;
+        }
+        case EVAL_TOKEN_TYPE_GE:
+        {
+            int ret = strcmp(a->v.str.str, b->v.str.str) >= 0;
+            expr_value_set_number(a, ret);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    else
+    {
+        expr_value_to_number(a);
+        expr_value_to_number(b);
+        a->v.val = number_op(a->v.val, b->v.val, op);
+    }
+
+    return result;
+}
+
+void expr_value_clear(ExprValue *v)
+{
+    if (v->type == EXPR_VALUE_TYPE_STRING)
+    {
+        expr_value_set_number(v, 0);
+    }
+}
+
+/* Lexer */
+
+/* what a byte starts, in the low bits, and which runs it continues */
+#define EVAL_CHAR_ILLEGAL           0
+#define EVAL_CHAR_END               1
+#define EVAL_CHAR_SPACE             2
+#define EVAL_CHAR_NUMBER            3
+#define EVAL_CHAR_NAME              4
+#define EVAL_CHAR_VARIABLE          5
+#define EVAL_CHAR_STRING            6
+#define EVAL_CHAR_OPERATOR          7
+#define EVAL_CHAR_KIND              0x07
+#define EVAL_CHAR_DIGIT             0x10
+#define EVAL_CHAR_NAME_PART         0x20
+
+#define X_ EVAL_CHAR_ILLEGAL
+#define E_ EVAL_CHAR_END
+#define S_ EVAL_CHAR_SPACE
+#define D_ (EVAL_CHAR_NUMBER | EVAL_CHAR_DIGIT | EVAL_CHAR_NAME_PART)
+#define P_ EVAL_CHAR_NUMBER
+#define N_ (EVAL_CHAR_NAME | EVAL_CHAR_NAME_PART)
+#define V_ EVAL_CHAR_VARIABLE
+#define Q_ EVAL_CHAR_STRING
+#define O_ EVAL_CHAR_OPERATOR
+
+/* bytes from 0x80 up are spaces, as they were when compared as signed chars */
+static const unsigned char EVAL_CHAR_CLASS[256] = {
+    E_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_,  /* 00 */
+    S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_,  /* 10 */
+    S_, O_, Q_, X_, V_, X_, O_, X_, O_, O_, O_, O_, O_, O_, P_, O_,  /* 20 */
+    D_, D_, D_, D_, D_, D_, D_, D_, D_, D_, X_, O_, O_, O_, O_, X_,  /* 30 */
+    X_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_,  /* 40 */
+    N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, X_, X_, X_, X_, N_,  /* 50 */
+    X_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_,  /* 60 */
+    N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, X_, O_, X_, O_, X_,  /* 70 */
+    S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_,  /* 80 */
+    S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_,  /* 90 */
+    S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_,  /* a0 */
+    S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_,  /* b0 */
+    S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_,  /* c0 */
+    S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_,  /* d0 */
+    S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_,  /* e0 */
+    S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_, S_   /* f0 */
+};
+
+#undef X_
+#undef E_
+#undef S_
+#undef D_
+#undef P_
+#undef N_
+#undef V_
+#undef Q_
+#undef O_
+
+#define T(type) EVAL_TOKEN_TYPE_##type
+
+/* the token an operator byte stands for on its own, the rest are 0 */
+static const unsigned char EVAL_CHAR_TOKEN[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 00 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 10 */
+    0, T(NOT), 0, 0, 0, 0, T(BITS_AND), 0,
+    T(OPEN_BRACKET), T(CLOSE_BRACKET), T(MULTIPLY), T(ADD), T(COMMA), T(SUBTRACT), 0, T(DIVIDE),  /* 20 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, T(SEMICOLON), T(L), T(E), T(G), 0,  /* 30 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 40 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 50 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 60 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, T(BITS_OR), 0, T(BITS_NOT), 0  /* 70 */
+};
+
+/* by token type: the byte that makes a two byte operator of it, and what it becomes */
+static const struct
+{
+    char second;
+    unsigned char pair;
+} EVAL_TOKEN_PAIR[] = {
+    {0, 0},          /* END */
+    {0, 0},          /* ADD */
+    {'=', T(GE)},    /* G */
+    {0, 0},          /* GE */
+    {'=', T(LE)},    /* L */
+    {0, 0},          /* LE */
+    {0, 0},          /* NE */
+    {'=', T(E)},     /* E */
+    {'=', T(NE)},    /* NOT */
+    {0, 0},          /* OR */
+    {0, 0},          /* AND */
+    {0, 0},          /* BITS_NOT */
+    {'|', T(OR)},    /* BITS_OR */
+    {'&', T(AND)},   /* BITS_AND */
+    {0, 0},          /* SUBTRACT */
+    {0, 0},          /* MULTIPLY */
+    {0, 0},          /* DIVIDE */
+    {0, 0},          /* OPEN_BRACKET */
+    {0, 0},          /* CLOSE_BRACKET */
+    {0, 0},          /* NUMBER */
+    {0, 0},          /* FUNC */
+    {0, 0},          /* STRING */
+    {0, 0},          /* VARIABLE */
+    {0, 0},          /* COMMA */
+    {0, 0}           /* SEMICOLON */
+};
+
+#undef T
+
+#define EVAL_CHAR_IS(c, flag)       (EVAL_CHAR_CLASS[(unsigned char)(c)] & (flag))
+
+/*
+ * Runs are scanned 16 bytes at a time while that many are left before the end
+ * of the input, the tail a byte at a time. Each returns where the run stops.
+ */
+#ifdef EVAL_HAVE_SSE2
+static const char *scan_spaces(const char *p, const char *end)
+{
+    const __m128i space = _mm_set1_epi8(' ');
+
+    /* signed compare: the bytes from 0x80 up are below the space too */
+    for (; end - p >= 16; p += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpgt_epi8(x, space));
+
+        if (mask)
+            return p + EVAL_CTZ64(mask);
+    }
+
+    while (p < end && (EVAL_CHAR_CLASS[(unsigned char)*p] & EVAL_CHAR_KIND) == EVAL_CHAR_SPACE)
+        p++;
+
+    return p;
+}
+
+static const char *scan_name(const char *p, const char *end)
+{
+    const __m128i lower = _mm_set1_epi8(0x20);
+    const __m128i before_a = _mm_set1_epi8('a' - 1);
+    const __m128i after_z = _mm_set1_epi8('z' + 1);
+    const __m128i before_0 = _mm_set1_epi8('0' - 1);
+    const __m128i after_9 = _mm_set1_epi8('9' + 1);
+    const __m128i underscore = _mm_set1_epi8('_');
+
+    for (; end - p >= 16; p += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        __m128i l = _mm_or_si128(x, lower);
+        __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(l, before_a), _mm_cmplt_epi8(l, after_z));
+        __m128i digits = _mm_and_si128(_mm_cmpgt_epi8(x, before_0), _mm_cmplt_epi8(x, after_9));
+        __m128i name = _mm_or_si128(_mm_or_si128(letters, digits), _mm_cmpeq_epi8(x, underscore));
+        unsigned int mask = ~(unsigned int)_mm_movemask_epi8(name) & 0xffff;
+
+        if (mask)
+            return p + EVAL_CTZ64(mask);
+    }
+
+    while (p < end && EVAL_CHAR_IS(*p, EVAL_CHAR_NAME_PART))
+        p++;
+
+    return p;
+}
+
+/* the closing quote or a backslash */
+static const char *scan_string(const char *p, const char *end)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+
+    for (; end - p >= 16; p += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, quote),
+                                                                         _mm_cmpeq_epi8(x, backslash)));
+
+        if (mask)
+            return p + EVAL_CTZ64(mask);
+    }
+
+    while (p < end && *p != '"' && *p != '\\')
+        p++;
+
+    return p;
+}
+#else
+static const char *scan_spaces(const char *p, const char *end)
+{
+    while (p < end && (EVAL_CHAR_CLASS[(unsigned char)*p] & EVAL_CHAR_KIND) == EVAL_CHAR_SPACE)
+        p++;
+
+    return p;
+}
+
+static const char *scan_name(const char *p, const char *end)
+{
+    while (p < end && EVAL_CHAR_IS(*p, EVAL_CHAR_NAME_PART))
+        p++;
+
+    return p;
+}
+
+static const char *scan_string(const char *p, const char *end)
+{
+    while (p < end && *p != '"' && *p != '\\')
+        p++;
+
+    return p;
+}
+#endif
+
+/*
+ * Number literals are read to the nearest double. Up to 15 significant digits
+ * and a power of ten up to 1e22 are both exact, so one multiplication or
+ * division rounds correctly; other literals go to strtod() as digits and an
+ * exponent without a decimal point, which reads the same in every locale.
+ * Past EVAL_NUMBER_MAX_DIGITS digits only whether any of the rest is non-zero
+ * can change the result.
+ */
+
+#define EVAL_NUMBER_MAX_DIGITS      800
+#define EVAL_NUMBER_MAX_EXP         100000000L
+
+static const double EVAL_POWERS_OF_TEN[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* the digits at p, with or without a '.', times 10^exp */
+static double number_exact(const char *p, long exp)
+{
+    char digits[EVAL_NUMBER_MAX_DIGITS + 32];
+    size_t nr_digits = 0;
+    int dropped = 0;
+
+    for (; EVAL_CHAR_IS(*p, EVAL_CHAR_DIGIT) || *p == '.'; p++)
+    {
+        if (*p == '.' || (nr_digits == 0 && *p == '0'))
+            continue;
+
+        if (nr_digits < EVAL_NUMBER_MAX_DIGITS)
+        {
+            digits[nr_digits++] = *p;
+        }
+        else
+        {
+            dropped |= *p != '0';
+            exp++;
+        }
+    }
+
+    if (dropped)
+    {
+        digits[nr_digits++] = '1';
+        exp--;
+    }
+    sprintf(digits + nr_digits, "e%ld", exp);
+
+    return strtod(digits, NULL);
+}
+
+/* the end of the number literal at p, NULL when there is none */
+static const char *scan_number(const char *p, double *number)
+{
+    const char *start = p;
+    size_t nr_digits = 0;           /* significant ones */
+    double value = 0;               /* of the digits, exact while there are at most 15 */
+    long exp = 0;
+
+    if (*p != '.')
+    {
+        if (!EVAL_CHAR_IS(*p, EVAL_CHAR_DIGIT))
+            return NULL;
+
+        do
+        {
+            value = (value * 10.0f) + (*p - '0');
+            nr_digits += value != 0;
+            p++;
+
+        } while (EVAL_CHAR_IS(*p, EVAL_CHAR_DIGIT));
+    }
+
+    if (*p == '.')
+    {
+        p++;
+        if (!EVAL_CHAR_IS(*p, EVAL_CHAR_DIGIT))
+            return NULL;
+
+        do
+        {
+            value = (value * 10.0f) + (*p - '0');
+            nr_digits += value != 0;
+            exp--;
+            p++;
+
+        } while (EVAL_CHAR_IS(*p, EVAL_CHAR_DIGIT));
+    }
+
+    if (*p == 'e' || *p == 'E')
+    {
+        int exp_neg;
+        long int_val;
+
+        exp_neg = 0;
+
+        switch (*++p)
+        {
+        case '-':
+            exp_neg = 1;
+        /* fall through */
+
+        case '+':
+            p++;
+        /* fall through */
+
+        default:
+            break;
+        }
+
+        int_val = 0;
+
+        if (!EVAL_CHAR_IS(*p, EVAL_CHAR_DIGIT))
+            return NULL;
+
+        do
+        {
+            if (int_val < EVAL_NUMBER_MAX_EXP)
+                int_val = (int_val * 10) + (*p - '0');
+            p++;
+
+        } while (EVAL_CHAR_IS(*p, EVAL_CHAR_DIGIT));
+
+        if (exp_neg)
+            exp -= int_val;
+        else
+            exp += int_val;
+    }
+
+    if (nr_digits == 0)
+        *number = 0;
+    else if (nr_digits <= 15 && exp >= -22 && exp <= 22)
+        *number = exp < 0 ? value / EVAL_POWERS_OF_TEN[-exp] : value * EVAL_POWERS_OF_TEN[exp];
+    else
+        *number = number_exact(start, exp);
+
+    return p;
+}
+
+static EvalResult get_number(EvalContext *ctx)
+{
+    const char *p = scan_number(ctx->input, &(ctx->token.v.number));
+
+    if (p == NULL)
+        return EVAL_RESULT_INVALID_LITERAL;
+
+    ctx->input = p;
+    ctx->token.type = EVAL_TOKEN_TYPE_NUMBER;
+
+    return EVAL_RESULT_OK;
+}
+
+EvalResult eval_number_parse(const char *str, size_t len, double *value)
+{
+    char buff[64];
+    char *copy = len < sizeof(buff) ? buff : (char *)EVAL_MALLOC(len + 1);
+    const char *p;
+    int negative;
+    int whole;
+
+    if (copy == NULL)
+        return EVAL_RESULT_OOM;
+
+    /* the scanner reads up to a byte it does not take, so the text is terminated */
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    negative = len && *copy == '-';
+    p = scan_number(copy + negative, value);
+    whole = p == copy + len;
+    if (whole && negative)
+        *value = -*value;
+    if (copy != buff)
+        EVAL_FREE(copy);
+
+    return whole ? EVAL_RESULT_OK : EVAL_RESULT_INVALID_LITERAL;
+}
+
+/* the token refers to the name in the input */
+static EvalResult get_name(EvalContext *ctx, EvalTokenType type)
+{
+    const char *end = scan_name(ctx->input, ctx->end);
+    size_t length = (size_t)(end - ctx->input);
+
+    ctx->token.type = type;
+    ctx->token.v.slice.text = ctx->input;
+    ctx->token.v.slice.length = length;
+    ctx->input = end;
+
+    return EVAL_RESULT_OK;
+}
+
+/*
+ * A backslash takes the byte after it literally, whatever it is, and a run of
+ * them counts as one. Literals without any refer to the input; the others are
+ * unescaped into str, sized once from where the literal ends.
+ */
+static EvalResult get_string(EvalContext *ctx)
+{
+    const char *start = ctx->input;
+    const char *end = scan_string(start, ctx->end);
+    const char *p;
+    char *dst;
+    EvalResult result;
+
+    if (end == ctx->end)
+        return EVAL_RESULT_INVALID_LITERAL;
+
+    if (*end == '\\')
+    {
+        do
+        {
+            while (*end == '\\')
+                end++;
+            if (end == ctx->end)
+                return EVAL_RESULT_INVALID_LITERAL;
+
+            end = scan_string(end + 1, ctx->end);
+            if (end == ctx->end)
+                return EVAL_RESULT_INVALID_LITERAL;
+
+        } while (*end == '\\');
+
+        if ((size_t)(end - start) > ctx->str.capacity)
+        {
+            result = expr_str_reserve(&(ctx->str), (size_t)(end - start));
+            if (result != EVAL_RESULT_OK)
+                return result;
+        }
+
+        dst = ctx->str.str;
+        for (p = start; p < end;)
+        {
+            const char *run = (const char *)memchr(p, '\\', (size_t)(end - p));
+
+            if (run == NULL)
+                run = end;
+
+            memcpy(dst, p, (size_t)(run - p));
+            dst += run - p;
+            p = run;
+
+            if (p < end)
+            {
+                while (*p == '\\')
+                    p++;
+                *dst++ = *p++;
+            }
+        }
+
+        ctx->str.size = (size_t)(dst - ctx->str.str);
+        ctx->str.str[ctx->str.size] = '\0';
+        ctx->token.v.slice.text = ctx->str.str;
+        ctx->token.v.slice.length = ctx->str.size;
+    }
+    else
+    {
+        ctx->token.v.slice.text = start;
+        ctx->token.v.slice.length = (size_t)(end - start);
+    }
+
+    ctx->input = end + 1;
+    ctx->token.type = EVAL_TOKEN_TYPE_STRING;
+
+    return EVAL_RESULT_OK;
+}
+
+static EvalResult lex_token(EvalContext *ctx)
+{
+    unsigned char c = (unsigned char)*ctx->input;
+    unsigned int kind = EVAL_CHAR_CLASS[c] & EVAL_CHAR_KIND;
+
+    if (kind == EVAL_CHAR_SPACE)
+    {
+        /* single spaces between tokens are the common case */
+        ctx->input++;
+        if ((EVAL_CHAR_CLASS[(unsigned char)*ctx->input] & EVAL_CHAR_KIND) == EVAL_CHAR_SPACE)
+            ctx->input = scan_spaces(ctx->input, ctx->end);
+        c = (unsigned char)*ctx->input;
+        kind = EVAL_CHAR_CLASS[c] & EVAL_CHAR_KIND;
+    }
+
+    switch (kind)
+    {
+    case EVAL_CHAR_END:
+        ctx->token.type = EVAL_TOKEN_TYPE_END;
+        return EVAL_RESULT_OK;
+    case EVAL_CHAR_NUMBER:
+        return get_number(ctx);
+    case EVAL_CHAR_NAME:
+        return get_name(ctx, EVAL_TOKEN_TYPE_FUNC);
+    case EVAL_CHAR_VARIABLE:
+        ctx->input++;
+        return get_name(ctx, EVAL_TOKEN_TYPE_VARIABLE);
+    case EVAL_CHAR_STRING:
+        ctx->input++;
+        return get_string(ctx);
+    case EVAL_CHAR_OPERATOR:
+    {
+        unsigned int type = EVAL_CHAR_TOKEN[c];
+
+        ctx->input++;
+        if (EVAL_TOKEN_PAIR[type].second && *ctx->input == EVAL_TOKEN_PAIR[type].second)
+        {
+            type = EVAL_TOKEN_PAIR[type].pair;
+            ctx->input++;
+        }
+        ctx->token.type = (EvalTokenType)type;
+        return EVAL_RESULT_OK;
+    }
+    default:
+        ctx->input++;
+        return EVAL_RESULT_ILLEGAL_CHARACTER;
+    }
+}
+
+static EvalResult get_token(EvalContext *ctx)
+{
+    if (ctx->meter)
+    {
+        EvalResult result = meter_charge(ctx->meter);
+        if (result != EVAL_RESULT_OK)
+            return result;
+    }
+
+#ifdef EVAL_ENABLE_STATS
+    if (eval_tracer)
+    {
+        const char *input = ctx->input;
+        unsigned long long start = eval_port_now_ns();
+        EvalResult result = lex_token(ctx);
+
+        eval_tracer->stats.lex_ns += eval_port_now_ns() - start;
+        eval_tracer->stats.nr_tokens++;
+        trace_event(EVAL_EVENT_TOKEN, NULL, (size_t)(ctx->input - input));
+
+        return result;
+    }
+#endif
+    return lex_token(ctx);
+}
+
+static EvalResult execute(const char *expression, const EvalHooks *hooks,
+                          void *user_data, ExprValue *output)
+{
+    EvalContext ctx;
+    EvalResult result;
+
+    result = expr_str_init(&ctx.str, 100);
+    if (result != EVAL_RESULT_OK)
+        return result;
+
+    ctx.hooks = hooks;
+    ctx.user_data = user_data;
+    ctx.input = expression;
+    ctx.end = expression + strlen(expression);
+    ctx.stack_level = 0;
+    ctx.meter = eval_meter;
+
+    result = get_token(&ctx);
+    if (result == EVAL_RESULT_OK)
+        result = parse(&ctx, NULL, output);
+
+    if (result == EVAL_RESULT_OK && ctx.token.type != EVAL_TOKEN_TYPE_END)
+    {
+        expr_value_clear(output);
+        result = EVAL_RESULT_UNEXPECTED_CHAR;
+    }
+    expr_str_clear(&ctx.str);
+
+    return result;
+}
+
+static EvalResult execute_captured(const char *expression, const EvalHooks *hooks,
+                                   void *user_data, ExprValue *output)
+{
+    EvalCapture *capture = eval_capture;
+    EvalCaptureBuffer buffer;
+    EvalResult result;
+
+    if (capture == NULL)
+        return execute(expression, hooks, user_data, output);
+
+    capture_begin(&buffer, expression);
+    capture_buffer = &buffer;
+    result = execute(expression, hooks, user_data, output);
+    capture_buffer = NULL;
+    capture_end(capture, &buffer, result, output);
+
+    return result;
+}
+
+EvalResult eval_capture_start(const char *filename)
+{
+    static const char MAGIC[8] = EVAL_CAPTURE_MAGIC;
+    unsigned int header[2] = {EVAL_CAPTURE_VERSION, EVAL_CAPTURE_BYTE_ORDER};
+    EvalCapture *capture;
+
+    eval_capture_stop();
+    capture = (EvalCapture *)eval_calloc(1, sizeof(EvalCapture));
+    if (capture == NULL)
+        return EVAL_RESULT_OOM;
+
+    capture->file = fopen(filename, "wb");
+    if (capture->file == NULL)
+    {
+        EVAL_FREE(capture);
+        return EVAL_RESULT_IO_ERROR;
+    }
+    setvbuf(capture->file, NULL, _IOFBF, EVAL_CAPTURE_FILE_BUFFER);
+
+    if (fwrite(MAGIC, 1, sizeof(MAGIC), capture->file) != sizeof(MAGIC) ||
+        fwrite(header, 1, sizeof(header), capture->file) != sizeof(header))
+    {
+        fclose(capture->file);
+        EVAL_FREE(capture);
+        return EVAL_RESULT_IO_ERROR;
+    }
+    capture->result = EVAL_RESULT_OK;
+    eval_capture = capture;
+
+    return EVAL_RESULT_OK;
+}
+
+EvalResult eval_capture_stop(void)
+{
+    EvalCapture *capture = eval_capture;
+    EvalResult result;
+
+    if (capture == NULL)
+        return EVAL_RESULT_OK;
+
+    eval_capture = NULL;
+    result = capture->result;
+    if (fclose(capture->file) != 0 && result == EVAL_RESULT_OK)
+        result = EVAL_RESULT_IO_ERROR;
+    EVAL_FREE(capture);
+
+    return result;
+}
+
+/*
+ * Replay.
+ *
+ * The whole capture is read into memory and indexed by record. A record is
+ * evaluated again with hooks that walk its events: variables and host
+ * functions give back what they gave back then, builtins run for real. A
+ * lookup the record does not have next, by kind or by name, is a divergence.
+ */
+
+struct _EvalReplay
+{
+    char *data;
+    size_t size;
+    size_t *records;
+    size_t nr_records;
+};
+
+typedef struct
+{
+    const char *p;
+    const char *end;
+    int diverged;
+} EvalReplayCursor;
+
+static int replay_get(EvalReplayCursor *c, void *data, size_t size)
+{
+    if ((size_t)(c->end - c->p) < size)
+    {
+        c->diverged = 1;
+        return 0;
+    }
+
+    memcpy(data, c->p, size);
+    c->p += size;
+
+    return 1;
+}
+
+static int replay_get_byte(EvalReplayCursor *c, int *value)
+{
+    unsigned char byte;
+
+    if (!replay_get(c, &byte, 1))
+        return 0;
+    *value = byte;
+
+    return 1;
+}
+
+static int replay_get_string(EvalReplayCursor *c, const char **str, size_t *size)
+{
+    unsigned int u32;
+
+    if (!replay_get(c, &u32, sizeof(u32)))
+        return 0;
+    if ((size_t)(c->end - c->p) < u32)
+    {
+        c->diverged = 1;
+        return 0;
+    }
+
+    *str = c->p;
+    *size = u32;
+    c->p += u32;
+
+    return 1;
+}
+
+/* the next event must be this one, and about this name if there is one */
+static int replay_expect(EvalReplayCursor *c, int event, const char *name)
+{
+    const char *str;
+    size_t size;
+    int e;
+
+    if (!replay_get_byte(c, &e) || e != event)
+    {
+        c->diverged = 1;
+        return 0;
+    }
+
+    if (name && (!replay_get_string(c, &str, &size) || size != strlen(name) || memcmp(str, name, size) != 0))
+    {
+        c->diverged = 1;
+        return 0;
+    }
+
+    return 1;
+}
+
+static EvalResult replay_get_value(EvalReplayCursor *c, ExprValue *output)
+{
+    const char *str;
+    size_t size;
+    double val;
+    int result;
+    int type;
+
+    if (!replay_get_byte(c, &result))
+        return EVAL_RESULT_INVALID_IMAGE;
+    if (result != EVAL_RESULT_OK)
+        return (EvalResult)result;
+
+    if (!replay_get_byte(c, &type))
+        return EVAL_RESULT_INVALID_IMAGE;
+
+    if (type == EXPR_VALUE_TYPE_STRING)
+    {
+        if (!replay_get_string(c, &str, &size))
+            return EVAL_RESULT_INVALID_IMAGE;
+        return expr_value_set_string(output, str, size);
+    }
+
+    if (!replay_get(c, &val, sizeof(val)))
+        return EVAL_RESULT_INVALID_IMAGE;
+    expr_value_set_number(output, val);
+
+    return EVAL_RESULT_OK;
+}
+
+static EvalResult replay_call(const ExprValue *input, void *user_data, ExprValue *output)
+{
+    EvalReplayCursor *c = (EvalReplayCursor *)user_data;
+
+    (void)input;
+    if (!replay_expect(c, EVAL_CAPTURE_CALL, NULL))
+        return EVAL_RESULT_INVALID_IMAGE;
+
+    return replay_get_value(c, output);
+}
+
+static EvalFunc replay_get_func(const char *name, void *user_data)
+{
+    EvalReplayCursor *c = (EvalReplayCursor *)user_data;
+    int func;
+
+    if (!replay_expect(c, EVAL_CAPTURE_GET_FUNC, name) || !replay_get_byte(c, &func))
+        return NULL;
+
+    if (func == EVAL_CAPTURE_FUNC_BUILTIN)
+        return default_get_func(name, NULL);
+
+    return func == EVAL_CAPTURE_FUNC_HOST ? replay_call : NULL;
+}
+
+static EvalResult replay_get_variable(const char *name, void *user_data, ExprValue *output)
+{
+    EvalReplayCursor *c = (EvalReplayCursor *)user_data;
+
+    if (!replay_expect(c, EVAL_CAPTURE_VARIABLE, name))
+        return EVAL_RESULT_UNDEFINED_VARIABLE;
+
+    return replay_get_value(c, output);
+}
+
+static int replay_same_value(const ExprValue *a, const ExprValue *b)
+{
+    if (a->type != b->type)
+        return 0;
+
+    if (a->type == EXPR_VALUE_TYPE_STRING)
+        return a->v.str.size == b->v.str.size && memcmp(a->v.str.str, b->v.str.str, a->v.str.size) == 0;
+
+    /* NAN is what it was if it is NAN again */
+    return a->v.val == b->v.val || (a->v.val != a->v.val && b->v.val != b->v.val);
+}
+
+EvalResult eval_replay_open(const char *filename, EvalReplay **replay)
+{
+    static const char MAGIC[8] = EVAL_CAPTURE_MAGIC;
+    unsigned int header[2];
+    EvalReplay *r;
+    EvalReplayCursor c;
+    size_t capacity = 0;
+    size_t n;
+    FILE *fp;
+
+    *replay = NULL;
+    fp = fopen(filename, "rb");
+    if (fp == NULL)
+        return EVAL_RESULT_IO_ERROR;
+
+    r = (EvalReplay *)eval_calloc(1, sizeof(EvalReplay));
+    if (r == NULL)
+    {
+        fclose(fp);
+        return EVAL_RESULT_OOM;
+    }
+
+    for (;;)
+    {
+        if (r->size == capacity)
+        {
+            char *p;
+
+            capacity = capacity ? capacity * 2 : 64 * 1024;
+            p = (char *)EVAL_REALLOC(r->data, capacity);
+            if (p == NULL)
+            {
+                fclose(fp);
+                eval_replay_destroy(r);
+                return EVAL_RESULT_OOM;
+            }
+            r->data = p;
+        }
+
+        n = fread(r->data + r->size, 1, capacity - r->size, fp);
+        r->size += n;
+        if (n == 0)
+            break;
+    }
+
+    if (ferror(fp))
+    {
+        fclose(fp);
+        eval_replay_destroy(r);
+        return EVAL_RESULT_IO_ERROR;
+    }
+    fclose(fp);
+
+    c.p = r->data;
+    c.end = r->data + r->size;
+    c.diverged = 0;
+    if (r->size < sizeof(MAGIC) + sizeof(header) || memcmp(r->data, MAGIC, sizeof(MAGIC)) != 0)
+    {
+        eval_replay_destroy(r);
+        return EVAL_RESULT_INVALID_IMAGE;
+    }
+    memcpy(header, r->data + sizeof(MAGIC), sizeof(header));
+    if (header[0] != EVAL_CAPTURE_VERSION || header[1] != EVAL_CAPTURE_BYTE_ORDER)
+    {
+        eval_replay_destroy(r);
+        return EVAL_RESULT_INVALID_IMAGE;
+    }
+    c.p += sizeof(MAGIC) + sizeof(header);
+
+    capacity = 0;
+    while (c.p != c.end)
+    {
+        EvalReplayCursor record;
+        const char *expr;
+        size_t size;
+
+        if (!replay_get_string(&c, &record.p, &size))
+            break;
+        record.end = record.p + size;
+        if (!replay_get_string(&record, &expr, &size) || size == 0 || expr[size - 1] != '\0')
+        {
+            c.diverged = 1;
+            break;
+        }
+
+        if (r->nr_records == capacity)
+        {
+            size_t *p;
+
+            capacity = capacity ? capacity * 2 : 1024;
+            p = (size_t *)EVAL_REALLOC(r->records, capacity * sizeof(size_t));
+            if (p == NULL)
+            {
+                eval_replay_destroy(r);
+                return EVAL_RESULT_OOM;
+            }
+            r->records = p;
+        }
+        r->records[r->nr_records++] = (size_t)(expr - sizeof(unsigned int) - r->data);
+    }
+
+    if (c.diverged)
+    {
+        eval_replay_destroy(r);
+        return EVAL_RESULT_INVALID_IMAGE;
+    }
+    *replay = r;
+
+    return EVAL_RESULT_OK;
+}
+
+void eval_replay_destroy(EvalReplay *replay)
+{
+    if (replay == NULL)
+        return;
+
+    EVAL_FREE(replay->data);
+    EVAL_FREE(replay->records);
+    EVAL_FREE(replay);
+}
+
+size_t eval_replay_size(const EvalReplay *replay)
+{
+    return replay->nr_records;
+}
+
+const char *eval_replay_expression(const EvalReplay *replay, size_t index)
+{
+    return replay->data + replay->records[index] + sizeof(unsigned int);
+}
+
+EvalResult eval_replay_execute(const EvalReplay *replay, size_t index, int *match)
+{
+    static const EvalHooks HOOKS = {replay_get_func, replay_get_variable, NULL, NULL};
+    const char *record = replay->data + replay->records[index];
+    unsigned int size;
+    unsigned int expr_size;
+    EvalReplayCursor c;
+    ExprValue output;
+    ExprValue expected;
+    EvalResult result;
+    EvalResult captured;
+
+    memcpy(&size, record - sizeof(unsigned int), sizeof(size));
+    memcpy(&expr_size, record, sizeof(expr_size));
+    c.p = record + sizeof(unsigned int) + expr_size;
+    c.end = record + size;
+    c.diverged = 0;
+
+    expr_value_init(&output);
+    expr_value_init(&expected);
+    result = eval_execute(record + sizeof(unsigned int), &HOOKS, &c, &output);
+
+    captured = replay_expect(&c, EVAL_CAPTURE_RESULT, NULL) ? replay_get_value(&c, &expected)
+                                                            : EVAL_RESULT_INVALID_IMAGE;
+    *match = !c.diverged && c.p == c.end && captured == result &&
+             (result != EVAL_RESULT_OK || replay_same_value(&output, &expected));
+
+    if (result == EVAL_RESULT_OK)
+        expr_value_clear(&output);
+    if (captured == EVAL_RESULT_OK)
+        expr_value_clear(&expected);
+
+    return result;
+}
+
+/*
+ * Latency histograms.
+ *
+ * One slot per distinct expression in an open addressed table keyed by a 64
+ * bit hash of the source. A slot is claimed with a compare-and-swap on its
+ * key and its text published with a release store, everything else is
+ * relaxed atomic counters, so recording never takes a lock. Buckets are log
+ * linear like HDR histograms: 8 per power of two, about 12% resolution, from
+ * 1ns to about 36 minutes. Times come from the cheapest clock there is and
+ * are converted to nanoseconds when recorded.
+ */
+
+#define EVAL_HISTOGRAM_SUB_BITS     3
+#define EVAL_HISTOGRAM_SUB          (1 << EVAL_HISTOGRAM_SUB_BITS)
+#define EVAL_HISTOGRAM_MAX_EXP      41
+#define EVAL_HISTOGRAM_BUCKETS      ((EVAL_HISTOGRAM_MAX_EXP - 1) * EVAL_HISTOGRAM_SUB)
+#define EVAL_HISTOGRAM_CALIBRATE_NS 2000000ull
+
+typedef struct
+{
+    unsigned long long key;
+    unsigned long long count;
+    unsigned long long total_ns;
+    unsigned int ready;
+    char text[EVAL_HISTOGRAM_TEXT];
+    unsigned int buckets[EVAL_HISTOGRAM_BUCKETS];
+} EvalHistogramSlot;
+
+typedef struct
+{
+    EvalHistogramSlot *slots;
+    size_t mask;
+    unsigned long long dropped;
+    double ns_per_tick;
+} EvalHistograms;
+
+static EvalHistograms *eval_histograms = NULL;
+
+static size_t histogram_bucket(unsigned long long ns)
+{
+    unsigned int e;
+
+    if (ns < EVAL_HISTOGRAM_SUB)
+        return (size_t)ns;
+
+    e = 63 - EVAL_CLZ64(ns);
+    if (e > EVAL_HISTOGRAM_MAX_EXP)
+        return EVAL_HISTOGRAM_BUCKETS - 1;
+
+    return (size_t)(e - EVAL_HISTOGRAM_SUB_BITS + 1) * EVAL_HISTOGRAM_SUB +
+           (size_t)((ns >> (e - EVAL_HISTOGRAM_SUB_BITS)) & (EVAL_HISTOGRAM_SUB - 1));
+}
+
+/* the highest value that lands in bucket i */
+static double histogram_bucket_value(size_t i)
+{
+    unsigned int e;
+    unsigned long long sub;
+
+    if (i < EVAL_HISTOGRAM_SUB)
+        return (double)i;
+
+    e = (unsigned int)(i / EVAL_HISTOGRAM_SUB) + EVAL_HISTOGRAM_SUB_BITS - 1;
+    sub = (unsigned long long)(i % EVAL_HISTOGRAM_SUB);
+
+    return (double)(((EVAL_HISTOGRAM_SUB + sub + 1) << (e - EVAL_HISTOGRAM_SUB_BITS)) - 1);
+}
+
+static void histogram_record(EvalHistograms *h, const char *expr, unsigned long long ticks)
+{
+    unsigned long long ns = EVAL_PORT_TICKS_ARE_NS ? ticks : (unsigned long long)((double)ticks * h->ns_per_tick);
+    size_t len = strlen(expr);
+    unsigned long long key = eval_hash(expr, len);
+    size_t i = (size_t)key & h->mask;
+    size_t probes;
+
+    for (probes = 0; probes <= h->mask; probes++, i = (i + 1) & h->mask)
+    {
+        EvalHistogramSlot *slot = h->slots + i;
+        unsigned long long k = EVAL_ATOMIC_LOAD_U64(&slot->key);
+
+        if (k == 0)
+        {
+            unsigned long long expected = 0;
+
+            if (EVAL_ATOMIC_CAS_U64(&slot->key, expected, key))
+            {
+                size_t n = len < EVAL_HISTOGRAM_TEXT - 1 ? len : EVAL_HISTOGRAM_TEXT - 1;
+
+                memcpy(slot->text, expr, n);
+                slot->text[n] = '\0';
+                EVAL_ATOMIC_STORE_RELEASE_U32(&slot->ready, 1);
+                k = key;
+            }
+            else
+            {
+                k = EVAL_ATOMIC_LOAD_U64(&slot->key);
+            }
+        }
+
+        if (k == key)
+        {
+            EVAL_ATOMIC_ADD_U64(&slot->count, 1);
+            EVAL_ATOMIC_ADD_U64(&slot->total_ns, ns);
+            EVAL_ATOMIC_ADD_U32(slot->buckets + histogram_bucket(ns), 1);
+            return;
+        }
+    }
+
+    EVAL_ATOMIC_ADD_U64(&h->dropped, 1);
+}
+
+static EvalResult execute_recorded(const char *expression, const EvalHooks *hooks,
+                                   void *user_data, ExprValue *output)
+{
+    unsigned long long start;
+    EvalResult result;
+
+    if (eval_histograms == NULL)
+        return execute_captured(expression, hooks, user_data, output);
+
+    start = eval_port_ticks();
+    result = execute_captured(expression, hooks, user_data, output);
+    histogram_record(eval_histograms, expression, eval_port_ticks() - start);
+
+    return result;
+}
+
+EvalResult eval_histograms_enable(size_t capacity)
+{
+    EvalHistograms *h;
+    size_t size = 16;
+
+    while (size < capacity)
+        size *= 2;
+
+    eval_histograms_disable();
+    h = (EvalHistograms *)eval_calloc(1, sizeof(EvalHistograms));
+    if (h == NULL)
+        return EVAL_RESULT_OOM;
+
+    h->slots = (EvalHistogramSlot *)eval_calloc(size, sizeof(EvalHistogramSlot));
+    if (h->slots == NULL)
+    {
+        EVAL_FREE(h);
+        return EVAL_RESULT_OOM;
+    }
+    h->mask = size - 1;
+    h->ns_per_tick = 1;
+
+    if (!EVAL_PORT_TICKS_ARE_NS)
+    {
+        unsigned long long ns = eval_port_now_ns();
+        unsigned long long ticks = eval_port_ticks();
+        unsigned long long elapsed;
+
+        while ((elapsed = eval_port_now_ns() - ns) < EVAL_HISTOGRAM_CALIBRATE_NS)
+        {
+        }
+        h->ns_per_tick = (double)elapsed / (double)(eval_port_ticks() - ticks);
+    }
+
+    eval_histograms = h;
+
+    return EVAL_RESULT_OK;
+}
+
+void eval_histograms_disable(void)
+{
+    if (eval_histograms != NULL)
+    {
+        EVAL_FREE(eval_histograms->slots);
+        EVAL_FREE(eval_histograms);
+        eval_histograms = NULL;
+    }
+}
+
+/* slots keep their expression, only the counts go */
+void eval_histograms_reset(void)
+{
+    EvalHistograms *h = eval_histograms;
+    size_t i;
+    size_t j;
+
+    if (h == NULL)
+        return;
+
+    for (i = 0; i <= h->mask; i++)
+    {
+        EvalHistogramSlot *slot = h->slots + i;
+
+        EVAL_ATOMIC_STORE_U64(&slot->count, 0);
+        EVAL_ATOMIC_STORE_U64(&slot->total_ns, 0);
+        for (j = 0; j < EVAL_HISTOGRAM_BUCKETS; j++)
+        {
+            EVAL_ATOMIC_STORE_U32(slot->buckets + j, 0);
+        }
+    }
+    EVAL_ATOMIC_STORE_U64(&h->dropped, 0);
+}
+
+size_t eval_histograms_dropped(void)
+{
+    return eval_histograms ? (size_t)EVAL_ATOMIC_LOAD_U64(&eval_histograms->dropped) : 0;
+}
+
+static void histogram_entry(const EvalHistogramSlot *slot, EvalHistogramEntry *entry)
+{
+    unsigned int counts[EVAL_HISTOGRAM_BUCKETS];
+    unsigned long long count = 0;
+    unsigned long long seen = 0;
+    double *targets[3];
+    double quantiles[3] = {0.5, 0.9, 0.99};
+    size_t q = 0;
+    size_t i;
+
+    targets[0] = &entry->p50_ns;
+    targets[1] = &entry->p90_ns;
+    targets[2] = &entry->p99_ns;
+
+    /* the buckets are a snapshot of their own, count may be ahead of them */
+    for (i = 0; i < EVAL_HISTOGRAM_BUCKETS; i++)
+    {
+        counts[i] = EVAL_ATOMIC_LOAD_U32(slot->buckets + i);
+        count += counts[i];
+    }
+
+    memcpy(entry->expr, slot->text, EVAL_HISTOGRAM_TEXT);
+    entry->hash = slot->key;
+    entry->count = count;
+    entry->total_ns = (double)EVAL_ATOMIC_LOAD_U64(&slot->total_ns);
+    entry->p50_ns = entry->p90_ns = entry->p99_ns = entry->max_ns = 0;
+
+    for (i = 0; i < EVAL_HISTOGRAM_BUCKETS && count; i++)
+    {
+        if (counts[i] == 0)
+            continue;
+
+        seen += counts[i];
+        while (q < 3 && (double)seen >= quantiles[q] * (double)count)
+            *targets[q++] = histogram_bucket_value(i);
+        entry->max_ns = histogram_bucket_value(i);
+    }
+}
+
+static int histogram_by_p99(const void *a, const void *b)
+{
+    const EvalHistogramEntry *x = (const EvalHistogramEntry *)a;
+    const EvalHistogramEntry *y = (const EvalHistogramEntry *)b;
+
+    if (x->p99_ns != y->p99_ns)
+        return x->p99_ns < y->p99_ns ? 1 : -1;
+
+    return x->total_ns < y->total_ns ? 1 : x->total_ns > y->total_ns ? -1 : 0;
+}
+
+static int histogram_by_total(const void *a, const void *b)
+{
+    const EvalHistogramEntry *x = (const EvalHistogramEntry *)a;
+    const EvalHistogramEntry *y = (const EvalHistogramEntry *)b;
+
+    if (x->total_ns != y->total_ns)
+        return x->total_ns < y->total_ns ? 1 : -1;
+
+    return x->p99_ns < y->p99_ns ? 1 : x->p99_ns > y->p99_ns ? -1 : 0;
+}
+
+size_t eval_histograms_top(EvalHistogramOrder order, EvalHistogramEntry *entries, size_t n)
+{
+    EvalHistograms *h = eval_histograms;
+    EvalHistogramEntry *all;
+    size_t nr_entries = 0;
+    size_t i;
+
+    if (h == NULL || n == 0)
+        return 0;
+
+    all = (EvalHistogramEntry *)EVAL_MALLOC((h->mask + 1) * sizeof(EvalHistogramEntry));
+    if (all == NULL)
+        return 0;
+
+    for (i = 0; i <= h->mask; i++)
+    {
+        const EvalHistogramSlot *slot = h->slots + i;
+
+        if (!EVAL_ATOMIC_LOAD_ACQUIRE_U32(&slot->ready))
+            continue;
+
+        histogram_entry(slot, all + nr_entries);
+        if (all[nr_entries].count)
+            nr_entries++;
+    }
+
+    qsort(all, nr_entries, sizeof(EvalHistogramEntry),
+          order == EVAL_HISTOGRAM_BY_TOTAL ? histogram_by_total : histogram_by_p99);
+    if (n > nr_entries)
+        n = nr_entries;
+    memcpy(entries, all, n * sizeof(EvalHistogramEntry));
+    EVAL_FREE(all);
+
+    return n;
+}
+
+void eval_histograms_dump(FILE *out, EvalHistogramOrder order, size_t n)
+{
+    EvalHistogramEntry *entries = (EvalHistogramEntry *)EVAL_MALLOC((n ? n : 1) * sizeof(EvalHistogramEntry));
+    size_t i;
+
+    if (entries == NULL)
+        return;
+
+    n = eval_histograms_top(order, entries, n);
+    fprintf(out, "%12s %12s %10s %10s %10s %10s  %s\n", "count", "total ms", "p50 ns", "p90 ns", "p99 ns", "max ns",
+            "expression");
+    for (i = 0; i < n; i++)
+    {
+        const EvalHistogramEntry *e = entries + i;
+
+        fprintf(out, "%12llu %12.3f %10.0f %10.0f %10.0f %10.0f  %s\n", e->count, e->total_ns / 1e6, e->p50_ns,
+                e->p90_ns, e->p99_ns, e->max_ns, e->expr);
+    }
+    EVAL_FREE(entries);
+}
+
+EvalResult eval_execute(const char *expression, const EvalHooks *hooks,
+                        void *user_data, ExprValue *output)
+{
+    return execute_recorded(expression, hooks, user_data, output);
+}
+
+EvalResult eval_execute_ex(const char *expression, const EvalHooks *hooks, void *user_data,
+                           const EvalOptions *options, ExprValue *output)
+{
+    EvalResult result;
+    EvalMeter meter;
+    EvalMeter *previous_meter = meter_begin(&meter, options);
+#ifdef EVAL_ENABLE_STATS
+    EvalTracer tracer;
+    EvalTracer *previous = trace_begin(&tracer, options);
+
+    result = execute_recorded(expression, hooks, user_data, output);
+    trace_end(&tracer, previous, options);
+#else
+    if (options && options->stats)
+        memset(options->stats, 0x00, sizeof(EvalStats));
+    result = execute_recorded(expression, hooks, user_data, output);
+#endif
+    meter_end(&meter, previous_meter, options);
+
+    return result;
+}
+
+/*
+ * Compiled programs.
+ *
+ * eval_compile() parses an expression once into a flat postfix program that
+ * can be executed many times without lexing or parsing. A program is a single
+ * heap block: header, number constants, code, then a pool of length prefixed
+ * strings (string literals and variable/function names, the names with their
+ * interned symbol) and of the entries of builtin calls, membership sets and
+ * the names of locals.
+ */
+
+#define EVAL_OP_BITS                8
+#define EVAL_OP_MASK                0xff
+#define EVAL_OP_MAX_ARG             0xffffff
+#define EVAL_CODE(op, arg)          ((EvalCode)(op) | ((EvalCode)(arg) << EVAL_OP_BITS))
+#define EVAL_CODE_OP(code)          ((EvalOpcode)((code) & EVAL_OP_MASK))
+#define EVAL_CODE_ARG(code)         ((size_t)((code) >> EVAL_OP_BITS))
+
+#define EVAL_UNARY_NEG              1
+#define EVAL_UNARY_NOT              2
+#define EVAL_UNARY_BITS_NOT         4
+
+#define EVAL_PROGRAM_STACK_SIZE     16
+#define EVAL_NO_COLUMN              ((size_t)-1)
+
+typedef unsigned int EvalCode;
+
+typedef enum {
+    EVAL_OP_NUMBER,
+    EVAL_OP_STRING,
+    EVAL_OP_VARIABLE,
+    EVAL_OP_CALL,
+    EVAL_OP_UNARY,
+    EVAL_OP_BINARY,
+    EVAL_OP_BUILTIN,
+    EVAL_OP_IN,
+    EVAL_OP_LOCAL,
+    EVAL_OP_RETURN
+} EvalOpcode;
+
+/* a builtin call in the pool: needle is the pool offset of a literal needle, or EVAL_NO_NEEDLE */
+typedef struct
+{
+    unsigned int builtin;
+    unsigned int nr_args;
+    unsigned int needle;
+    unsigned int first;
+    unsigned int second;
+} EvalBuiltinEntry;
+
+struct _EvalProgram
+{
+    unsigned int nr_numbers;
+    unsigned int nr_code;
+    unsigned int pool_size;
+    unsigned int max_stack;
+};
+
+typedef struct _EvalBuilder
+{
+    double *numbers;
+    size_t nr_numbers;
+    size_t numbers_capacity;
+
+    EvalCode *code;
+    size_t nr_code;
+    size_t code_capacity;
+
+    char *pool;
+    size_t pool_size;
+    size_t pool_capacity;
+
+    size_t depth;
+    size_t max_depth;
+} EvalBuilder;
+
+static const double *program_numbers(const EvalProgram *program)
+{
+    return (const double *)(program + 1);
+}
+
+static const EvalCode *program_code(const EvalProgram *program)
+{
+    return (const EvalCode *)(program_numbers(program) + program->nr_numbers);
+}
+
+static const char *program_pool(const EvalProgram *program)
+{
+    return (const char *)(program_code(program) + program->nr_code);
+}
+
+/* a pool entry is the length, the symbol of a name and the NUL terminated text */
+static const char *program_string(const EvalProgram *program, size_t offset, size_t *len)
+{
+    const char *entry = program_pool(program) + offset;
+
+    if (len)
+    {
+        unsigned int size;
+        memcpy(&size, entry, sizeof(size));
+        *len = size;
+    }
+
+    return entry + 2 * sizeof(unsigned int);
+}
+
+static EvalSymbol program_symbol(const EvalProgram *program, size_t offset)
+{
+    EvalSymbol symbol;
+
+    memcpy(&symbol, program_pool(program) + offset + sizeof(unsigned int), sizeof(symbol));
+
+    return symbol;
+}
+
+static EvalResult builder_reserve(void **data, size_t *capacity, size_t need, size_t item_size)
+{
+    if (need > *capacity)
+    {
+        size_t new_capacity = *capacity ? *capacity * 2 : 16;
+        void *p;
+
+        while (new_capacity < need)
+            new_capacity *= 2;
+
+        p = EVAL_REALLOC(*data, new_capacity * item_size);
+        if (p == NULL)
+            return EVAL_RESULT_OOM;
+
+        *data = p;
+        *capacity = new_capacity;
+    }
+
+    return EVAL_RESULT_OK;
+}
+
+static void builder_init(EvalBuilder *b)
+{
+    memset(b, 0x00, sizeof(EvalBuilder));
+}
+
+static void builder_deinit(EvalBuilder *b)
+{
+    EVAL_FREE(b->numbers);
+    EVAL_FREE(b->code);
+    EVAL_FREE(b->pool);
+    memset(b, 0x00, sizeof(EvalBuilder));
+}
+
+static EvalResult builder_emit(EvalBuilder *b, EvalOpcode op, size_t arg)
+{
+    EvalResult result;
+
+    if (arg > EVAL_OP_MAX_ARG)
+        return EVAL_RESULT_OOM;
+
+    result = builder_reserve((void **)&(b->code), &(b->code_capacity), b->nr_code + 1, sizeof(EvalCode));
+    if (result != EVAL_RESULT_OK)
+        return result;
+
+    b->code[b->nr_code++] = EVAL_CODE(op, arg);
+
+    switch (op)
+    {
+    case EVAL_OP_NUMBER:
+    case EVAL_OP_STRING:
+    case EVAL_OP_VARIABLE:
+    case EVAL_OP_LOCAL:
+        if (++b->depth > b->max_depth)
+            b->max_depth = b->depth;
+        break;
+    case EVAL_OP_BINARY:
+        b->depth--;
+        break;
+    default:
+        break;
+    }
+
+    return EVAL_RESULT_OK;
+}
+
+/* a number constant, pushed by EVAL_OP_NUMBER or an item of a set */
+static EvalResult builder_number(EvalBuilder *b, double value, size_t *index)
+{
+    EvalResult result;
+
+    if (b->nr_numbers > EVAL_OP_MAX_ARG)
+        return EVAL_RESULT_OOM;
+
+    result = builder_reserve((void **)&(b->numbers), &(b->numbers_capacity), b->nr_numbers + 1, sizeof(double));
+    if (result != EVAL_RESULT_OK)
+        return result;
+
+    *index = b->nr_numbers;
+    b->numbers[b->nr_numbers++] = value;
+
+    return EVAL_RESULT_OK;
+}
+
+static EvalResult builder_add_number(EvalBuilder *b, double value)
+{
+    EvalResult result;
+    size_t index;
+
+    result = builder_number(b, value, &index);
+    if (result != EVAL_RESULT_OK)
+        return result;
+
+    return builder_emit(b, EVAL_OP_NUMBER, index);
+}
+
+/* a string in the pool, with its symbol when it is a name */
+static EvalResult builder_pool_string(EvalBuilder *b, const char *str, size_t len, EvalSymbol symbol, size_t *offset)
+{
+    EvalResult result;
+    unsigned int size = (unsigned int)len;
+    size_t entry = (2 * sizeof(unsigned int) + len + 1 + (sizeof(unsigned int) - 1)) & ~(sizeof(unsigned int) - 1);
+
+    result = builder_reserve((void **)&(b->pool), &(b->pool_capacity), b->pool_size + entry, 1);
+    if (result != EVAL_RESULT_OK)
+        return result;
+
+    *offset = b->pool_size;
+    memset(b->pool + *offset, 0x00, entry);
+    memcpy(b->pool + *offset, &size, sizeof(size));
+    memcpy(b->pool + *offset + sizeof(size), &symbol, sizeof(symbol));
+    memcpy(b->pool + *offset + 2 * sizeof(size), str, len);
+    b->pool_size += entry;
+
+    return EVAL_RESULT_OK;
+}
+
+/* names are interned as they are compiled, so running a program never hashes them */
+static EvalResult builder_add_string(EvalBuilder *b, EvalOpcode op, const char *str, size_t len)
+{
+    EvalResult result;
+    EvalSymbol symbol = EVAL_SYMBOL_NONE;
+    size_t offset;
+
+    if (op != EVAL_OP_STRING && eval_symbol_intern(str, len, &symbol) != EVAL_RESULT_OK)
+        return EVAL_RESULT_OOM;
+
+    result = builder_pool_string(b, str, len, symbol, &offset);
+    if (result != EVAL_RESULT_OK)
+        return result;
+
+    return builder_emit(b, op, offset);
+}
+
+static EvalResult builder_finish(EvalBuilder *b, EvalProgram **program)
+{
+    size_t numbers_size = b->nr_numbers * sizeof(double);
+    size_t code_size = b->nr_code * sizeof(EvalCode);
+    EvalProgram *p = (EvalProgram *)EVAL_MALLOC(sizeof(EvalProgram) + numbers_size + code_size + b->pool_size);
+
+    if (p == NULL)
+        return EVAL_RESULT_OOM;
+
+    p->nr_numbers = (unsigned int)b->nr_numbers;
+    p->nr_code = (unsigned int)b->nr_code;
+    p->pool_size = (unsigned int)b->pool_size;
+    p->max_stack = (unsigned int)b->max_depth;
+
+    if (numbers_size)
+        memcpy((char *)(p + 1), b->numbers, numbers_size);
+    if (code_size)
+        memcpy((char *)(p + 1) + numbers_size, b->code, code_size);
+    if (b->pool_size)
+        memcpy((char *)(p + 1) + numbers_size + code_size, b->pool, b->pool_size);
+
+    *program = p;
+
+    return EVAL_RESULT_OK;
+}
+
+static int is_product_op(int type)
+{
+    return type == EVAL_TOKEN_TYPE_MULTIPLY || type == EVAL_TOKEN_TYPE_DIVIDE || type == EVAL_TOKEN_TYPE_E || type == EVAL_TOKEN_TYPE_L || type == EVAL_TOKEN_TYPE_G || type == EVAL_TOKEN_TYPE_NE || type == EVAL_TOKEN_TYPE_LE || type == EVAL_TOKEN_TYPE_GE || type == EVAL_TOKEN_TYPE_OR || type == EVAL_TOKEN_TYPE_AND || type == EVAL_TOKEN_TYPE_BITS_OR || type == EVAL_TOKEN_TYPE_BITS_AND;
+}
+
+static int is_logic_op(int type)
+{
+    return type == EVAL_TOKEN_TYPE_E || type == EVAL_TOKEN_TYPE_L || type == EVAL_TOKEN_TYPE_G || type == EVAL_TOKEN_TYPE_NE || type == EVAL_TOKEN_TYPE_LE || type == EVAL_TOKEN_TYPE_GE || type == EVAL_TOKEN_TYPE_OR || type == EVAL_TOKEN_TYPE_AND;
+}
+
+static double number_unary(double value, size_t flags)
+{
+    if (flags & EVAL_UNARY_NEG)
+    {
+        value = -value;
+    }
+    if (flags & EVAL_UNARY_NOT)
+    {
+        value = !value;
+    }
+    if (flags & EVAL_UNARY_BITS_NOT)
+    {
+        value = ~(unsigned int)value;
+    }
+
+    return value;
+}
+
+static void expr_value_unary(ExprValue *value, size_t flags)
+{
+    if (value->type == EXPR_VALUE_TYPE_NUMBER)
+    {
+        value->v.val = number_unary(value->v.val, flags);
+    }
+    else if (flags & EVAL_UNARY_NOT)
+    {
+        expr_value_set_number(value, !value->v.str.size);
+    }
+}
+
+/*
+ * Values in eight bytes.
+ *
+ * An EvalValue holds the bits of a double unless its top 14 bits are all set,
+ * which no double has once NaNs are made the one quiet NaN 0x7ff8...; those
+ * patterns carry a tag in bits 48 and up and a payload in the low 48 bits:
+ * a 32-bit integer, or the address of a string buffer. The buffer's size and
+ * capacity are written to its header when the string is boxed and read back
+ * when it is unboxed, so strings move to and from ExprValue without a copy.
+ * Addresses are assumed to fit in 48 bits, as they do on every 64-bit target
+ * the evaluator is built for.
+ */
+
+#define EVAL_VALUE_TAG_MASK         0xffff000000000000ull
+#define EVAL_VALUE_TAG_STRING       0xfffc000000000000ull
+#define EVAL_VALUE_TAG_INT          0xfffd000000000000ull
+#define EVAL_VALUE_PAYLOAD          0x0000ffffffffffffull
+#define EVAL_VALUE_NAN              0x7ff8000000000000ull
+#define EVAL_VALUE_SIGN             0x8000000000000000ull
+
+#define EVAL_VALUE_IS_STRING(v)     (((v) & EVAL_VALUE_TAG_MASK) == EVAL_VALUE_TAG_STRING)
+
+static char *value_string(EvalValue v)
+{
+    return (char *)(size_t)(v & EVAL_VALUE_PAYLOAD);
+}
+
+static ExprStrHeader *value_header(EvalValue v)
+{
+    return (ExprStrHeader *)(value_string(v) - sizeof(ExprStrHeader));
+}
+
+static double value_number(EvalValue v)
+{
+    double val;
+
+    if ((v & EVAL_VALUE_TAG_MASK) == EVAL_VALUE_TAG_INT)
+        return (double)(int)(unsigned int)v;
+
+    memcpy(&val, &v, sizeof(val));
+
+    return val;
+}
+
+/* a view of v as an ExprValue, sharing its string */
+static void value_unbox(EvalValue v, ExprValue *value)
+{
+    if (EVAL_VALUE_IS_STRING(v))
+    {
+        value->type = EXPR_VALUE_TYPE_STRING;
+        value->owned = 1;
+        value->v.str.str = value_string(v);
+        value->v.str.size = value_header(v)->size;
+        value->v.str.capacity = value_header(v)->capacity;
+    }
+    else
+    {
+        value->type = EXPR_VALUE_TYPE_NUMBER;
+        value->v.val = value_number(v);
+    }
+}
+
+static EvalValue value_box(const ExprValue *value)
+{
+    ExprStrHeader *header;
+
+    if (value->type == EXPR_VALUE_TYPE_NUMBER)
+        return eval_value_number(value->v.val);
+
+    header = (ExprStrHeader *)(value->v.str.str - sizeof(ExprStrHeader));
+    header->size = value->v.str.size;
+    header->capacity = value->v.str.capacity;
+
+    return EVAL_VALUE_TAG_STRING | ((EvalValue)(size_t)value->v.str.str & EVAL_VALUE_PAYLOAD);
+}
+
+/* numbers are worked out in place, strings through their ExprValue views */
+static EvalResult value_op(EvalValue *a, EvalValue *b, EvalTokenType op)
+{
+    ExprValue x;
+    ExprValue y;
+    EvalResult result;
+
+    if (!EVAL_VALUE_IS_STRING(*a) && !EVAL_VALUE_IS_STRING(*b))
+    {
+        *a = eval_value_number(number_op(value_number(*a), value_number(*b), op));
+        return EVAL_RESULT_OK;
+    }
+
+    value_unbox(*a, &x);
+    value_unbox(*b, &y);
+    result = expr_value_op(&x, &y, op);
+    *a = value_box(&x);
+    *b = value_box(&y);
+
+    return result;
+}
+
+static void value_unary(EvalValue *v, size_t flags)
+{
+    ExprValue x;
+
+    if (!EVAL_VALUE_IS_STRING(*v))
+    {
+        *v = eval_value_number(number_unary(value_number(*v), flags));
+    }
+    else if (flags & EVAL_UNARY_NOT)
+    {
+        value_unbox(*v, &x);
+        expr_value_unary(&x, flags);
+        *v = value_box(&x);
+    }
+}
+
+/* strings have a single owner, so a copy of one is a new buffer */
+static EvalResult value_copy(EvalValue v, EvalValue *output)
+{
+    *output = 0;
+    if (!EVAL_VALUE_IS_STRING(v))
+    {
+        *output = v;
+        return EVAL_RESULT_OK;
+    }
+
+    return eval_value_set_string(output, value_string(v), value_header(v)->size);
+}
+
+int expr_value_is_string(const ExprValue *v)
+{
+    return v->type == EXPR_VALUE_TYPE_STRING;
+}
+
+size_t expr_value_get_size(const ExprValue *v)
+{
+    return v->type == EXPR_VALUE_TYPE_STRING ? v->v.str.size : 0;
+}
+
+/* a call with an argument the evaluator holds, which the function may take */
+static EvalResult hook_call_value(EvalFunc func, const char *name, EvalValue *value, void *user_data,
+                                  ExprValue *output)
+{
+    ExprValue input;
+    EvalResult result;
+
+    value_unbox(*value, &input);
+    eval_spare_input = &input;
+    result = hook_call(func, name, &input, user_data, output);
+    eval_spare_input = NULL;
+
+    /* a taken string belongs to output now */
+    if (EVAL_VALUE_IS_STRING(*value) && input.type != EXPR_VALUE_TYPE_STRING)
+        *value = 0;
+
+    return result;
+}
+
+EvalValue eval_value_number(double val)
+{
+    EvalValue v;
+
+    memcpy(&v, &val, sizeof(v));
+    /* a NaN keeps its sign but not a payload that could read as a tag */
+    if (val != val)
+        return (v & EVAL_VALUE_SIGN) | EVAL_VALUE_NAN;
+
+    return v;
+}
+
+EvalValue eval_value_int(int val)
+{
+    return EVAL_VALUE_TAG_INT | (unsigned int)val;
+}
+
+void eval_value_clear(EvalValue *v)
+{
+    if (EVAL_VALUE_IS_STRING(*v))
+        string_free(value_header(*v), sizeof(ExprStrHeader) + value_header(*v)->capacity + 1);
+
+    *v = 0;
+}
+
+int eval_value_is_string(EvalValue v)
+{
+    return EVAL_VALUE_IS_STRING(v);
+}
+
+double eval_value_get_number(EvalValue v)
+{
+    return EVAL_VALUE_IS_STRING(v) ? atof(value_string(v)) : value_number(v);
+}
+
+const char *eval_value_get_string(EvalValue v)
+{
+    return EVAL_VALUE_IS_STRING(v) ? value_string(v) : NULL;
+}
+
+size_t eval_value_get_size(EvalValue v)
+{
+    return EVAL_VALUE_IS_STRING(v) ? value_header(v)->size : 0;
+}
+
+EvalResult eval_value_set_string(EvalValue *v, const char *str, size_t len)
+{
+    ExprValue value;
+    EvalResult result;
+
+    eval_value_clear(v);
+    expr_value_init(&value);
+    result = expr_value_set_string(&value, str, len);
+    if (result == EVAL_RESULT_OK)
+        *v = value_box(&value);
+
+    return result;
+}
+
+void eval_value_from_expr(EvalValue *v, ExprValue *value)
+{
+    expr_value_adopt(value);
+    *v = value_box(value);
+    expr_value_init(value);
+}
+
+void eval_value_to_expr(EvalValue *v, ExprValue *value)
+{
+    value_unbox(*v, value);
+    *v = 0;
+}
+
+/*
+ * Regular expressions.
+ *
+ * matches() takes the usual syntax short of backreferences and lookaround:
+ * literal bytes, ., [] classes, \d \w \s and their negations, groups, |,
+ * * + ? and {m,n}, and ^ and $ for the ends of the subject, which matches
+ * anywhere unless anchored. A pattern becomes a Thompson NFA and then a DFA
+ * over the classes of bytes the pattern tells apart, so a match reads each
+ * byte once and never backtracks. When the DFA would be too big the NFA runs
+ * instead, one set of states per byte, still linear in the subject.
+ *
+ * Literal patterns are interned like names, in a table apart from them, and
+ * kept compiled by id for the life of the process, in pages read without a
+ * lock; storing a new one takes a spin lock once it is compiled. A literal
+ * pattern is interned and compiled with the program, so a call looks it up
+ * with two loads.
+ */
+
+#define EVAL_REGEX_MAX_LENGTH       4096
+#define EVAL_REGEX_MAX_INSTS        2048
+#define EVAL_REGEX_MAX_GROUPS       64
+#define EVAL_REGEX_MAX_DEPTH        255
+#define EVAL_REGEX_MAX_REPEAT       1000
+#define EVAL_REGEX_MAX_STATES       1024
+#define EVAL_REGEX_MAX_CELLS        (1 << 16)
+#define EVAL_REGEX_INFINITE         0xffffffff
+#define EVAL_REGEX_NO_NODE          ((size_t)-1)
+#define EVAL_REGEX_NO_PC            0xffffffff
+
+#define EVAL_REGEX_HAS(set, c)      ((set)[(c) >> 3] & (1 << ((c) & 7)))
+
+/* a transition: the offset of the next state's row, and what the state means */
+#define EVAL_REGEX_ROW              0x00ffffff
+#define EVAL_REGEX_ACCEPT           0x01000000
+#define EVAL_REGEX_ACCEPT_END       0x02000000
+#define EVAL_REGEX_DEAD             0x04000000
+
+/* how far a closure may go: past ^ at the start of the subject, past $ at its end */
+#define EVAL_REGEX_AT_BEGIN         1
+#define EVAL_REGEX_AT_END           2
+
+typedef enum {
+    EVAL_REGEX_SET,                 /* one byte of the set, then the next instruction */
+    EVAL_REGEX_SPLIT,               /* both x and y */
+    EVAL_REGEX_JUMP,
+    EVAL_REGEX_BEGIN,
+    EVAL_REGEX_END,
+    EVAL_REGEX_MATCH                /* always the last instruction */
+} EvalRegexOp;
+
+typedef struct
+{
+    unsigned short op;
+    unsigned short set;
+    unsigned int x;
+    unsigned int y;
+} EvalRegexInst;
+
+typedef enum {
+    EVAL_REGEX_NODE_SET,
+    EVAL_REGEX_NODE_BEGIN,
+    EVAL_REGEX_NODE_END,
+    EVAL_REGEX_NODE_CAT,            /* the children in turn, none is the empty pattern */
+    EVAL_REGEX_NODE_ALT,
+    EVAL_REGEX_NODE_REPEAT
+} EvalRegexNodeType;
+
+typedef struct
+{
+    unsigned char type;
+    unsigned char depth;
+    unsigned short set;
+    unsigned int min;
+    unsigned int max;
+    size_t child;
+    size_t last;
+    size_t next;
+} EvalRegexNode;
+
+typedef struct
+{
+    const unsigned char *p;
+    const unsigned char *end;
+    EvalRegexNode *nodes;
+    size_t nr_nodes;
+    size_t nodes_capacity;
+    unsigned char (*sets)[32];
+    size_t nr_sets;
+    size_t nr_groups;
+    EvalRegexInst *insts;
+    size_t nr_insts;
+    int failed;
+} EvalRegexCompiler;
+
+typedef struct _EvalRegex
+{
+    unsigned int valid;
+    unsigned int nr_insts;
+    unsigned int nr_classes;
+    unsigned int start;             /* the flags of the first state, whose row is the first */
+    unsigned int empty;             /* the empty subject matches, the only one where ^ may follow $ */
+    unsigned char classes[256];
+    const EvalRegexInst *insts;
+    const unsigned char (*sets)[32];
+    const unsigned int *next;
+} EvalRegex;
+
+/* marks of the instructions a step has been through, and a stack to walk them */
+typedef struct
+{
+    unsigned int *marks;
+    unsigned int *stack;
+    unsigned int gen;
+} EvalRegexWork;
+
+static EvalRegex **eval_regex_pages[EVAL_SYMBOL_MAX_PAGES];
+static unsigned int eval_regex_lock = 0;
+
+static size_t regex_node(EvalRegexCompiler *c, EvalRegexNodeType type)
+{
+    EvalRegexNode *node;
+
+    if (c->nr_nodes == c->nodes_capacity)
+    {
+        c->failed = 1;
+        return EVAL_REGEX_NO_NODE;
+    }
+
+    node = c->nodes + c->nr_nodes;
+    memset(node, 0x00, sizeof(*node));
+    node->type = (unsigned char)type;
+    node->depth = 1;
+    node->child = EVAL_REGEX_NO_NODE;
+    node->last = EVAL_REGEX_NO_NODE;
+    node->next = EVAL_REGEX_NO_NODE;
+
+    return c->nr_nodes++;
+}
+
+static void regex_append(EvalRegexCompiler *c, size_t parent, size_t child)
+{
+    EvalRegexNode *p = c->nodes + parent;
+
+    if (p->child == EVAL_REGEX_NO_NODE)
+        p->child = child;
+    else
+        c->nodes[p->last].next = child;
+    p->last = child;
+
+    if (c->nodes[child].depth >= p->depth)
+    {
+        if (c->nodes[child].depth == EVAL_REGEX_MAX_DEPTH)
+            c->failed = 1;
+        else
+            p->depth = (unsigned char)(c->nodes[child].depth + 1);
+    }
+}
+
+static unsigned char *regex_set(EvalRegexCompiler *c, size_t node)
+{
+    c->nodes[node].set = (unsigned short)c->nr_sets;
+    memset(c->sets[c->nr_sets], 0x00, sizeof(c->sets[0]));
+
+    return c->sets[c->nr_sets++];
+}
+
+static void regex_set_range(unsigned char *set, unsigned int from, unsigned int to)
+{
+    for (; from <= to; from++)
+        set[from >> 3] |= (unsigned char)(1 << (from & 7));
+}
+
+/* the byte after a backslash, into set; \d \w \s and their negations are classes */
+static void regex_escape(EvalRegexCompiler *c, unsigned char e, unsigned char *set)
+{
+    unsigned char class_set[32];
+    size_t i;
+
+    memset(class_set, 0x00, sizeof(class_set));
+    switch (e | 0x20)
+    {
+    case 'd':
+        regex_set_range(class_set, '0', '9');
+        break;
+    case 'w':
+        regex_set_range(class_set, '0', '9');
+        regex_set_range(class_set, 'A', 'Z');
+        regex_set_range(class_set, 'a', 'z');
+        regex_set_range(class_set, '_', '_');
+        break;
+    case 's':
+        regex_set_range(class_set, '\t', '\r');
+        regex_set_range(class_set, ' ', ' ');
+        break;
+    default:
+        if (e == 'n' || e == 't' || e == 'r' || e == 'f' || e == 'v')
+            e = e == 'n' ? '\n' : e == 't' ? '\t' : e == 'r' ? '\r' : e == 'f' ? '\f' : '\v';
+        else if ((e >= 'a' && e <= 'z') || (e >= 'A' && e <= 'Z') || (e >= '0' && e <= '9'))
+            c->failed = 1;
+        regex_set_range(set, e, e);
+        return;
+    }
+
+    for (i = 0; i < sizeof(class_set); i++)
+        set[i] |= e >= 'a' ? class_set[i] : (unsigned char)~class_set[i];
+}
+
+/* a [] class, p past the bracket; a ] right after the bracket is a literal */
+static void regex_class(EvalRegexCompiler *c, unsigned char *set)
+{
+    int negate = c->p < c->end && *c->p == '^';
+    int first;
+    size_t i;
+
+    c->p += negate;
+    for (first = 1;; first = 0)
+    {
+        unsigned int from;
+        unsigned int to;
+
+        if (c->p == c->end)
+        {
+            c->failed = 1;
+            return;
+        }
+        if (*c->p == ']' && !first)
+            break;
+
+        if (*c->p == '\\')
+        {
+            if (++c->p < c->end)
+                regex_escape(c, *c->p++, set);
+            continue;
+        }
+
+        from = *c->p++;
+        to = from;
+        if (c->end - c->p >= 2 && *c->p == '-' && c->p[1] != ']')
+        {
+            c->p++;
+            if (*c->p == '\\' && c->end - c->p >= 2)
+                c->p++;
+            to = *c->p++;
+            if (to < from)
+                c->failed = 1;
+        }
+        regex_set_range(set, from, to);
+    }
+    c->p++;
+
+    if (negate)
+    {
+        for (i = 0; i < 32; i++)
+            set[i] = (unsigned char)~set[i];
+    }
+}
+
+static size_t regex_alt(EvalRegexCompiler *c);
+
+static size_t regex_atom(EvalRegexCompiler *c)
+{
+    unsigned char b = *c->p++;
+    size_t node;
+
+    switch (b)
+    {
+    case '(':
+        if (++c->nr_groups > EVAL_REGEX_MAX_GROUPS)
+        {
+            c->failed = 1;
+            return EVAL_REGEX_NO_NODE;
+        }
+        if (c->end - c->p >= 2 && c->p[0] == '?' && c->p[1] == ':')
+            c->p += 2;
+        node = regex_alt(c);
+        if (c->p == c->end || *c->p != ')')
+        {
+            c->failed = 1;
+            return EVAL_REGEX_NO_NODE;
+        }
+        c->p++;
+        c->nr_groups--;
+        return node;
+    case '*':
+    case '+':
+    case '?':
+        c->failed = 1;
+        return EVAL_REGEX_NO_NODE;
+    case '^':
+        return regex_node(c, EVAL_REGEX_NODE_BEGIN);
+    case '$':
+        return regex_node(c, EVAL_REGEX_NODE_END);
+    }
+
+    node = regex_node(c, EVAL_REGEX_NODE_SET);
+    if (node == EVAL_REGEX_NO_NODE)
+        return node;
+
+    if (b == '[')
+        regex_class(c, regex_set(c, node));
+    else if (b == '.')
+        regex_set_range(regex_set(c, node), 0, 255);
+    else if (b != '\\')
+        regex_set_range(regex_set(c, node), b, b);
+    else if (c->p == c->end)
+        c->failed = 1;
+    else
+        regex_escape(c, *c->p++, regex_set(c, node));
+
+    return node;
+}
+
+/* a count of {m,n}, 0 when there is none */
+static int regex_count(EvalRegexCompiler *c, unsigned int *count)
+{
+    int digits = 0;
+
+    for (*count = 0; c->p < c->end && *c->p >= '0' && *c->p <= '9'; c->p++, digits++)
+    {
+        if (*count <= EVAL_REGEX_MAX_REPEAT)
+            *count = *count * 10 + (unsigned int)(*c->p - '0');
+    }
+
+    return digits;
+}
+
+/* the quantifiers after an atom; a { that does not start one is a literal */
+static size_t regex_repeat(EvalRegexCompiler *c)
+{
+    size_t node = regex_atom(c);
+
+    while (!c->failed && c->p < c->end)
+    {
+        const unsigned char *start = c->p;
+        unsigned int min = 0;
+        unsigned int max = EVAL_REGEX_INFINITE;
+        size_t repeat;
+
+        if (*c->p == '*' || *c->p == '+' || *c->p == '?')
+        {
+            min = *c->p == '+';
+            max = *c->p == '?' ? 1 : EVAL_REGEX_INFINITE;
+            c->p++;
+        }
+        else if (*c->p == '{')
+        {
+            c->p++;
+            if (!regex_count(c, &min))
+            {
+                c->p = start;
+                break;
+            }
+            max = min;
+            if (c->p < c->end && *c->p == ',')
+            {
+                c->p++;
+                if (!regex_count(c, &max))
+                    max = EVAL_REGEX_INFINITE;
+            }
+            if (c->p == c->end || *c->p != '}')
+            {
+                c->p = start;
+                break;
+            }
+            c->p++;
+            if (min > EVAL_REGEX_MAX_REPEAT ||
+                (max != EVAL_REGEX_INFINITE && (max > EVAL_REGEX_MAX_REPEAT || max < min)))
+                c->failed = 1;
+        }
+        else
+        {
+            break;
+        }
+
+        repeat = regex_node(c, EVAL_REGEX_NODE_REPEAT);
+        if (repeat == EVAL_REGEX_NO_NODE)
+            break;
+        c->nodes[repeat].min = min;
+        c->nodes[repeat].max = max;
+        regex_append(c, repeat, node);
+        node = repeat;
+    }
+
+    return node;
+}
+
+static size_t regex_cat(EvalRegexCompiler *c)
+{
+    size_t cat = regex_node(c, EVAL_REGEX_NODE_CAT);
+
+    while (!c->failed && c->p < c->end && *c->p != '|' && *c->p != ')')
+    {
+        size_t node = regex_repeat(c);
+
+        if (node != EVAL_REGEX_NO_NODE)
+            regex_append(c, cat, node);
+    }
+
+    return cat;
+}
+
+static size_t regex_alt(EvalRegexCompiler *c)
+{
+    size_t cat = regex_cat(c);
+    size_t alt;
+
+    if (c->failed || c->p == c->end || *c->p != '|')
+        return cat;
+
+    alt = regex_node(c, EVAL_REGEX_NODE_ALT);
+    if (alt == EVAL_REGEX_NO_NODE)
+        return alt;
+
+    regex_append(c, alt, cat);
+    while (!c->failed && c->p < c->end && *c->p == '|')
+    {
+        c->p++;
+        cat = regex_cat(c);
+        if (cat != EVAL_REGEX_NO_NODE)
+            regex_append(c, alt, cat);
+    }
+
+    return alt;
+}
+
+static size_t regex_inst(EvalRegexCompiler *c, EvalRegexOp op, size_t x, size_t y)
+{
+    EvalRegexInst *inst = c->insts + c->nr_insts;
+
+    /* the last one is kept for the match */
+    if (c->nr_insts + 1 >= EVAL_REGEX_MAX_INSTS)
+    {
+        c->failed = 1;
+        return 0;
+    }
+
+    inst->op = (unsigned short)op;
+    inst->set = 0;
+    inst->x = (unsigned int)x;
+    inst->y = (unsigned int)y;
+
+    return c->nr_insts++;
+}
+
+/* pending jumps are chained through the field they wait for, and all of them land here */
+static void regex_patch(EvalRegexCompiler *c, size_t list, int y)
+{
+    while (list != EVAL_REGEX_NO_PC)
+    {
+        unsigned int *field = y ? &(c->insts[list].y) : &(c->insts[list].x);
+
+        list = *field;
+        *field = (unsigned int)c->nr_insts;
+    }
+}
+
+static void regex_emit(EvalRegexCompiler *c, size_t n)
+{
+    const EvalRegexNode *node = c->nodes + n;
+    size_t pending = EVAL_REGEX_NO_PC;
+    size_t child;
+    size_t start;
+    size_t i;
+
+    switch (node->type)
+    {
+    case EVAL_REGEX_NODE_SET:
+        c->insts[regex_inst(c, EVAL_REGEX_SET, 0, 0)].set = node->set;
+        break;
+    case EVAL_REGEX_NODE_BEGIN:
+        regex_inst(c, EVAL_REGEX_BEGIN, c->nr_insts + 1, 0);
+        break;
+    case EVAL_REGEX_NODE_END:
+        regex_inst(c, EVAL_REGEX_END, c->nr_insts + 1, 0);
+        break;
+    case EVAL_REGEX_NODE_CAT:
+        for (child = node->child; child != EVAL_REGEX_NO_NODE && !c->failed; child = c->nodes[child].next)
+            regex_emit(c, child);
+        break;
+    case EVAL_REGEX_NODE_ALT:
+        for (child = node->child; c->nodes[child].next != EVAL_REGEX_NO_NODE && !c->failed; child = c->nodes[child].next)
+        {
+            size_t split = regex_inst(c, EVAL_REGEX_SPLIT, c->nr_insts + 1, 0);
+
+            regex_emit(c, child);
+            pending = regex_inst(c, EVAL_REGEX_JUMP, pending, 0);
+            c->insts[split].y = (unsigned int)c->nr_insts;
+        }
+        regex_emit(c, child);
+        if (!c->failed)
+            regex_patch(c, pending, 0);
+        break;
+    default:
+        for (i = 1; i < node->min && !c->failed; i++)
+            regex_emit(c, node->child);
+
+        /* the last copy loops back on itself, or may be skipped when none is needed */
+        if (node->max == EVAL_REGEX_INFINITE && node->min)
+        {
+            start = c->nr_insts;
+            regex_emit(c, node->child);
+            regex_inst(c, EVAL_REGEX_SPLIT, start, c->nr_insts + 1);
+            break;
+        }
+        if (node->max == EVAL_REGEX_INFINITE)
+        {
+            start = regex_inst(c, EVAL_REGEX_SPLIT, c->nr_insts + 1, 0);
+            regex_emit(c, node->child);
+            regex_inst(c, EVAL_REGEX_JUMP, start, 0);
+            c->insts[start].y = (unsigned int)c->nr_insts;
+            break;
+        }
+
+        /* then the optional ones, any of which may skip to the end */
+        if (node->min && !c->failed)
+            regex_emit(c, node->child);
+        for (i = node->min; i < node->max && !c->failed; i++)
+        {
+            pending = regex_inst(c, EVAL_REGEX_SPLIT, c->nr_insts + 1, pending);
+            regex_emit(c, node->child);
+        }
+        if (!c->failed)
+            regex_patch(c, pending, 1);
+        break;
+    }
+}
+
+/*
+ * Adds what pc leads to without reading a byte: the sets, the $ the closure
+ * cannot pass and the match. Instructions marked in this step are skipped.
+ */
+static size_t regex_close(const EvalRegex *re, EvalRegexWork *w, unsigned int pc, int at, unsigned int *list, size_t n)
+{
+    size_t sp = 0;
+
+    w->stack[sp++] = pc;
+    while (sp)
+    {
+        const EvalRegexInst *inst;
+
+        pc = w->stack[--sp];
+        if (w->marks[pc] == w->gen)
+            continue;
+        w->marks[pc] = w->gen;
+
+        inst = re->insts + pc;
+        switch (inst->op)
+        {
+        case EVAL_REGEX_SPLIT:
+            w->stack[sp++] = inst->y;
+            w->stack[sp++] = inst->x;
+            break;
+        case EVAL_REGEX_JUMP:
+            w->stack[sp++] = inst->x;
+            break;
+        case EVAL_REGEX_BEGIN:
+            if (at & EVAL_REGEX_AT_BEGIN)
+                w->stack[sp++] = inst->x;
+            break;
+        case EVAL_REGEX_END:
+            if (at & EVAL_REGEX_AT_END)
+                w->stack[sp++] = inst->x;
+            else
+                list[n++] = pc;
+            break;
+        default:
+            list[n++] = pc;
+            break;
+        }
+    }
+
+    return n;
+}
+
+static void regex_next_gen(const EvalRegex *re, EvalRegexWork *w)
+{
+    if (++w->gen == 0)
+    {
+        memset(w->marks, 0x00, re->nr_insts * sizeof(unsigned int));
+        w->gen = 1;
+    }
+}
+
+/* the states after byte b, a match may start at any of them */
+static size_t regex_step(const EvalRegex *re, EvalRegexWork *w, const unsigned int *from, size_t nr_from,
+                         unsigned char b, unsigned int *to)
+{
+    size_t n = 0;
+    size_t i;
+
+    regex_next_gen(re, w);
+    for (i = 0; i < nr_from; i++)
+    {
+        const EvalRegexInst *inst = re->insts + from[i];
+
+        if (inst->op == EVAL_REGEX_SET && EVAL_REGEX_HAS(re->sets[inst->set], b))
+            n = regex_close(re, w, from[i] + 1, 0, to, n);
+    }
+
+    return regex_close(re, w, 0, 0, to, n);
+}
+
+/* the step that made list reached the match */
+static int regex_matched(const EvalRegex *re, const EvalRegexWork *w)
+{
+    return w->marks[re->nr_insts - 1] == w->gen;
+}
+
+/* the subject may end after the states in list */
+static int regex_matched_at_end(const EvalRegex *re, EvalRegexWork *w, const unsigned int *list, size_t n,
+                                unsigned int *scratch)
+{
+    size_t i;
+
+    regex_next_gen(re, w);
+    for (i = 0; i < n; i++)
+    {
+        if (re->insts[list[i]].op == EVAL_REGEX_END)
+            regex_close(re, w, list[i], EVAL_REGEX_AT_END, scratch, 0);
+    }
+
+    return regex_matched(re, w);
+}
+
+static void regex_sort(unsigned int *list, size_t n)
+{
+    size_t i;
+    size_t j;
+
+    for (i = 1; i < n; i++)
+    {
+        unsigned int pc = list[i];
+
+        for (j = i; j > 0 && list[j - 1] > pc; j--)
+            list[j] = list[j - 1];
+        list[j] = pc;
+    }
+}
+
+/* a step that reached the match stops there, one that left no state cannot reach it */
+static unsigned int regex_flags(const EvalRegex *re, EvalRegexWork *w, const unsigned int *list, size_t n,
+                                unsigned int *scratch)
+{
+    if (regex_matched(re, w))
+        return EVAL_REGEX_ACCEPT | EVAL_REGEX_ACCEPT_END;
+    if (n == 0)
+        return EVAL_REGEX_DEAD;
+
+    return regex_matched_at_end(re, w, list, n, scratch) ? EVAL_REGEX_ACCEPT_END : 0;
+}
+
+/* byte classes: bytes no set of the pattern tells apart share one */
+static void regex_classes(EvalRegex *re, size_t nr_sets)
+{
+    unsigned int map[512];
+    size_t nr_classes = 1;
+    size_t i;
+    size_t b;
+
+    memset(re->classes, 0x00, sizeof(re->classes));
+    for (i = 0; i < nr_sets; i++)
+    {
+        memset(map, 0xff, sizeof(map));
+        nr_classes = 0;
+        for (b = 0; b < 256; b++)
+        {
+            unsigned int key = re->classes[b] * 2u + (EVAL_REGEX_HAS(re->sets[i], b) != 0);
+
+            if (map[key] == 0xffffffff)
+                map[key] = (unsigned int)nr_classes++;
+            re->classes[b] = (unsigned char)map[key];
+        }
+    }
+
+    re->nr_classes = (unsigned int)nr_classes;
+}
+
+/* the DFA while it is built, its states the sorted sets of NFA states */
+typedef struct
+{
+    unsigned int *members;
+    size_t members_capacity;
+    size_t nr_states;
+    size_t max_states;
+    size_t offsets[EVAL_REGEX_MAX_STATES + 1];
+    unsigned int flags[EVAL_REGEX_MAX_STATES];
+    unsigned long long hashes[EVAL_REGEX_MAX_STATES];
+    unsigned int slots[2 * EVAL_REGEX_MAX_STATES];  /* a state plus one, 0 is free */
+} EvalRegexDfa;
+
+/* the state of a sorted set, added when it is new; -1 when there would be too many */
+static long regex_dfa_state(EvalRegexDfa *d, const unsigned int *list, size_t n, unsigned int flags)
+{
+    unsigned long long hash = eval_hash((const char *)list, n * sizeof(unsigned int));
+    size_t i = (size_t)hash & (2 * EVAL_REGEX_MAX_STATES - 1);
+    size_t state;
+
+    for (; d->slots[i]; i = (i + 1) & (2 * EVAL_REGEX_MAX_STATES - 1))
+    {
+        state = d->slots[i] - 1;
+        if (d->hashes[state] == hash && d->offsets[state + 1] - d->offsets[state] == n &&
+            memcmp(d->members + d->offsets[state], list, n * sizeof(unsigned int)) == 0)
+            return (long)state;
+    }
+
+    if (d->nr_states == d->max_states)
+        return -1;
+
+    state = d->nr_states;
+    if (d->offsets[state] + n > d->members_capacity)
+    {
+        size_t capacity = 2 * d->members_capacity + n + 64;
+        unsigned int *members = (unsigned int *)EVAL_REALLOC(d->members, capacity * sizeof(unsigned int));
+
+        if (members == NULL)
+            return -1;
+        d->members = members;
+        d->members_capacity = capacity;
+    }
+
+    if (n)
+        memcpy(d->members + d->offsets[state], list, n * sizeof(unsigned int));
+    d->offsets[state + 1] = d->offsets[state] + n;
+    d->hashes[state] = hash;
+    d->flags[state] = flags;
+    d->slots[i] = (unsigned int)++d->nr_states;
+
+    return (long)state;
+}
+
+/*
+ * Builds the DFA breadth first, one row of transitions per state and one
+ * cell per byte class. A state that matched or cannot match any more only
+ * leads to itself. NULL when it would have too many states, the NFA runs
+ * then.
+ */
+static unsigned int *regex_dfa(EvalRegex *re, EvalRegexWork *w, unsigned int *list, unsigned int *scratch,
+                               size_t *nr_cells)
+{
+    size_t nr_classes = re->nr_classes;
+    EvalRegexDfa *d = (EvalRegexDfa *)EVAL_MALLOC(sizeof(EvalRegexDfa));
+    unsigned int *next = NULL;
+    unsigned char representative[256];
+    size_t state;
+    size_t c;
+    size_t n;
+    long to;
+
+    if (d == NULL)
+        return NULL;
+
+    d->members = NULL;
+    d->members_capacity = 0;
+    d->nr_states = 0;
+    d->max_states = EVAL_REGEX_MAX_CELLS / nr_classes < EVAL_REGEX_MAX_STATES ?
+                    EVAL_REGEX_MAX_CELLS / nr_classes : EVAL_REGEX_MAX_STATES;
+    d->offsets[0] = 0;
+    memset(d->slots, 0x00, sizeof(d->slots));
+
+    next = (unsigned int *)EVAL_MALLOC(d->max_states * nr_classes * sizeof(unsigned int));
+    for (c = 256; c-- > 0;)
+        representative[re->classes[c]] = (unsigned char)c;
+
+    regex_next_gen(re, w);
+    n = regex_close(re, w, 0, EVAL_REGEX_AT_BEGIN, list, 0);
+    to = regex_flags(re, w, list, n, scratch);
+    regex_sort(list, n);
+    to = next != NULL ? regex_dfa_state(d, list, n, (unsigned int)to) : -1;
+
+    for (state = 0; to >= 0 && state < d->nr_states; state++)
+    {
+        unsigned int *row = next + state * nr_classes;
+
+        for (c = 0; c < nr_classes; c++)
+        {
+            if (d->flags[state] & (EVAL_REGEX_ACCEPT | EVAL_REGEX_DEAD))
+            {
+                row[c] = (unsigned int)(state * nr_classes) | d->flags[state];
+                continue;
+            }
+
+            n = regex_step(re, w, d->members + d->offsets[state], d->offsets[state + 1] - d->offsets[state],
+                           representative[c], list);
+            to = regex_flags(re, w, list, n, scratch);
+            regex_sort(list, n);
+            to = regex_dfa_state(d, list, n, (unsigned int)to);
+            if (to < 0)
+                break;
+            row[c] = (unsigned int)((size_t)to * nr_classes) | d->flags[to];
+        }
+    }
+
+    if (to >= 0)
+    {
+        re->start = d->flags[0];
+        *nr_cells = d->nr_states * nr_classes;
+    }
+    else
+    {
+        EVAL_FREE(next);
+        next = NULL;
+    }
+
+    EVAL_FREE(d->members);
+    EVAL_FREE(d);
+
+    return next;
+}
+
+static void regex_free_compiler(EvalRegexCompiler *c)
+{
+    EVAL_FREE(c->nodes);
+    EVAL_FREE(c->sets);
+    EVAL_FREE(c->insts);
+}
+
+/*
+ * The compiled pattern in one block, NULL when out of memory. A pattern that
+ * does not parse, or would take too many instructions, is compiled as well
+ * but not valid, so it is only refused once.
+ */
+static EvalRegex *regex_compile(const char *pattern, size_t len)
+{
+    EvalRegexCompiler c;
+    EvalRegex tmp;
+    EvalRegexWork w;
+    EvalRegex *re;
+    unsigned int *work = NULL;
+    unsigned int *next = NULL;
+    size_t nr_cells = 0;
+    size_t root;
+    size_t size = sizeof(EvalRegex);
+    char *p;
+
+    memset(&c, 0x00, sizeof(c));
+    memset(&tmp, 0x00, sizeof(tmp));
+    c.p = (const unsigned char *)pattern;
+    c.end = c.p + len;
+    c.failed = len > EVAL_REGEX_MAX_LENGTH;
+
+    if (!c.failed)
+    {
+        c.nodes_capacity = 3 * len + 4;
+        c.nodes = (EvalRegexNode *)EVAL_MALLOC(c.nodes_capacity * sizeof(EvalRegexNode));
+        c.sets = (unsigned char (*)[32])EVAL_MALLOC((len + 1) * sizeof(c.sets[0]));
+        c.insts = (EvalRegexInst *)EVAL_MALLOC(EVAL_REGEX_MAX_INSTS * sizeof(EvalRegexInst));
+        if (c.nodes == NULL || c.sets == NULL || c.insts == NULL)
+        {
+            regex_free_compiler(&c);
+            return NULL;
+        }
+
+        root = regex_alt(&c);
+        if (c.p != c.end)
+            c.failed = 1;
+        if (!c.failed)
+            regex_emit(&c, root);
+        if (!c.failed)
+        {
+            c.insts[c.nr_insts].op = EVAL_REGEX_MATCH;
+            c.insts[c.nr_insts++].set = 0;
+        }
+    }
+
+    if (!c.failed)
+    {
+        tmp.valid = 1;
+        tmp.nr_insts = (unsigned int)c.nr_insts;
+        tmp.insts = c.insts;
+        tmp.sets = (const unsigned char (*)[32])c.sets;
+        regex_classes(&tmp, c.nr_sets);
+
+        /* marks, a stack of twice as many, and two lists */
+        work = (unsigned int *)eval_calloc(5 * c.nr_insts + 2, sizeof(unsigned int));
+        if (work == NULL)
+        {
+            regex_free_compiler(&c);
+            return NULL;
+        }
+        w.marks = work;
+        w.stack = work + c.nr_insts;
+        w.gen = 0;
+        regex_next_gen(&tmp, &w);
+        regex_close(&tmp, &w, 0, EVAL_REGEX_AT_BEGIN | EVAL_REGEX_AT_END, work + 3 * c.nr_insts + 2, 0);
+        tmp.empty = (unsigned int)regex_matched(&tmp, &w);
+        next = regex_dfa(&tmp, &w, work + 3 * c.nr_insts + 2, work + 4 * c.nr_insts + 2, &nr_cells);
+        EVAL_FREE(work);
+
+        size += c.nr_insts * sizeof(EvalRegexInst) + c.nr_sets * sizeof(c.sets[0]) + nr_cells * sizeof(unsigned int);
+    }
+
+    re = (EvalRegex *)EVAL_MALLOC(size);
+    if (re != NULL)
+    {
+        *re = tmp;
+        p = (char *)(re + 1);
+        if (tmp.valid)
+        {
+            re->insts = (const EvalRegexInst *)memcpy(p, c.insts, c.nr_insts * sizeof(EvalRegexInst));
+            p += c.nr_insts * sizeof(EvalRegexInst);
+            re->next = nr_cells ? (const unsigned int *)memcpy(p, next, nr_cells * sizeof(unsigned int)) : NULL;
+            p += nr_cells * sizeof(unsigned int);
+            re->sets = (const unsigned char (*)[32])(c.nr_sets ? memcpy(p, c.sets, c.nr_sets * sizeof(c.sets[0])) : p);
+        }
+    }
+
+    EVAL_FREE(next);
+    regex_free_compiler(&c);
+
+    return re;
+}
+
+/* the NFA a byte at a time, for a pattern without a DFA */
+static EvalResult regex_run_nfa(const EvalRegex *re, const char *s, size_t n, int *matched)
+{
+    size_t nr_insts = re->nr_insts;
+    unsigned int *work = (unsigned int *)eval_calloc(5 * nr_insts + 2, sizeof(unsigned int));
+    unsigned int *list;
+    unsigned int *other;
+    EvalRegexWork w;
+    size_t nr_states;
+    size_t i;
+    int accept;
+
+    if (work == NULL)
+        return EVAL_RESULT_OOM;
+
+    w.marks = work;
+    w.stack = work + nr_insts;
+    w.gen = 0;
+    list = work + 3 * nr_insts + 2;
+    other = list + nr_insts;
+
+    regex_next_gen(re, &w);
+    nr_states = regex_close(re, &w, 0, EVAL_REGEX_AT_BEGIN, list, 0);
+    accept = regex_matched(re, &w);
+
+    for (i = 0; i < n && !accept && nr_states; i++)
+    {
+        unsigned int *swap = list;
+
+        nr_states = regex_step(re, &w, list, nr_states, (unsigned char)s[i], other);
+        accept = regex_matched(re, &w);
+        list = other;
+        other = swap;
+    }
+
+    *matched = accept || (nr_states && regex_matched_at_end(re, &w, list, nr_states, other));
+    EVAL_FREE(work);
+
+    return EVAL_RESULT_OK;
+}
+
+static EvalResult regex_match(const EvalRegex *re, const char *s, size_t n, int *matched)
+{
+    const unsigned char *p = (const unsigned char *)s;
+    const unsigned char *end = p + n;
+    unsigned int t = re->start;
+
+    if (n == 0)
+    {
+        *matched = (int)re->empty;
+        return EVAL_RESULT_OK;
+    }
+    if (re->next == NULL)
+        return regex_run_nfa(re, s, n, matched);
+
+    while (p < end && !(t & (EVAL_REGEX_ACCEPT | EVAL_REGEX_DEAD)))
+        t = re->next[(t & EVAL_REGEX_ROW) + re->classes[*p++]];
+
+    *matched = (t & EVAL_REGEX_ACCEPT_END) != 0;
+
+    return EVAL_RESULT_OK;
+}
+
+/* the compiled pattern of a literal's id in eval_patterns, interned from the text when it is EVAL_SYMBOL_NONE */
+static EvalResult regex_get(EvalSymbol symbol, const char *pattern, size_t len, const EvalRegex **regex)
+{
+    EvalRegex **page;
+    EvalRegex *re = NULL;
+    EvalRegex *found;
+    size_t i;
+
+    if (symbol == EVAL_SYMBOL_NONE)
+    {
+        const EvalSymbolEntry *entry = symbol_intern(&eval_patterns, pattern, len);
+
+        if (entry == NULL)
+            return EVAL_RESULT_OOM;
+        symbol = entry->symbol;
+    }
+
+    i = (symbol - 1) & (EVAL_SYMBOL_PAGE - 1);
+    page = (EvalRegex **)EVAL_ATOMIC_LOAD_ACQUIRE_PTR(eval_regex_pages + ((symbol - 1) >> EVAL_SYMBOL_PAGE_BITS));
+    if (page != NULL)
+        re = (EvalRegex *)EVAL_ATOMIC_LOAD_ACQUIRE_PTR(page + i);
+
+    if (re == NULL)
+    {
+        re = regex_compile(pattern, len);
+        if (re == NULL)
+            return EVAL_RESULT_OOM;
+
+        /* another thread may have stored its own meanwhile */
+        while (!EVAL_SPIN_TRY_LOCK(&eval_regex_lock))
+        {
+        }
+        page = eval_regex_pages[(symbol - 1) >> EVAL_SYMBOL_PAGE_BITS];
+        if (page == NULL)
+        {
+            page = (EvalRegex **)eval_calloc(EVAL_SYMBOL_PAGE, sizeof(EvalRegex *));
+            if (page != NULL)
+                EVAL_ATOMIC_STORE_RELEASE_PTR(eval_regex_pages + ((symbol - 1) >> EVAL_SYMBOL_PAGE_BITS), page);
+        }
+        found = page ? page[i] : NULL;
+        if (page != NULL && found == NULL)
+            EVAL_ATOMIC_STORE_RELEASE_PTR(page + i, re);
+        EVAL_SPIN_UNLOCK(&eval_regex_lock);
+
+        if (page == NULL || found != NULL)
+            EVAL_FREE(re);
+        if (page == NULL)
+            return EVAL_RESULT_OOM;
+        if (found != NULL)
+            re = found;
+    }
+
+    *regex = re;
+
+    return re->valid ? EVAL_RESULT_OK : EVAL_RESULT_INVALID_PATTERN;
+}
+
+/*
+ * Patterns built at run time are not interned: each thread keeps the last
+ * ones it compiled in EVAL_REGEX_CACHE_SLOTS slots picked by the hash of the
+ * text, and a miss replaces the pattern in its slot. However many distinct
+ * patterns a host feeds, a thread holds at most that many, until
+ * eval_thread_cleanup() gives them back.
+ */
+
+#define EVAL_REGEX_CACHE_SLOTS      64
+
+typedef struct
+{
+    unsigned long long hash;
+    char *text;
+    size_t len;
+    EvalRegex *regex;               /* NULL for a free slot */
+} EvalRegexCacheSlot;
+
+static EVAL_THREAD_LOCAL EvalRegexCacheSlot eval_regex_cache[EVAL_REGEX_CACHE_SLOTS];
+
+static EvalResult regex_cached(const char *pattern, size_t len, const EvalRegex **regex)
+{
+    unsigned long long hash = eval_hash(pattern, len);
+    EvalRegexCacheSlot *slot = eval_regex_cache + (hash & (EVAL_REGEX_CACHE_SLOTS - 1));
+
+    if (slot->regex == NULL || slot->hash != hash || slot->len != len || memcmp(slot->text, pattern, len) != 0)
+    {
+        EvalRegex *re = regex_compile(pattern, len);
+        char *text = (char *)EVAL_MALLOC(len + 1);
+
+        if (re == NULL || text == NULL)
+        {
+            if (re != NULL)
+                EVAL_FREE(re);
+            if (text != NULL)
+                EVAL_FREE(text);
+            return EVAL_RESULT_OOM;
+        }
+
+        if (slot->regex != NULL)
+        {
+            EVAL_FREE(slot->regex);
+            EVAL_FREE(slot->text);
+        }
+        slot->hash = hash;
+        slot->text = (char *)memcpy(text, pattern, len);
+        slot->len = len;
+        slot->regex = re;
+    }
+
+    *regex = slot->regex;
+
+    return slot->regex->valid ? EVAL_RESULT_OK : EVAL_RESULT_INVALID_PATTERN;
+}
+
+void eval_thread_cleanup(void)
+{
+    size_t i;
+
+    for (i = 0; i < EVAL_REGEX_CACHE_SLOTS; i++)
+    {
+        if (eval_regex_cache[i].regex != NULL)
+        {
+            EVAL_FREE(eval_regex_cache[i].regex);
+            EVAL_FREE(eval_regex_cache[i].text);
+            eval_regex_cache[i].regex = NULL;
+            eval_regex_cache[i].text = NULL;
+        }
+    }
+}
+
+/*
+ * String builtins.
+ *
+ * contains(), startswith(), endswith(), find(), replace(), substr() and
+ * matches() take more than one argument, which hooks cannot, so they belong
+ * to the language:
+ * a call with several arguments names one of them and a call with one still
+ * goes to the hooks. They read their arguments where they lie on the value
+ * stack, and only replace() and substr() ever make a string.
+ *
+ * Searches test 16 positions at a time for two bytes of the needle, its
+ * least common one in typical text and its last, and compare the whole needle
+ * only where both match. A literal needle is kept in the program with the two
+ * bytes already chosen.
+ */
+
+#define EVAL_BUILTIN_MAX_ARGS       3
+#define EVAL_NO_BUILTIN             ((size_t)-1)
+#define EVAL_NO_NEEDLE              0xffffffff
+
+typedef enum {
+    EVAL_BUILTIN_CONTAINS,
+    EVAL_BUILTIN_STARTSWITH,
+    EVAL_BUILTIN_ENDSWITH,
+    EVAL_BUILTIN_FIND,
+    EVAL_BUILTIN_REPLACE,
+    EVAL_BUILTIN_SUBSTR,
+    EVAL_BUILTIN_MATCHES,
+    EVAL_NR_BUILTINS
+} EvalBuiltin;
+
+static const struct
+{
+    const char *name;
+    unsigned char min_args;
+    unsigned char max_args;
+    unsigned char needle;       /* the second argument is searched for */
+} EVAL_BUILTINS[EVAL_NR_BUILTINS] = {
+    {"contains", 2, 2, 1},
+    {"startswith", 2, 2, 1},
+    {"endswith", 2, 2, 1},
+    {"find", 2, 2, 1},
+    {"replace", 3, 3, 1},
+    {"substr", 2, 3, 0},
+    {"matches", 2, 2, 1}
+};
+
+/* a needle and the positions of the two bytes a search filters on */
+typedef struct
+{
+    const char *str;
+    size_t len;
+    size_t first;
+    size_t second;
+    EvalSymbol symbol;          /* a pattern's, EVAL_SYMBOL_NONE until it is interned */
+} EvalNeedle;
+
+/* an argument as text: its own buffer, or a number printed into buff */
+typedef struct
+{
+    const char *str;
+    size_t len;
+    char buff[64];
+} EvalTextArg;
+
+static size_t builtin_lookup(const char *name, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < EVAL_NR_BUILTINS; i++)
+    {
+        if (strlen(EVAL_BUILTINS[i].name) == length && memcmp(EVAL_BUILTINS[i].name, name, length) == 0)
+            return i;
+    }
+
+    return EVAL_NO_BUILTIN;
+}
+
+/* how common a byte is in names, paths and text, higher is more common */
+static unsigned int byte_rank(unsigned char c)
+{
+    static const char LETTERS[] = "etaoinshrdlcumwfgypbvkjxqz";
+
+    if (c == ' ')
+        return 255;
+    if (c >= 'a' && c <= 'z')
+        return 250 - 4 * (unsigned int)(strchr(LETTERS, c) - LETTERS);
+    if (c == '/' || c == '.' || c == '_' || c == '-')
+        return 150;
+    if (c >= '0' && c <= '9')
+        return 120;
+    if (c >= 'A' && c <= 'Z')
+        return 100;
+    if (c > ' ' && c < 0x7f)
+        return 60;
+
+    return 10;
+}
+
+/*
+ * the rarest byte, and the last one since near misses tend to share a prefix;
+ * the first byte instead when the rarest is the last
+ */
+static void needle_plan(EvalNeedle *needle)
+{
+    size_t rarest = 0;
+    size_t i;
+
+    needle->first = 0;
+    needle->second = 0;
+    if (needle->len < 2)
+        return;
+
+    for (i = 1; i < needle->len; i++)
+    {
+        if (byte_rank((unsigned char)needle->str[i]) < byte_rank((unsigned char)needle->str[rarest]))
+            rarest = i;
+    }
+
+    needle->first = rarest == needle->len - 1 ? 0 : rarest;
+    needle->second = needle->len - 1;
+}
+
+/* the first occurrence of the needle in h[0..n), NULL when there is none */
+static const char *needle_find(const char *h, size_t n, const EvalNeedle *needle)
+{
+    size_t m = needle->len;
+    size_t last;
+    size_t i = 0;
+    char a;
+    char b;
+
+    if (m == 0)
+        return h;
+    if (m > n)
+        return NULL;
+    if (m == 1)
+        return (const char *)memchr(h, needle->str[0], n);
+
+    /* the last position an occurrence can start at */
+    last = n - m;
+    a = needle->str[needle->first];
+    b = needle->str[needle->second];
+
+#ifdef EVAL_HAVE_SSE2
+    {
+        const __m128i x = _mm_set1_epi8(a);
+        const __m128i y = _mm_set1_epi8(b);
+
+        for (; i <= last && last - i >= 15; i += 16)
+        {
+            __m128i p = _mm_loadu_si128((const __m128i *)(h + i + needle->first));
+            __m128i q = _mm_loadu_si128((const __m128i *)(h + i + needle->second));
+            unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(p, x),
+                                                                              _mm_cmpeq_epi8(q, y)));
+
+            while (mask)
+            {
+                size_t j = i + EVAL_CTZ64(mask);
+
+                if (memcmp(h + j, needle->str, m) == 0)
+                    return h + j;
+                mask &= mask - 1;
+            }
+        }
+    }
+#endif
+
+    /* the tail, or all of it: memchr finds the candidates for the first byte */
+    while (i <= last)
+    {
+        const char *p = (const char *)memchr(h + i + needle->first, a, last - i + 1);
+
+        if (p == NULL)
+            return NULL;
+
+        i = (size_t)(p - h) - needle->first;
+        if (h[i + needle->second] == b && memcmp(h + i, needle->str, m) == 0)
+            return h + i;
+        i++;
+    }
+
+    return NULL;
+}
+
+static void text_arg(EvalValue v, EvalTextArg *arg)
+{
+    if (EVAL_VALUE_IS_STRING(v))
+    {
+        arg->str = value_string(v);
+        arg->len = value_header(v)->size;
+    }
+    else
+    {
+        arg->str = number_to_string(value_number(v), arg->buff, sizeof(arg->buff));
+        arg->len = strlen(arg->str);
+    }
+}
+
+/* a string of size bytes for the caller to fill */
+static EvalResult value_new_string(EvalValue *v, size_t size)
+{
+    ExprValue value;
+
+    expr_value_init(&value);
+    if (expr_str_init(&(value.v.str), size) != EVAL_RESULT_OK)
+        return EVAL_RESULT_OOM;
+
+    value.type = EXPR_VALUE_TYPE_STRING;
+    value.owned = 1;
+    value.v.str.size = size;
+    value.v.str.str[size] = '\0';
+    *v = value_box(&value);
+
+    return EVAL_RESULT_OK;
+}
+
+/* every occurrence, left to right; in place when the lengths match and the string is the subject's own */
+static EvalResult str_replace(EvalValue *subject, const EvalTextArg *s, const EvalNeedle *needle,
+                              const EvalTextArg *with, EvalValue *output)
+{
+    const char *end = s->str + s->len;
+    const char *p = s->str;
+    const char *next;
+    size_t count = 0;
+    EvalResult result;
+    char *q;
+
+    while (needle->len && (p = needle_find(p, (size_t)(end - p), needle)) != NULL)
+    {
+        p += needle->len;
+        count++;
+    }
+
+    /* a number subject is made a string either way */
+    if (EVAL_VALUE_IS_STRING(*subject) && (count == 0 || needle->len == with->len))
+    {
+        for (p = s->str; count && (p = needle_find(p, (size_t)(end - p), needle)) != NULL; p += needle->len)
+            memcpy((char *)p, with->str, with->len);
+
+        *output = *subject;
+        *subject = 0;
+        return EVAL_RESULT_OK;
+    }
+
+    result = value_new_string(output, s->len - count * needle->len + count * with->len);
+    if (result != EVAL_RESULT_OK)
+        return result;
+
+    q = value_string(*output);
+    for (p = s->str; count && (next = needle_find(p, (size_t)(end - p), needle)) != NULL; p = next + needle->len)
+    {
+        memcpy(q, p, (size_t)(next - p));
+        q += next - p;
+        memcpy(q, with->str, with->len);
+        q += with->len;
+    }
+    memcpy(q, p, (size_t)(end - p));
+
+    return EVAL_RESULT_OK;
+}
+
+/* a negative start counts from the end, and both ends are clamped to the string */
+static EvalResult str_substr(EvalValue *subject, const EvalTextArg *s, double start, double length,
+                             EvalValue *output)
+{
+    size_t from = 0;
+    size_t n = 0;
+
+    if (start < 0)
+        start += (double)s->len;
+    if (start > 0)
+        from = start < (double)s->len ? (size_t)start : s->len;
+    if (length > 0)
+        n = length < (double)(s->len - from) ? (size_t)length : s->len - from;
+
+    if (!EVAL_VALUE_IS_STRING(*subject))
+        return eval_value_set_string(output, s->str + from, n);
+
+    memmove(value_string(*subject), s->str + from, n);
+    value_string(*subject)[n] = '\0';
+    value_header(*subject)->size = n;
+    *output = *subject;
+    *subject = 0;
+
+    return EVAL_RESULT_OK;
+}
+
+/*
+ * Runs a builtin on its arguments at args, all of them on the stack unless the
+ * needle is a literal passed in needle. The result takes the place of the
+ * first argument and the others are cleared, whatever the outcome.
+ */
+static EvalResult builtin_run(size_t builtin, EvalValue *args, size_t nr_args, const EvalNeedle *literal)
+{
+    size_t nr_values = nr_args - (literal != NULL);
+    EvalValue *next = args + 1;
+    EvalValue output = 0;
+    EvalResult result = EVAL_RESULT_OK;
+    EvalTextArg s;
+    EvalTextArg t;
+    EvalTextArg with;
+    EvalNeedle needle;
+    const EvalRegex *regex;
+    const char *p;
+    int matched;
+
+    text_arg(args[0], &s);
+    if (literal)
+    {
+        needle = *literal;
+    }
+    else if (EVAL_BUILTINS[builtin].needle)
+    {
+        text_arg(*next++, &t);
+        needle.str = t.str;
+        needle.len = t.len;
+        needle.symbol = EVAL_SYMBOL_NONE;
+        if (builtin == EVAL_BUILTIN_CONTAINS || builtin == EVAL_BUILTIN_FIND || builtin == EVAL_BUILTIN_REPLACE)
+            needle_plan(&needle);
+    }
+
+    switch (builtin)
+    {
+    case EVAL_BUILTIN_CONTAINS:
+        output = eval_value_number(needle_find(s.str, s.len, &needle) != NULL);
+        break;
+    case EVAL_BUILTIN_STARTSWITH:
+        output = eval_value_number(needle.len <= s.len && memcmp(s.str, needle.str, needle.len) == 0);
+        break;
+    case EVAL_BUILTIN_ENDSWITH:
+        output = eval_value_number(needle.len <= s.len &&
+                                   memcmp(s.str + s.len - needle.len, needle.str, needle.len) == 0);
+        break;
+    case EVAL_BUILTIN_FIND:
+        p = needle_find(s.str, s.len, &needle);
+        output = eval_value_number(p ? (double)(p - s.str) : -1);
+        break;
+    case EVAL_BUILTIN_REPLACE:
+        text_arg(*next, &with);
+        result = str_replace(args, &s, &needle, &with, &output);
+        break;
+    case EVAL_BUILTIN_MATCHES:
+        if (literal)
+            result = regex_get(needle.symbol, needle.str, needle.len, &regex);
+        else
+            result = regex_cached(needle.str, needle.len, &regex);
+        if (result == EVAL_RESULT_OK)
+            result = regex_match(regex, s.str, s.len, &matched);
+        if (result == EVAL_RESULT_OK)
+            output = eval_value_number(matched);
+        break;
+    default:
+        result = str_substr(args, &s, eval_value_get_number(args[1]),
+                            nr_args > 2 ? eval_value_get_number(args[2]) : (double)s.len, &output);
+        break;
+    }
+
+    while (nr_values)
+        eval_value_clear(args + --nr_values);
+    *args = output;
+
+    return result;
+}
+
+/*
+ * The arguments are on the stack but for a literal needle, which is already in
+ * the pool at needle. A literal pattern is interned and compiled now.
+ */
+static EvalResult builder_add_builtin(EvalBuilder *b, size_t builtin, size_t nr_args, size_t needle)
+{
+    EvalBuiltinEntry entry;
+    EvalResult result;
+    size_t offset = b->pool_size;
+
+    result = builder_reserve((void **)&(b->pool), &(b->pool_capacity), b->pool_size + sizeof(entry), 1);
+    if (result != EVAL_RESULT_OK)
+        return result;
+
+    entry.builtin = (unsigned int)builtin;
+    entry.nr_args = (unsigned int)nr_args;
+    entry.needle = EVAL_NO_NEEDLE;
+    entry.first = 0;
+    entry.second = 0;
+    if (needle != EVAL_NO_NEEDLE)
+    {
+        EvalNeedle plan;
+        unsigned int len;
+
+        memcpy(&len, b->pool + needle, sizeof(len));
+        plan.str = b->pool + needle + 2 * sizeof(unsigned int);
+        plan.len = len;
+        needle_plan(&plan);
+
+        if (builtin == EVAL_BUILTIN_MATCHES)
+        {
+            const EvalRegex *regex;
+            const EvalSymbolEntry *pattern = symbol_intern(&eval_patterns, plan.str, plan.len);
+            EvalSymbol symbol;
+
+            if (pattern == NULL)
+                return EVAL_RESULT_OOM;
+            symbol = pattern->symbol;
+            result = regex_get(symbol, plan.str, plan.len, &regex);
+            if (result != EVAL_RESULT_OK)
+                return result;
+            memcpy(b->pool + needle + sizeof(unsigned int), &symbol, sizeof(symbol));
+        }
+
+        entry.needle = (unsigned int)needle;
+        entry.first = (unsigned int)plan.first;
+        entry.second = (unsigned int)plan.second;
+        nr_args--;
+    }
+
+    memcpy(b->pool + offset, &entry, sizeof(entry));
+    b->pool_size += sizeof(entry);
+
+    result = builder_emit(b, EVAL_OP_BUILTIN, offset);
+    b->depth -= nr_args - 1;
+
+    return result;
+}
+
+/*
+ * Membership sets.
+ *
+ * x in (a, b, ...) is 1 when x == a || x == b || ... would be, x not in (...)
+ * its negation, and the items are literals. The interpreter compares them one
+ * by one as it reads them. A compiled set is one pool entry with two open
+ * addressed tables: the texts of all items, each number printed the way ==
+ * prints it, and the values of the number items. A string is looked up among
+ * the texts; a number among the values, then among the texts of the string
+ * items, so a test costs a hash and a probe or two however long the list is.
+ */
+
+#define EVAL_SET_EMPTY              0xffffffff
+#define EVAL_SET_NUMBER             0x80000000  /* an item that is the index of a number */
+#define EVAL_SET_NUMBER_TEXT        1           /* a text that only a number item has */
+
+/* followed by the items, (mask + 1) text slots of hash and string offset and (mask + 1) number slots */
+typedef struct
+{
+    unsigned int negate;
+    unsigned int nr_items;
+    unsigned int mask;
+    unsigned int max_len;
+    unsigned int has_strings;
+} EvalSetEntry;
+
+#define EVAL_SET_WORDS(nr_items, mask) \
+    (sizeof(EvalSetEntry) / sizeof(unsigned int) + (size_t)(nr_items) + 3 * ((size_t)(mask) + 1))
+
+/* byte at a time, so images hash the same on every host */
+static unsigned int set_hash(const char *str, size_t len)
+{
+    unsigned int h = 2166136261u;
+
+    while (len--)
+        h = (h ^ (unsigned char)*str++) * 16777619u;
+
+    return h;
+}
+
+/* 0 and -0 are equal and hash alike */
+static unsigned int set_hash_number(double value)
+{
+    unsigned long long bits;
+
+    if (value == 0)
+        value = 0;
+    memcpy(&bits, &value, sizeof(bits));
+
+    return (unsigned int)((bits * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+/* the slot of a text in the table, or the empty slot it would go to */
+static size_t set_find_text(const unsigned int *texts, size_t mask, const char *pool, const char *str, size_t len,
+                            unsigned int hash)
+{
+    size_t i = hash & mask;
+
+    for (; texts[2 * i + 1] != EVAL_SET_EMPTY; i = (i + 1) & mask)
+    {
+        size_t offset = texts[2 * i + 1] & ~(unsigned int)EVAL_SET_NUMBER_TEXT;
+        unsigned int size;
+
+        memcpy(&size, pool + offset, sizeof(size));
+        if (texts[2 * i] == hash && size == len && memcmp(pool + offset + 2 * sizeof(unsigned int), str, len) == 0)
+            break;
+    }
+
+    return i;
+}
+
+static const unsigned int *set_entry(const EvalProgram *program, size_t offset, EvalSetEntry *set)
+{
+    const unsigned int *words = (const unsigned int *)(program_pool(program) + offset);
+
+    memcpy(set, words, sizeof(EvalSetEntry));
+
+    return words + sizeof(EvalSetEntry) / sizeof(unsigned int);
+}
+
+/* str is the subject when it is a string, number otherwise */
+static int set_test(const EvalProgram *program, size_t offset, const char *str, double number)
+{
+    EvalSetEntry set;
+    const unsigned int *items = set_entry(program, offset, &set);
+    const unsigned int *texts = items + set.nr_items;
+    const char *pool = program_pool(program);
+    char buff[64];
+    size_t len;
+    size_t i;
+
+    if (str == NULL)
+    {
+        const unsigned int *numbers = texts + 2 * ((size_t)set.mask + 1);
+        const double *values = program_numbers(program);
+
+        for (i = set_hash_number(number) & set.mask; numbers[i] != EVAL_SET_EMPTY; i = (i + 1) & set.mask)
+        {
+            if (values[numbers[i]] == number)
+                return !set.negate;
+        }
+
+        if (!set.has_strings)
+            return (int)set.negate;
+
+        str = number_to_string(number, buff, sizeof(buff));
+        len = strlen(str);
+        i = set_find_text(texts, set.mask, pool, str, len, set_hash(str, len));
+
+        return (texts[2 * i + 1] != EVAL_SET_EMPTY && !(texts[2 * i + 1] & EVAL_SET_NUMBER_TEXT)) != (int)set.negate;
+    }
+
+    len = strlen(str);
+    if (len > set.max_len)
+        return (int)set.negate;
+
+    i = set_find_text(texts, set.mask, pool, str, len, set_hash(str, len));
+
+    return (texts[2 * i + 1] != EVAL_SET_EMPTY) != (int)set.negate;
+}
+
+static int set_test_value(const EvalProgram *program, size_t offset, EvalValue v)
+{
+    if (EVAL_VALUE_IS_STRING(v))
+        return set_test(program, offset, value_string(v), 0);
+
+    return set_test(program, offset, NULL, value_number(v));
+}
+
+/* v == item as the interpreter reads the list, item being text or, when text is NULL, number */
+static int set_item_equal(EvalValue v, const char *text, size_t len, double number)
+{
+    char buff[64];
+    char item[64];
+    const char *str;
+
+    if (!EVAL_VALUE_IS_STRING(v) && text == NULL)
+        return value_number(v) == number;
+
+    str = EVAL_VALUE_IS_STRING(v) ? value_string(v) : number_to_string(value_number(v), buff, sizeof(buff));
+    if (text == NULL)
+    {
+        text = number_to_string(number, item, sizeof(item));
+        len = strlen(text);
+    }
+
+    return strlen(str) == len && memcmp(str, text, len) == 0;
+}
+
+/* the slot of a text, added when it is new: a number's text is pooled then, a string's already is */
+static EvalResult builder_set_text(EvalBuilder *b, EvalSetEntry *set, unsigned int *texts, const char *str,
+                                   size_t len, size_t offset, size_t *slot)
+{
+    unsigned int hash = set_hash(str, len);
+    EvalResult result;
+    size_t i;
+
+    i = set_find_text(texts, set->mask, b->pool, str, len, hash);
+    *slot = i;
+    if (texts[2 * i + 1] != EVAL_SET_EMPTY)
+    {
+        if (offset != EVAL_SET_EMPTY)
+            texts[2 * i + 1] &= ~(unsigned int)EVAL_SET_NUMBER_TEXT;
+        return EVAL_RESULT_OK;
+    }
+
+    texts[2 * i] = hash;
+    if (offset != EVAL_SET_EMPTY)
+    {
+        texts[2 * i + 1] = (unsigned int)offset;
+    }
+    else
+    {
+        result = builder_pool_string(b, str, len, EVAL_SYMBOL_NONE, &offset);
+        if (result != EVAL_RESULT_OK)
+            return result;
+        texts[2 * i + 1] = (unsigned int)offset | EVAL_SET_NUMBER_TEXT;
+    }
+    if (len > set->max_len)
+        set->max_len = (unsigned int)len;
+
+    return EVAL_RESULT_OK;
+}
+
+/*
+ * the test of the value on the stack against items, each the pool offset of a
+ * string or EVAL_SET_NUMBER and the index of a number. Strings items become
+ * the slots of their texts in the entry.
+ */
+static EvalResult builder_add_set(EvalBuilder *b, const unsigned int *items, size_t nr_items, int negate)
+{
+    EvalSetEntry set;
+    EvalResult result = EVAL_RESULT_OK;
+    unsigned int *words;
+    unsigned int *texts;
+    unsigned int *numbers;
+    size_t capacity = 1;
+    size_t nr_words;
+    size_t offset;
+    size_t i;
+
+    while (capacity < 2 * nr_items)
+        capacity *= 2;
+    if (capacity > EVAL_OP_MAX_ARG)
+        return EVAL_RESULT_OOM;
+
+    nr_words = EVAL_SET_WORDS(nr_items, capacity - 1);
+    words = (unsigned int *)EVAL_MALLOC(nr_words * sizeof(unsigned int));
+    if (words == NULL)
+        return EVAL_RESULT_OOM;
+
+    set.negate = (unsigned int)negate;
+    set.nr_items = (unsigned int)nr_items;
+    set.mask = (unsigned int)(capacity - 1);
+    set.max_len = 0;
+    set.has_strings = 0;
+    texts = words + sizeof(set) / sizeof(unsigned int) + nr_items;
+    numbers = texts + 2 * capacity;
+    memset(texts, 0xff, 3 * capacity * sizeof(unsigned int));
+
+    for (i = 0; i < nr_items && result == EVAL_RESULT_OK; i++)
+    {
+        size_t slot;
+
+        if (items[i] & EVAL_SET_NUMBER)
+        {
+            unsigned int index = items[i] & ~(unsigned int)EVAL_SET_NUMBER;
+            double value = b->numbers[index];
+            char buff[64];
+            size_t j;
+
+            /* NaN equals nothing, not even itself */
+            for (j = set_hash_number(value) & set.mask; value == value; j = (j + 1) & set.mask)
+            {
+                if (numbers[j] == EVAL_SET_EMPTY)
+                    numbers[j] = index;
+                if (b->numbers[numbers[j]] == value)
+                    break;
+            }
+
+            number_to_string(value, buff, sizeof(buff));
+            result = builder_set_text(b, &set, texts, buff, strlen(buff), EVAL_SET_EMPTY, &slot);
+            words[sizeof(set) / sizeof(unsigned int) + i] = items[i];
+        }
+        else
+        {
+            unsigned int len;
+
+            memcpy(&len, b->pool + items[i], sizeof(len));
+            result = builder_set_text(b, &set, texts, b->pool + items[i] + 2 * sizeof(unsigned int), len, items[i],
+                                      &slot);
+            words[sizeof(set) / sizeof(unsigned int) + i] = (unsigned int)slot;
+            set.has_strings = 1;
+        }
+    }
+
+    offset = b->pool_size;
+    if (result == EVAL_RESULT_OK)
+        result = builder_reserve((void **)&(b->pool), &(b->pool_capacity),
+                                 b->pool_size + nr_words * sizeof(unsigned int), 1);
+    if (result == EVAL_RESULT_OK)
+    {
+        memcpy(words, &set, sizeof(set));
+        memcpy(b->pool + offset, words, nr_words * sizeof(unsigned int));
+        b->pool_size += nr_words * sizeof(unsigned int);
+        result = builder_emit(b, EVAL_OP_IN, offset);
+    }
+
+    EVAL_FREE(words);
+
+    return result;
+}
+
+/*
+ * Statements and locals.
+ *
+ * An expression may be a list of statements separated by semicolons, each
+ * optionally bound to a name with name = ..., and its value is the last
+ * one's. The statements before the last leave their values on the stack and
+ * a name refers to its statement's slot there, so a local is a load by index
+ * that never reaches get_variable. Binding a name again binds it to the new
+ * slot. A compiled program with more than one statement ends with
+ * EVAL_OP_RETURN, which clears the slots under the result; its pool entry is
+ * the number of slots and the pool offset of each slot's name, for printing.
+ */
+
+#define EVAL_NO_LOCAL               ((size_t)-1)
+#define EVAL_NO_NAME                0xffffffff
+
+static const unsigned int *program_locals(const EvalProgram *program, size_t offset, size_t *nr_slots)
+{
+    const unsigned int *entry = (const unsigned int *)(program_pool(program) + offset);
+
+    *nr_slots = entry[0];
+
+    return entry + 1;
+}
+
+/* the end of a program with nr_slots statements before the last, none of them named yet */
+static EvalResult builder_add_return(EvalBuilder *b, size_t nr_slots, size_t *offset)
+{
+    unsigned int count = (unsigned int)nr_slots;
+    size_t size = (nr_slots + 1) * sizeof(unsigned int);
+    EvalResult result;
+
+    if (nr_slots > EVAL_OP_MAX_ARG)
+        return EVAL_RESULT_OOM;
+
+    result = builder_reserve((void **)&(b->pool), &(b->pool_capacity), b->pool_size + size, 1);
+    if (result != EVAL_RESULT_OK)
+        return result;
+
+    *offset = b->pool_size;
+    memcpy(b->pool + *offset, &count, sizeof(count));
+    memset(b->pool + *offset + sizeof(count), 0xff, size - sizeof(count));
+    b->pool_size += size;
+
+    result = builder_emit(b, EVAL_OP_RETURN, *offset);
+    b->depth -= nr_slots;
+
+    return result;
+}
+
+static EvalResult builder_name_local(EvalBuilder *b, size_t entry, size_t slot, const char *name, size_t len)
+{
+    EvalResult result;
+    unsigned int index;
+    size_t offset;
+
+    result = builder_pool_string(b, name, len, EVAL_SYMBOL_NONE, &offset);
+    if (result != EVAL_RESULT_OK)
+        return result;
+
+    index = (unsigned int)offset;
+    memcpy(b->pool + entry + (slot + 1) * sizeof(unsigned int), &index, sizeof(index));
+
+    return EVAL_RESULT_OK;
+}
+
+/* Parser */
+
+/*
+ * One operator-precedence pass serves both eval_execute(), which folds values
+ * as operators reduce, and eval_compile(), which emits the same reductions as
+ * code. Brackets and calls are frames on an explicit stack, so nesting costs
+ * heap rather than C stack and the limit is a runtime setting.
+ */
+
+#define EVAL_PARSER_INLINE          32
+
+typedef enum {
+    EVAL_FRAME_GROUP,
+    EVAL_FRAME_CALL,
+    EVAL_FRAME_BINARY
+} EvalFrameType;
+
+typedef struct
+{
+    EvalFrameType type;
+    EvalTokenType op;
+    size_t flags;
+    EvalFunc func;
+
+    /* calls: the name as written, and its symbol once looked up */
+    const char *text;
+    size_t length;
+    EvalSymbol symbol;
+
+    /* the builtin of that name, the arguments so far and the pool offset of a literal needle */
+    size_t builtin;
+    size_t nr_args;
+    size_t needle;
+} EvalFrame;
+
+/* a name bound to the slot of a statement, as written in the input */
+typedef struct
+{
+    const char *text;
+    size_t length;
+    size_t slot;
+} EvalLocal;
+
+typedef struct
+{
+    EvalFrame *frames;
+    size_t nr_frames;
+    size_t frames_capacity;
+
+    EvalValue *values;
+    size_t nr_values;
+    size_t values_capacity;
+
+    /* every binding so far, and the statements that are finished */
+    EvalLocal *locals;
+    size_t nr_locals;
+    size_t locals_capacity;
+    size_t nr_slots;
+
+    EvalFrame inline_frames[EVAL_PARSER_INLINE];
+    EvalValue inline_values[EVAL_PARSER_INLINE];
+    EvalLocal inline_locals[EVAL_PARSER_INLINE];
+} EvalParser;
+
+/* binding strength of each token as a binary operator, 0 if it is not one */
+static const unsigned char EVAL_PRECEDENCE[] = {
+    0, /* END */
+    1, /* ADD */
+    2, /* G */
+    2, /* GE */
+    2, /* L */
+    2, /* LE */
+    2, /* NE */
+    2, /* E */
+    0, /* NOT */
+    2, /* OR */
+    2, /* AND */
+    0, /* BITS_NOT */
+    2, /* BITS_OR */
+    2, /* BITS_AND */
+    1, /* SUBTRACT */
+    2, /* MULTIPLY */
+    2, /* DIVIDE */
+    0, /* OPEN_BRACKET */
+    0, /* CLOSE_BRACKET */
+    0, /* NUMBER */
+    0, /* FUNC */
+    0, /* STRING */
+    0, /* VARIABLE */
+    0, /* COMMA */
+    0  /* SEMICOLON */
+};
+
+static size_t eval_max_depth = EVAL_MAX_STACK_DEPTH;
+
+void eval_set_max_depth(size_t depth)
+{
+    eval_max_depth = depth;
+}
+
+size_t eval_get_max_depth(void)
+{
+    return eval_max_depth;
+}
+
+static void parser_init(EvalParser *p)
+{
+    p->frames = p->inline_frames;
+    p->nr_frames = 0;
+    p->frames_capacity = EVAL_PARSER_INLINE;
+    p->values = p->inline_values;
+    p->nr_values = 0;
+    p->values_capacity = EVAL_PARSER_INLINE;
+    p->locals = p->inline_locals;
+    p->nr_locals = 0;
+    p->locals_capacity = EVAL_PARSER_INLINE;
+    p->nr_slots = 0;
+}
+
+static void parser_deinit(EvalParser *p)
+{
+    while (p->nr_values)
+        eval_value_clear(p->values + --p->nr_values);
+
+    if (p->frames != p->inline_frames)
+        EVAL_FREE(p->frames);
+    if (p->values != p->inline_values)
+        EVAL_FREE(p->values);
+    if (p->locals != p->inline_locals)
+        EVAL_FREE(p->locals);
+}
+
+/* the inline arrays are copied out the first time a stack outgrows them */
+static EvalResult parser_grow(void **items, size_t *capacity, void *inline_items, size_t item_size)
+{
+    size_t new_capacity = *capacity * 2;
+    void *p;
+
+    if (*items == inline_items)
+    {
+        p = EVAL_MALLOC(new_capacity * item_size);
+        if (p != NULL)
+            memcpy(p, *items, *capacity * item_size);
+    }
+    else
+    {
+        p = EVAL_REALLOC(*items, new_capacity * item_size);
+    }
+
+    if (p == NULL)
+        return EVAL_RESULT_OOM;
+
+    *items = p;
+    *capacity = new_capacity;
+
+    return EVAL_RESULT_OK;
+}
+
+static EvalFrame *parser_push_frame(EvalParser *p, EvalFrameType type)
+{
+    EvalFrame *frame;
+
+    if (p->nr_frames == p->frames_capacity &&
+        parser_grow((void **)&(p->frames), &(p->frames_capacity), p->inline_frames, sizeof(EvalFrame)) != EVAL_RESULT_OK)
+        return NULL;
+
+    frame = p->frames + p->nr_frames++;
+    frame->type = type;
+
+    return frame;
+}
+
+/* the caller initialises the value */
+static EvalValue *parser_push_value(EvalParser *p)
+{
+    if (p->nr_values == p->values_capacity &&
+        parser_grow((void **)&(p->values), &(p->values_capacity), p->inline_values, sizeof(EvalValue)) != EVAL_RESULT_OK)
+        return NULL;
+
+    return p->values + p->nr_values++;
+}
+
+/* a bracket or an argument list opens a new level */
+static EvalResult parser_enter(EvalContext *ctx)
+{
+    if (eval_max_depth && ctx->stack_level >= eval_max_depth)
+    {
+        return EVAL_RESULT_STACK_OVERFLOW;
+    }
+
+    ctx->stack_level++;
+#ifdef EVAL_ENABLE_STATS
+    if (eval_tracer && ctx->stack_level > eval_tracer->stats.max_depth)
+        eval_tracer->stats.max_depth = ctx->stack_level;
+#endif
+
+    return EVAL_RESULT_OK;
+}
+
+/* pops binary operators binding at least as tightly as precedence */
+static EvalResult parser_reduce(EvalParser *p, EvalBuilder *b, unsigned int precedence)
+{
+    EvalResult result;
+
+    while (p->nr_frames)
+    {
+        EvalFrame *frame = p->frames + p->nr_frames - 1;
+        EvalValue *rhs;
+
+        if (frame->type != EVAL_FRAME_BINARY || EVAL_PRECEDENCE[frame->op] < precedence)
+            break;
+
+        p->nr_frames--;
+        if (b)
+        {
+            result = builder_emit(b, EVAL_OP_BINARY, frame->op);
+        }
+        else
+        {
+            rhs = p->values + --p->nr_values;
+            result = value_op(rhs - 1, rhs, frame->op);
+            eval_value_clear(rhs);
+        }
+        if (result != EVAL_RESULT_OK)
+            return result;
+    }
+
+    return EVAL_RESULT_OK;
+}
+
+static EvalResult parser_unary(EvalParser *p, EvalBuilder *b, size_t flags)
+{
+    if (!flags)
+        return EVAL_RESULT_OK;
+
+    if (b)
+        return builder_emit(b, EVAL_OP_UNARY, flags);
+
+    value_unary(p->values + p->nr_values - 1, flags);
+
+    return EVAL_RESULT_OK;
+}
+
+/* a number, a string or a variable */
+static EvalResult parser_operand(EvalContext *ctx, EvalParser *p, EvalBuilder *b)
+{
+    const EvalSymbolEntry *entry;
+    EvalValue *value;
+    ExprValue output;
+    EvalResult result;
+
+    if (b)
+    {
+        switch (ctx->token.type)
+        {
+        case EVAL_TOKEN_TYPE_NUMBER:
+            return builder_add_number(b, ctx->token.v.number);
+        case EVAL_TOKEN_TYPE_STRING:
+            return builder_add_string(b, EVAL_OP_STRING, ctx->token.v.slice.text, ctx->token.v.slice.length);
+        case EVAL_TOKEN_TYPE_VARIABLE:
+            return builder_add_string(b, EVAL_OP_VARIABLE, ctx->token.v.slice.text, ctx->token.v.slice.length);
+        default:
+            return EVAL_RESULT_EXPECTED_TERM;
+        }
+    }
+
+    switch (ctx->token.type)
+    {
+    case EVAL_TOKEN_TYPE_NUMBER:
+    case EVAL_TOKEN_TYPE_STRING:
+        break;
+    case EVAL_TOKEN_TYPE_VARIABLE:
+        if (!ctx->hooks || (!ctx->hooks->get_variable && !ctx->hooks->get_variable_symbol))
+            return EVAL_RESULT_UNDEFINED_VARIABLE;
+        break;
+    default:
+        return EVAL_RESULT_EXPECTED_TERM;
+    }
+
+    value = parser_push_value(p);
+    if (value == NULL)
+        return EVAL_RESULT_OOM;
+
+    *value = 0;
+    if (ctx->token.type == EVAL_TOKEN_TYPE_NUMBER)
+    {
+        *value = eval_value_number(ctx->token.v.number);
+        return EVAL_RESULT_OK;
+    }
+
+    if (ctx->token.type == EVAL_TOKEN_TYPE_STRING)
+        return eval_value_set_string(value, ctx->token.v.slice.text, ctx->token.v.slice.length);
+
+    entry = symbol_intern(&eval_symbols, ctx->token.v.slice.text, ctx->token.v.slice.length);
+    if (entry == NULL)
+        return EVAL_RESULT_OOM;
+
+    expr_value_init(&output);
+    result = hook_get_variable(ctx->hooks, entry->symbol, entry->name, ctx->user_data, &output);
+    eval_value_from_expr(value, &output);
+
+    return result;
+}
+
+/* the hook function a call goes to */
+static EvalResult parser_resolve(EvalContext *ctx, EvalFrame *frame)
+{
+    const EvalSymbolEntry *entry;
+
+    if (!ctx->hooks || (!ctx->hooks->get_func && !ctx->hooks->get_func_symbol))
+    {
+        return EVAL_RESULT_UNDEFINED_FUNCTION;
+    }
+
+    entry = symbol_intern(&eval_symbols, frame->text, frame->length);
+    if (entry == NULL)
+        return EVAL_RESULT_OOM;
+
+    frame->symbol = entry->symbol;
+    frame->func = hook_get_func(ctx->hooks, frame->symbol, entry->name, ctx->user_data);
+
+    return frame->func ? EVAL_RESULT_OK : EVAL_RESULT_UNDEFINED_FUNCTION;
+}
+
+/*
+ * a function name up to and including the opening bracket of its arguments.
+ * The names of builtins are only looked up in the hooks when the call turns
+ * out to have one argument.
+ */
+static EvalResult parser_call(EvalContext *ctx, EvalParser *p, EvalBuilder *b, size_t flags)
+{
+    EvalResult result;
+    EvalFrame *frame;
+
+    frame = parser_push_frame(p, EVAL_FRAME_CALL);
+    if (frame == NULL)
+        return EVAL_RESULT_OOM;
+
+    /* the token is gone by the time the function is called, its text is not */
+    frame->flags = flags;
+    frame->func = NULL;
+    frame->text = ctx->token.v.slice.text;
+    frame->length = ctx->token.v.slice.length;
+    frame->symbol = EVAL_SYMBOL_NONE;
+    frame->builtin = builtin_lookup(frame->text, frame->length);
+    frame->nr_args = 1;
+    frame->needle = EVAL_NO_NEEDLE;
+
+    if (!b && frame->builtin == EVAL_NO_BUILTIN)
+    {
+        result = parser_resolve(ctx, frame);
+        if (result != EVAL_RESULT_OK)
+            return result;
+    }
+
+    result = get_token(ctx);
+    if (result != EVAL_RESULT_OK)
+        return result;
+
+    if (ctx->token.type != EVAL_TOKEN_TYPE_OPEN_BRACKET)
+    {
+        return EVAL_RESULT_EXPECTED_OPEN_BRACKET;
+    }
+
+    result = get_token(ctx);
+    if (result != EVAL_RESULT_OK)
+        return result;
+
+    return parser_enter(ctx);
+}
+
+/* the end of an argument: a literal needle leaves the code for the call's pool entry */
+static void parser_end_arg(EvalFrame *frame, EvalBuilder *b)
+{
+    EvalCode last = b->code[b->nr_code - 1];
+
+    if (frame->nr_args == 2 && frame->builtin != EVAL_NO_BUILTIN && EVAL_BUILTINS[frame->builtin].needle &&
+        EVAL_CODE_OP(last) == EVAL_OP_STRING)
+    {
+        frame->needle = EVAL_CODE_ARG(last);
+        b->nr_code--;
+        b->depth--;
+    }
+}
+
+/* the comma between two arguments */
+static EvalResult parser_comma(EvalContext *ctx, EvalParser *p, EvalBuilder *b)
+{
+    EvalFrame *frame = p->frames + p->nr_frames - 1;
+
+    if (frame->nr_args == EVAL_BUILTIN_MAX_ARGS)
+        return EVAL_RESULT_UNDEFINED_FUNCTION;
+
+    if (b)
+        parser_end_arg(frame, b);
+    frame->nr_args++;
+
+    return get_token(ctx);
+}
+
+/* the closing bracket of a group or an argument list */
+static EvalResult parser_close(EvalContext *ctx, EvalParser *p, EvalBuilder *b)
+{
+    EvalResult result;
+    EvalFrame frame = p->frames[--p->nr_frames];
+
+    if (ctx->token.type != EVAL_TOKEN_TYPE_CLOSE_BRACKET)
+    {
+        return EVAL_RESULT_EXPECTED_CLOSE_BRACKET;
+    }
+    ctx->stack_level--;
+
+    if (frame.type == EVAL_FRAME_CALL && frame.nr_args > 1)
+    {
+        if (frame.builtin == EVAL_NO_BUILTIN || frame.nr_args < EVAL_BUILTINS[frame.builtin].min_args ||
+            frame.nr_args > EVAL_BUILTINS[frame.builtin].max_args)
+            return EVAL_RESULT_UNDEFINED_FUNCTION;
+
+        if (b)
+        {
+            parser_end_arg(&frame, b);
+            result = builder_add_builtin(b, frame.builtin, frame.nr_args, frame.needle);
+        }
+        else
+        {
+            p->nr_values -= frame.nr_args - 1;
+            result = builtin_run(frame.builtin, p->values + p->nr_values - 1, frame.nr_args, NULL);
+        }
+        if (result != EVAL_RESULT_OK)
+            return result;
+    }
+    else if (frame.type == EVAL_FRAME_CALL)
+    {
+        if (b)
+        {
+            result = builder_add_string(b, EVAL_OP_CALL, frame.text, frame.length);
+        }
+        else if (!frame.func && (result = parser_resolve(ctx, &frame)) != EVAL_RESULT_OK)
+        {
+            return result;
+        }
+        else
+        {
+            EvalValue *arg = p->values + p->nr_values - 1;
+            ExprValue output;
+
+            expr_value_init(&output);
+            result = hook_call_value(frame.func, symbol_entry(frame.symbol)->name, arg, ctx->user_data, &output);
+            eval_value_clear(arg);
+            eval_value_from_expr(arg, &output);
+        }
+        if (result != EVAL_RESULT_OK)
+            return result;
+    }
+
+    result = get_token(ctx);
+    if (result != EVAL_RESULT_OK)
+        return result;
+
+    return parser_unary(p, b, frame.flags);
+}
+
+/* in and not in are names where an operator is expected */
+static int parser_is_in(const EvalContext *ctx)
+{
+    const char *text = ctx->token.v.slice.text;
+    size_t length = ctx->token.v.slice.length;
+
+    return ctx->token.type == EVAL_TOKEN_TYPE_FUNC &&
+           ((length == 2 && memcmp(text, "in", 2) == 0) || (length == 3 && memcmp(text, "not", 3) == 0));
+}
+
+/*
+ * in or not in and the bracketed list of literals after it, tested against
+ * the value on top of the stack. The items are compared as they are read, or
+ * collected into a set compiled into the pool.
+ */
+static EvalResult parser_in(EvalContext *ctx, EvalParser *p, EvalBuilder *b)
+{
+    unsigned int inline_items[EVAL_PARSER_INLINE];
+    unsigned int *items = inline_items;
+    size_t capacity = EVAL_PARSER_INLINE;
+    size_t nr_items = 0;
+    int negate = ctx->token.v.slice.length == 3;
+    int found = 0;
+    EvalResult result;
+
+    result = get_token(ctx);
+    if (result == EVAL_RESULT_OK && negate)
+    {
+        if (ctx->token.type != EVAL_TOKEN_TYPE_FUNC || ctx->token.v.slice.length != 2 ||
+            memcmp(ctx->token.v.slice.text, "in", 2) != 0)
+            return EVAL_RESULT_UNEXPECTED_CHAR;
+        result = get_token(ctx);
+    }
+    if (result != EVAL_RESULT_OK)
+        return result;
+
+    if (ctx->token.type != EVAL_TOKEN_TYPE_OPEN_BRACKET)
+        return EVAL_RESULT_EXPECTED_OPEN_BRACKET;
+
+    result = get_token(ctx);
+    while (result == EVAL_RESULT_OK && ctx->token.type != EVAL_TOKEN_TYPE_CLOSE_BRACKET)
+    {
+        int minus = 0;
+
+        if (nr_items)
+        {
+            if (ctx->token.type != EVAL_TOKEN_TYPE_COMMA)
+            {
+                result = EVAL_RESULT_EXPECTED_CLOSE_BRACKET;
+                break;
+            }
+            result = get_token(ctx);
+            if (result != EVAL_RESULT_OK)
+                break;
+        }
+
+        if (ctx->token.type == EVAL_TOKEN_TYPE_SUBTRACT)
+        {
+            minus = 1;
+            result = get_token(ctx);
+            if (result != EVAL_RESULT_OK)
+                break;
+        }
+
+        if (ctx->token.type != EVAL_TOKEN_TYPE_NUMBER && (minus || ctx->token.type != EVAL_TOKEN_TYPE_STRING))
+        {
+            result = EVAL_RESULT_UNEXPECTED_CHAR;
+            break;
+        }
+
+        if (b && nr_items == capacity)
+        {
+            if (parser_grow((void **)&items, &capacity, inline_items, sizeof(unsigned int)) != EVAL_RESULT_OK)
+            {
+                result = EVAL_RESULT_OOM;
+                break;
+            }
+        }
+
+        if (ctx->token.type == EVAL_TOKEN_TYPE_NUMBER)
+        {
+            double value = minus ? -ctx->token.v.number : ctx->token.v.number;
+            size_t index;
+
+            if (!b)
+            {
+                found |= set_item_equal(p->values[p->nr_values - 1], NULL, 0, value);
+            }
+            else if ((result = builder_number(b, value, &index)) == EVAL_RESULT_OK)
+            {
+                items[nr_items] = (unsigned int)index | EVAL_SET_NUMBER;
+            }
+        }
+        else if (!b)
+        {
+            found |= set_item_equal(p->values[p->nr_values - 1], ctx->token.v.slice.text, ctx->token.v.slice.length, 0);
+        }
+        else
+        {
+            size_t offset;
+
+            result = builder_pool_string(b, ctx->token.v.slice.text, ctx->token.v.slice.length, EVAL_SYMBOL_NONE,
+                                         &offset);
+            items[nr_items] = (unsigned int)offset;
+        }
+        nr_items++;
+
+        if (result == EVAL_RESULT_OK)
+            result = get_token(ctx);
+    }
+
+    if (result == EVAL_RESULT_OK)
+        result = get_token(ctx);
+
+    if (result == EVAL_RESULT_OK)
+    {
+        if (b)
+        {
+            result = builder_add_set(b, items, nr_items, negate);
+        }
+        else
+        {
+            eval_value_clear(p->values + p->nr_values - 1);
+            p->values[p->nr_values - 1] = eval_value_number(found != negate);
+        }
+    }
+
+    if (items != inline_items)
+        EVAL_FREE(items);
+
+    return result;
+}
+
+/* where the token after the current one starts, without reading it */
+static const char *parser_next(const EvalContext *ctx)
+{
+    return scan_spaces(ctx->input, ctx->end);
+}
+
+/*
+ * name = at the start of a statement binds the name to the statement's slot,
+ * which the statements after it see. name == is a comparison.
+ */
+static EvalResult parser_assign(EvalContext *ctx, EvalParser *p)
+{
+    const char *next = parser_next(ctx);
+    EvalLocal *local;
+
+    if (ctx->token.type != EVAL_TOKEN_TYPE_FUNC || next == ctx->end || *next != '=' ||
+        (next + 1 != ctx->end && next[1] == '='))
+        return EVAL_RESULT_OK;
+
+    if (p->nr_locals == p->locals_capacity &&
+        parser_grow((void **)&(p->locals), &(p->locals_capacity), p->inline_locals, sizeof(EvalLocal)) != EVAL_RESULT_OK)
+        return EVAL_RESULT_OOM;
+
+    local = p->locals + p->nr_locals++;
+    local->text = ctx->token.v.slice.text;
+    local->length = ctx->token.v.slice.length;
+    local->slot = p->nr_slots;
+    ctx->input = next + 1;
+
+    return get_token(ctx);
+}
+
+/* the slot of the local a name refers to, the latest binding of a finished statement, unless it is called */
+static size_t parser_find_local(const EvalContext *ctx, const EvalParser *p)
+{
+    const char *next;
+    size_t i = p->nr_locals;
+
+    if (p->nr_slots == 0)
+        return EVAL_NO_LOCAL;
+
+    next = parser_next(ctx);
+    if (next != ctx->end && *next == '(')
+        return EVAL_NO_LOCAL;
+
+    while (i--)
+    {
+        const EvalLocal *local = p->locals + i;
+
+        if (local->slot < p->nr_slots && local->length == ctx->token.v.slice.length &&
+            memcmp(local->text, ctx->token.v.slice.text, local->length) == 0)
+            return local->slot;
+    }
+
+    return EVAL_NO_LOCAL;
+}
+
+/* a copy of the value in a slot */
+static EvalResult parser_local(EvalParser *p, EvalBuilder *b, size_t slot)
+{
+    EvalValue *value;
+
+    if (b)
+        return builder_emit(b, EVAL_OP_LOCAL, slot);
+
+    value = parser_push_value(p);
+    if (value == NULL)
+        return EVAL_RESULT_OOM;
+
+    return value_copy(p->values[slot], value);
+}
+
+/* the code that clears the slots under the value of the last statement */
+static EvalResult parser_return(EvalParser *p, EvalBuilder *b)
+{
+    EvalResult result;
+    size_t entry;
+    size_t i;
+
+    result = builder_add_return(b, p->nr_slots, &entry);
+    for (i = 0; i < p->nr_locals && result == EVAL_RESULT_OK; i++)
+    {
+        if (p->locals[i].slot < p->nr_slots)
+            result = builder_name_local(b, entry, p->locals[i].slot, p->locals[i].text, p->locals[i].length);
+    }
+
+    return result;
+}
+
+/*
+ * Evaluates into output, or emits code into b when it is not NULL. The token
+ * after the expression is left in ctx for the caller to check.
+ */
+static EvalResult parse(EvalContext *ctx, EvalBuilder *b, ExprValue *output)
+{
+    EvalParser p;
+    EvalResult result;
+    EvalFrame *frame;
+    unsigned int precedence;
+    size_t flags;
+    size_t slot;
+
+    parser_init(&p);
+
+    result = parser_enter(ctx);
+    if (result == EVAL_RESULT_OK)
+        result = parser_assign(ctx, &p);
+    while (result == EVAL_RESULT_OK)
+    {
+        /* an operand: prefix operators toggle, then a term */
+        flags = 0;
+        for (;;)
+        {
+            if (ctx->token.type == EVAL_TOKEN_TYPE_NOT)
+                flags ^= EVAL_UNARY_NOT;
+            else if (ctx->token.type == EVAL_TOKEN_TYPE_BITS_NOT)
+                flags ^= EVAL_UNARY_BITS_NOT;
+            else if (ctx->token.type == EVAL_TOKEN_TYPE_SUBTRACT)
+                flags ^= EVAL_UNARY_NEG;
+            else
+                break;
+
+            result = get_token(ctx);
+            if (result != EVAL_RESULT_OK)
+                break;
+        }
+        if (result != EVAL_RESULT_OK)
+            break;
+
+        if (ctx->token.type == EVAL_TOKEN_TYPE_OPEN_BRACKET)
+        {
+            result = get_token(ctx);
+            if (result == EVAL_RESULT_OK)
+                result = parser_enter(ctx);
+            if (result != EVAL_RESULT_OK)
+                break;
+
+            frame = parser_push_frame(&p, EVAL_FRAME_GROUP);
+            if (frame == NULL)
+            {
+                result = EVAL_RESULT_OOM;
+                break;
+            }
+            frame->flags = flags;
+            continue;
+        }
+        if (ctx->token.type != EVAL_TOKEN_TYPE_FUNC)
+        {
+            result = parser_operand(ctx, &p, b);
+        }
+        else if ((slot = parser_find_local(ctx, &p)) != EVAL_NO_LOCAL)
+        {
+            result = parser_local(&p, b, slot);
+        }
+        else
+        {
+            result = parser_call(ctx, &p, b, flags);
+            continue;
+        }
+        if (result == EVAL_RESULT_OK)
+            result = get_token(ctx);
+        if (result == EVAL_RESULT_OK)
+            result = parser_unary(&p, b, flags);
+
+        /* operators: reduce, then either expect another operand or close a level */
+        while (result == EVAL_RESULT_OK)
+        {
+            /* a membership test binds like == and is a complete term once its list is read */
+            if (parser_is_in(ctx))
+            {
+                result = parser_reduce(&p, b, EVAL_PRECEDENCE[EVAL_TOKEN_TYPE_E]);
+                if (result == EVAL_RESULT_OK)
+                    result = parser_in(ctx, &p, b);
+                continue;
+            }
+
+            precedence = EVAL_PRECEDENCE[ctx->token.type];
+
+            result = parser_reduce(&p, b, precedence);
+            if (result != EVAL_RESULT_OK)
+                break;
+
+            if (precedence)
+            {
+                frame = parser_push_frame(&p, EVAL_FRAME_BINARY);
+                if (frame == NULL)
+                {
+                    result = EVAL_RESULT_OOM;
+                    break;
+                }
+                frame->op = ctx->token.type;
+                result = get_token(ctx);
+                break;
+            }
+
+            if (ctx->token.type == EVAL_TOKEN_TYPE_COMMA && p.nr_frames &&
+                p.frames[p.nr_frames - 1].type == EVAL_FRAME_CALL)
+            {
+                result = parser_comma(ctx, &p, b);
+                break;
+            }
+
+            /* a finished statement's value stays on the stack as its slot */
+            if (p.nr_frames == 0 && ctx->token.type == EVAL_TOKEN_TYPE_SEMICOLON)
+            {
+                p.nr_slots++;
+                result = get_token(ctx);
+                if (result == EVAL_RESULT_OK)
+                    result = parser_assign(ctx, &p);
+                break;
+            }
+
+            if (p.nr_frames == 0)
+            {
+                ctx->stack_level--;
+                if (b && p.nr_slots)
+                    result = parser_return(&p, b);
+                else if (!b)
+                    eval_value_to_expr(p.values + --p.nr_values, output);
+                parser_deinit(&p);
+                return result;
+            }
+
+            result = parser_close(ctx, &p, b);
+        }
+    }
+
+    parser_deinit(&p);
+
+    return result;
+}
+
+EvalResult eval_compile(const char *expression, EvalProgram **program)
+{
+    EvalContext ctx;
+    EvalBuilder b;
+    EvalResult result;
+
+    *program = NULL;
+
+    result = expr_str_init(&ctx.str, 100);
+    if (result != EVAL_RESULT_OK)
+        return result;
+
+    ctx.hooks = NULL;
+    ctx.user_data = NULL;
+    ctx.input = expression;
+    ctx.end = expression + strlen(expression);
+    ctx.stack_level = 0;
+    ctx.meter = NULL;
+    builder_init(&b);
+
+    result = get_token(&ctx);
+    if (result == EVAL_RESULT_OK)
+        result = parse(&ctx, &b, NULL);
+    if (result == EVAL_RESULT_OK && ctx.token.type != EVAL_TOKEN_TYPE_END)
+        result = EVAL_RESULT_UNEXPECTED_CHAR;
+    if (result == EVAL_RESULT_OK)
+        result = builder_finish(&b, program);
+
+    builder_deinit(&b);
+    expr_str_clear(&ctx.str);
+
+    return result;
+}
+
+void eval_program_destroy(EvalProgram *program)
+{
+    EVAL_FREE(program);
+}
+
+static EvalResult program_call(EvalSymbol symbol, const char *name, const EvalHooks *hooks, void *user_data,
+                               EvalValue *value)
+{
+    EvalFunc func;
+    EvalResult result;
+    ExprValue output;
+
+    if (!hooks || (!hooks->get_func && !hooks->get_func_symbol))
+        return EVAL_RESULT_UNDEFINED_FUNCTION;
+
+    func = hook_get_func(hooks, symbol, name, user_data);
+    if (!func)
+        return EVAL_RESULT_UNDEFINED_FUNCTION;
+
+    expr_value_init(&output);
+    result = hook_call_value(func, name, value, user_data, &output);
+    if (result != EVAL_RESULT_OK)
+    {
+        /* a suspended call is made again with the same argument */
+        if (result != EVAL_RESULT_PENDING)
+            eval_value_clear(value);
+        expr_value_clear(&output);
+        return result;
+    }
+
+    eval_value_clear(value);
+    eval_value_from_expr(value, &output);
+
+    return EVAL_RESULT_OK;
+}
+
+static EvalBuiltinEntry program_builtin(const EvalProgram *program, size_t offset, EvalNeedle *needle)
+{
+    EvalBuiltinEntry entry;
+
+    memcpy(&entry, program_pool(program) + offset, sizeof(entry));
+    if (entry.needle != EVAL_NO_NEEDLE)
+    {
+        needle->str = program_string(program, entry.needle, &(needle->len));
+        needle->first = entry.first;
+        needle->second = entry.second;
+        needle->symbol = program_symbol(program, entry.needle);
+    }
+    else
+    {
+        needle->str = NULL;
+        needle->len = 0;
+    }
+
+    return entry;
+}
+
+/* the arguments at the top of the stack become the result */
+static EvalResult program_run_builtin(const EvalProgram *program, size_t offset, EvalValue *stack, size_t *sp)
+{
+    EvalNeedle needle;
+    EvalBuiltinEntry entry = program_builtin(program, offset, &needle);
+    int literal = entry.needle != EVAL_NO_NEEDLE;
+
+    *sp -= entry.nr_args - literal - 1;
+
+    return builtin_run(entry.builtin, stack + *sp - 1, entry.nr_args, literal ? &needle : NULL);
+}
+
+static EvalResult program_load_column(const EvalRowSet *rows, size_t column, size_t row, EvalValue *output)
+{
+    const EvalColumn *c = rows->columns + column;
+
+    if (c->type == EXPR_VALUE_TYPE_NUMBER)
+    {
+        *output = eval_value_number(c->numbers[row]);
+        return EVAL_RESULT_OK;
+    }
+
+    if (c->strings[row] == NULL)
+        return eval_value_set_string(output, "", 0);
+
+    return eval_value_set_string(output, c->strings[row], strlen(c->strings[row]));
+}
+
+static EvalResult program_get_variable(const EvalHooks *hooks, EvalSymbol symbol, const char *name, void *user_data,
+                                       EvalValue *output)
+{
+    ExprValue value;
+    EvalResult result;
+
+    expr_value_init(&value);
+    result = hook_get_variable(hooks, symbol, name, user_data, &value);
+    eval_value_from_expr(output, &value);
+
+    return result;
+}
+
+/*
+ * runs the program from instruction *pc with *top values on the stack and
+ * leaves the result at the bottom of the stack. A hook that answers
+ * EVAL_RESULT_PENDING stops it at that instruction with the stack as it was
+ * before it and *pc and *top updated, any other failure clears the stack.
+ */
+static EvalResult program_resume(EvalExecContext *ctx, const EvalProgram *program, const EvalHooks *hooks,
+                                 void *user_data, size_t *pc, size_t *top)
+{
+    const EvalCode *code = program_code(program);
+    const double *numbers = program_numbers(program);
+    const size_t *bindings = (ctx->program == program) ? ctx->bindings : NULL;
+    EvalMeter *meter = eval_meter;
+    EvalValue *stack = ctx->stack;
+    EvalResult result = EVAL_RESULT_OK;
+    size_t sp = *top;
+    size_t i;
+
+    for (i = *pc; i < program->nr_code; i++)
+    {
+        size_t arg = EVAL_CODE_ARG(code[i]);
+
+        if (meter && (result = meter_charge(meter)) != EVAL_RESULT_OK)
+            break;
+
+        switch (EVAL_CODE_OP(code[i]))
+        {
+        case EVAL_OP_NUMBER:
+            stack[sp++] = eval_value_number(numbers[arg]);
+            break;
+        case EVAL_OP_STRING:
+        {
+            size_t len;
+            const char *str = program_string(program, arg, &len);
+
+            stack[sp] = 0;
+            result = eval_value_set_string(stack + sp++, str, len);
+            break;
+        }
+        case EVAL_OP_VARIABLE:
+            stack[sp] = 0;
+            if (bindings && bindings[i] != EVAL_NO_COLUMN)
+                result = program_load_column(ctx->rows, bindings[i], ctx->row, stack + sp);
+            else if (!hooks || (!hooks->get_variable && !hooks->get_variable_symbol))
+                result = EVAL_RESULT_UNDEFINED_VARIABLE;
+            else
+                result = program_get_variable(hooks, program_symbol(program, arg), program_string(program, arg, NULL),
+                                              user_data, stack + sp);
+            sp++;
+            break;
+        case EVAL_OP_CALL:
+            result = program_call(program_symbol(program, arg), program_string(program, arg, NULL), hooks, user_data,
+                                  stack + sp - 1);
+            break;
+        case EVAL_OP_UNARY:
+            value_unary(stack + sp - 1, arg);
+            break;
+        case EVAL_OP_BINARY:
+            result = value_op(stack + sp - 2, stack + sp - 1, (EvalTokenType)arg);
+            eval_value_clear(stack + --sp);
+            break;
+        case EVAL_OP_BUILTIN:
+            result = program_run_builtin(program, arg, stack, &sp);
+            break;
+        case EVAL_OP_IN:
+        {
+            int ret = set_test_value(program, arg, stack[sp - 1]);
+
+            eval_value_clear(stack + sp - 1);
+            stack[sp - 1] = eval_value_number(ret);
+            break;
+        }
+        case EVAL_OP_LOCAL:
+            result = value_copy(stack[arg], stack + sp++);
+            break;
+        case EVAL_OP_RETURN:
+        {
+            EvalValue last = stack[--sp];
+            size_t nr_slots;
+
+            program_locals(program, arg, &nr_slots);
+            while (nr_slots--)
+                eval_value_clear(stack + --sp);
+            stack[sp++] = last;
+            break;
+        }
+        }
+
+        if (result != EVAL_RESULT_OK)
+            break;
+    }
+
+    if (result == EVAL_RESULT_PENDING)
+    {
+        if (EVAL_CODE_OP(code[i]) == EVAL_OP_VARIABLE)
+            eval_value_clear(stack + --sp);
+        *pc = i;
+        *top = sp;
+        return result;
+    }
+
+    if (result != EVAL_RESULT_OK)
+    {
+        while (sp)
+            eval_value_clear(stack + --sp);
+    }
+
+    return result;
+}
+
+static EvalResult program_run(EvalExecContext *ctx, const EvalProgram *program, const EvalHooks *hooks,
+                              void *user_data, EvalValue *output)
+{
+    EvalResult result;
+    size_t pc = 0;
+    size_t sp = 0;
+
+    result = program_resume(ctx, program, hooks, user_data, &pc, &sp);
+    if (result == EVAL_RESULT_OK)
+        *output = ctx->stack[0];
+
+    return result;
+}
+
+void eval_exec_context_init(EvalExecContext *ctx)
+{
+    memset(ctx, 0x00, sizeof(EvalExecContext));
+}
+
+void eval_exec_context_deinit(EvalExecContext *ctx)
+{
+    EVAL_FREE(ctx->stack);
+    EVAL_FREE(ctx->bindings);
+    memset(ctx, 0x00, sizeof(EvalExecContext));
+}
+
+EvalResult eval_exec_context_bind(EvalExecContext *ctx, const EvalProgram *program, const EvalRowSet *rows)
+{
+    const EvalCode *code = program_code(program);
+    size_t *bindings;
+    size_t i;
+    size_t j;
+
+    bindings = (size_t *)EVAL_REALLOC(ctx->bindings, program->nr_code * sizeof(size_t));
+    if (bindings == NULL)
+        return EVAL_RESULT_OOM;
+
+    for (i = 0; i < program->nr_code; i++)
+    {
+        bindings[i] = EVAL_NO_COLUMN;
+        if (EVAL_CODE_OP(code[i]) != EVAL_OP_VARIABLE)
+            continue;
+
+        for (j = 0; j < rows->nr_columns; j++)
+        {
+            if (strcmp(rows->columns[j].name, program_string(program, EVAL_CODE_ARG(code[i]), NULL)) == 0)
+            {
+                bindings[i] = j;
+                break;
+            }
+        }
+    }
+
+    ctx->bindings = bindings;
+    ctx->program = program;
+    ctx->rows = rows;
+    ctx->row = 0;
+
+    return EVAL_RESULT_OK;
+}
+
+int eval_program_uses_variable(const EvalProgram *program, const char *name)
+{
+    const EvalCode *code = program_code(program);
+    size_t i;
+
+    for (i = 0; i < program->nr_code; i++)
+    {
+        if (EVAL_CODE_OP(code[i]) == EVAL_OP_VARIABLE &&
+            strcmp(program_string(program, EVAL_CODE_ARG(code[i]), NULL), name) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+void eval_exec_context_set_row(EvalExecContext *ctx, size_t row)
+{
+    ctx->row = row;
+}
+
+EvalResult eval_program_execute_value_in(EvalExecContext *ctx, const EvalProgram *program, const EvalHooks *hooks,
+                                         void *user_data, EvalValue *output)
+{
+    if (program->max_stack > ctx->capacity)
+    {
+        EvalValue *stack = (EvalValue *)EVAL_REALLOC(ctx->stack, program->max_stack * sizeof(EvalValue));
+        if (stack == NULL)
+            return EVAL_RESULT_OOM;
+
+        ctx->stack = stack;
+        ctx->capacity = program->max_stack;
+    }
+
+    return program_run(ctx, program, hooks, user_data, output);
+}
+
+EvalResult eval_program_execute_in(EvalExecContext *ctx, const EvalProgram *program, const EvalHooks *hooks,
+                                   void *user_data, ExprValue *output)
+{
+    EvalValue value;
+    EvalResult result = eval_program_execute_value_in(ctx, program, hooks, user_data, &value);
+
+    if (result == EVAL_RESULT_OK)
+        eval_value_to_expr(&value, output);
+
+    return result;
+}
+
+EvalResult eval_program_execute(const EvalProgram *program, const EvalHooks *hooks,
+                                void *user_data, ExprValue *output)
+{
+    EvalValue local[EVAL_PROGRAM_STACK_SIZE];
+    EvalExecContext ctx;
+    EvalResult result;
+
+    eval_exec_context_init(&ctx);
+    if (program->max_stack <= EVAL_PROGRAM_STACK_SIZE)
+    {
+        ctx.stack = local;
+        ctx.capacity = EVAL_PROGRAM_STACK_SIZE;
+    }
+
+    result = eval_program_execute_in(&ctx, program, hooks, user_data, output);
+
+    if (ctx.stack == local)
+        ctx.stack = NULL;
+    eval_exec_context_deinit(&ctx);
+
+    return result;
+}
+
+EvalResult eval_program_execute_ex(const EvalProgram *program, const EvalHooks *hooks, void *user_data,
+                                   const EvalOptions *options, ExprValue *output)
+{
+    EvalResult result;
+    EvalMeter meter;
+    EvalMeter *previous_meter = meter_begin(&meter, options);
+#ifdef EVAL_ENABLE_STATS
+    EvalTracer tracer;
+    EvalTracer *previous = trace_begin(&tracer, options);
+
+    result = eval_program_execute(program, hooks, user_data, output);
+    trace_end(&tracer, previous, options);
+#else
+    if (options && options->stats)
+        memset(options->stats, 0x00, sizeof(EvalStats));
+    result = eval_program_execute(program, hooks, user_data, output);
+#endif
+    meter_end(&meter, previous_meter, options);
+
+    return result;
+}
+
+/*
+ * Suspended evaluations.
+ *
+ * A hook that cannot answer yet returns EVAL_RESULT_PENDING. Programs keep
+ * all of their state in the code index and the value stack, so suspending one
+ * copies the stack into a continuation and resuming it carries on from the
+ * instruction that waited. Nothing is allocated until a hook actually
+ * suspends. Expressions are compiled first and the continuation owns the
+ * program.
+ */
+
+struct _EvalContinuation
+{
+    EvalExecContext ctx;
+    const EvalProgram *program;
+    EvalProgram *owned;
+    const EvalHooks *hooks;
+    void *user_data;
+    size_t pc;
+    size_t sp;
+};
+
+static EvalResult continuation_run(EvalContinuation *c, ExprValue *output)
+{
+    EvalResult result = program_resume(&c->ctx, c->program, c->hooks, c->user_data, &c->pc, &c->sp);
+
+    if (result == EVAL_RESULT_PENDING)
+        return result;
+
+    c->sp = 0;
+    if (result == EVAL_RESULT_OK)
+        eval_value_to_expr(c->ctx.stack, output);
+
+    return result;
+}
+
+/* the stack lives right after the continuation, in the same block */
+static EvalContinuation *continuation_save(const EvalContinuation *c)
+{
+    size_t size = sizeof(EvalContinuation) + c->program->max_stack * sizeof(EvalValue);
+    EvalContinuation *saved = (EvalContinuation *)EVAL_REALLOC(NULL, size);
+
+    if (saved == NULL)
+        return NULL;
+
+    *saved = *c;
+    saved->ctx.stack = (EvalValue *)(saved + 1);
+    saved->ctx.capacity = c->program->max_stack;
+    memcpy(saved->ctx.stack, c->ctx.stack, c->sp * sizeof(EvalValue));
+
+    return saved;
+}
+
+static EvalResult continuation_start(const EvalProgram *program, EvalProgram *owned, const EvalHooks *hooks,
+                                     void *user_data, ExprValue *output, EvalContinuation **continuation)
+{
+    EvalValue local[EVAL_PROGRAM_STACK_SIZE];
+    EvalContinuation c;
+    EvalResult result = EVAL_RESULT_OOM;
+
+    memset(&c, 0x00, sizeof(c));
+    c.program = program;
+    c.owned = owned;
+    c.hooks = hooks;
+    c.user_data = user_data;
+    c.ctx.stack = local;
+    if (program->max_stack > EVAL_PROGRAM_STACK_SIZE)
+        c.ctx.stack = (EvalValue *)EVAL_REALLOC(NULL, program->max_stack * sizeof(EvalValue));
+
+    if (c.ctx.stack != NULL)
+    {
+        result = continuation_run(&c, output);
+        if (result == EVAL_RESULT_PENDING && (*continuation = continuation_save(&c)) == NULL)
+        {
+            while (c.sp)
+                eval_value_clear(c.ctx.stack + --c.sp);
+            result = EVAL_RESULT_OOM;
+        }
+
+        if (c.ctx.stack != local)
+            EVAL_FREE(c.ctx.stack);
+    }
+
+    if (result != EVAL_RESULT_PENDING)
+        eval_program_destroy(owned);
+
+    return result;
+}
+
+EvalResult eval_execute_async(const char *expression, const EvalHooks *hooks, void *user_data, ExprValue *output,
+                              EvalContinuation **continuation)
+{
+    EvalProgram *program = NULL;
+    EvalResult result;
+
+    *continuation = NULL;
+    result = eval_compile(expression, &program);
+    if (result != EVAL_RESULT_OK)
+        return result;
+
+    return continuation_start(program, program, hooks, user_data, output, continuation);
+}
+
+EvalResult eval_program_execute_async(const EvalProgram *program, const EvalHooks *hooks, void *user_data,
+                                      ExprValue *output, EvalContinuation **continuation)
+{
+    *continuation = NULL;
+
+    return continuation_start(program, NULL, hooks, user_data, output, continuation);
+}
+
+EvalResult eval_continuation_resume(EvalContinuation *continuation, ExprValue *value, ExprValue *output)
+{
+    EvalContinuation *c = continuation;
+    EvalResult result;
+
+    if (value != NULL && expr_value_adopt(value) != EVAL_RESULT_OK)
+    {
+        eval_continuation_destroy(c);
+        return EVAL_RESULT_OOM;
+    }
+
+    if (value != NULL)
+    {
+        /* the value takes the place of the hook's output and the instruction is done */
+        if (EVAL_CODE_OP(program_code(c->program)[c->pc]) == EVAL_OP_VARIABLE)
+            c->sp++;
+        else
+            eval_value_clear(c->ctx.stack + c->sp - 1);
+        eval_value_from_expr(c->ctx.stack + c->sp - 1, value);
+        c->pc++;
+    }
+
+    result = continuation_run(c, output);
+    if (result != EVAL_RESULT_PENDING)
+        eval_continuation_destroy(c);
+
+    return result;
+}
+
+const char *eval_continuation_name(const EvalContinuation *continuation)
+{
+    const EvalCode *code = program_code(continuation->program);
+
+    return program_string(continuation->program, EVAL_CODE_ARG(code[continuation->pc]), NULL);
+}
+
+void eval_continuation_destroy(EvalContinuation *continuation)
+{
+    if (continuation == NULL)
+        return;
+
+    while (continuation->sp)
+        eval_value_clear(continuation->ctx.stack + --continuation->sp);
+    eval_program_destroy(continuation->owned);
+    EVAL_FREE(continuation);
+}
+
+/*
+ * Predicate filters.
+ *
+ * eval_program_filter() evaluates a predicate for a range of rows and sets one
+ * bit per row. Programs that only use numeric columns, constants, arithmetic,
+ * comparisons, &&, || and ! run 64 rows at a time: comparisons become SIMD
+ * compares whose results are packed into a 64 bit mask and &&/|| become mask
+ * AND/OR. String columns may be compared with string constants and any
+ * column tested against a membership set. Any other program falls back to
+ * evaluating row by row, with identical results.
+ */
+
+#define EVAL_FILTER_BLOCK           64
+
+typedef enum {
+    EVAL_LANE_NUMBER,
+    EVAL_LANE_NUMBERS,
+    EVAL_LANE_MASK,
+    EVAL_LANE_STRING,
+    EVAL_LANE_STRINGS
+} EvalLaneKind;
+
+typedef struct
+{
+    EvalLaneKind kind;
+    double number;
+    const double *numbers;
+    EvalMask mask;
+    const char *str;
+    const char *const *strings;
+    double buff[EVAL_FILTER_BLOCK];
+} EvalLane;
+
+static EvalMask mask_first(size_t n)
+{
+    return n >= EVAL_FILTER_BLOCK ? ~(EvalMask)0 : (((EvalMask)1 << n) - 1);
+}
+
+/* the kinds each instruction produces, or -1 when the block evaluator cannot run the program */
+static int filter_plan(const EvalProgram *program, const size_t *bindings, const EvalRowSet *rows, EvalLaneKind *kinds)
+{
+    const EvalCode *code = program_code(program);
+    size_t sp = 0;
+    size_t i;
+
+    for (i = 0; i < program->nr_code; i++)
+    {
+        size_t arg = EVAL_CODE_ARG(code[i]);
+
+        switch (EVAL_CODE_OP(code[i]))
+        {
+        case EVAL_OP_NUMBER:
+            kinds[sp++] = EVAL_LANE_NUMBER;
+            break;
+        case EVAL_OP_STRING:
+            kinds[sp++] = EVAL_LANE_STRING;
+            break;
+        case EVAL_OP_VARIABLE:
+            if (bindings == NULL || bindings[i] == EVAL_NO_COLUMN)
+                return -1;
+            kinds[sp++] = rows->columns[bindings[i]].type == EXPR_VALUE_TYPE_NUMBER ? EVAL_LANE_NUMBERS : EVAL_LANE_STRINGS;
+            break;
+        case EVAL_OP_UNARY:
+        {
+            EvalLaneKind k = kinds[sp - 1];
+
+            if (k == EVAL_LANE_STRING || k == EVAL_LANE_STRINGS)
+                kinds[sp - 1] = (arg & EVAL_UNARY_NOT) ? (k == EVAL_LANE_STRING ? EVAL_LANE_NUMBER : EVAL_LANE_MASK) : k;
+            else if (arg & EVAL_UNARY_BITS_NOT)
+                return -1;
+            else if (k != EVAL_LANE_NUMBER)
+                kinds[sp - 1] = (arg & EVAL_UNARY_NOT) ? EVAL_LANE_MASK : EVAL_LANE_NUMBERS;
+            break;
+        }
+        case EVAL_OP_IN:
+            kinds[sp - 1] = (kinds[sp - 1] == EVAL_LANE_NUMBER || kinds[sp - 1] == EVAL_LANE_STRING) ? EVAL_LANE_NUMBER
+                                                                                                     : EVAL_LANE_MASK;
             break;
+        case EVAL_OP_BINARY:
+        {
+            EvalLaneKind a = kinds[sp - 2];
+            EvalLaneKind b = kinds[sp - 1];
+            int a_str = a == EVAL_LANE_STRING || a == EVAL_LANE_STRINGS;
+            int b_str = b == EVAL_LANE_STRING || b == EVAL_LANE_STRINGS;
+
+            sp--;
+            if (arg == EVAL_TOKEN_TYPE_BITS_AND || arg == EVAL_TOKEN_TYPE_BITS_OR || a_str != b_str)
+                return -1;
+
+            if (a_str)
+            {
+                if (!is_logic_op((int)arg) || arg == EVAL_TOKEN_TYPE_AND || arg == EVAL_TOKEN_TYPE_OR)
+                    return -1;
+                kinds[sp - 1] = (a == EVAL_LANE_STRING && b == EVAL_LANE_STRING) ? EVAL_LANE_NUMBER : EVAL_LANE_MASK;
+            }
+            else if (a == EVAL_LANE_NUMBER && b == EVAL_LANE_NUMBER)
+            {
+                kinds[sp - 1] = EVAL_LANE_NUMBER;
+            }
+            else
+            {
+                kinds[sp - 1] = is_logic_op((int)arg) ? EVAL_LANE_MASK : EVAL_LANE_NUMBERS;
+            }
+            break;
+        }
+        default:
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+#ifdef EVAL_HAVE_SSE2
+#define EVAL_FILTER_COMPARE(name, sse, expr)                                         \
+    static EvalMask name(const double *a, const double *b, size_t n)                 \
+    {                                                                                \
+        EvalMask m = 0;                                                              \
+        size_t i = 0;                                                                \
+        for (; i + 2 <= n; i += 2)                                                   \
+        {                                                                            \
+            __m128d r = sse(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));               \
+            m |= (EvalMask)_mm_movemask_pd(r) << i;                                  \
+        }                                                                            \
+        for (; i < n; i++)                                                           \
+            m |= (EvalMask)(expr) << i;                                              \
+        return m;                                                                    \
+    }
+#else
+#define EVAL_FILTER_COMPARE(name, sse, expr)                                         \
+    static EvalMask name(const double *a, const double *b, size_t n)                 \
+    {                                                                                \
+        EvalMask m = 0;                                                              \
+        size_t i;                                                                    \
+        for (i = 0; i < n; i++)                                                      \
+            m |= (EvalMask)(expr) << i;                                              \
+        return m;                                                                    \
+    }
+#endif
+
+EVAL_FILTER_COMPARE(compare_e, _mm_cmpeq_pd, a[i] == b[i])
+EVAL_FILTER_COMPARE(compare_ne, _mm_cmpneq_pd, a[i] != b[i])
+EVAL_FILTER_COMPARE(compare_g, _mm_cmpgt_pd, a[i] > b[i])
+EVAL_FILTER_COMPARE(compare_ge, _mm_cmpge_pd, a[i] >= b[i])
+EVAL_FILTER_COMPARE(compare_l, _mm_cmplt_pd, a[i] < b[i])
+EVAL_FILTER_COMPARE(compare_le, _mm_cmple_pd, a[i] <= b[i])
+
+static const double EVAL_ZEROS[EVAL_FILTER_BLOCK];
+
+/* numbers of a lane, scalars and masks are expanded into the lane's buffer */
+static const double *lane_numbers(EvalLane *lane, size_t n)
+{
+    size_t i;
+
+    if (lane->kind == EVAL_LANE_NUMBERS)
+        return lane->numbers;
+
+    for (i = 0; i < n; i++)
+    {
+        lane->buff[i] = lane->kind == EVAL_LANE_MASK ? (double)((lane->mask >> i) & 1) : lane->number;
+    }
+
+    return lane->buff;
+}
+
+static EvalMask lane_truth(EvalLane *lane, size_t n)
+{
+    if (lane->kind == EVAL_LANE_MASK)
+        return lane->mask;
+    if (lane->kind == EVAL_LANE_NUMBER)
+        return lane->number ? mask_first(n) : 0;
+
+    return compare_ne(lane->numbers, EVAL_ZEROS, n);
+}
+
+static void lane_set_numbers(EvalLane *lane, const double *numbers)
+{
+    if (numbers != lane->buff)
+        memcpy(lane->buff, numbers, sizeof(lane->buff));
+    lane->numbers = lane->buff;
+    lane->kind = EVAL_LANE_NUMBERS;
+}
+
+static void lane_set_mask(EvalLane *lane, EvalMask mask)
+{
+    lane->mask = mask;
+    lane->kind = EVAL_LANE_MASK;
+}
+
+static int compare_strings(const char *a, const char *b, size_t op)
+{
+    int ret = strcmp(a ? a : "", b ? b : "");
+
+    switch (op)
+    {
+    case EVAL_TOKEN_TYPE_E:
+        return ret == 0;
+    case EVAL_TOKEN_TYPE_NE:
+        return ret != 0;
+    case EVAL_TOKEN_TYPE_G:
+        return ret > 0;
+    case EVAL_TOKEN_TYPE_GE:
+        return ret >= 0;
+    case EVAL_TOKEN_TYPE_L:
+        return ret < 0;
+    default:
+        return ret <= 0;
+    }
+}
+
+static void lane_binary(EvalLane *a, EvalLane *b, size_t op, size_t n)
+{
+    if (a->kind == EVAL_LANE_STRING || a->kind == EVAL_LANE_STRINGS)
+    {
+        EvalMask m = 0;
+        size_t i;
+
+        if (a->kind == EVAL_LANE_STRING && b->kind == EVAL_LANE_STRING)
+        {
+            a->number = compare_strings(a->str, b->str, op);
+            a->kind = EVAL_LANE_NUMBER;
+            return;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            const char *x = a->kind == EVAL_LANE_STRING ? a->str : a->strings[i];
+            const char *y = b->kind == EVAL_LANE_STRING ? b->str : b->strings[i];
+
+            m |= (EvalMask)compare_strings(x, y, op) << i;
         }
+
+        lane_set_mask(a, m);
+        return;
+    }
+
+    if (a->kind == EVAL_LANE_NUMBER && b->kind == EVAL_LANE_NUMBER)
+    {
+        a->number = number_op(a->number, b->number, (EvalTokenType)op);
+        return;
+    }
+
+    if (op == EVAL_TOKEN_TYPE_AND)
+    {
+        lane_set_mask(a, lane_truth(a, n) & lane_truth(b, n));
+    }
+    else if (op == EVAL_TOKEN_TYPE_OR)
+    {
+        lane_set_mask(a, lane_truth(a, n) | lane_truth(b, n));
+    }
+    else
+    {
+        const double *x = lane_numbers(a, n);
+        const double *y = lane_numbers(b, n);
+        size_t i;
+
+        switch (op)
+        {
+        case EVAL_TOKEN_TYPE_E:
+            lane_set_mask(a, compare_e(x, y, n));
+            break;
+        case EVAL_TOKEN_TYPE_NE:
+            lane_set_mask(a, compare_ne(x, y, n));
+            break;
+        case EVAL_TOKEN_TYPE_G:
+            lane_set_mask(a, compare_g(x, y, n));
+            break;
+        case EVAL_TOKEN_TYPE_GE:
+            lane_set_mask(a, compare_ge(x, y, n));
+            break;
+        case EVAL_TOKEN_TYPE_L:
+            lane_set_mask(a, compare_l(x, y, n));
+            break;
+        case EVAL_TOKEN_TYPE_LE:
+            lane_set_mask(a, compare_le(x, y, n));
+            break;
         case EVAL_TOKEN_TYPE_ADD:
+            for (i = 0; i < n; i++)
+                a->buff[i] = x[i] + y[i];
+            lane_set_numbers(a, a->buff);
+            break;
+        case EVAL_TOKEN_TYPE_SUBTRACT:
+            for (i = 0; i < n; i++)
+                a->buff[i] = x[i] - y[i];
+            lane_set_numbers(a, a->buff);
+            break;
+        case EVAL_TOKEN_TYPE_MULTIPLY:
+            for (i = 0; i < n; i++)
+                a->buff[i] = x[i] * y[i];
+            lane_set_numbers(a, a->buff);
+            break;
+        default:
+            for (i = 0; i < n; i++)
+                a->buff[i] = x[i] / y[i];
+            lane_set_numbers(a, a->buff);
+            break;
+        }
+    }
+}
+
+static void lane_unary(EvalLane *lane, size_t flags, size_t n)
+{
+    if (lane->kind == EVAL_LANE_STRING)
+    {
+        if (flags & EVAL_UNARY_NOT)
+        {
+            lane->number = !lane->str[0];
+            lane->kind = EVAL_LANE_NUMBER;
+        }
+    }
+    else if (lane->kind == EVAL_LANE_STRINGS)
+    {
+        if (flags & EVAL_UNARY_NOT)
+        {
+            EvalMask m = 0;
+            size_t i;
+
+            for (i = 0; i < n; i++)
+                m |= (EvalMask)(lane->strings[i] == NULL || lane->strings[i][0] == '\0') << i;
+
+            lane_set_mask(lane, m);
+        }
+    }
+    else if (lane->kind == EVAL_LANE_NUMBER)
+    {
+        lane->number = number_unary(lane->number, flags);
+    }
+    else if (flags & EVAL_UNARY_NOT)
+    {
+        /* -x is zero exactly when x is */
+        lane_set_mask(lane, ~lane_truth(lane, n) & mask_first(n));
+    }
+    else if (flags & EVAL_UNARY_NEG)
+    {
+        const double *x = lane_numbers(lane, n);
+        size_t i;
+
+        for (i = 0; i < n; i++)
+            lane->buff[i] = -x[i];
+        lane_set_numbers(lane, lane->buff);
+    }
+}
+
+/* a set is looked up row by row, the result packed into a mask */
+static void lane_in(const EvalProgram *program, size_t offset, EvalLane *lane, size_t n)
+{
+    EvalMask m = 0;
+    size_t i;
+
+    if (lane->kind == EVAL_LANE_STRING || lane->kind == EVAL_LANE_NUMBER)
+    {
+        lane->number = set_test(program, offset, lane->kind == EVAL_LANE_STRING ? lane->str : NULL, lane->number);
+        lane->kind = EVAL_LANE_NUMBER;
+        return;
+    }
+
+    if (lane->kind == EVAL_LANE_STRINGS)
+    {
+        for (i = 0; i < n; i++)
+            m |= (EvalMask)set_test(program, offset, lane->strings[i] ? lane->strings[i] : "", 0) << i;
+    }
+    else
+    {
+        const double *x = lane_numbers(lane, n);
+
+        for (i = 0; i < n; i++)
+            m |= (EvalMask)set_test(program, offset, NULL, x[i]) << i;
+    }
+
+    lane_set_mask(lane, m);
+}
+
+static EvalMask filter_block(const EvalProgram *program, const EvalExecContext *ctx, EvalLane *lanes,
+                             size_t base, size_t n)
+{
+    const EvalCode *code = program_code(program);
+    const double *numbers = program_numbers(program);
+    size_t sp = 0;
+    size_t i;
+
+    for (i = 0; i < program->nr_code; i++)
+    {
+        size_t arg = EVAL_CODE_ARG(code[i]);
+
+        switch (EVAL_CODE_OP(code[i]))
+        {
+        case EVAL_OP_NUMBER:
+            lanes[sp].kind = EVAL_LANE_NUMBER;
+            lanes[sp++].number = numbers[arg];
+            break;
+        case EVAL_OP_STRING:
+            lanes[sp].kind = EVAL_LANE_STRING;
+            lanes[sp++].str = program_string(program, arg, NULL);
+            break;
+        case EVAL_OP_VARIABLE:
         {
-            expr_value_append_string(a, b->v.str.str, b->v.str.size);
+            const EvalColumn *c = ctx->rows->columns + ctx->bindings[i];
+
+            if (c->type == EXPR_VALUE_TYPE_NUMBER)
+            {
+                lanes[sp].kind = EVAL_LANE_NUMBERS;
+                lanes[sp++].numbers = c->numbers + base;
+            }
+            else
+            {
+                lanes[sp].kind = EVAL_LANE_STRINGS;
+                lanes[sp++].strings = c->strings + base;
+            }
             break;
         }
-        case EVAL_TOKEN_TYPE_E:
+        case EVAL_OP_UNARY:
+            lane_unary(lanes + sp - 1, arg, n);
+            break;
+        case EVAL_OP_IN:
+            lane_in(program, arg, lanes + sp - 1, n);
+            break;
+        default:
+            sp--;
+            lane_binary(lanes + sp - 1, lanes + sp, arg, n);
+            break;
+        }
+    }
+
+    if (lanes[0].kind == EVAL_LANE_STRING)
+        return lanes[0].str[0] ? mask_first(n) : 0;
+
+    return lane_truth(lanes, n) & mask_first(n);
+}
+
+EvalResult eval_program_filter(EvalExecContext *ctx, const EvalProgram *program, const EvalHooks *hooks,
+                               void *user_data, size_t begin, size_t end, EvalMask *bitmap, size_t *failed_row)
+{
+    const size_t *bindings = (ctx->program == program) ? ctx->bindings : NULL;
+    EvalResult result = EVAL_RESULT_OK;
+    EvalLaneKind *kinds;
+    EvalLane *lanes = NULL;
+    size_t base;
+
+    kinds = (EvalLaneKind *)EVAL_MALLOC(program->max_stack * sizeof(EvalLaneKind));
+    if (kinds == NULL)
+        return EVAL_RESULT_OOM;
+
+    if (filter_plan(program, bindings, ctx->rows, kinds) == 0 && kinds[0] != EVAL_LANE_STRINGS)
+    {
+        lanes = (EvalLane *)EVAL_MALLOC(program->max_stack * sizeof(EvalLane));
+        if (lanes == NULL)
         {
-            int ret = strcmp(a->v.str.str, b->v.str.str) == 0;
-            expr_value_set_number(a, ret);
+            EVAL_FREE(kinds);
+            return EVAL_RESULT_OOM;
+        }
+    }
+    EVAL_FREE(kinds);
+
+    for (base = begin; base < end; base += EVAL_FILTER_BLOCK)
+    {
+        size_t n = end - base < EVAL_FILTER_BLOCK ? end - base : EVAL_FILTER_BLOCK;
+        EvalMask mask = 0;
+
+        if (lanes)
+        {
+            mask = filter_block(program, ctx, lanes, base, n);
+        }
+        else
+        {
+            ExprValue value;
+            size_t i;
+
+            expr_value_init(&value);
+            for (i = 0; i < n; i++)
+            {
+                EvalResult ret;
+
+                ctx->row = base + i;
+                ret = eval_program_execute_in(ctx, program, hooks, user_data, &value);
+                if (ret != EVAL_RESULT_OK)
+                {
+                    if (result == EVAL_RESULT_OK)
+                    {
+                        result = ret;
+                        *failed_row = base + i;
+                    }
+                    continue;
+                }
+
+                if (value.type == EXPR_VALUE_TYPE_STRING ? value.v.str.size != 0 : value.v.val != 0)
+                    mask |= (EvalMask)1 << i;
+                expr_value_clear(&value);
+            }
+        }
+
+        bitmap[(base - begin) / EVAL_FILTER_BLOCK] = mask;
+    }
+
+    EVAL_FREE(lanes);
+
+    return result;
+}
+
+size_t eval_bitmap_to_indexes(const EvalMask *bitmap, size_t nr_rows, size_t *indexes)
+{
+    size_t nr_words = (nr_rows + EVAL_FILTER_BLOCK - 1) / EVAL_FILTER_BLOCK;
+    size_t n = 0;
+    size_t i;
+
+    for (i = 0; i < nr_words; i++)
+    {
+        EvalMask m = bitmap[i];
+
+        while (m)
+        {
+            indexes[n++] = i * EVAL_FILTER_BLOCK + EVAL_CTZ64(m);
+            m &= m - 1;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Partial evaluation.
+ *
+ * The program is turned back into a tree (one node per instruction, children
+ * always precede their parent), constants are propagated bottom-up and the
+ * residual program is emitted from the root. A local's node refers to the
+ * statement it loads, whose value it shares. Each node also tracks the type
+ * its value is known to have, which decides whether && and || can be pruned
+ * without knowing the other operand: a number operand is converted to a
+ * non-empty string when the other side turns out to be a string.
+ */
+
+#define EVAL_NODE_NONE              ((size_t)-1)
+
+typedef enum {
+    EVAL_NODE_TYPE_UNKNOWN,
+    EVAL_NODE_TYPE_NUMBER,
+    EVAL_NODE_TYPE_STRING
+} EvalNodeType;
+
+typedef struct
+{
+    EvalCode code;
+    size_t lhs;
+    size_t rhs;
+    size_t third;               /* a builtin's third value on the stack */
+    size_t before;              /* the statement before this one, which a return also clears */
+    int is_const;
+    EvalNodeType type;
+    ExprValue value;
+} EvalNode;
+
+static EvalResult program_tree(const EvalProgram *program, EvalNode **tree)
+{
+    const EvalCode *code = program_code(program);
+    size_t *stack;
+    EvalNode *nodes;
+    size_t sp = 0;
+    size_t i;
+
+    nodes = (EvalNode *)eval_calloc(program->nr_code + 1, sizeof(EvalNode));
+    stack = (size_t *)EVAL_MALLOC((program->max_stack + 1) * sizeof(size_t));
+    if (nodes == NULL || stack == NULL)
+    {
+        EVAL_FREE(nodes);
+        EVAL_FREE(stack);
+        return EVAL_RESULT_OOM;
+    }
+
+    for (i = 0; i < program->nr_code; i++)
+    {
+        EvalNode *node = nodes + i;
+
+        node->code = code[i];
+        node->lhs = EVAL_NODE_NONE;
+        node->rhs = EVAL_NODE_NONE;
+        node->third = EVAL_NODE_NONE;
+        node->before = EVAL_NODE_NONE;
+        expr_value_init(&(node->value));
+
+        switch (EVAL_CODE_OP(code[i]))
+        {
+        case EVAL_OP_BUILTIN:
+        {
+            EvalNeedle needle;
+            EvalBuiltinEntry entry = program_builtin(program, EVAL_CODE_ARG(code[i]), &needle);
+            size_t nr_values = entry.nr_args - (entry.needle != EVAL_NO_NEEDLE);
+
+            if (nr_values > 2)
+                node->third = stack[--sp];
+            if (nr_values > 1)
+                node->rhs = stack[--sp];
+            node->lhs = stack[--sp];
             break;
         }
-        case EVAL_TOKEN_TYPE_G:
+        case EVAL_OP_BINARY:
+            node->rhs = stack[--sp];
+        /* fall through */
+        case EVAL_OP_CALL:
+        case EVAL_OP_UNARY:
+        case EVAL_OP_IN:
+            node->lhs = stack[--sp];
+            break;
+        case EVAL_OP_LOCAL:
+            node->lhs = stack[EVAL_CODE_ARG(code[i])];
+            break;
+        case EVAL_OP_RETURN:
+        {
+            size_t nr_slots;
+
+            program_locals(program, EVAL_CODE_ARG(code[i]), &nr_slots);
+            node->lhs = stack[--sp];
+            for (; nr_slots; nr_slots--, sp--)
+                nodes[stack[sp]].before = stack[sp - 1];
+            break;
+        }
+        default:
+            break;
+        }
+
+        stack[sp++] = i;
+    }
+
+    EVAL_FREE(stack);
+    *tree = nodes;
+
+    return EVAL_RESULT_OK;
+}
+
+static void program_tree_destroy(EvalNode *nodes, size_t nr_nodes)
+{
+    size_t i;
+
+    for (i = 0; i < nr_nodes; i++)
+    {
+        expr_value_clear(&(nodes[i].value));
+    }
+
+    EVAL_FREE(nodes);
+}
+
+static EvalNodeType node_value_type(const ExprValue *value)
+{
+    return value->type == EXPR_VALUE_TYPE_STRING ? EVAL_NODE_TYPE_STRING : EVAL_NODE_TYPE_NUMBER;
+}
+
+static EvalResult node_set_const(EvalNode *node, const ExprValue *value)
+{
+    EvalResult result = EVAL_RESULT_OK;
+
+    if (value->type == EXPR_VALUE_TYPE_STRING)
+        result = expr_value_set_string(&(node->value), value->v.str.str, value->v.str.size);
+    else
+        expr_value_set_number(&(node->value), value->v.val);
+
+    node->is_const = 1;
+    node->type = node_value_type(value);
+
+    return result;
+}
+
+/* value of (c op other) when it does not depend on other, -1 otherwise; other is dropped even when it would
+ * have failed or called a hook */
+static int node_prune(const EvalNode *c, const EvalNode *other, int op)
+{
+    if (op == EVAL_TOKEN_TYPE_AND)
+    {
+        if (c->value.type == EXPR_VALUE_TYPE_STRING)
+            return c->value.v.str.size ? -1 : 0;
+        if (c->value.v.val == 0 && other->type == EVAL_NODE_TYPE_NUMBER)
+            return 0;
+    }
+    else if (op == EVAL_TOKEN_TYPE_OR)
+    {
+        if (c->value.type == EXPR_VALUE_TYPE_STRING)
+            return c->value.v.str.size ? 1 : -1;
+        if (c->value.v.val != 0)
+            return 1;
+    }
+
+    return -1;
+}
+
+static EvalResult node_fold_binary(EvalNode *nodes, EvalNode *node)
+{
+    EvalNode *lhs = nodes + node->lhs;
+    EvalNode *rhs = nodes + node->rhs;
+    int op = (int)EVAL_CODE_ARG(node->code);
+    EvalResult result;
+
+    if (lhs->is_const && rhs->is_const)
+    {
+        ExprValue a;
+        ExprValue b;
+
+        expr_value_init(&a);
+        expr_value_init(&b);
+        a = lhs->value;
+        b = rhs->value;
+        expr_value_init(&(lhs->value));
+        expr_value_init(&(rhs->value));
+
+        result = expr_value_op(&a, &b, (EvalTokenType)op);
+        expr_value_clear(&b);
+        if (result == EVAL_RESULT_OK)
+            result = node_set_const(node, &a);
+        expr_value_clear(&a);
+
+        return result;
+    }
+
+    if (lhs->is_const || rhs->is_const)
+    {
+        int ret = lhs->is_const ? node_prune(lhs, rhs, op) : node_prune(rhs, lhs, op);
+
+        if (ret >= 0)
         {
-            int ret = strcmp(a->v.str.str, b->v.str.str) > 0;
-            expr_value_set_number(a, ret);
-            break;
+            ExprValue v;
+
+            expr_value_init(&v);
+            v.v.val = ret;
+
+            return node_set_const(node, &v);
         }
-        case EVAL_TOKEN_TYPE_L:
+    }
+
+    /* (x + "a") + "b" => x + "ab": the inner sum is already a string concatenation */
+    if (op == EVAL_TOKEN_TYPE_ADD && rhs->is_const && rhs->type == EVAL_NODE_TYPE_STRING &&
+        EVAL_CODE_OP(lhs->code) == EVAL_OP_BINARY && EVAL_CODE_ARG(lhs->code) == EVAL_TOKEN_TYPE_ADD &&
+        nodes[lhs->rhs].is_const && nodes[lhs->rhs].type == EVAL_NODE_TYPE_STRING)
+    {
+        EvalNode *inner = nodes + lhs->rhs;
+
+        result = expr_value_append_string(&(inner->value), rhs->value.v.str.str, rhs->value.v.str.size);
+        if (result != EVAL_RESULT_OK)
+            return result;
+
+        *node = *lhs;
+        expr_value_init(&(lhs->value));
+        return EVAL_RESULT_OK;
+    }
+
+    if (is_logic_op(op))
+        node->type = EVAL_NODE_TYPE_NUMBER;
+    else if (lhs->type == EVAL_NODE_TYPE_STRING || rhs->type == EVAL_NODE_TYPE_STRING)
+        node->type = EVAL_NODE_TYPE_STRING;
+    else if (lhs->type == EVAL_NODE_TYPE_NUMBER && rhs->type == EVAL_NODE_TYPE_NUMBER)
+        node->type = EVAL_NODE_TYPE_NUMBER;
+    else
+        node->type = EVAL_NODE_TYPE_UNKNOWN;
+
+    return EVAL_RESULT_OK;
+}
+
+/* a builtin of constants is run now, otherwise only its type is known */
+static EvalResult node_fold_builtin(const EvalProgram *program, EvalNode *nodes, EvalNode *node)
+{
+    size_t children[3];
+    EvalValue args[3];
+    EvalNeedle needle;
+    EvalBuiltinEntry entry = program_builtin(program, EVAL_CODE_ARG(node->code), &needle);
+    size_t nr_values = 0;
+    EvalResult result = EVAL_RESULT_OK;
+    ExprValue value;
+    size_t i;
+
+    children[0] = node->lhs;
+    children[1] = node->rhs;
+    children[2] = node->third;
+    while (nr_values < 3 && children[nr_values] != EVAL_NODE_NONE)
+    {
+        if (!nodes[children[nr_values]].is_const)
         {
-            int ret = strcmp(a->v.str.str, b->v.str.str) < 0;
-            expr_value_set_number(a, ret);
-            break;
+            if (entry.builtin == EVAL_BUILTIN_SUBSTR)
+                node->type = EVAL_NODE_TYPE_STRING;
+            else if (entry.builtin != EVAL_BUILTIN_REPLACE)
+                node->type = EVAL_NODE_TYPE_NUMBER;
+            return EVAL_RESULT_OK;
         }
-        case EVAL_TOKEN_TYPE_LE:
+        nr_values++;
+    }
+
+    for (i = 0; i < nr_values; i++)
+    {
+        const ExprValue *v = &(nodes[children[i]].value);
+
+        args[i] = 0;
+        if (v->type == EXPR_VALUE_TYPE_NUMBER)
+            args[i] = eval_value_number(v->v.val);
+        else if (result == EVAL_RESULT_OK)
+            result = eval_value_set_string(args + i, v->v.str.str, v->v.str.size);
+    }
+
+    if (result == EVAL_RESULT_OK)
+    {
+        result = builtin_run(entry.builtin, args, entry.nr_args, entry.needle != EVAL_NO_NEEDLE ? &needle : NULL);
+        nr_values = 1;
+    }
+    while (nr_values > 1)
+        eval_value_clear(args + --nr_values);
+
+    eval_value_to_expr(args, &value);
+    if (result == EVAL_RESULT_OK)
+        result = node_set_const(node, &value);
+    expr_value_clear(&value);
+
+    return result;
+}
+
+static EvalResult program_fold(const EvalProgram *program, EvalNode *nodes,
+                               const EvalConstant *constants, size_t nr_constants)
+{
+    const double *numbers = program_numbers(program);
+    EvalResult result = EVAL_RESULT_OK;
+    size_t i;
+
+    for (i = 0; i < program->nr_code && result == EVAL_RESULT_OK; i++)
+    {
+        EvalNode *node = nodes + i;
+        size_t arg = EVAL_CODE_ARG(node->code);
+
+        switch (EVAL_CODE_OP(node->code))
         {
-            int ret = strcmp(a->v.str.str, b->v.str.str) <= 0;
-            expr_value_set_number(a, ret);
+        case EVAL_OP_NUMBER:
+            node->is_const = 1;
+            node->type = EVAL_NODE_TYPE_NUMBER;
+            node->value.v.val = numbers[arg];
             break;
-        }
-        case EVAL_TOKEN_TYPE_NE:
+        case EVAL_OP_STRING:
         {
-            int ret = strcmp(a->v.str.str, b->v.str.str) != 0;
-            expr_value_set_number(a, ret);
+            size_t len;
+            const char *str = program_string(program, arg, &len);
+
+            node->is_const = 1;
+            node->type = EVAL_NODE_TYPE_STRING;
+            result = expr_value_set_string(&(node->value), str, len);
             break;
         }
-        case EVAL_TOKEN_TYPE_GE:
+        case EVAL_OP_VARIABLE:
         {
-            int ret = strcmp(a->v.str.str, b->v.str.str) >= 0;
-            expr_value_set_number(a, ret);
+            const char *name = program_string(program, arg, NULL);
+            size_t j;
+
+            for (j = 0; j < nr_constants; j++)
+            {
+                if (strcmp(constants[j].name, name) == 0)
+                {
+                    result = node_set_const(node, &(constants[j].value));
+                    break;
+                }
+            }
             break;
         }
-        default:
+        case EVAL_OP_CALL:
             break;
-        }
-    }
-    else
-    {
-        expr_value_to_number(a);
-        expr_value_to_number(b);
-        switch (op)
-        {
-        case EVAL_TOKEN_TYPE_MULTIPLY:
+        case EVAL_OP_UNARY:
         {
-            a->v.val *= b->v.val;
+            EvalNode *child = nodes + node->lhs;
+
+            if (child->is_const)
+            {
+                expr_value_unary(&(child->value), arg);
+                result = node_set_const(node, &(child->value));
+            }
+            else if (arg & EVAL_UNARY_NOT)
+            {
+                node->type = EVAL_NODE_TYPE_NUMBER;
+            }
+            else
+            {
+                node->type = child->type;
+            }
             break;
         }
-        case EVAL_TOKEN_TYPE_OR:
-        {
-            a->v.val = a->v.val || b->v.val;
+        case EVAL_OP_BINARY:
+            result = node_fold_binary(nodes, node);
             break;
-        }
-        case EVAL_TOKEN_TYPE_AND:
-        {
-            a->v.val = a->v.val && b->v.val;
+        case EVAL_OP_BUILTIN:
+            result = node_fold_builtin(program, nodes, node);
             break;
-        }
-        case EVAL_TOKEN_TYPE_BITS_OR:
+        case EVAL_OP_IN:
         {
-            a->v.val = (unsigned int)a->v.val | (unsigned int)b->v.val;
+            EvalNode *child = nodes + node->lhs;
+
+            node->type = EVAL_NODE_TYPE_NUMBER;
+            if (child->is_const)
+            {
+                const ExprValue *c = &(child->value);
+                ExprValue v;
+
+                expr_value_init(&v);
+                if (c->type == EXPR_VALUE_TYPE_STRING)
+                    v.v.val = set_test(program, arg, c->v.str.str, 0);
+                else
+                    v.v.val = set_test(program, arg, NULL, c->v.val);
+                result = node_set_const(node, &v);
+            }
             break;
         }
-        case EVAL_TOKEN_TYPE_BITS_AND:
+        case EVAL_OP_LOCAL:
+        case EVAL_OP_RETURN:
         {
-            a->v.val = (unsigned int)a->v.val & (unsigned int)b->v.val;
+            EvalNode *child = nodes + node->lhs;
+
+            if (child->is_const)
+                result = node_set_const(node, &(child->value));
+            else
+                node->type = child->type;
             break;
         }
-        case EVAL_TOKEN_TYPE_DIVIDE:
-        {
-            a->v.val /= b->v.val;
-            break;
         }
-        case EVAL_TOKEN_TYPE_ADD:
+    }
+
+    return result;
+}
+
+/* the statements a return ends, in order and the last one included */
+static size_t *node_statements(const EvalNode *nodes, const EvalNode *node, size_t nr_slots)
+{
+    size_t *statements = (size_t *)EVAL_MALLOC((nr_slots + 1) * sizeof(size_t));
+    size_t index = node->lhs;
+    size_t i = nr_slots + 1;
+
+    if (statements == NULL)
+        return NULL;
+
+    while (i--)
+    {
+        statements[i] = index;
+        index = nodes[index].before;
+    }
+
+    return statements;
+}
+
+/* a set is built again from its items, whose offsets and indexes change in the new program */
+static EvalResult program_emit_set(const EvalProgram *program, size_t offset, EvalBuilder *b)
+{
+    EvalSetEntry set;
+    const unsigned int *items = set_entry(program, offset, &set);
+    const unsigned int *texts = items + set.nr_items;
+    unsigned int *copy = (unsigned int *)EVAL_MALLOC((set.nr_items + 1) * sizeof(unsigned int));
+    EvalResult result = EVAL_RESULT_OK;
+    size_t i;
+
+    if (copy == NULL)
+        return EVAL_RESULT_OOM;
+
+    for (i = 0; i < set.nr_items && result == EVAL_RESULT_OK; i++)
+    {
+        size_t index;
+        size_t len;
+        const char *str;
+
+        if (items[i] & EVAL_SET_NUMBER)
         {
-            a->v.val += b->v.val;
-            break;
+            result = builder_number(b, program_numbers(program)[items[i] & ~(unsigned int)EVAL_SET_NUMBER], &index);
+            if (result == EVAL_RESULT_OK)
+                copy[i] = (unsigned int)index | EVAL_SET_NUMBER;
         }
-        case EVAL_TOKEN_TYPE_SUBTRACT:
+        else
         {
-            a->v.val -= b->v.val;
-            break;
+            str = program_string(program, texts[2 * items[i] + 1], &len);
+            result = builder_pool_string(b, str, len, EVAL_SYMBOL_NONE, &index);
+            if (result == EVAL_RESULT_OK)
+                copy[i] = (unsigned int)index;
         }
-        case EVAL_TOKEN_TYPE_E:
+    }
+
+    if (result == EVAL_RESULT_OK)
+        result = builder_add_set(b, copy, set.nr_items, (int)set.negate);
+    EVAL_FREE(copy);
+
+    return result;
+}
+
+static EvalResult program_emit_node(const EvalProgram *program, const EvalNode *nodes, size_t index, EvalBuilder *b);
+
+/* a return that did not fold keeps every statement, so the slots of the locals stay where they were; one that
+ * folded was emitted as its constant, statements and all */
+static EvalResult program_emit_return(const EvalProgram *program, const EvalNode *nodes, const EvalNode *node,
+                                      EvalBuilder *b)
+{
+    size_t nr_slots;
+    const unsigned int *names = program_locals(program, EVAL_CODE_ARG(node->code), &nr_slots);
+    size_t *statements = node_statements(nodes, node, nr_slots);
+    EvalResult result = EVAL_RESULT_OK;
+    size_t entry;
+    size_t i;
+
+    if (statements == NULL)
+        return EVAL_RESULT_OOM;
+
+    for (i = 0; i <= nr_slots && result == EVAL_RESULT_OK; i++)
+        result = program_emit_node(program, nodes, statements[i], b);
+    if (result == EVAL_RESULT_OK)
+        result = builder_add_return(b, nr_slots, &entry);
+
+    for (i = 0; i < nr_slots && result == EVAL_RESULT_OK; i++)
+    {
+        size_t len;
+        const char *name;
+
+        if (names[i] == EVAL_NO_NAME)
+            continue;
+
+        name = program_string(program, names[i], &len);
+        result = builder_name_local(b, entry, i, name, len);
+    }
+
+    EVAL_FREE(statements);
+
+    return result;
+}
+
+static EvalResult program_emit_node(const EvalProgram *program, const EvalNode *nodes, size_t index, EvalBuilder *b)
+{
+    const EvalNode *node = nodes + index;
+    EvalOpcode op = EVAL_CODE_OP(node->code);
+    size_t arg = EVAL_CODE_ARG(node->code);
+    EvalResult result;
+
+    if (node->is_const)
+    {
+        if (node->value.type == EXPR_VALUE_TYPE_STRING)
+            return builder_add_string(b, EVAL_OP_STRING, node->value.v.str.str, node->value.v.str.size);
+        else
+            return builder_add_number(b, node->value.v.val);
+    }
+
+    if (op == EVAL_OP_LOCAL)
+        return builder_emit(b, op, arg);
+    if (op == EVAL_OP_RETURN)
+        return program_emit_return(program, nodes, node, b);
+
+    if (node->lhs != EVAL_NODE_NONE)
+    {
+        result = program_emit_node(program, nodes, node->lhs, b);
+        if (result != EVAL_RESULT_OK)
+            return result;
+    }
+
+    if (node->rhs != EVAL_NODE_NONE)
+    {
+        result = program_emit_node(program, nodes, node->rhs, b);
+        if (result != EVAL_RESULT_OK)
+            return result;
+    }
+
+    if (node->third != EVAL_NODE_NONE)
+    {
+        result = program_emit_node(program, nodes, node->third, b);
+        if (result != EVAL_RESULT_OK)
+            return result;
+    }
+
+    if (op == EVAL_OP_BUILTIN)
+    {
+        EvalNeedle needle;
+        EvalBuiltinEntry entry = program_builtin(program, arg, &needle);
+        size_t offset = EVAL_NO_NEEDLE;
+
+        if (entry.needle != EVAL_NO_NEEDLE)
         {
-            a->v.val = a->v.val == b->v.val;
-            break;
+            result = builder_pool_string(b, needle.str, needle.len, EVAL_SYMBOL_NONE, &offset);
+            if (result != EVAL_RESULT_OK)
+                return result;
         }
-        case EVAL_TOKEN_TYPE_G:
+
+        return builder_add_builtin(b, entry.builtin, entry.nr_args, offset);
+    }
+
+    if (op == EVAL_OP_IN)
+        return program_emit_set(program, arg, b);
+
+    if (op == EVAL_OP_VARIABLE || op == EVAL_OP_CALL)
+    {
+        size_t len;
+        const char *name = program_string(program, arg, &len);
+
+        return builder_add_string(b, op, name, len);
+    }
+
+    return builder_emit(b, op, arg);
+}
+
+EvalResult eval_program_specialize(const EvalProgram *program, const EvalConstant *constants,
+                                   size_t nr_constants, EvalProgram **residual)
+{
+    EvalNode *nodes = NULL;
+    EvalBuilder b;
+    EvalResult result;
+
+    *residual = NULL;
+
+    result = program_tree(program, &nodes);
+    if (result != EVAL_RESULT_OK)
+        return result;
+
+    builder_init(&b);
+
+    result = program_fold(program, nodes, constants, nr_constants);
+    if (result == EVAL_RESULT_OK)
+        result = program_emit_node(program, nodes, program->nr_code - 1, &b);
+    if (result == EVAL_RESULT_OK)
+        result = builder_finish(&b, residual);
+
+    builder_deinit(&b);
+    program_tree_destroy(nodes, program->nr_code);
+
+    return result;
+}
+
+/* 1: sum level, 2: product level, 3: unary (and negative numbers), 4: term */
+static int node_level(const EvalProgram *program, const EvalNode *node)
+{
+    EvalOpcode op = EVAL_CODE_OP(node->code);
+
+    if (op == EVAL_OP_BINARY)
+    {
+        size_t type = EVAL_CODE_ARG(node->code);
+        return (type == EVAL_TOKEN_TYPE_ADD || type == EVAL_TOKEN_TYPE_SUBTRACT) ? 1 : 2;
+    }
+    else if (op == EVAL_OP_IN)
+    {
+        return 2;
+    }
+    else if (op == EVAL_OP_UNARY)
+    {
+        return 3;
+    }
+    else if (op == EVAL_OP_NUMBER)
+    {
+        double value = program_numbers(program)[EVAL_CODE_ARG(node->code)];
+        return (value < 0 || (value == 0 && 1 / value < 0)) ? 3 : 4;
+    }
+
+    return 4;
+}
+
+static EvalResult program_print_node(const EvalProgram *program, const EvalNode *nodes, size_t index,
+                                     int min_level, ExprValue *output);
+
+static EvalResult program_print_number(double value, ExprValue *output)
+{
+    char buff[64];
+
+    if (value != value)
+        strcpy(buff, "(1e999*0)");
+    else if (value > 1.7976931348623157e308)
+        strcpy(buff, "1e999");
+    else if (value < -1.7976931348623157e308)
+        strcpy(buff, "-1e999");
+    else
+    {
+        int precision;
+        double back;
+
+        /* the shortest form the lexer reads back to the same double, 17 digits always are */
+        for (precision = 15; ; precision++)
         {
-            a->v.val = a->v.val > b->v.val;
-            break;
+            snprintf(buff, sizeof(buff), "%.*g", precision, value);
+            if (precision == 17 || (scan_number(buff + (*buff == '-'), &back) != NULL &&
+                                    (*buff == '-' ? -back : back) == value))
+                break;
         }
-        case EVAL_TOKEN_TYPE_L:
-        {
-            a->v.val = a->v.val < b->v.val;
+    }
+
+    return expr_value_append_string(output, buff, strlen(buff));
+}
+
+static EvalResult program_print_string(const char *str, size_t len, ExprValue *output)
+{
+    const char *end = str + len;
+    EvalResult result = expr_value_append_string(output, "\"", 1);
+
+    for (; str != end && result == EVAL_RESULT_OK; str++)
+    {
+        if (*str == '"')
+            result = expr_value_append_string(output, "\\", 1);
+        if (result == EVAL_RESULT_OK)
+            result = expr_value_append_string(output, str, 1);
+    }
+    if (result == EVAL_RESULT_OK)
+        result = expr_value_append_string(output, "\"", 1);
+
+    return result;
+}
+
+/* the arguments in the order they were written, a literal needle second */
+static EvalResult program_print_builtin(const EvalProgram *program, const EvalNode *nodes, const EvalNode *node,
+                                        ExprValue *output)
+{
+    EvalNeedle needle;
+    EvalBuiltinEntry entry = program_builtin(program, EVAL_CODE_ARG(node->code), &needle);
+    const char *name = EVAL_BUILTINS[entry.builtin].name;
+    size_t values[3];
+    size_t i;
+    EvalResult result;
+
+    values[0] = node->lhs;
+    values[1] = node->rhs;
+    values[2] = node->third;
+
+    result = expr_value_append_string(output, name, strlen(name));
+    if (result == EVAL_RESULT_OK)
+        result = expr_value_append_string(output, "(", 1);
+    if (result == EVAL_RESULT_OK)
+        result = program_print_node(program, nodes, values[0], 0, output);
+
+    for (i = 1; i < entry.nr_args && result == EVAL_RESULT_OK; i++)
+    {
+        result = expr_value_append_string(output, ", ", 2);
+        if (result != EVAL_RESULT_OK)
             break;
-        }
-        case EVAL_TOKEN_TYPE_NE:
-        {
-            a->v.val = a->v.val != b->v.val;
+
+        if (entry.needle == EVAL_NO_NEEDLE)
+            result = program_print_node(program, nodes, values[i], 0, output);
+        else if (i == 1)
+            result = program_print_string(needle.str, needle.len, output);
+        else
+            result = program_print_node(program, nodes, values[i - 1], 0, output);
+    }
+
+    if (result == EVAL_RESULT_OK)
+        result = expr_value_append_string(output, ")", 1);
+
+    return result;
+}
+
+/* the items in the order they were written */
+static EvalResult program_print_set(const EvalProgram *program, size_t offset, ExprValue *output)
+{
+    EvalSetEntry set;
+    const unsigned int *items = set_entry(program, offset, &set);
+    const unsigned int *texts = items + set.nr_items;
+    const char *op = set.negate ? " not in (" : " in (";
+    EvalResult result = expr_value_append_string(output, op, strlen(op));
+    size_t i;
+
+    for (i = 0; i < set.nr_items && result == EVAL_RESULT_OK; i++)
+    {
+        size_t len;
+        const char *str;
+
+        if (i)
+            result = expr_value_append_string(output, ", ", 2);
+        if (result != EVAL_RESULT_OK)
             break;
-        }
-        case EVAL_TOKEN_TYPE_LE:
+
+        if (items[i] & EVAL_SET_NUMBER)
         {
-            a->v.val = a->v.val <= b->v.val;
-            break;
+            result = program_print_number(program_numbers(program)[items[i] & ~(unsigned int)EVAL_SET_NUMBER], output);
         }
-        case EVAL_TOKEN_TYPE_GE:
+        else
         {
-            a->v.val = a->v.val >= b->v.val;
-            break;
-        }
-        default:
-            break;
+            str = program_string(program, texts[2 * items[i] + 1], &len);
+            result = program_print_string(str, len, output);
         }
     }
 
-    return EVAL_RESULT_OK;
+    if (result == EVAL_RESULT_OK)
+        result = expr_value_append_string(output, ")", 1);
+
+    return result;
 }
 
-void expr_value_clear(ExprValue *v)
+/* name = before each named statement and a semicolon after all but the last */
+static EvalResult program_print_return(const EvalProgram *program, const EvalNode *nodes, const EvalNode *node,
+                                       ExprValue *output)
 {
-    if (v->type == EXPR_VALUE_TYPE_STRING)
+    size_t nr_slots;
+    const unsigned int *names = program_locals(program, EVAL_CODE_ARG(node->code), &nr_slots);
+    size_t *statements = node_statements(nodes, node, nr_slots);
+    EvalResult result = EVAL_RESULT_OK;
+    size_t i;
+
+    if (statements == NULL)
+        return EVAL_RESULT_OOM;
+
+    for (i = 0; i < nr_slots && result == EVAL_RESULT_OK; i++)
     {
-        expr_value_set_number(v, 0);
+        if (names[i] != EVAL_NO_NAME)
+        {
+            size_t len;
+            const char *name = program_string(program, names[i], &len);
+
+            result = expr_value_append_string(output, name, len);
+            if (result == EVAL_RESULT_OK)
+                result = expr_value_append_string(output, " = ", 3);
+        }
+        if (result == EVAL_RESULT_OK)
+            result = program_print_node(program, nodes, statements[i], 0, output);
+        if (result == EVAL_RESULT_OK)
+            result = expr_value_append_string(output, "; ", 2);
     }
+    if (result == EVAL_RESULT_OK)
+        result = program_print_node(program, nodes, statements[nr_slots], 0, output);
+
+    EVAL_FREE(statements);
+
+    return result;
 }
 
-static EvalResult get_number(EvalContext *ctx)
+static EvalResult program_print_node(const EvalProgram *program, const EvalNode *nodes, size_t index,
+                                     int min_level, ExprValue *output)
 {
-    char c;
-    double value;
-    long exp;
-    double power;
+    static const char *BINARY_OPS[] = {
+        "", " + ", " > ", " >= ", " < ", " <= ", " != ", " == ", "", " || ", " && ",
+        "", " | ", " & ", " - ", " * ", " / "};
+    const EvalNode *node = nodes + index;
+    int level = node_level(program, node);
+    size_t arg = EVAL_CODE_ARG(node->code);
+    EvalResult result = EVAL_RESULT_OK;
 
-    value = 0.0f;
-    exp = 0;
+    if (level < min_level)
+        result = expr_value_append_string(output, "(", 1);
 
-    c = get_char(ctx);
+    if (result != EVAL_RESULT_OK)
+        return result;
 
-    if (!is_dp(c))
+    if (EVAL_CODE_OP(node->code) == EVAL_OP_NUMBER)
     {
-        if (!is_digit(c))
-            return EVAL_RESULT_INVALID_LITERAL;
+        result = program_print_number(program_numbers(program)[arg], output);
+    }
+    else if (EVAL_CODE_OP(node->code) == EVAL_OP_STRING)
+    {
+        size_t len;
+        const char *str = program_string(program, arg, &len);
 
-        do
-        {
-            value = (value * 10.0f) + (c - '0');
-            c = get_char(ctx);
+        result = program_print_string(str, len, output);
+    }
+    else if (EVAL_CODE_OP(node->code) == EVAL_OP_VARIABLE)
+    {
+        size_t len;
+        const char *name = program_string(program, arg, &len);
 
-        } while (is_digit(c));
+        result = expr_value_append_string(output, "$", 1);
+        if (result == EVAL_RESULT_OK)
+            result = expr_value_append_string(output, name, len);
+    }
+    else if (EVAL_CODE_OP(node->code) == EVAL_OP_CALL)
+    {
+        size_t len;
+        const char *name = program_string(program, arg, &len);
+
+        result = expr_value_append_string(output, name, len);
+        if (result == EVAL_RESULT_OK)
+            result = expr_value_append_string(output, "(", 1);
+        if (result == EVAL_RESULT_OK)
+            result = program_print_node(program, nodes, node->lhs, 0, output);
+        if (result == EVAL_RESULT_OK)
+            result = expr_value_append_string(output, ")", 1);
+    }
+    else if (EVAL_CODE_OP(node->code) == EVAL_OP_BUILTIN)
+    {
+        result = program_print_builtin(program, nodes, node, output);
+    }
+    else if (EVAL_CODE_OP(node->code) == EVAL_OP_IN)
+    {
+        result = program_print_node(program, nodes, node->lhs, level, output);
+        if (result == EVAL_RESULT_OK)
+            result = program_print_set(program, arg, output);
     }
+    else if (EVAL_CODE_OP(node->code) == EVAL_OP_LOCAL)
+    {
+        size_t nr_slots;
+        size_t len;
+        const unsigned int *names = program_locals(program, EVAL_CODE_ARG(nodes[program->nr_code - 1].code), &nr_slots);
+        const char *name = program_string(program, names[arg], &len);
 
-    if (is_dp(c))
+        result = expr_value_append_string(output, name, len);
+    }
+    else if (EVAL_CODE_OP(node->code) == EVAL_OP_RETURN)
+    {
+        result = program_print_return(program, nodes, node, output);
+    }
+    else if (EVAL_CODE_OP(node->code) == EVAL_OP_UNARY)
     {
-        c = get_char(ctx);
-        if (!is_digit(c))
-            return EVAL_RESULT_INVALID_LITERAL;
+        if (arg & EVAL_UNARY_NEG)
+            result = expr_value_append_string(output, "-", 1);
+        if (result == EVAL_RESULT_OK && (arg & EVAL_UNARY_NOT))
+            result = expr_value_append_string(output, "!", 1);
+        if (result == EVAL_RESULT_OK && (arg & EVAL_UNARY_BITS_NOT))
+            result = expr_value_append_string(output, "~", 1);
+        if (result == EVAL_RESULT_OK)
+            result = program_print_node(program, nodes, node->lhs, 4, output);
+    }
+    else
+    {
+        const char *op = BINARY_OPS[arg];
 
-        do
-        {
-            value = (value * 10.0f) + (c - '0');
-            exp--;
+        result = program_print_node(program, nodes, node->lhs, level, output);
+        if (result == EVAL_RESULT_OK)
+            result = expr_value_append_string(output, op, strlen(op));
+        if (result == EVAL_RESULT_OK)
+            result = program_print_node(program, nodes, node->rhs, level + 1, output);
+    }
 
-            c = get_char(ctx);
+    if (result == EVAL_RESULT_OK && level < min_level)
+        result = expr_value_append_string(output, ")", 1);
 
-        } while (is_digit(c));
-    }
+    return result;
+}
 
-    if (is_exp(c))
-    {
-        int exp_neg;
-        int int_val;
+EvalResult eval_program_to_string(const EvalProgram *program, ExprValue *output)
+{
+    EvalNode *nodes = NULL;
+    EvalResult result;
 
-        exp_neg = 0;
+    result = program_tree(program, &nodes);
+    if (result != EVAL_RESULT_OK)
+        return result;
 
-        c = get_char(ctx);
+    result = expr_value_set_string(output, "", 0);
+    if (result == EVAL_RESULT_OK)
+        result = program_print_node(program, nodes, program->nr_code - 1, 0, output);
 
-        switch (c)
-        {
-        case '-':
-            exp_neg = 1;
-        /* fall through */
+    program_tree_destroy(nodes, program->nr_code);
 
-        case '+':
-            c = get_char(ctx);
-        /* fall through */
+    return result;
+}
 
-        default:
-            break;
-        }
+/*
+ * Program images.
+ *
+ * An image stores any number of compiled programs in one file that can be
+ * mapped into memory and executed in place. All fields are little-endian:
+ *
+ *   header   magic "EVALIMG\0", u32 version, u32 nr_programs, u32 size,
+ *            u32 crc32 of everything after the header, u32 reserved[2]
+ *   index    u32 offset of each program from the start of the image
+ *   programs one program block each (see EvalProgram), 8 byte aligned
+ *
+ * On little-endian hosts the programs are used straight from the mapping.
+ * Big-endian hosts convert the whole image once into a single heap block.
+ */
 
-        int_val = 0;
+#define EVAL_IMAGE_VERSION          2
+#define EVAL_IMAGE_HEADER_SIZE      32
+#define EVAL_IMAGE_ALIGN(n)         (((n) + 7) & ~(size_t)7)
 
-        if (!is_digit(c))
-            return EVAL_RESULT_INVALID_LITERAL;
+struct _EvalImage
+{
+    const unsigned char *data;
+    size_t size;
+    size_t nr_programs;
+    void *buffer;
+    EvalMappedFile file;
+};
 
-        do
-        {
-            int_val = (int_val * 10) + (c - '0');
-            c = get_char(ctx);
+static const char EVAL_IMAGE_MAGIC[8] = {'E', 'V', 'A', 'L', 'I', 'M', 'G', '\0'};
 
-        } while (is_digit(c));
+static int is_big_endian(void)
+{
+    unsigned int x = 1;
+    return *(unsigned char *)&x == 0;
+}
 
-        if (exp_neg)
-            exp -= int_val;
-        else
-            exp += int_val;
-    }
+static unsigned int load_le32(const unsigned char *p)
+{
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
 
-    power = 10.0f;
+static void store_le32(unsigned char *p, unsigned int v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
 
-    if (exp < 0)
-    {
-        exp = -exp;
+static void swap_bytes(void *data, size_t item_size, size_t count)
+{
+    unsigned char *p = (unsigned char *)data;
+    size_t i;
+    size_t j;
 
-        while (exp)
-        {
-            if (exp & 1)
-                value /= power;
-            exp >>= 1;
-            power *= power;
-        }
-    }
-    else
+    for (i = 0; i < count; i++, p += item_size)
     {
-        while (exp)
+        for (j = 0; j < item_size / 2; j++)
         {
-            if (exp & 1)
-                value *= power;
-            exp >>= 1;
-            power *= power;
+            unsigned char c = p[j];
+            p[j] = p[item_size - 1 - j];
+            p[item_size - 1 - j] = c;
         }
     }
+}
+
+/* a builtin's entry and the length of its needle, the offset only read in host order */
+static void program_swap_builtin(const EvalProgram *program, unsigned char *pool, size_t offset, int to_host)
+{
+    EvalBuiltinEntry entry;
 
-    put_char(ctx);
+    if (to_host)
+        swap_bytes(pool + offset, sizeof(unsigned int), sizeof(entry) / sizeof(unsigned int));
 
-    ctx->token.type = EVAL_TOKEN_TYPE_NUMBER;
-    ctx->token.value.number = value;
+    memcpy(&entry, pool + offset, sizeof(entry));
+    if (entry.needle != EVAL_NO_NEEDLE && entry.needle + sizeof(unsigned int) <= program->pool_size)
+        swap_bytes(pool + entry.needle, sizeof(unsigned int), 1);
 
-    return EVAL_RESULT_OK;
+    if (!to_host)
+        swap_bytes(pool + offset, sizeof(unsigned int), sizeof(entry) / sizeof(unsigned int));
 }
 
-static EvalResult get_name(EvalContext *ctx, EvalTokenType type)
+/* a set's entry and the lengths of its texts, the counts and offsets only read in host order */
+static void program_swap_set(const EvalProgram *program, unsigned char *pool, size_t offset, int to_host)
 {
-    char c;
-    int length = 0;
+    EvalSetEntry set;
+    size_t nr_words;
+    size_t i;
 
-    for (;;)
-    {
-        c = get_char(ctx);
-        if (!is_name(c))
-            break;
+    if (to_host)
+        swap_bytes(pool + offset, sizeof(unsigned int), sizeof(set) / sizeof(unsigned int));
 
-        if (length >= (EVAL_MAX_NAME_LENGTH - 1))
-            return EVAL_RESULT_NAME_TOO_LONG;
+    memcpy(&set, pool + offset, sizeof(set));
+    if (set.nr_items > program->pool_size || set.mask > program->pool_size)
+        return;
+    nr_words = EVAL_SET_WORDS(set.nr_items, set.mask);
+    if (offset + nr_words * sizeof(unsigned int) > program->pool_size)
+        return;
 
-        ctx->token.value.name[length++] = c;
-    }
+    if (to_host)
+        swap_bytes(pool + offset + sizeof(set), sizeof(unsigned int), nr_words - sizeof(set) / sizeof(unsigned int));
 
-    put_char(ctx);
+    for (i = 0; i <= set.mask; i++)
+    {
+        unsigned int text;
 
-    ctx->token.type = type;
-    ctx->token.value.name[length] = '\0';
+        memcpy(&text, pool + offset + sizeof(set) + (set.nr_items + 2 * i + 1) * sizeof(unsigned int), sizeof(text));
+        if (text == EVAL_SET_EMPTY)
+            continue;
 
-    return EVAL_RESULT_OK;
+        text &= ~(unsigned int)EVAL_SET_NUMBER_TEXT;
+        if (text + sizeof(unsigned int) <= program->pool_size)
+            swap_bytes(pool + text, sizeof(unsigned int), 1);
+    }
+
+    if (!to_host)
+        swap_bytes(pool + offset, sizeof(unsigned int), nr_words);
 }
 
-static EvalResult get_string(EvalContext *ctx, EvalTokenType type)
+/* a return's entry and the lengths of its names, the count and offsets only read in host order */
+static void program_swap_return(const EvalProgram *program, unsigned char *pool, size_t offset, int to_host)
 {
-    char c;
-    char last_c = '\0';
-    ctx->str.size = 0;
-    for (;;)
+    unsigned int nr_slots;
+    size_t i;
+
+    if (to_host)
+        swap_bytes(pool + offset, sizeof(unsigned int), 1);
+
+    memcpy(&nr_slots, pool + offset, sizeof(nr_slots));
+    if (nr_slots > program->pool_size || offset + ((size_t)nr_slots + 1) * sizeof(unsigned int) > program->pool_size)
+        return;
+
+    if (to_host)
+        swap_bytes(pool + offset + sizeof(unsigned int), sizeof(unsigned int), nr_slots);
+
+    for (i = 0; i < nr_slots; i++)
     {
-        c = get_char(ctx);
-        if(c == '\\') 
-        {
-            last_c = c;
-            continue;
-        }
+        unsigned int name;
 
-        if (c == '"' && last_c != '\\')
-        {
-            break;
-        }
-        last_c = c;
-        expr_str_append_char(&(ctx->str), c);
+        memcpy(&name, pool + offset + (i + 1) * sizeof(unsigned int), sizeof(name));
+        if (name != EVAL_NO_NAME && (size_t)name + sizeof(unsigned int) <= program->pool_size)
+            swap_bytes(pool + name, sizeof(unsigned int), 1);
     }
 
-    ctx->token.type = type;
+    if (!to_host)
+        swap_bytes(pool + offset, sizeof(unsigned int), (size_t)nr_slots + 1);
+}
 
-    return EVAL_RESULT_OK;
+/* converts a program block between host and little-endian byte order */
+static void program_swap(EvalProgram *program, int to_host)
+{
+    unsigned char *numbers = (unsigned char *)(program + 1);
+    unsigned char *code;
+    unsigned char *pool;
+    size_t offset;
+
+    if (to_host)
+        swap_bytes(program, sizeof(unsigned int), 4);
+
+    code = numbers + program->nr_numbers * sizeof(double);
+    pool = code + program->nr_code * sizeof(EvalCode);
+    swap_bytes(numbers, sizeof(double), program->nr_numbers);
+
+    if (!to_host)
+        swap_bytes(code, sizeof(EvalCode), program->nr_code);
+
+    /* pool entries are only reachable through the code, which is in foreign byte order here */
+    for (offset = 0; offset < program->nr_code; offset++)
+    {
+        EvalCode c = ((EvalCode *)code)[offset];
+        EvalOpcode op;
+
+        swap_bytes(&c, sizeof(c), 1);
+        op = EVAL_CODE_OP(c);
+        if (op == EVAL_OP_STRING || op == EVAL_OP_VARIABLE || op == EVAL_OP_CALL)
+            swap_bytes(pool + EVAL_CODE_ARG(c), sizeof(unsigned int), 1);
+        else if (op == EVAL_OP_BUILTIN && EVAL_CODE_ARG(c) + sizeof(EvalBuiltinEntry) <= program->pool_size)
+            program_swap_builtin(program, pool, EVAL_CODE_ARG(c), to_host);
+        else if (op == EVAL_OP_IN && EVAL_CODE_ARG(c) + sizeof(EvalSetEntry) <= program->pool_size)
+            program_swap_set(program, pool, EVAL_CODE_ARG(c), to_host);
+        else if (op == EVAL_OP_RETURN && EVAL_CODE_ARG(c) + sizeof(unsigned int) <= program->pool_size)
+            program_swap_return(program, pool, EVAL_CODE_ARG(c), to_host);
+    }
+
+    if (to_host)
+        swap_bytes(code, sizeof(EvalCode), program->nr_code);
+    else
+        swap_bytes(program, sizeof(unsigned int), 4);
 }
 
-static EvalResult get_token(EvalContext *ctx)
+/* symbols are only valid in the process that interned them, images carry names alone */
+static void program_clear_symbols(EvalProgram *program)
 {
-    char c;
+    const EvalCode *code = program_code(program);
+    char *pool = (char *)program_pool(program);
+    size_t i;
 
-    for (;;)
+    for (i = 0; i < program->nr_code; i++)
     {
-        c = get_char(ctx);
+        EvalOpcode op = EVAL_CODE_OP(code[i]);
 
-        if (c == '\0')
-        {
-            put_char(ctx);
-            ctx->token.type = EVAL_TOKEN_TYPE_END;
-            return EVAL_RESULT_OK;
-        }
-        else if (c <= ' ')
-        {
-            continue;
-        }
-        else if (is_digit(c) || is_dp(c))
-        {
-            put_char(ctx);
-            return get_number(ctx);
-        }
-        else if (is_name_start(c))
-        {
-            put_char(ctx);
-            return get_name(ctx, EVAL_TOKEN_TYPE_FUNC);
-        }
-        else if (c == '$')
+        if (op == EVAL_OP_VARIABLE || op == EVAL_OP_CALL)
         {
-            return get_name(ctx, EVAL_TOKEN_TYPE_VARIABLE);
+            memset(pool + EVAL_CODE_ARG(code[i]) + sizeof(unsigned int), 0x00, sizeof(EvalSymbol));
         }
-        else if (c == '"')
+        else if (op == EVAL_OP_BUILTIN)
         {
-            return get_string(ctx, EVAL_TOKEN_TYPE_STRING);
+            EvalBuiltinEntry entry;
+
+            memcpy(&entry, pool + EVAL_CODE_ARG(code[i]), sizeof(entry));
+            if (entry.needle != EVAL_NO_NEEDLE)
+                memset(pool + entry.needle + sizeof(unsigned int), 0x00, sizeof(EvalSymbol));
         }
-        else
-            switch (c)
-            {
-            case '>':
-            {
-                char next_c = get_char(ctx);
-                if (next_c == '=')
-                {
-                    ctx->token.type = EVAL_TOKEN_TYPE_GE;
-                }
-                else
-                {
-                    put_char(ctx);
-                    ctx->token.type = EVAL_TOKEN_TYPE_G;
-                }
-                break;
-            }
-            case '<':
-            {
-                char next_c = get_char(ctx);
-                if (next_c == '=')
-                {
-                    ctx->token.type = EVAL_TOKEN_TYPE_LE;
-                }
-                else
-                {
-                    put_char(ctx);
-                    ctx->token.type = EVAL_TOKEN_TYPE_L;
-                }
-                break;
-            }
-            case '!':
-            {
-                char next_c = get_char(ctx);
-                if (next_c == '=')
-                {
-                    ctx->token.type = EVAL_TOKEN_TYPE_NE;
-                }
-                else
-                {
-                    put_char(ctx);
-                    ctx->token.type = EVAL_TOKEN_TYPE_NOT;
-                }
-                break;
-            }
-            case '&':
-            {
-                char next_c = get_char(ctx);
-                if (next_c == '&')
-                {
-                    ctx->token.type = EVAL_TOKEN_TYPE_AND;
-                }
-                else
-                {
-                    put_char(ctx);
-                    ctx->token.type = EVAL_TOKEN_TYPE_BITS_AND;
-                }
-                break;
-            }
-            case '|':
-            {
-                char next_c = get_char(ctx);
-                if (next_c == '|')
-                {
-                    ctx->token.type = EVAL_TOKEN_TYPE_OR;
-                }
-                else
-                {
-                    put_char(ctx);
-                    ctx->token.type = EVAL_TOKEN_TYPE_BITS_OR;
-                }
-                break;
-            }
-            case '=':
-            {
-                char next_c = get_char(ctx);
-                ctx->token.type = EVAL_TOKEN_TYPE_E;
-                if (next_c != '=')
-                {
-                    put_char(ctx);
-                }
-                break;
-            }
-            case '~':
-                ctx->token.type = EVAL_TOKEN_TYPE_BITS_NOT;
-                break;
-            case '+':
-                ctx->token.type = EVAL_TOKEN_TYPE_ADD;
-                break;
-            case '-':
-                ctx->token.type = EVAL_TOKEN_TYPE_SUBTRACT;
-                break;
-            case '*':
-                ctx->token.type = EVAL_TOKEN_TYPE_MULTIPLY;
-                break;
-            case '/':
-                ctx->token.type = EVAL_TOKEN_TYPE_DIVIDE;
-                break;
-            case '(':
-                ctx->token.type = EVAL_TOKEN_TYPE_OPEN_BRACKET;
-                break;
-            case ')':
-                ctx->token.type = EVAL_TOKEN_TYPE_CLOSE_BRACKET;
-                break;
+    }
+}
 
-            default:
-                return EVAL_RESULT_ILLEGAL_CHARACTER;
-            }
+static size_t program_size(const EvalProgram *program)
+{
+    return sizeof(EvalProgram) + program->nr_numbers * sizeof(double) +
+           program->nr_code * sizeof(EvalCode) + program->pool_size;
+}
 
-        return EVAL_RESULT_OK;
-    }
+/* the reflected CRC-32 of zlib, polynomial 0xedb88320, one entry per byte */
+static const unsigned int eval_crc32_table[256] =
+{
+    0x00000000u, 0x77073096u, 0xee0e612cu, 0x990951bau, 0x076dc419u, 0x706af48fu,
+    0xe963a535u, 0x9e6495a3u, 0x0edb8832u, 0x79dcb8a4u, 0xe0d5e91eu, 0x97d2d988u,
+    0x09b64c2bu, 0x7eb17cbdu, 0xe7b82d07u, 0x90bf1d91u, 0x1db71064u, 0x6ab020f2u,
+    0xf3b97148u, 0x84be41deu, 0x1adad47du, 0x6ddde4ebu, 0xf4d4b551u, 0x83d385c7u,
+    0x136c9856u, 0x646ba8c0u, 0xfd62f97au, 0x8a65c9ecu, 0x14015c4fu, 0x63066cd9u,
+    0xfa0f3d63u, 0x8d080df5u, 0x3b6e20c8u, 0x4c69105eu, 0xd56041e4u, 0xa2677172u,
+    0x3c03e4d1u, 0x4b04d447u, 0xd20d85fdu, 0xa50ab56bu, 0x35b5a8fau, 0x42b2986cu,
+    0xdbbbc9d6u, 0xacbcf940u, 0x32d86ce3u, 0x45df5c75u, 0xdcd60dcfu, 0xabd13d59u,
+    0x26d930acu, 0x51de003au, 0xc8d75180u, 0xbfd06116u, 0x21b4f4b5u, 0x56b3c423u,
+    0xcfba9599u, 0xb8bda50fu, 0x2802b89eu, 0x5f058808u, 0xc60cd9b2u, 0xb10be924u,
+    0x2f6f7c87u, 0x58684c11u, 0xc1611dabu, 0xb6662d3du, 0x76dc4190u, 0x01db7106u,
+    0x98d220bcu, 0xefd5102au, 0x71b18589u, 0x06b6b51fu, 0x9fbfe4a5u, 0xe8b8d433u,
+    0x7807c9a2u, 0x0f00f934u, 0x9609a88eu, 0xe10e9818u, 0x7f6a0dbbu, 0x086d3d2du,
+    0x91646c97u, 0xe6635c01u, 0x6b6b51f4u, 0x1c6c6162u, 0x856530d8u, 0xf262004eu,
+    0x6c0695edu, 0x1b01a57bu, 0x8208f4c1u, 0xf50fc457u, 0x65b0d9c6u, 0x12b7e950u,
+    0x8bbeb8eau, 0xfcb9887cu, 0x62dd1ddfu, 0x15da2d49u, 0x8cd37cf3u, 0xfbd44c65u,
+    0x4db26158u, 0x3ab551ceu, 0xa3bc0074u, 0xd4bb30e2u, 0x4adfa541u, 0x3dd895d7u,
+    0xa4d1c46du, 0xd3d6f4fbu, 0x4369e96au, 0x346ed9fcu, 0xad678846u, 0xda60b8d0u,
+    0x44042d73u, 0x33031de5u, 0xaa0a4c5fu, 0xdd0d7cc9u, 0x5005713cu, 0x270241aau,
+    0xbe0b1010u, 0xc90c2086u, 0x5768b525u, 0x206f85b3u, 0xb966d409u, 0xce61e49fu,
+    0x5edef90eu, 0x29d9c998u, 0xb0d09822u, 0xc7d7a8b4u, 0x59b33d17u, 0x2eb40d81u,
+    0xb7bd5c3bu, 0xc0ba6cadu, 0xedb88320u, 0x9abfb3b6u, 0x03b6e20cu, 0x74b1d29au,
+    0xead54739u, 0x9dd277afu, 0x04db2615u, 0x73dc1683u, 0xe3630b12u, 0x94643b84u,
+    0x0d6d6a3eu, 0x7a6a5aa8u, 0xe40ecf0bu, 0x9309ff9du, 0x0a00ae27u, 0x7d079eb1u,
+    0xf00f9344u, 0x8708a3d2u, 0x1e01f268u, 0x6906c2feu, 0xf762575du, 0x806567cbu,
+    0x196c3671u, 0x6e6b06e7u, 0xfed41b76u, 0x89d32be0u, 0x10da7a5au, 0x67dd4accu,
+    0xf9b9df6fu, 0x8ebeeff9u, 0x17b7be43u, 0x60b08ed5u, 0xd6d6a3e8u, 0xa1d1937eu,
+    0x38d8c2c4u, 0x4fdff252u, 0xd1bb67f1u, 0xa6bc5767u, 0x3fb506ddu, 0x48b2364bu,
+    0xd80d2bdau, 0xaf0a1b4cu, 0x36034af6u, 0x41047a60u, 0xdf60efc3u, 0xa867df55u,
+    0x316e8eefu, 0x4669be79u, 0xcb61b38cu, 0xbc66831au, 0x256fd2a0u, 0x5268e236u,
+    0xcc0c7795u, 0xbb0b4703u, 0x220216b9u, 0x5505262fu, 0xc5ba3bbeu, 0xb2bd0b28u,
+    0x2bb45a92u, 0x5cb36a04u, 0xc2d7ffa7u, 0xb5d0cf31u, 0x2cd99e8bu, 0x5bdeae1du,
+    0x9b64c2b0u, 0xec63f226u, 0x756aa39cu, 0x026d930au, 0x9c0906a9u, 0xeb0e363fu,
+    0x72076785u, 0x05005713u, 0x95bf4a82u, 0xe2b87a14u, 0x7bb12baeu, 0x0cb61b38u,
+    0x92d28e9bu, 0xe5d5be0du, 0x7cdcefb7u, 0x0bdbdf21u, 0x86d3d2d4u, 0xf1d4e242u,
+    0x68ddb3f8u, 0x1fda836eu, 0x81be16cdu, 0xf6b9265bu, 0x6fb077e1u, 0x18b74777u,
+    0x88085ae6u, 0xff0f6a70u, 0x66063bcau, 0x11010b5cu, 0x8f659effu, 0xf862ae69u,
+    0x616bffd3u, 0x166ccf45u, 0xa00ae278u, 0xd70dd2eeu, 0x4e048354u, 0x3903b3c2u,
+    0xa7672661u, 0xd06016f7u, 0x4969474du, 0x3e6e77dbu, 0xaed16a4au, 0xd9d65adcu,
+    0x40df0b66u, 0x37d83bf0u, 0xa9bcae53u, 0xdebb9ec5u, 0x47b2cf7fu, 0x30b5ffe9u,
+    0xbdbdf21cu, 0xcabac28au, 0x53b39330u, 0x24b4a3a6u, 0xbad03605u, 0xcdd70693u,
+    0x54de5729u, 0x23d967bfu, 0xb3667a2eu, 0xc4614ab8u, 0x5d681b02u, 0x2a6f2b94u,
+    0xb40bbe37u, 0xc30c8ea1u, 0x5a05df1bu, 0x2d02ef8du
+};
+
+static unsigned int eval_crc32(const unsigned char *data, size_t size)
+{
+    unsigned int crc = 0xffffffff;
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        crc = eval_crc32_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+
+    return crc ^ 0xffffffff;
 }
 
-static EvalResult parse_term(EvalContext *ctx, ExprValue *output)
+EvalResult eval_image_write(FILE *fp, const EvalProgram *const *programs, size_t nr_programs)
 {
-    EvalResult result;
+    unsigned char *image;
+    size_t size;
+    size_t offset;
+    size_t i;
 
-    if (ctx->token.type == EVAL_TOKEN_TYPE_NUMBER)
-    {
-        expr_value_set_number(output, ctx->token.value.number);
-    }
-    else if (ctx->token.type == EVAL_TOKEN_TYPE_STRING)
-    {
-        expr_value_set_string(output, ctx->str.str, ctx->str.size);
-    }
-    else if (ctx->token.type == EVAL_TOKEN_TYPE_OPEN_BRACKET)
+    size = EVAL_IMAGE_ALIGN(EVAL_IMAGE_HEADER_SIZE + nr_programs * 4);
+    for (i = 0; i < nr_programs; i++)
+        size += EVAL_IMAGE_ALIGN(program_size(programs[i]));
+
+    if (size > 0xffffffff)
+        return EVAL_RESULT_OOM;
+
+    image = (unsigned char *)eval_calloc(1, size);
+    if (image == NULL)
+        return EVAL_RESULT_OOM;
+
+    memcpy(image, EVAL_IMAGE_MAGIC, sizeof(EVAL_IMAGE_MAGIC));
+    store_le32(image + 8, EVAL_IMAGE_VERSION);
+    store_le32(image + 12, (unsigned int)nr_programs);
+    store_le32(image + 16, (unsigned int)size);
+
+    offset = EVAL_IMAGE_ALIGN(EVAL_IMAGE_HEADER_SIZE + nr_programs * 4);
+    for (i = 0; i < nr_programs; i++)
     {
-        result = get_token(ctx);
-        if (result != EVAL_RESULT_OK)
-            return result;
+        size_t n = program_size(programs[i]);
 
-        result = parse_expr(ctx, output);
-        if (result != EVAL_RESULT_OK)
-            return result;
+        store_le32(image + EVAL_IMAGE_HEADER_SIZE + i * 4, (unsigned int)offset);
+        memcpy(image + offset, programs[i], n);
+        program_clear_symbols((EvalProgram *)(image + offset));
+        if (is_big_endian())
+            program_swap((EvalProgram *)(image + offset), 0);
 
-        if (ctx->token.type != EVAL_TOKEN_TYPE_CLOSE_BRACKET)
-        {
-            return EVAL_RESULT_EXPECTED_CLOSE_BRACKET;
-        }
+        offset += EVAL_IMAGE_ALIGN(n);
     }
-    else if (ctx->token.type == EVAL_TOKEN_TYPE_FUNC)
-    {
-        EvalFunc func;
-        ExprValue arg;
-        expr_value_init(&arg);
 
-        if (!ctx->hooks || !ctx->hooks->get_func)
-        {
-            return EVAL_RESULT_UNDEFINED_FUNCTION;
-        }
+    store_le32(image + 20, eval_crc32(image + EVAL_IMAGE_HEADER_SIZE, size - EVAL_IMAGE_HEADER_SIZE));
 
-        func = ctx->hooks->get_func(ctx->token.value.name, ctx->user_data);
-        if (!func)
-            return EVAL_RESULT_UNDEFINED_FUNCTION;
+    i = fwrite(image, 1, size, fp);
+    EVAL_FREE(image);
 
-        result = get_token(ctx);
-        if (result != EVAL_RESULT_OK)
-            return result;
+    return i == size ? EVAL_RESULT_OK : EVAL_RESULT_IO_ERROR;
+}
 
-        if (ctx->token.type != EVAL_TOKEN_TYPE_OPEN_BRACKET)
-        {
-            return EVAL_RESULT_EXPECTED_OPEN_BRACKET;
-        }
+static int is_binary_op(size_t type)
+{
+    return type == EVAL_TOKEN_TYPE_ADD || type == EVAL_TOKEN_TYPE_SUBTRACT || is_product_op((int)type);
+}
 
-        result = get_token(ctx);
-        if (result != EVAL_RESULT_OK)
-            return result;
+/* a length prefixed string inside the pool, with no symbol */
+static int pool_string_valid(const EvalProgram *program, size_t offset)
+{
+    const char *pool = program_pool(program);
+    unsigned int len;
+
+    if (offset % sizeof(unsigned int) || offset + 2 * sizeof(unsigned int) > program->pool_size ||
+        program_symbol(program, offset) != EVAL_SYMBOL_NONE)
+        return 0;
+
+    memcpy(&len, pool + offset, sizeof(len));
+
+    return len < program->pool_size - offset - 2 * sizeof(unsigned int) &&
+           pool[offset + 2 * sizeof(unsigned int) + len] == '\0';
+}
+
+/* the number of values a builtin call takes off the stack, 0 when its entry is not sound */
+static size_t pool_builtin_values(const EvalProgram *program, size_t offset)
+{
+    EvalBuiltinEntry entry;
+    size_t len;
+
+    if (offset % sizeof(unsigned int) || offset + sizeof(entry) > program->pool_size)
+        return 0;
+
+    memcpy(&entry, program_pool(program) + offset, sizeof(entry));
+    if (entry.builtin >= EVAL_NR_BUILTINS || entry.nr_args < EVAL_BUILTINS[entry.builtin].min_args ||
+        entry.nr_args > EVAL_BUILTINS[entry.builtin].max_args)
+        return 0;
+
+    if (entry.needle == EVAL_NO_NEEDLE)
+        return entry.nr_args;
+
+    if (!EVAL_BUILTINS[entry.builtin].needle || !pool_string_valid(program, entry.needle))
+        return 0;
+
+    program_string(program, entry.needle, &len);
+    if (len ? (entry.first >= len || entry.second >= len) : (entry.first || entry.second))
+        return 0;
 
-        result = parse_expr(ctx, &arg);
-        if (result != EVAL_RESULT_OK)
-            return result;
+    return entry.nr_args - 1;
+}
 
-        if (ctx->token.type != EVAL_TOKEN_TYPE_CLOSE_BRACKET)
+/* a set whose probes all end at an empty slot and whose slots and items are in bounds */
+static int pool_set_valid(const EvalProgram *program, size_t offset)
+{
+    EvalSetEntry set;
+    const unsigned int *items;
+    const unsigned int *texts;
+    const unsigned int *numbers;
+    size_t nr_texts = 0;
+    size_t nr_numbers = 0;
+    size_t len;
+    size_t i;
+
+    if (offset % sizeof(unsigned int) || offset + sizeof(set) > program->pool_size)
+        return 0;
+
+    items = set_entry(program, offset, &set);
+    if (set.negate > 1 || set.has_strings > 1 || set.nr_items > program->pool_size || set.mask >= program->pool_size ||
+        (set.mask & (set.mask + 1)) ||
+        offset + EVAL_SET_WORDS(set.nr_items, set.mask) * sizeof(unsigned int) > program->pool_size)
+        return 0;
+
+    texts = items + set.nr_items;
+    numbers = texts + 2 * ((size_t)set.mask + 1);
+    for (i = 0; i <= set.mask; i++)
+    {
+        if (texts[2 * i + 1] != EVAL_SET_EMPTY)
         {
-            return EVAL_RESULT_EXPECTED_CLOSE_BRACKET;
+            if (!pool_string_valid(program, texts[2 * i + 1] & ~(unsigned int)EVAL_SET_NUMBER_TEXT))
+                return 0;
+            program_string(program, texts[2 * i + 1] & ~(unsigned int)EVAL_SET_NUMBER_TEXT, &len);
+            if (len > set.max_len)
+                return 0;
+            nr_texts++;
+        }
+        if (numbers[i] != EVAL_SET_EMPTY)
+        {
+            if (numbers[i] >= program->nr_numbers)
+                return 0;
+            nr_numbers++;
         }
-
-        result = func(&arg, ctx->user_data, output);
-        if (result != EVAL_RESULT_OK)
-            return result;
-        expr_value_clear(&arg);
     }
-    else if (ctx->token.type == EVAL_TOKEN_TYPE_VARIABLE)
+    if (nr_texts > set.mask || nr_numbers > set.mask)
+        return 0;
+
+    for (i = 0; i < set.nr_items; i++)
     {
-        if (!ctx->hooks || !ctx->hooks->get_variable)
+        if (items[i] & EVAL_SET_NUMBER)
         {
-            return EVAL_RESULT_UNDEFINED_VARIABLE;
+            if ((items[i] & ~(unsigned int)EVAL_SET_NUMBER) >= program->nr_numbers)
+                return 0;
+        }
+        else if (items[i] > set.mask || texts[2 * items[i] + 1] == EVAL_SET_EMPTY ||
+                 (texts[2 * items[i] + 1] & EVAL_SET_NUMBER_TEXT))
+        {
+            return 0;
         }
-
-        result = ctx->hooks->get_variable(ctx->token.value.name, ctx->user_data, output);
-        if (result != EVAL_RESULT_OK)
-            return result;
     }
-    else
+
+    return 1;
+}
+
+/* the number of slots of a return whose names are all in the pool, EVAL_NO_LOCAL when its entry is not sound */
+static size_t pool_return_slots(const EvalProgram *program, size_t offset)
+{
+    const unsigned int *names;
+    size_t nr_slots;
+    size_t i;
+
+    if (offset % sizeof(unsigned int) || offset + sizeof(unsigned int) > program->pool_size)
+        return EVAL_NO_LOCAL;
+
+    names = program_locals(program, offset, &nr_slots);
+    if (nr_slots > program->pool_size || offset + (nr_slots + 1) * sizeof(unsigned int) > program->pool_size)
+        return EVAL_NO_LOCAL;
+
+    for (i = 0; i < nr_slots; i++)
     {
-        return EVAL_RESULT_EXPECTED_TERM;
+        if (names[i] != EVAL_NO_NAME && !pool_string_valid(program, names[i]))
+            return EVAL_NO_LOCAL;
     }
 
-    return get_token(ctx);
+    return nr_slots;
 }
 
-static EvalResult parse_unary(EvalContext *ctx, ExprValue *output)
+/* checks that a program can be executed without reading out of bounds */
+static EvalResult program_verify(const EvalProgram *program, size_t size)
 {
-    EvalResult result;
-    int neg = 0;
-    int not = 0;
-    int bit_not = 0;
-    ExprValue value;
+    const EvalCode *code;
+    const unsigned int *names = NULL;
+    size_t nr_slots = 0;
+    size_t depth = 0;
+    size_t i;
 
-    expr_value_init(&value);
+    if (size < sizeof(EvalProgram) || program->nr_code == 0 || program->pool_size % sizeof(unsigned int) ||
+        program->nr_numbers > size / sizeof(double) || program->nr_code > size / sizeof(EvalCode) ||
+        program->pool_size > size || program_size(program) > size)
+        return EVAL_RESULT_INVALID_IMAGE;
 
-    for (;;)
+    code = program_code(program);
+
+    /* locals are named by the return that ends the program */
+    if (EVAL_CODE_OP(code[program->nr_code - 1]) == EVAL_OP_RETURN)
     {
-        if (ctx->token.type == EVAL_TOKEN_TYPE_NOT)
-        {
-            not = !not;
+        if (pool_return_slots(program, EVAL_CODE_ARG(code[program->nr_code - 1])) == EVAL_NO_LOCAL)
+            return EVAL_RESULT_INVALID_IMAGE;
+        names = program_locals(program, EVAL_CODE_ARG(code[program->nr_code - 1]), &nr_slots);
+    }
 
-            result = get_token(ctx);
-            if (result != EVAL_RESULT_OK)
-                return result;
-        }
-        else if (ctx->token.type == EVAL_TOKEN_TYPE_BITS_NOT)
-        {
-            bit_not = !bit_not;
+    for (i = 0; i < program->nr_code; i++)
+    {
+        size_t arg = EVAL_CODE_ARG(code[i]);
 
-            result = get_token(ctx);
-            if (result != EVAL_RESULT_OK)
-                return result;
-        }
-        else if (ctx->token.type == EVAL_TOKEN_TYPE_SUBTRACT)
+        switch (EVAL_CODE_OP(code[i]))
         {
-            neg = !neg;
+        case EVAL_OP_NUMBER:
+            if (arg >= program->nr_numbers)
+                return EVAL_RESULT_INVALID_IMAGE;
+            depth++;
+            break;
+        case EVAL_OP_STRING:
+        case EVAL_OP_VARIABLE:
+        case EVAL_OP_CALL:
+            if (!pool_string_valid(program, arg))
+                return EVAL_RESULT_INVALID_IMAGE;
+
+            if (EVAL_CODE_OP(code[i]) != EVAL_OP_CALL)
+                depth++;
+            else if (depth < 1)
+                return EVAL_RESULT_INVALID_IMAGE;
+            break;
+        case EVAL_OP_BUILTIN:
+        {
+            size_t nr_values = pool_builtin_values(program, arg);
 
-            result = get_token(ctx);
-            if (result != EVAL_RESULT_OK)
-                return result;
+            if (nr_values == 0 || depth < nr_values)
+                return EVAL_RESULT_INVALID_IMAGE;
+            depth -= nr_values - 1;
+            break;
         }
-        else
-        {
+        case EVAL_OP_UNARY:
+            if (depth < 1 || arg > (EVAL_UNARY_NEG | EVAL_UNARY_NOT | EVAL_UNARY_BITS_NOT))
+                return EVAL_RESULT_INVALID_IMAGE;
+            break;
+        case EVAL_OP_IN:
+            if (depth < 1 || !pool_set_valid(program, arg))
+                return EVAL_RESULT_INVALID_IMAGE;
+            break;
+        case EVAL_OP_BINARY:
+            if (depth < 2 || !is_binary_op(arg))
+                return EVAL_RESULT_INVALID_IMAGE;
+            depth--;
+            break;
+        case EVAL_OP_LOCAL:
+            if (names == NULL || arg >= nr_slots || arg >= depth || names[arg] == EVAL_NO_NAME)
+                return EVAL_RESULT_INVALID_IMAGE;
+            depth++;
             break;
+        case EVAL_OP_RETURN:
+            if (i != program->nr_code - 1 || depth != nr_slots + 1)
+                return EVAL_RESULT_INVALID_IMAGE;
+            depth = 1;
+            break;
+        default:
+            return EVAL_RESULT_INVALID_IMAGE;
         }
+
+        if (depth > program->max_stack)
+            return EVAL_RESULT_INVALID_IMAGE;
     }
 
-    result = parse_term(ctx, &value);
-    if (result != EVAL_RESULT_OK)
-        return result;
+    return depth == 1 ? EVAL_RESULT_OK : EVAL_RESULT_INVALID_IMAGE;
+}
 
-    if (value.type == EXPR_VALUE_TYPE_NUMBER)
-    {
-        if (neg)
-        {
-            value.v.val = -value.v.val;
-        }
-        if (not)
-        {
-            value.v.val = !value.v.val;
-        }
-        if (bit_not)
-        {
-            value.v.val = ~(unsigned int)value.v.val;
-        }
-    }
-    if (value.type == EXPR_VALUE_TYPE_STRING)
+static EvalResult image_verify(const unsigned char *data, size_t size, int swap)
+{
+    size_t nr_programs;
+    size_t i;
+
+    if (size < EVAL_IMAGE_HEADER_SIZE || memcmp(data, EVAL_IMAGE_MAGIC, sizeof(EVAL_IMAGE_MAGIC)) != 0 ||
+        load_le32(data + 8) != EVAL_IMAGE_VERSION || load_le32(data + 16) != size ||
+        load_le32(data + 20) != eval_crc32(data + EVAL_IMAGE_HEADER_SIZE, size - EVAL_IMAGE_HEADER_SIZE))
+        return EVAL_RESULT_INVALID_IMAGE;
+
+    nr_programs = load_le32(data + 12);
+    if (nr_programs > (size - EVAL_IMAGE_HEADER_SIZE) / 4)
+        return EVAL_RESULT_INVALID_IMAGE;
+
+    for (i = 0; i < nr_programs; i++)
     {
-        if (not)
+        size_t offset = load_le32(data + EVAL_IMAGE_HEADER_SIZE + i * 4);
+        EvalProgram *program = (EvalProgram *)(data + offset);
+        EvalResult result;
+
+        if (offset % 8 || offset < EVAL_IMAGE_HEADER_SIZE + nr_programs * 4 || offset + sizeof(EvalProgram) > size)
+            return EVAL_RESULT_INVALID_IMAGE;
+
+        if (swap)
         {
-            expr_value_set_number(&value, !value.v.str.size);
+            /* the header is swapped first so the counts can be checked before touching the rest */
+            swap_bytes(program, sizeof(unsigned int), 4);
+            if (program_size(program) > size - offset)
+                return EVAL_RESULT_INVALID_IMAGE;
+            swap_bytes(program, sizeof(unsigned int), 4);
+            program_swap(program, 1);
         }
-    }
 
-    *output = value;
+        result = program_verify(program, size - offset);
+        if (result != EVAL_RESULT_OK)
+            return result;
+    }
 
     return EVAL_RESULT_OK;
 }
 
-static EvalResult parse_product(EvalContext *ctx, ExprValue *output)
+EvalResult eval_image_load(const void *data, size_t size, EvalImage **image)
 {
+    EvalImage *img;
     EvalResult result;
-    ExprValue lhs;
-    ExprValue rhs;
 
-    expr_value_init(&lhs);
-    expr_value_init(&rhs);
+    *image = NULL;
 
-    result = parse_unary(ctx, &lhs);
-    if (result != EVAL_RESULT_OK)
-        return result;
+    if (((size_t)data) % 8)
+        return EVAL_RESULT_INVALID_IMAGE;
 
-    for (;;)
-    {
-        int type = ctx->token.type;
-        if (type == EVAL_TOKEN_TYPE_MULTIPLY || type == EVAL_TOKEN_TYPE_DIVIDE || type == EVAL_TOKEN_TYPE_E || type == EVAL_TOKEN_TYPE_L || type == EVAL_TOKEN_TYPE_G || type == EVAL_TOKEN_TYPE_NE || type == EVAL_TOKEN_TYPE_LE || type == EVAL_TOKEN_TYPE_GE || type == EVAL_TOKEN_TYPE_OR || type == EVAL_TOKEN_TYPE_AND || type == EVAL_TOKEN_TYPE_BITS_OR || type == EVAL_TOKEN_TYPE_BITS_AND)
-        {
-            result = get_token(ctx);
-            if (result != EVAL_RESULT_OK)
-                return result;
+    img = (EvalImage *)eval_calloc(1, sizeof(EvalImage));
+    if (img == NULL)
+        return EVAL_RESULT_OOM;
 
-            result = parse_unary(ctx, &rhs);
-            if (result != EVAL_RESULT_OK)
-                return result;
+    img->data = (const unsigned char *)data;
+    img->size = size;
 
-            expr_value_op(&lhs, &rhs, type);
-        }
-        else
+    if (is_big_endian())
+    {
+        img->buffer = EVAL_MALLOC(size ? size : 1);
+        if (img->buffer == NULL)
         {
-            break;
+            EVAL_FREE(img);
+            return EVAL_RESULT_OOM;
         }
+
+        memcpy(img->buffer, data, size);
+        img->data = (const unsigned char *)img->buffer;
     }
 
-    *output = lhs;
-    expr_value_clear(&rhs);
+    result = image_verify(img->data, size, img->buffer != NULL);
+    if (result != EVAL_RESULT_OK)
+    {
+        EVAL_FREE(img->buffer);
+        EVAL_FREE(img);
+        return result;
+    }
+
+    img->nr_programs = load_le32(img->data + 12);
+    *image = img;
 
     return EVAL_RESULT_OK;
 }
 
-static EvalResult parse_sum(EvalContext *ctx, ExprValue *output)
+EvalResult eval_image_open(const char *filename, EvalImage **image)
 {
-    ExprValue lhs;
-    ExprValue rhs;
+    EvalMappedFile file;
     EvalResult result;
 
-    expr_value_init(&lhs);
-    expr_value_init(&rhs);
-
-    result = parse_product(ctx, &lhs);
+    result = eval_file_map(filename, &file);
     if (result != EVAL_RESULT_OK)
         return result;
 
-    for (;;)
+    result = eval_image_load(file.data, file.size, image);
+    if (result != EVAL_RESULT_OK)
     {
-        int type = ctx->token.type;
-        if (type == EVAL_TOKEN_TYPE_ADD || type == EVAL_TOKEN_TYPE_SUBTRACT)
-        {
-            result = get_token(ctx);
-            if (result != EVAL_RESULT_OK)
-                return result;
+        eval_file_unmap(&file);
+        return result;
+    }
 
-            result = parse_product(ctx, &rhs);
-            if (result != EVAL_RESULT_OK)
-                return result;
+    (*image)->file = file;
 
-            expr_value_op(&lhs, &rhs, type);
-        }
-        else
-        {
-            break;
-        }
+    return EVAL_RESULT_OK;
+}
+
+void eval_image_close(EvalImage *image)
+{
+    if (image)
+    {
+        eval_file_unmap(&(image->file));
+        EVAL_FREE(image->buffer);
+        EVAL_FREE(image);
     }
+}
 
-    *output = lhs;
-    expr_value_clear(&rhs);
+size_t eval_image_count(const EvalImage *image)
+{
+    return image->nr_programs;
+}
 
-    return EVAL_RESULT_OK;
+const EvalProgram *eval_image_get(const EvalImage *image, size_t index)
+{
+    if (index >= image->nr_programs)
+        return NULL;
+
+    return (const EvalProgram *)(image->data + load_le32(image->data + EVAL_IMAGE_HEADER_SIZE + index * 4));
 }
 
-static EvalResult parse_expr(EvalContext *ctx, ExprValue *output)
+#ifdef WIN32
+
+EvalResult eval_file_map(const char *filename, EvalMappedFile *file)
 {
-    EvalResult result;
+    HANDLE fh;
+    HANDLE mapping;
+    LARGE_INTEGER size;
 
-    if (ctx->stack_level >= EVAL_MAX_STACK_DEPTH)
+    memset(file, 0x00, sizeof(EvalMappedFile));
+
+    fh = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (fh == INVALID_HANDLE_VALUE)
+        return EVAL_RESULT_IO_ERROR;
+
+    if (!GetFileSizeEx(fh, &size))
     {
-        return EVAL_RESULT_STACK_OVERFLOW;
+        CloseHandle(fh);
+        return EVAL_RESULT_IO_ERROR;
     }
 
-    ctx->stack_level++;
-    result = parse_sum(ctx, output);
-    ctx->stack_level--;
+    file->size = (size_t)size.QuadPart;
+    if (file->size == 0)
+    {
+        CloseHandle(fh);
+        return EVAL_RESULT_OK;
+    }
 
-    return result;
+    mapping = CreateFileMappingA(fh, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(fh);
+    if (mapping == NULL)
+        return EVAL_RESULT_IO_ERROR;
+
+    file->data = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+
+    return file->data ? EVAL_RESULT_OK : EVAL_RESULT_IO_ERROR;
 }
 
-EvalResult eval_execute(const char *expression, const EvalHooks *hooks,
-                        void *user_data, ExprValue *output)
+void eval_file_unmap(EvalMappedFile *file)
 {
-    EvalContext ctx;
-    EvalResult result;
+    if (file->data)
+        UnmapViewOfFile(file->data);
+    memset(file, 0x00, sizeof(EvalMappedFile));
+}
 
-    expr_str_init(&ctx.str, 100);
+#else
 
-    ctx.hooks = hooks;
-    ctx.user_data = user_data;
-    ctx.input = expression;
-    ctx.stack_level = 0;
+EvalResult eval_file_map(const char *filename, EvalMappedFile *file)
+{
+    struct stat st;
+    void *data;
+    int fd;
 
-    result = get_token(&ctx);
-    if (result != EVAL_RESULT_OK)
-        return result;
+    memset(file, 0x00, sizeof(EvalMappedFile));
 
-    result = parse_expr(&ctx, output);
-    if (result != EVAL_RESULT_OK)
-        return result;
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return EVAL_RESULT_IO_ERROR;
 
-    result = (ctx.token.type == EVAL_TOKEN_TYPE_END) ? EVAL_RESULT_OK : EVAL_RESULT_UNEXPECTED_CHAR;
-    expr_str_clear(&ctx.str);
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return EVAL_RESULT_IO_ERROR;
+    }
 
-    return result;
+    file->size = (size_t)st.st_size;
+    if (file->size == 0)
+    {
+        close(fd);
+        return EVAL_RESULT_OK;
+    }
+
+    data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return EVAL_RESULT_IO_ERROR;
+
+    file->data = (const char *)data;
+
+    return EVAL_RESULT_OK;
+}
+
+void eval_file_unmap(EvalMappedFile *file)
+{
+    if (file->data)
+        munmap((void *)file->data, file->size);
+    memset(file, 0x00, sizeof(EvalMappedFile));
 }
 
+#endif
+
 static EvalResult func_number(const ExprValue *input, void *user_data, ExprValue *output)
 {
     (void)user_data;
@@ -1123,23 +9172,79 @@ static EvalResult func_strlen(const ExprValue *input, void *user_data, ExprValue
     return EVAL_RESULT_OK;
 }
 
+/*
+ * String transforms, done in place 16 bytes at a time and the tail a byte at
+ * a time. Case conversion is ASCII only: bytes from 0x80 up are left alone,
+ * as toupper() and tolower() do in the C locale.
+ */
+static void str_convert_case(char *p, size_t n, char first)
+{
+    size_t i = 0;
+#ifdef EVAL_HAVE_SSE2
+    const __m128i before = _mm_set1_epi8((char)(first - 1));
+    const __m128i after = _mm_set1_epi8((char)(first + 26));
+    const __m128i flip = _mm_set1_epi8(0x20);
+
+    /* signed compare: the bytes from 0x80 up are below both bounds */
+    for (; n - i >= 16; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(x, before), _mm_cmplt_epi8(x, after));
+
+        _mm_storeu_si128((__m128i *)(p + i), _mm_xor_si128(x, _mm_and_si128(letters, flip)));
+    }
+#endif
+
+    for (; i < n; i++)
+    {
+        if ((unsigned char)(p[i] - first) < 26)
+            p[i] ^= 0x20;
+    }
+}
+
+static void str_replace_separators(char *p, size_t n)
+{
+    size_t i = 0;
+#ifdef EVAL_HAVE_SSE2
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i separator = _mm_set1_epi8(DIRECTORY_SEPARATOR_CHAR);
+
+    for (; n - i >= 16; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i found = _mm_or_si128(_mm_cmpeq_epi8(x, slash), _mm_cmpeq_epi8(x, backslash));
+
+        _mm_storeu_si128((__m128i *)(p + i), _mm_or_si128(_mm_andnot_si128(found, x), _mm_and_si128(found, separator)));
+    }
+#endif
+
+    for (; i < n; i++)
+    {
+        if (p[i] == '/' || p[i] == '\\')
+            p[i] = DIRECTORY_SEPARATOR_CHAR;
+    }
+}
+
+/* the string argument in output, taken when the evaluator gives it up and copied otherwise */
+static EvalResult func_own_input(const ExprValue *input, ExprValue *output)
+{
+    if (take_input(input, output))
+        return EVAL_RESULT_OK;
+
+    return expr_value_set_string(output, input->v.str.str, input->v.str.size);
+}
+
 static EvalResult func_path(const ExprValue *input, void *user_data, ExprValue *output)
 {
     (void)user_data;
     if (input->type == EXPR_VALUE_TYPE_STRING)
     {
-        size_t i = 0;
-        char* p = NULL;  
-        size_t n = input->v.str.size;
-        expr_value_set_string(output, input->v.str.str, input->v.str.size);
+        EvalResult result = func_own_input(input, output);
+        if (result != EVAL_RESULT_OK)
+            return result;
 
-        p = output->v.str.str;
-        for(i = 0; i < n; i++) {
-            char c = p[i];
-            if(c == '/' || c == '\\') {
-                p[i] = DIRECTORY_SEPARATOR_CHAR;
-            }
-        }
+        str_replace_separators(output->v.str.str, output->v.str.size);
     }
 
     return EVAL_RESULT_OK;
@@ -1150,21 +9255,17 @@ static EvalResult func_toupper(const ExprValue *input, void *user_data, ExprValu
     (void)user_data;
     if (input->type == EXPR_VALUE_TYPE_STRING)
     {
-        size_t i = 0;
-        char* p = NULL;  
-        size_t n = input->v.str.size;
-        expr_value_set_string(output, input->v.str.str, input->v.str.size);
+        EvalResult result = func_own_input(input, output);
+        if (result != EVAL_RESULT_OK)
+            return result;
 
-        p = output->v.str.str;
-        for(i = 0; i < n; i++) {
-            p[i] = toupper(p[i]);
-        }
+        str_convert_case(output->v.str.str, output->v.str.size, 'a');
     }
     else
     {
         char buff[64];
         number_to_string(input->v.val, buff, sizeof(buff));
-        expr_value_set_string(output, buff, strlen(buff));
+        return expr_value_set_string(output, buff, strlen(buff));
     }
 
     return EVAL_RESULT_OK;
@@ -1175,21 +9276,17 @@ static EvalResult func_tolower(const ExprValue *input, void *user_data, ExprValu
     (void)user_data;
     if (input->type == EXPR_VALUE_TYPE_STRING)
     {
-        size_t i = 0;
-        char* p = NULL;  
-        size_t n = input->v.str.size;
-        expr_value_set_string(output, input->v.str.str, input->v.str.size);
+        EvalResult result = func_own_input(input, output);
+        if (result != EVAL_RESULT_OK)
+            return result;
 
-        p = output->v.str.str;
-        for(i = 0; i < n; i++) {
-            p[i] = tolower(p[i]);
-        }
+        str_convert_case(output->v.str.str, output->v.str.size, 'A');
     }
     else
     {
         char buff[64];
         number_to_string(input->v.val, buff, sizeof(buff));
-        expr_value_set_string(output, buff, strlen(buff));
+        return expr_value_set_string(output, buff, strlen(buff));
     }
 
     return EVAL_RESULT_OK;
@@ -1200,15 +9297,13 @@ static EvalResult func_string(const ExprValue *input, void *user_data, ExprValue
     (void)user_data;
     if (input->type == EXPR_VALUE_TYPE_STRING)
     {
-        expr_value_set_string(output, input->v.str.str, input->v.str.size);
+        return expr_value_set_string(output, input->v.str.str, input->v.str.size);
     }
     else
     {
         expr_value_set_number(output, (expr_value_get_number(input)));
-        expr_value_to_string(output);
+        return expr_value_to_string(output);
     }
-
-    return EVAL_RESULT_OK;
 }
 
 static EvalResult func_cos(const ExprValue *input, void *user_data, ExprValue *output)
@@ -1303,45 +9398,6 @@ static EvalResult func_round(const ExprValue *input, void *user_data, ExprValue
     return EVAL_RESULT_OK;
 }
 
-static EvalFunc default_get_func(const char *name, void *user_data)
-{
-    static const EvalFunctionEntry FUNCTIONS[] =
-        {
-            {"number", func_number},
-            {"strlen", func_strlen},
-            {"path", func_path},
-            {"string", func_string},
-            {"toupper", func_toupper},
-            {"tolower", func_tolower},
-            {"cos", func_cos},
-            {"sin", func_sin},
-            {"tan", func_tan},
-            {"acos", func_acos},
-            {"asin", func_asin},
-            {"atan", func_atan},
-            {"exp", func_exp},
-            {"log", func_log},
-            {"log10", func_log10},
-            {"sqrt", func_sqrt},
-            {"ceil", func_ceil},
-            {"floor", func_floor},
-            {"round", func_round}};
-
-    const EvalFunctionEntry *i = FUNCTIONS;
-    const EvalFunctionEntry *e = i + (sizeof(FUNCTIONS) / sizeof(*FUNCTIONS));
-
-    while (i != e)
-    {
-        if (strcmp(i->name, name) == 0)
-            return i->func;
-        i++;
-    }
-
-    (void)user_data;
-
-    return 0;
-}
-
 #ifndef _HUGE_ENUF
 #define _HUGE_ENUF 1e+300
 #endif
@@ -1354,30 +9410,80 @@ static EvalFunc default_get_func(const char *name, void *user_data)
 #define NAN ((float)(INFINITY * 0.0F))
 #endif /*NAN*/
 
-static EvalResult default_get_variable(const char *name, void *user_data, ExprValue *output)
+static const EvalFunctionEntry FUNCTIONS[] =
+    {
+        {"number", func_number},
+        {"strlen", func_strlen},
+        {"path", func_path},
+        {"string", func_string},
+        {"toupper", func_toupper},
+        {"tolower", func_tolower},
+        {"cos", func_cos},
+        {"sin", func_sin},
+        {"tan", func_tan},
+        {"acos", func_acos},
+        {"asin", func_asin},
+        {"atan", func_atan},
+        {"exp", func_exp},
+        {"log", func_log},
+        {"log10", func_log10},
+        {"sqrt", func_sqrt},
+        {"ceil", func_ceil},
+        {"floor", func_floor},
+        {"round", func_round}};
+
+static const EvalVariableEntry VARIABLES[] =
+    {
+        {"INFINITY", INFINITY},
+        {"NAN", NAN},
+        {"PI", 3.14159265358979f}};
+
+#define EVAL_NR_FUNCTIONS           (sizeof(FUNCTIONS) / sizeof(*FUNCTIONS))
+#define EVAL_NR_VARIABLES           (sizeof(VARIABLES) / sizeof(*VARIABLES))
+
+/* the functions take the first symbols, the variables the ones after them */
+static const char *default_symbol_name(size_t i)
 {
-    static const EvalVariableEntry VARIABLES[] =
-        {
-            {"INFINITY", INFINITY},
-            {"NAN", NAN},
-            {"PI", 3.14159265358979f}};
+    if (i < EVAL_NR_FUNCTIONS)
+        return FUNCTIONS[i].name;
 
-    const EvalVariableEntry *i = VARIABLES;
-    const EvalVariableEntry *e = i + (sizeof(VARIABLES) / sizeof(*VARIABLES));
+    if (i < EVAL_NR_FUNCTIONS + EVAL_NR_VARIABLES)
+        return VARIABLES[i - EVAL_NR_FUNCTIONS].name;
+
+    return NULL;
+}
 
+static EvalFunc default_get_func_symbol(EvalSymbol symbol, void *user_data)
+{
     (void)user_data;
-    while (i != e)
-    {
-        if (strcmp(i->name, name) == 0)
-        {
-            expr_value_set_number(output, i->value);
-            return EVAL_RESULT_OK;
-        }
 
-        i++;
-    }
+    if (symbol == EVAL_SYMBOL_NONE || symbol > EVAL_NR_FUNCTIONS)
+        return NULL;
 
-    return EVAL_RESULT_UNDEFINED_VARIABLE;
+    return FUNCTIONS[symbol - 1].func;
+}
+
+static EvalResult default_get_variable_symbol(EvalSymbol symbol, void *user_data, ExprValue *output)
+{
+    (void)user_data;
+
+    if (symbol <= EVAL_NR_FUNCTIONS || symbol > EVAL_NR_FUNCTIONS + EVAL_NR_VARIABLES)
+        return EVAL_RESULT_UNDEFINED_VARIABLE;
+
+    expr_value_set_number(output, VARIABLES[symbol - EVAL_NR_FUNCTIONS - 1].value);
+
+    return EVAL_RESULT_OK;
+}
+
+/* a name that was never interned is no builtin */
+static EvalFunc default_get_func(const char *name, void *user_data)
+{
+    return default_get_func_symbol(symbol_lookup(name, strlen(name)), user_data);
+}
+
+static EvalResult default_get_variable(const char *name, void *user_data, ExprValue *output)
+{
+    return default_get_variable_symbol(symbol_lookup(name, strlen(name)), user_data, output);
 }
 
 const EvalHooks *eval_default_hooks(void)
@@ -1385,7 +9491,9 @@ const EvalHooks *eval_default_hooks(void)
     static const EvalHooks HOOKS =
         {
             default_get_func,
-            default_get_variable};
+            default_get_variable,
+            default_get_func_symbol,
+            default_get_variable_symbol};
 
     return &HOOKS;
 }
@@ -1405,7 +9513,13 @@ const char *eval_result_to_string(EvalResult result)
             "undefined function",
             "undefined variable",
             "expected open bracket",
-            "expected close bracket"};
+            "expected close bracket",
+            "out of memory",
+            "i/o error",
+            "invalid image",
+            "budget exceeded",
+            "pending",
+            "invalid pattern"};
 
     return ((result < N_EVAL_RESULT_CODES)) ? STRS[result] : "undefined error";
 }
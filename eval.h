@@ -28,8 +28,10 @@
 #define EVAL_H
 
 #include <stddef.h>
+#include <stdio.h>
 
 #define EVAL_MAX_STACK_DEPTH        8
+/* deprecated and no longer used: names have no length limit; kept for code that sizes buffers by it */
 #define EVAL_MAX_NAME_LENGTH        16
 
 typedef enum _ExprValueType {
@@ -43,21 +45,31 @@ typedef struct _ExprStr {
     char* str;
 }ExprStr;
 
+/* A string made by the expr_value_ functions carries a header of the evaluator in front of its buffer and has owned
+ * set; give such strings back with expr_value_clear(), never free(). A hook may still fill in a string by hand: with
+ * owned 0 (as expr_value_init() leaves it) str must come from malloc(), and the evaluator copies it into a buffer of
+ * its own and free()s it. Use expr_value_set_string() to skip the copy. */
 typedef struct _ExprValue{
     ExprValueType type;
+    unsigned int owned;
     union {
         double  val;
         ExprStr str;
     }v;
 }ExprValue;
 
+/* a value in 8 bytes instead of an ExprValue's 32: a double, or a NaN that carries a small integer or a string.
+ * Strings belong to the value like an ExprValue's and move between the two forms without being copied, so hooks
+ * keep using ExprValue. A zeroed EvalValue is the number 0. Only touch the bits through the functions below. */
+typedef unsigned long long EvalValue;
+
 typedef enum
 {
     EVAL_RESULT_OK,
     EVAL_RESULT_ILLEGAL_CHARACTER,
     EVAL_RESULT_INVALID_LITERAL,
     EVAL_RESULT_LITERAL_OUT_OF_RANGE,
-    EVAL_RESULT_NAME_TOO_LONG,
+    EVAL_RESULT_NAME_TOO_LONG,          /* no longer returned: names have no length limit */
     EVAL_RESULT_UNEXPECTED_CHAR,
     EVAL_RESULT_EXPECTED_TERM,
     EVAL_RESULT_STACK_OVERFLOW,
@@ -65,24 +77,294 @@ typedef enum
     EVAL_RESULT_UNDEFINED_VARIABLE,
     EVAL_RESULT_EXPECTED_OPEN_BRACKET,
     EVAL_RESULT_EXPECTED_CLOSE_BRACKET,
-    EVAL_RESULT_OOM,    
+    EVAL_RESULT_OOM,
+    EVAL_RESULT_IO_ERROR,
+    EVAL_RESULT_INVALID_IMAGE,
+    EVAL_RESULT_BUDGET_EXCEEDED,
+    EVAL_RESULT_PENDING,                /* a hook will answer later, see eval_execute_async() */
+    EVAL_RESULT_INVALID_PATTERN,        /* matches() with a pattern that does not compile */
     N_EVAL_RESULT_CODES
 } EvalResult;
 
 typedef EvalResult (*EvalFunc) (const ExprValue* input, void* user_data, ExprValue* output);
 
+/* identifiers are interned once per process into symbols: small integers from 1 up, the same for the same name on
+ * every thread and valid for the life of the process. EVAL_SYMBOL_NONE is never a name. */
+typedef unsigned int EvalSymbol;
+
+#define EVAL_SYMBOL_NONE            0
+
+EvalResult eval_symbol_intern(const char* name, size_t length, EvalSymbol* symbol);
+/* the name, '\0' terminated, or NULL for a symbol that was never interned */
+const char* eval_symbol_name(EvalSymbol symbol);
+
+/* the symbol hooks are used instead of the name hooks when they are set, so zero what you do not fill in */
 typedef struct
 {
     EvalFunc   (*get_func) (const char* name, void* user_data);
     EvalResult (*get_variable) (const char* name, void* user_data, ExprValue* output);
+    EvalFunc   (*get_func_symbol) (EvalSymbol symbol, void* user_data);
+    EvalResult (*get_variable_symbol) (EvalSymbol symbol, void* user_data, ExprValue* output);
 } EvalHooks;
 
 EvalResult eval_execute(const char* expr, const EvalHooks* hooks, void* ctx, ExprValue* output);
 
+/* reads the len bytes at str as a number literal of the language, possibly after a '-', and gives the value the
+ * lexer would; EVAL_RESULT_INVALID_LITERAL for anything else, such as spaces, "nan", "inf" or "0x10" */
+EvalResult eval_number_parse(const char* str, size_t len, double* value);
+
+/* frees what the calling thread keeps for itself, such as the patterns matches() compiled at run time; call it
+ * before a thread that evaluated exits. The thread may go on evaluating afterwards. */
+void eval_thread_cleanup(void);
+
+/* how deeply brackets and calls may nest before eval_execute() and eval_compile() report stack overflow,
+ * EVAL_MAX_STACK_DEPTH by default and 0 for no limit. Process-wide: set it before evaluating from several threads. */
+void eval_set_max_depth(size_t depth);
+size_t eval_get_max_depth(void);
+
+/* memoization of pure functions: calls to a function registered here with an argument seen before are answered
+ * from a bounded process-wide table, keyed by the argument (numbers bitwise, strings by their bytes), without
+ * calling it. Only successful outputs are kept. Register and unregister before evaluating from several threads;
+ * invalidation and stats may run at any time. */
+typedef struct _EvalMemoStats {
+    size_t hits;
+    size_t misses;
+    size_t evictions;   /* outputs replaced by one whose argument hashed to the same set of slots */
+    size_t size;        /* outputs held */
+    size_t capacity;
+}EvalMemoStats;
+
+/* capacity is rounded up to a power of two (at least 2), registering again empties the table and 0 forgets the
+ * function */
+EvalResult eval_func_set_pure(EvalFunc func, size_t capacity);
+/* drops what is kept for func, or for every pure function when func is NULL; stats are not reset */
+void eval_func_memo_invalidate(EvalFunc func);
+/* EVAL_RESULT_UNDEFINED_FUNCTION when func is not registered */
+EvalResult eval_func_memo_stats(EvalFunc func, EvalMemoStats* stats);
+
+/* instrumentation, compiled in with EVAL_ENABLE_STATS (without it stats stay zero and trace is never called) */
+typedef enum _EvalEvent {
+    EVAL_EVENT_TOKEN,           /* value: bytes of input the token took */
+    EVAL_EVENT_GET_VARIABLE,    /* name: the variable */
+    EVAL_EVENT_GET_FUNC,        /* name: the function */
+    EVAL_EVENT_CALL,            /* name: the function */
+    EVAL_EVENT_STRING_ALLOC,    /* value: bytes */
+    EVAL_EVENT_STRING_REALLOC   /* value: bytes */
+}EvalEvent;
+
+typedef void (*EvalTraceFunc)(EvalEvent event, const char* name, size_t value, void* user_data);
+
+typedef struct _EvalStats {
+    size_t nr_tokens;
+    size_t max_depth;
+    size_t nr_get_variable;
+    size_t nr_get_func;
+    size_t nr_calls;
+    size_t nr_string_allocs;
+    size_t nr_string_reallocs;
+    size_t string_bytes;
+    unsigned long long lex_ns;
+    unsigned long long hook_ns;     /* get_variable and get_func */
+    unsigned long long call_ns;     /* functions */
+    unsigned long long string_ns;   /* string allocation */
+    unsigned long long total_ns;    /* parsing and math are what the phases above leave */
+}EvalStats;
+
+/* limits for one evaluation, zero is no limit. Running out of steps or time fails it with EVAL_RESULT_BUDGET_EXCEEDED;
+ * the clock is read every EVAL_BUDGET_CLOCK_STEPS steps and after every hook call, a slow hook is not interrupted */
+#define EVAL_BUDGET_CLOCK_STEPS     64
+
+typedef struct _EvalBudget {
+    size_t max_steps;               /* one per token, program instruction and hook call */
+    unsigned long long timeout_ns;
+    size_t max_bytes;               /* string memory held at once, going over fails with EVAL_RESULT_OOM */
+    size_t steps_left;              /* set on return for the limits given */
+    unsigned long long ns_left;
+    size_t peak_bytes;              /* set on return, counted with or without max_bytes */
+}EvalBudget;
+
+/* per evaluation options, a NULL options pointer is the same as all fields zero */
+typedef struct _EvalOptions {
+    EvalStats* stats;
+    EvalTraceFunc trace;
+    void* trace_data;
+    EvalBudget* budget;
+}EvalOptions;
+
+EvalResult eval_execute_ex(const char* expr, const EvalHooks* hooks, void* ctx, const EvalOptions* options,
+                           ExprValue* output);
+int eval_stats_enabled(void);
+
+/* per-expression latency histograms, off until enabled. Every eval_execute() call is recorded under a hash of
+ * its source, capacity bounds the number of distinct expressions (later ones are only counted as dropped).
+ * Enable and disable while no evaluation is running; reset and queries may run at any time. */
+#define EVAL_HISTOGRAM_TEXT         96
+
+typedef enum _EvalHistogramOrder {
+    EVAL_HISTOGRAM_BY_P99 = 0,
+    EVAL_HISTOGRAM_BY_TOTAL
+}EvalHistogramOrder;
+
+typedef struct _EvalHistogramEntry {
+    char expr[EVAL_HISTOGRAM_TEXT];     /* the source, truncated */
+    unsigned long long hash;
+    unsigned long long count;
+    double total_ns;
+    double p50_ns;
+    double p90_ns;
+    double p99_ns;
+    double max_ns;
+}EvalHistogramEntry;
+
+EvalResult eval_histograms_enable(size_t capacity);
+void eval_histograms_disable(void);
+void eval_histograms_reset(void);
+/* fills up to n entries with the slowest expressions first, returns how many were filled */
+size_t eval_histograms_top(EvalHistogramOrder order, EvalHistogramEntry* entries, size_t n);
+void eval_histograms_dump(FILE* out, EvalHistogramOrder order, size_t n);
+size_t eval_histograms_dropped(void);
+
+/* capture: while one runs every eval_execute() call is appended to the file with what get_variable, get_func and
+ * host functions returned and its result, for eval_replay. Start and stop while no evaluation is running; stop
+ * reports the first error writing the capture. */
+EvalResult eval_capture_start(const char* filename);
+EvalResult eval_capture_stop(void);
+
+/* replay: evaluates captured calls again, with hooks that return the captured values (builtins still run) */
+typedef struct _EvalReplay EvalReplay;
+
+EvalResult eval_replay_open(const char* filename, EvalReplay** replay);
+void eval_replay_destroy(EvalReplay* replay);
+size_t eval_replay_size(const EvalReplay* replay);
+const char* eval_replay_expression(const EvalReplay* replay, size_t index);
+/* returns the result of the evaluation, match is set when it and the value are the captured ones */
+EvalResult eval_replay_execute(const EvalReplay* replay, size_t index, int* match);
+
 const EvalHooks* eval_default_hooks(void);
 
+/* where the library gets memory for values, programs and images, the C library by default. Set it before
+ * anything is allocated (memory must go back to the allocator it came from), NULL restores the default. */
+typedef struct _EvalAllocator {
+    void* (*alloc)(size_t size, void* user_data);
+    void* (*realloc)(void* ptr, size_t size, void* user_data);
+    void (*free)(void* ptr, void* user_data);
+    void* user_data;
+}EvalAllocator;
+
+void eval_set_allocator(const EvalAllocator* allocator);
+
 const char* eval_result_to_string(EvalResult result);
 
+typedef struct _EvalProgram EvalProgram;
+
+typedef struct _EvalConstant {
+    const char* name;
+    ExprValue value;
+}EvalConstant;
+
+EvalResult eval_compile(const char* expr, EvalProgram** program);
+void eval_program_destroy(EvalProgram* program);
+EvalResult eval_program_execute(const EvalProgram* program, const EvalHooks* hooks, void* ctx, ExprValue* output);
+EvalResult eval_program_execute_ex(const EvalProgram* program, const EvalHooks* hooks, void* ctx,
+                                   const EvalOptions* options, ExprValue* output);
+
+/* folds the given variables into a new residual program, the input program is left untouched so it can
+ * be specialized again when a constant changes. What the constants decide is dropped unevaluated: the other side
+ * of a && or || whose result one constant side settles, and every statement of an expression whose result is
+ * constant. Their variables and calls are never looked up, so where the input program would fail on one (an
+ * undefined variable or function, a failing hook, a bad pattern) the residual succeeds: with $a = 1,
+ * "$a || $undefined" and "x = $undefined; $a" both specialize to 1. */
+EvalResult eval_program_specialize(const EvalProgram* program, const EvalConstant* constants, size_t nr_constants,
+                                   EvalProgram** residual);
+/* prints the program back as an expression, numbers in the shortest form that reads back to the same double, so
+ * compiling the text gives the same results */
+EvalResult eval_program_to_string(const EvalProgram* program, ExprValue* output);
+/* non-zero when the program reads the variable name (without the leading '$') */
+int eval_program_uses_variable(const EvalProgram* program, const char* name);
+
+/* a set of rows stored by column, a variable named like a column reads that column for the current row */
+typedef struct _EvalColumn {
+    const char* name;
+    ExprValueType type;
+    const double* numbers;
+    const char* const* strings;
+}EvalColumn;
+
+typedef struct _EvalRowSet {
+    size_t nr_rows;
+    size_t nr_columns;
+    const EvalColumn* columns;
+}EvalRowSet;
+
+/* mutable state for executing programs, programs themselves are never written to and can be shared by
+ * any number of threads as long as each thread uses its own context. The fields are private. */
+typedef struct _EvalExecContext {
+    EvalValue* stack;
+    size_t capacity;
+    const EvalProgram* program;
+    const EvalRowSet* rows;
+    size_t* bindings;
+    size_t row;
+}EvalExecContext;
+
+void eval_exec_context_init(EvalExecContext* ctx);
+void eval_exec_context_deinit(EvalExecContext* ctx);
+EvalResult eval_exec_context_bind(EvalExecContext* ctx, const EvalProgram* program, const EvalRowSet* rows);
+void eval_exec_context_set_row(EvalExecContext* ctx, size_t row);
+EvalResult eval_program_execute_in(EvalExecContext* ctx, const EvalProgram* program, const EvalHooks* hooks,
+                                   void* user_data, ExprValue* output);
+/* the same with the result as an EvalValue, output is overwritten */
+EvalResult eval_program_execute_value_in(EvalExecContext* ctx, const EvalProgram* program, const EvalHooks* hooks,
+                                         void* user_data, EvalValue* output);
+
+/* a suspended evaluation. A variable hook or function that cannot answer yet returns EVAL_RESULT_PENDING
+ * (without touching output); the blocking functions above report that as a failure, the ones below save the
+ * evaluation in a continuation and return EVAL_RESULT_PENDING to the caller. */
+typedef struct _EvalContinuation EvalContinuation;
+
+/* like eval_execute(), *continuation is set when the result is EVAL_RESULT_PENDING and NULL otherwise */
+EvalResult eval_execute_async(const char* expr, const EvalHooks* hooks, void* ctx, ExprValue* output,
+                              EvalContinuation** continuation);
+/* the program must outlive the continuation */
+EvalResult eval_program_execute_async(const EvalProgram* program, const EvalHooks* hooks, void* ctx,
+                                      ExprValue* output, EvalContinuation** continuation);
+/* carries on with value as the answer of the hook that is waiting (moved, the hook is not asked again), or asks
+ * the hook again when value is NULL. Unless the result is EVAL_RESULT_PENDING once more the evaluation is over
+ * and the continuation is freed. */
+EvalResult eval_continuation_resume(EvalContinuation* continuation, ExprValue* value, ExprValue* output);
+/* the variable or function that is waited for */
+const char* eval_continuation_name(const EvalContinuation* continuation);
+/* abandons a suspended evaluation */
+void eval_continuation_destroy(EvalContinuation* continuation);
+
+/* bit i of a selection bitmap is row i of a row set */
+typedef unsigned long long EvalMask;
+
+/* evaluates a predicate for rows [begin, end) of the row set ctx is bound to, begin must be a multiple of 64
+ * and bitmap points at the word for begin. Rows whose value is a non-zero number or a non-empty string are
+ * selected; failing rows are not, and the first of them is reported in failed_row. */
+EvalResult eval_program_filter(EvalExecContext* ctx, const EvalProgram* program, const EvalHooks* hooks,
+                               void* user_data, size_t begin, size_t end, EvalMask* bitmap, size_t* failed_row);
+size_t eval_bitmap_to_indexes(const EvalMask* bitmap, size_t nr_rows, size_t* indexes);
+
+typedef struct _EvalMappedFile {
+    const char* data;
+    size_t size;
+}EvalMappedFile;
+
+EvalResult eval_file_map(const char* filename, EvalMappedFile* file);
+void eval_file_unmap(EvalMappedFile* file);
+
+/* images hold compiled programs that are verified once and then executed in place, see eval.c for the format */
+typedef struct _EvalImage EvalImage;
+
+EvalResult eval_image_write(FILE* fp, const EvalProgram* const* programs, size_t nr_programs);
+EvalResult eval_image_open(const char* filename, EvalImage** image);
+EvalResult eval_image_load(const void* data, size_t size, EvalImage** image);
+void eval_image_close(EvalImage* image);
+size_t eval_image_count(const EvalImage* image);
+const EvalProgram* eval_image_get(const EvalImage* image, size_t index);
+
 void expr_value_init(ExprValue* v);
 void expr_value_clear(ExprValue* v);
 
@@ -92,5 +374,26 @@ EvalResult expr_value_set_number(ExprValue* v, double val);
 const char* expr_value_get_string(const ExprValue* v);
 EvalResult expr_value_set_string(ExprValue* v, const char* str, size_t len);
 
-#endif // EVAL_H
+int expr_value_is_string(const ExprValue* v);
+/* the length of a string, 0 for a number */
+size_t expr_value_get_size(const ExprValue* v);
+
+EvalValue eval_value_number(double val);
+EvalValue eval_value_int(int val);
+void eval_value_clear(EvalValue* v);
+
+int eval_value_is_string(EvalValue v);
+/* strings are converted like expr_value_get_number() does */
+double eval_value_get_number(EvalValue v);
+/* NULL for a number */
+const char* eval_value_get_string(EvalValue v);
+size_t eval_value_get_size(EvalValue v);
+EvalResult eval_value_set_string(EvalValue* v, const char* str, size_t len);
+
+/* the compatibility layer: both move the value, the source is left holding the number 0 and the destination is
+ * overwritten without being cleared */
+void eval_value_from_expr(EvalValue* v, ExprValue* value);
+void eval_value_to_expr(EvalValue* v, ExprValue* value);
+
+#endif /* EVAL_H */
 
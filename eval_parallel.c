@@ -0,0 +1,1614 @@
+/**
+ * Eval - parallel helpers
+ *
+ * The pool is fork-join: eval_thread_pool_run() hands one task to every
+ * thread and returns once all of them are done. Tasks split the work among
+ * themselves, the pool knows nothing about it.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eval_parallel.h"
+#include "eval_port.h"
+
+#define EVAL_COMPILE_CHUNK          32
+#define EVAL_ROWS_MIN_CHUNK         64
+#define EVAL_ROWS_MAX_CHUNK         4096
+#define EVAL_CACHE_LINE             64
+#define EVAL_AGGREGATE_BLOCK        1024
+
+typedef void (*EvalTask)(void *arg, size_t worker);
+
+typedef struct
+{
+    EvalThreadPool *pool;
+    size_t index;
+} EvalWorker;
+
+struct _EvalThreadPool
+{
+    size_t nr_threads;
+    EvalThread *threads;
+    EvalWorker *workers;
+
+    EvalMutex run_lock;
+    EvalMutex lock;
+    EvalCond start;
+    EvalCond done;
+
+    unsigned long generation;
+    size_t nr_running;
+    int quit;
+
+    EvalTask task;
+    void *arg;
+};
+
+static EVAL_THREAD_PROC worker_main(void *data)
+{
+    EvalWorker *worker = (EvalWorker *)data;
+    EvalThreadPool *pool = worker->pool;
+    unsigned long generation = 0;
+
+    for (;;)
+    {
+        EvalTask task;
+        void *arg;
+
+        EVAL_MUTEX_LOCK(&pool->lock);
+        while (pool->generation == generation && !pool->quit)
+        {
+            EVAL_COND_WAIT(&pool->start, &pool->lock);
+        }
+
+        if (pool->quit)
+        {
+            EVAL_MUTEX_UNLOCK(&pool->lock);
+            break;
+        }
+
+        generation = pool->generation;
+        task = pool->task;
+        arg = pool->arg;
+        EVAL_MUTEX_UNLOCK(&pool->lock);
+
+        task(arg, worker->index);
+
+        EVAL_MUTEX_LOCK(&pool->lock);
+        if (--pool->nr_running == 0)
+        {
+            EVAL_COND_SIGNAL(&pool->done);
+        }
+        EVAL_MUTEX_UNLOCK(&pool->lock);
+    }
+
+    eval_thread_cleanup();
+
+    return EVAL_THREAD_RETURN;
+}
+
+EvalResult eval_thread_pool_create(size_t nr_threads, EvalThreadPool **pool)
+{
+    EvalThreadPool *p;
+    size_t i;
+
+    *pool = NULL;
+    if (nr_threads == 0)
+        nr_threads = 1;
+
+    p = (EvalThreadPool *)calloc(1, sizeof(EvalThreadPool));
+    if (p == NULL)
+        return EVAL_RESULT_OOM;
+
+    p->threads = (EvalThread *)calloc(nr_threads, sizeof(EvalThread));
+    p->workers = (EvalWorker *)calloc(nr_threads, sizeof(EvalWorker));
+    if (p->threads == NULL || p->workers == NULL)
+    {
+        free(p->threads);
+        free(p->workers);
+        free(p);
+        return EVAL_RESULT_OOM;
+    }
+
+    EVAL_MUTEX_INIT(&p->run_lock);
+    EVAL_MUTEX_INIT(&p->lock);
+    EVAL_COND_INIT(&p->start);
+    EVAL_COND_INIT(&p->done);
+
+    /* worker 0 is the calling thread */
+    p->nr_threads = 1;
+    for (i = 1; i < nr_threads; i++)
+    {
+        p->workers[i].pool = p;
+        p->workers[i].index = i;
+        if (!EVAL_THREAD_CREATE(p->threads + i, worker_main, p->workers + i))
+        {
+            eval_thread_pool_destroy(p);
+            return EVAL_RESULT_OOM;
+        }
+        p->nr_threads++;
+    }
+
+    *pool = p;
+
+    return EVAL_RESULT_OK;
+}
+
+void eval_thread_pool_destroy(EvalThreadPool *pool)
+{
+    size_t i;
+
+    if (pool == NULL)
+        return;
+
+    EVAL_MUTEX_LOCK(&pool->lock);
+    pool->quit = 1;
+    EVAL_COND_BROADCAST(&pool->start);
+    EVAL_MUTEX_UNLOCK(&pool->lock);
+
+    for (i = 1; i < pool->nr_threads; i++)
+    {
+        EVAL_THREAD_JOIN(pool->threads[i]);
+    }
+
+    EVAL_COND_DESTROY(&pool->done);
+    EVAL_COND_DESTROY(&pool->start);
+    EVAL_MUTEX_DESTROY(&pool->lock);
+    EVAL_MUTEX_DESTROY(&pool->run_lock);
+    free(pool->workers);
+    free(pool->threads);
+    free(pool);
+}
+
+size_t eval_thread_pool_size(const EvalThreadPool *pool)
+{
+    return pool ? pool->nr_threads : 1;
+}
+
+static void eval_thread_pool_run(EvalThreadPool *pool, EvalTask task, void *arg)
+{
+    if (pool == NULL || pool->nr_threads == 1)
+    {
+        task(arg, 0);
+        return;
+    }
+
+    EVAL_MUTEX_LOCK(&pool->run_lock);
+
+    EVAL_MUTEX_LOCK(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->nr_running = pool->nr_threads - 1;
+    pool->generation++;
+    EVAL_COND_BROADCAST(&pool->start);
+    EVAL_MUTEX_UNLOCK(&pool->lock);
+
+    task(arg, 0);
+
+    EVAL_MUTEX_LOCK(&pool->lock);
+    while (pool->nr_running)
+    {
+        EVAL_COND_WAIT(&pool->done, &pool->lock);
+    }
+    EVAL_MUTEX_UNLOCK(&pool->lock);
+
+    EVAL_MUTEX_UNLOCK(&pool->run_lock);
+}
+
+typedef struct
+{
+    const char *const *exprs;
+    size_t nr_exprs;
+    EvalProgram **programs;
+    EvalResult *results;
+    size_t next;
+} EvalCompileTask;
+
+static void compile_task(void *arg, size_t worker)
+{
+    EvalCompileTask *t = (EvalCompileTask *)arg;
+
+    (void)worker;
+    for (;;)
+    {
+        size_t begin = EVAL_ATOMIC_ADD(&t->next, EVAL_COMPILE_CHUNK);
+        size_t end = begin + EVAL_COMPILE_CHUNK;
+        size_t i;
+
+        if (begin >= t->nr_exprs)
+            break;
+        if (end > t->nr_exprs)
+            end = t->nr_exprs;
+
+        for (i = begin; i < end; i++)
+        {
+            t->results[i] = eval_compile(t->exprs[i], t->programs + i);
+        }
+    }
+}
+
+EvalResult eval_compile_batch(EvalThreadPool *pool, const char *const *exprs, size_t nr_exprs,
+                              EvalProgram **programs, EvalResult *results)
+{
+    EvalCompileTask t;
+    EvalResult *local = NULL;
+    EvalResult result = EVAL_RESULT_OK;
+    size_t i;
+
+    if (results == NULL)
+    {
+        local = (EvalResult *)malloc((nr_exprs ? nr_exprs : 1) * sizeof(EvalResult));
+        if (local == NULL)
+            return EVAL_RESULT_OOM;
+        results = local;
+    }
+
+    t.exprs = exprs;
+    t.nr_exprs = nr_exprs;
+    t.programs = programs;
+    t.results = results;
+    t.next = 0;
+
+    eval_thread_pool_run(pool, compile_task, &t);
+
+    for (i = 0; i < nr_exprs; i++)
+    {
+        if (results[i] != EVAL_RESULT_OK)
+        {
+            result = results[i];
+            break;
+        }
+    }
+
+    free(local);
+
+    return result;
+}
+
+/*
+ * Work stealing over row ranges.
+ *
+ * Every worker starts with an equal slice of the rows and takes chunks from
+ * the front of it. A worker whose slice is empty steals the back half of the
+ * largest slice left, so a thread that got slow rows (or was descheduled)
+ * does not hold up the others. Ranges sit on their own cache lines.
+ */
+
+typedef struct
+{
+    EvalMutex lock;
+    size_t begin;
+    size_t end;
+    char pad[EVAL_CACHE_LINE];
+} EvalRange;
+
+typedef struct
+{
+    EvalRange *ranges;
+    size_t nr_workers;
+    size_t chunk;
+    size_t granule;
+} EvalScheduler;
+
+typedef void (*EvalRangeFunc)(void *arg, size_t worker, size_t begin, size_t end);
+
+/* all range boundaries except the last one are multiples of granule */
+static EvalResult scheduler_init(EvalScheduler *s, size_t nr_items, size_t nr_workers, size_t granule)
+{
+    size_t nr_granules = (nr_items + granule - 1) / granule;
+    size_t i;
+
+    s->ranges = (EvalRange *)calloc(nr_workers, sizeof(EvalRange));
+    if (s->ranges == NULL)
+        return EVAL_RESULT_OOM;
+
+    s->nr_workers = nr_workers;
+    s->granule = granule;
+    s->chunk = nr_items / (nr_workers * 16);
+    if (s->chunk < EVAL_ROWS_MIN_CHUNK)
+        s->chunk = EVAL_ROWS_MIN_CHUNK;
+    if (s->chunk > EVAL_ROWS_MAX_CHUNK)
+        s->chunk = EVAL_ROWS_MAX_CHUNK;
+    s->chunk = (s->chunk + granule - 1) / granule * granule;
+
+    for (i = 0; i < nr_workers; i++)
+    {
+        size_t begin = nr_granules * i / nr_workers * granule;
+        size_t end = nr_granules * (i + 1) / nr_workers * granule;
+
+        EVAL_MUTEX_INIT(&s->ranges[i].lock);
+        s->ranges[i].begin = begin < nr_items ? begin : nr_items;
+        s->ranges[i].end = end < nr_items ? end : nr_items;
+    }
+
+    return EVAL_RESULT_OK;
+}
+
+static void scheduler_deinit(EvalScheduler *s)
+{
+    size_t i;
+
+    for (i = 0; i < s->nr_workers; i++)
+    {
+        EVAL_MUTEX_DESTROY(&s->ranges[i].lock);
+    }
+    free(s->ranges);
+}
+
+static int scheduler_take(EvalScheduler *s, size_t worker, size_t *begin, size_t *end)
+{
+    EvalRange *own = s->ranges + worker;
+
+    EVAL_MUTEX_LOCK(&own->lock);
+    *begin = own->begin;
+    *end = own->begin + s->chunk < own->end ? own->begin + s->chunk : own->end;
+    own->begin = *end;
+    EVAL_MUTEX_UNLOCK(&own->lock);
+
+    return *begin < *end;
+}
+
+static size_t scheduler_left(EvalRange *r)
+{
+    size_t left;
+
+    EVAL_MUTEX_LOCK(&r->lock);
+    left = r->end - r->begin;
+    EVAL_MUTEX_UNLOCK(&r->lock);
+
+    return left;
+}
+
+static int scheduler_steal(EvalScheduler *s, size_t worker)
+{
+    EvalRange *own = s->ranges + worker;
+
+    for (;;)
+    {
+        size_t victim = worker;
+        size_t best = 0;
+        size_t i;
+        EvalRange *r;
+
+        for (i = 0; i < s->nr_workers; i++)
+        {
+            size_t left = i != worker ? scheduler_left(s->ranges + i) : 0;
+
+            if (left > best)
+            {
+                best = left;
+                victim = i;
+            }
+        }
+
+        if (victim == worker)
+            return 0;
+
+        /* the victim may have moved on since it was looked at */
+        r = s->ranges + victim;
+        EVAL_MUTEX_LOCK(&r->lock);
+        if (r->end > r->begin)
+        {
+            size_t mid = r->begin + (r->end - r->begin) / s->granule / 2 * s->granule;
+            size_t end = r->end;
+
+            r->end = mid;
+            EVAL_MUTEX_UNLOCK(&r->lock);
+
+            EVAL_MUTEX_LOCK(&own->lock);
+            own->begin = mid;
+            own->end = end;
+            EVAL_MUTEX_UNLOCK(&own->lock);
+
+            return 1;
+        }
+        EVAL_MUTEX_UNLOCK(&r->lock);
+    }
+}
+
+static void scheduler_run(EvalScheduler *s, size_t worker, EvalRangeFunc func, void *arg)
+{
+    size_t begin;
+    size_t end;
+
+    do
+    {
+        while (scheduler_take(s, worker, &begin, &end))
+        {
+            func(arg, worker, begin, end);
+        }
+    } while (scheduler_steal(s, worker));
+}
+
+typedef struct
+{
+    EvalScheduler scheduler;
+    const EvalProgram *program;
+    const EvalRowSet *rows;
+    const EvalHooks *hooks;
+    void *user_data;
+    ExprValue *outputs;
+    EvalValue *values;
+    EvalResult *results;
+    EvalExecContext *contexts;
+} EvalRowsTask;
+
+static void rows_range(void *arg, size_t worker, size_t begin, size_t end)
+{
+    EvalRowsTask *t = (EvalRowsTask *)arg;
+    EvalExecContext *ctx = t->contexts + worker;
+    size_t i;
+
+    for (i = begin; i < end; i++)
+    {
+        eval_exec_context_set_row(ctx, i);
+        if (t->values)
+            t->results[i] = eval_program_execute_value_in(ctx, t->program, t->hooks, t->user_data, t->values + i);
+        else
+            t->results[i] = eval_program_execute_in(ctx, t->program, t->hooks, t->user_data, t->outputs + i);
+    }
+}
+
+static void rows_task(void *arg, size_t worker)
+{
+    EvalRowsTask *t = (EvalRowsTask *)arg;
+    EvalExecContext *ctx = t->contexts + worker;
+    EvalResult result;
+
+    eval_exec_context_init(ctx);
+    result = eval_exec_context_bind(ctx, t->program, t->rows);
+    if (result != EVAL_RESULT_OK)
+    {
+        size_t begin;
+        size_t end;
+        size_t i;
+
+        /* still drain the range so every row gets a result */
+        while (scheduler_take(&t->scheduler, worker, &begin, &end))
+        {
+            for (i = begin; i < end; i++)
+                t->results[i] = result;
+        }
+        return;
+    }
+
+    scheduler_run(&t->scheduler, worker, rows_range, t);
+}
+
+/* exactly one of outputs and values is set */
+static EvalResult rows_execute(EvalThreadPool *pool, const EvalProgram *program, const EvalRowSet *rows,
+                               const EvalHooks *hooks, void *user_data, ExprValue *outputs, EvalValue *values,
+                               EvalResult *results)
+{
+    size_t nr_workers = eval_thread_pool_size(pool);
+    EvalResult *local = NULL;
+    EvalResult result = EVAL_RESULT_OK;
+    EvalRowsTask t;
+    size_t i;
+
+    if (results == NULL)
+    {
+        local = (EvalResult *)malloc((rows->nr_rows ? rows->nr_rows : 1) * sizeof(EvalResult));
+        if (local == NULL)
+            return EVAL_RESULT_OOM;
+        results = local;
+    }
+
+    t.program = program;
+    t.rows = rows;
+    t.hooks = hooks;
+    t.user_data = user_data;
+    t.outputs = outputs;
+    t.values = values;
+    t.results = results;
+    t.contexts = (EvalExecContext *)calloc(nr_workers, sizeof(EvalExecContext));
+
+    if (t.contexts == NULL || scheduler_init(&t.scheduler, rows->nr_rows, nr_workers, 1) != EVAL_RESULT_OK)
+    {
+        free(t.contexts);
+        free(local);
+        return EVAL_RESULT_OOM;
+    }
+
+    eval_thread_pool_run(pool, rows_task, &t);
+
+    for (i = 0; i < nr_workers; i++)
+    {
+        eval_exec_context_deinit(t.contexts + i);
+    }
+
+    for (i = 0; i < rows->nr_rows; i++)
+    {
+        if (results[i] != EVAL_RESULT_OK)
+        {
+            result = results[i];
+            break;
+        }
+    }
+
+    scheduler_deinit(&t.scheduler);
+    free(t.contexts);
+    free(local);
+
+    return result;
+}
+
+EvalResult eval_rows_execute(EvalThreadPool *pool, const EvalProgram *program, const EvalRowSet *rows,
+                             const EvalHooks *hooks, void *user_data, ExprValue *outputs, EvalResult *results)
+{
+    return rows_execute(pool, program, rows, hooks, user_data, outputs, NULL, results);
+}
+
+EvalResult eval_rows_execute_values(EvalThreadPool *pool, const EvalProgram *program, const EvalRowSet *rows,
+                                    const EvalHooks *hooks, void *user_data, EvalValue *outputs,
+                                    EvalResult *results)
+{
+    return rows_execute(pool, program, rows, hooks, user_data, NULL, outputs, results);
+}
+
+/*
+ * Aggregates.
+ *
+ * Rows are reduced into one partial accumulator per block of
+ * EVAL_AGGREGATE_BLOCK rows (the scheduler never splits a block between
+ * threads) and the partials are merged in block order at the end. This keeps
+ * the result bit-for-bit identical for any number of threads. Sums use
+ * Neumaier's compensated summation, the variance Welford's update and Chan's
+ * merge of (count, mean, m2).
+ */
+
+typedef struct
+{
+    size_t count;
+    size_t count_true;
+    double sum;
+    double compensation;
+    double mean;
+    double m2;
+    double min;
+    double max;
+    size_t error_row;
+    EvalResult error;
+} EvalPartial;
+
+typedef struct
+{
+    EvalScheduler scheduler;
+    const EvalProgram *program;
+    const EvalRowSet *rows;
+    const EvalHooks *hooks;
+    void *user_data;
+    EvalPartial *partials;
+    EvalExecContext *contexts;
+} EvalAggregateTask;
+
+static void partial_init(EvalPartial *p)
+{
+    memset(p, 0x00, sizeof(EvalPartial));
+    p->min = HUGE_VAL;
+    p->max = -HUGE_VAL;
+    p->error = EVAL_RESULT_OK;
+}
+
+static void neumaier_add(double *sum, double *compensation, double value)
+{
+    double t = *sum + value;
+
+    if (fabs(*sum) >= fabs(value))
+        *compensation += (*sum - t) + value;
+    else
+        *compensation += (value - t) + *sum;
+
+    *sum = t;
+}
+
+static void partial_add(EvalPartial *p, const ExprValue *value)
+{
+    double x = expr_value_get_number(value);
+    double delta;
+
+    if (value->type == EXPR_VALUE_TYPE_STRING ? value->v.str.size != 0 : x != 0)
+        p->count_true++;
+
+    p->count++;
+    neumaier_add(&p->sum, &p->compensation, x);
+
+    delta = x - p->mean;
+    p->mean += delta / (double)p->count;
+    p->m2 += delta * (x - p->mean);
+
+    if (x < p->min)
+        p->min = x;
+    if (x > p->max)
+        p->max = x;
+}
+
+static void partial_merge(EvalPartial *a, const EvalPartial *b)
+{
+    if (b->error != EVAL_RESULT_OK && (a->error == EVAL_RESULT_OK || b->error_row < a->error_row))
+    {
+        a->error = b->error;
+        a->error_row = b->error_row;
+    }
+
+    if (b->count == 0)
+        return;
+
+    if (a->count == 0)
+    {
+        EvalResult error = a->error;
+        size_t error_row = a->error_row;
+
+        *a = *b;
+        a->error = error;
+        a->error_row = error_row;
+        return;
+    }
+
+    {
+        double n = (double)(a->count + b->count);
+        double delta = b->mean - a->mean;
+
+        a->mean += delta * (double)b->count / n;
+        a->m2 += b->m2 + delta * delta * (double)a->count * (double)b->count / n;
+    }
+
+    neumaier_add(&a->sum, &a->compensation, b->sum);
+    a->compensation += b->compensation;
+    a->count += b->count;
+    a->count_true += b->count_true;
+    if (b->min < a->min)
+        a->min = b->min;
+    if (b->max > a->max)
+        a->max = b->max;
+}
+
+static void aggregate_range(void *arg, size_t worker, size_t begin, size_t end)
+{
+    EvalAggregateTask *t = (EvalAggregateTask *)arg;
+    EvalExecContext *ctx = t->contexts + worker;
+    ExprValue value;
+    size_t i;
+
+    expr_value_init(&value);
+    for (i = begin; i < end; i++)
+    {
+        EvalPartial *p = t->partials + i / EVAL_AGGREGATE_BLOCK;
+        EvalResult result;
+
+        eval_exec_context_set_row(ctx, i);
+        result = eval_program_execute_in(ctx, t->program, t->hooks, t->user_data, &value);
+        if (result == EVAL_RESULT_OK)
+        {
+            partial_add(p, &value);
+            expr_value_clear(&value);
+        }
+        else if (p->error == EVAL_RESULT_OK)
+        {
+            p->error = result;
+            p->error_row = i;
+        }
+    }
+}
+
+static void aggregate_task(void *arg, size_t worker)
+{
+    EvalAggregateTask *t = (EvalAggregateTask *)arg;
+    EvalExecContext *ctx = t->contexts + worker;
+    EvalResult result;
+
+    eval_exec_context_init(ctx);
+    result = eval_exec_context_bind(ctx, t->program, t->rows);
+    if (result != EVAL_RESULT_OK)
+    {
+        size_t begin;
+        size_t end;
+
+        while (scheduler_take(&t->scheduler, worker, &begin, &end))
+        {
+            EvalPartial *p = t->partials + begin / EVAL_AGGREGATE_BLOCK;
+
+            if (p->error == EVAL_RESULT_OK)
+            {
+                p->error = result;
+                p->error_row = begin;
+            }
+        }
+        return;
+    }
+
+    scheduler_run(&t->scheduler, worker, aggregate_range, t);
+}
+
+EvalResult eval_rows_aggregate(EvalThreadPool *pool, const EvalProgram *program, const EvalRowSet *rows,
+                               const EvalHooks *hooks, void *user_data, EvalAggregate *aggregate)
+{
+    size_t nr_workers = eval_thread_pool_size(pool);
+    size_t nr_blocks = (rows->nr_rows + EVAL_AGGREGATE_BLOCK - 1) / EVAL_AGGREGATE_BLOCK;
+    EvalAggregateTask t;
+    EvalPartial total;
+    size_t i;
+
+    t.program = program;
+    t.rows = rows;
+    t.hooks = hooks;
+    t.user_data = user_data;
+    t.partials = (EvalPartial *)malloc((nr_blocks ? nr_blocks : 1) * sizeof(EvalPartial));
+    t.contexts = (EvalExecContext *)calloc(nr_workers, sizeof(EvalExecContext));
+
+    if (t.partials == NULL || t.contexts == NULL ||
+        scheduler_init(&t.scheduler, rows->nr_rows, nr_workers, EVAL_AGGREGATE_BLOCK) != EVAL_RESULT_OK)
+    {
+        free(t.partials);
+        free(t.contexts);
+        return EVAL_RESULT_OOM;
+    }
+
+    for (i = 0; i < nr_blocks; i++)
+    {
+        partial_init(t.partials + i);
+    }
+
+    eval_thread_pool_run(pool, aggregate_task, &t);
+
+    partial_init(&total);
+    for (i = 0; i < nr_blocks; i++)
+    {
+        partial_merge(&total, t.partials + i);
+    }
+
+    for (i = 0; i < nr_workers; i++)
+    {
+        eval_exec_context_deinit(t.contexts + i);
+    }
+    scheduler_deinit(&t.scheduler);
+    free(t.contexts);
+    free(t.partials);
+
+    aggregate->count = total.count;
+    aggregate->count_true = total.count_true;
+    aggregate->sum = total.sum + total.compensation;
+    if (total.count)
+    {
+        aggregate->mean = aggregate->sum / (double)total.count;
+        aggregate->min = total.min;
+        aggregate->max = total.max;
+        aggregate->variance = total.m2 / (double)total.count;
+    }
+    else
+    {
+        aggregate->mean = aggregate->min = aggregate->max = aggregate->variance = NAN;
+    }
+
+    return total.error;
+}
+
+typedef struct
+{
+    size_t nr_selected;
+    size_t failed_row;
+    EvalResult result;
+    char pad[EVAL_CACHE_LINE];
+} EvalFilterWorker;
+
+typedef struct
+{
+    EvalScheduler scheduler;
+    const EvalProgram *program;
+    const EvalRowSet *rows;
+    const EvalHooks *hooks;
+    void *user_data;
+    EvalMask *bitmap;
+    EvalExecContext *contexts;
+    EvalFilterWorker *workers;
+} EvalFilterTask;
+
+static void filter_range(void *arg, size_t worker, size_t begin, size_t end)
+{
+    EvalFilterTask *t = (EvalFilterTask *)arg;
+    EvalFilterWorker *w = t->workers + worker;
+    EvalMask *bitmap = t->bitmap + begin / 64;
+    size_t failed_row = 0;
+    EvalResult result;
+    size_t i;
+
+    result = eval_program_filter(t->contexts + worker, t->program, t->hooks, t->user_data, begin, end, bitmap,
+                                 &failed_row);
+    if (result != EVAL_RESULT_OK && (w->result == EVAL_RESULT_OK || failed_row < w->failed_row))
+    {
+        w->result = result;
+        w->failed_row = failed_row;
+    }
+
+    for (i = 0; i < (end - begin + 63) / 64; i++)
+    {
+        w->nr_selected += EVAL_POPCOUNT64(bitmap[i]);
+    }
+}
+
+static void filter_task(void *arg, size_t worker)
+{
+    EvalFilterTask *t = (EvalFilterTask *)arg;
+    EvalExecContext *ctx = t->contexts + worker;
+    EvalFilterWorker *w = t->workers + worker;
+    EvalResult result;
+
+    eval_exec_context_init(ctx);
+    result = eval_exec_context_bind(ctx, t->program, t->rows);
+    if (result != EVAL_RESULT_OK)
+    {
+        size_t begin;
+        size_t end;
+
+        while (scheduler_take(&t->scheduler, worker, &begin, &end))
+        {
+            memset(t->bitmap + begin / 64, 0x00, (end - begin + 63) / 64 * sizeof(EvalMask));
+            if (w->result == EVAL_RESULT_OK || begin < w->failed_row)
+            {
+                w->result = result;
+                w->failed_row = begin;
+            }
+        }
+        return;
+    }
+
+    scheduler_run(&t->scheduler, worker, filter_range, t);
+}
+
+EvalResult eval_rows_filter(EvalThreadPool *pool, const EvalProgram *program, const EvalRowSet *rows,
+                            const EvalHooks *hooks, void *user_data, EvalMask *bitmap, size_t *nr_selected)
+{
+    size_t nr_workers = eval_thread_pool_size(pool);
+    EvalResult result = EVAL_RESULT_OK;
+    size_t failed_row = 0;
+    size_t selected = 0;
+    EvalFilterTask t;
+    size_t i;
+
+    t.program = program;
+    t.rows = rows;
+    t.hooks = hooks;
+    t.user_data = user_data;
+    t.bitmap = bitmap;
+    t.contexts = (EvalExecContext *)calloc(nr_workers, sizeof(EvalExecContext));
+    t.workers = (EvalFilterWorker *)calloc(nr_workers, sizeof(EvalFilterWorker));
+
+    if (t.contexts == NULL || t.workers == NULL ||
+        scheduler_init(&t.scheduler, rows->nr_rows, nr_workers, 64) != EVAL_RESULT_OK)
+    {
+        free(t.contexts);
+        free(t.workers);
+        return EVAL_RESULT_OOM;
+    }
+
+    eval_thread_pool_run(pool, filter_task, &t);
+
+    for (i = 0; i < nr_workers; i++)
+    {
+        EvalFilterWorker *w = t.workers + i;
+
+        selected += w->nr_selected;
+        if (w->result != EVAL_RESULT_OK && (result == EVAL_RESULT_OK || w->failed_row < failed_row))
+        {
+            result = w->result;
+            failed_row = w->failed_row;
+        }
+        eval_exec_context_deinit(t.contexts + i);
+    }
+
+    scheduler_deinit(&t.scheduler);
+    free(t.contexts);
+    free(t.workers);
+
+    if (nr_selected)
+        *nr_selected = selected;
+
+    return result;
+}
+
+/*
+ * Streaming.
+ *
+ * Input is read in large blocks and split into lines in place, so every
+ * expression is a NUL terminated slice of the block. A block's lines are
+ * evaluated in chunks of EVAL_STREAM_CHUNK, each chunk formats into its own
+ * output buffer and the buffers are written in chunk order, which keeps the
+ * output in input order for any number of threads. All buffers are reused
+ * from block to block.
+ */
+
+#define EVAL_STREAM_BLOCK           (1 << 20)
+#define EVAL_STREAM_CHUNK           256
+#define EVAL_STREAM_NUMBER_SIZE     400
+
+typedef struct
+{
+    char *data;
+    size_t size;
+    size_t capacity;
+    size_t nr_failed;
+    int oom;
+} EvalStreamChunk;
+
+typedef struct
+{
+    char **lines;
+    size_t nr_lines;
+    const EvalHooks *hooks;
+    void *user_data;
+    EvalStreamChunk *chunks;
+    size_t next;
+} EvalStreamTask;
+
+static char *stream_reserve(EvalStreamChunk *c, size_t size)
+{
+    if (c->size + size > c->capacity)
+    {
+        size_t capacity = c->capacity ? c->capacity * 2 : 4096;
+        char *data;
+
+        while (capacity < c->size + size)
+            capacity *= 2;
+
+        data = (char *)realloc(c->data, capacity);
+        if (data == NULL)
+        {
+            c->oom = 1;
+            return NULL;
+        }
+        c->data = data;
+        c->capacity = capacity;
+    }
+
+    return c->data + c->size;
+}
+
+/* same format as the eval command prints a single result */
+static void stream_format(EvalStreamChunk *c, EvalResult result, const ExprValue *value)
+{
+    char *p;
+
+    if (result != EVAL_RESULT_OK)
+    {
+        const char *str = eval_result_to_string(result);
+        size_t len = strlen(str);
+
+        if ((p = stream_reserve(c, len + 1)) == NULL)
+            return;
+        memcpy(p, str, len);
+        p[len] = '\n';
+        c->size += len + 1;
+        c->nr_failed++;
+    }
+    else if (value->type == EXPR_VALUE_TYPE_STRING)
+    {
+        if ((p = stream_reserve(c, value->v.str.size + 10)) == NULL)
+            return;
+        memcpy(p, "string: ", 8);
+        memcpy(p + 8, value->v.str.str, value->v.str.size);
+        p[8 + value->v.str.size] = '\n';
+        c->size += value->v.str.size + 9;
+    }
+    else
+    {
+        if ((p = stream_reserve(c, EVAL_STREAM_NUMBER_SIZE)) == NULL)
+            return;
+        c->size += (size_t)sprintf(p, "number: %lf\n", value->v.val);
+    }
+}
+
+static void stream_task(void *arg, size_t worker)
+{
+    EvalStreamTask *t = (EvalStreamTask *)arg;
+
+    (void)worker;
+    for (;;)
+    {
+        size_t begin = EVAL_ATOMIC_ADD(&t->next, EVAL_STREAM_CHUNK);
+        size_t end = begin + EVAL_STREAM_CHUNK;
+        EvalStreamChunk *c = t->chunks + begin / EVAL_STREAM_CHUNK;
+        size_t i;
+
+        if (begin >= t->nr_lines)
+            break;
+        if (end > t->nr_lines)
+            end = t->nr_lines;
+
+        c->size = 0;
+        c->nr_failed = 0;
+        for (i = begin; i < end; i++)
+        {
+            ExprValue value;
+            EvalResult result;
+
+            expr_value_init(&value);
+            result = eval_execute(t->lines[i], t->hooks, t->user_data, &value);
+            stream_format(c, result, &value);
+            if (result == EVAL_RESULT_OK)
+                expr_value_clear(&value);
+        }
+    }
+}
+
+static void stream_free(EvalStreamTask *t, size_t nr_chunks, char *block)
+{
+    size_t i;
+
+    for (i = 0; i < nr_chunks; i++)
+    {
+        free(t->chunks[i].data);
+    }
+    free(t->chunks);
+    free(t->lines);
+    free(block);
+}
+
+EvalResult eval_stream(EvalThreadPool *pool, FILE *in, FILE *out, const EvalHooks *hooks, void *user_data,
+                       size_t *nr_failed)
+{
+    EvalStreamTask t;
+    EvalResult result = EVAL_RESULT_OK;
+    size_t lines_capacity = 0;
+    size_t nr_chunks = 0;
+    size_t capacity = EVAL_STREAM_BLOCK;
+    size_t size = 0;
+    size_t failed = 0;
+    char *block = (char *)malloc(capacity + 1);
+    int eof = 0;
+
+    memset(&t, 0x00, sizeof(t));
+    t.hooks = hooks;
+    t.user_data = user_data;
+
+    if (block == NULL)
+        return EVAL_RESULT_OOM;
+
+    while (!eof && result == EVAL_RESULT_OK)
+    {
+        size_t start = 0;
+        size_t n;
+        size_t i;
+
+        if (size == capacity)
+        {
+            /* a line longer than the block */
+            char *p = (char *)realloc(block, capacity * 2 + 1);
+
+            if (p == NULL)
+            {
+                result = EVAL_RESULT_OOM;
+                break;
+            }
+            block = p;
+            capacity *= 2;
+        }
+
+        n = fread(block + size, 1, capacity - size, in);
+        if (n == 0)
+        {
+            if (ferror(in))
+            {
+                result = EVAL_RESULT_IO_ERROR;
+                break;
+            }
+            eof = 1;
+        }
+
+        /* split everything read so far into lines, the last one may be incomplete */
+        t.nr_lines = 0;
+        i = size;
+        size += n;
+        for (; i <= size; i++)
+        {
+            if (i == size && !(eof && start < size))
+                break;
+
+            if (i == size || block[i] == '\n')
+            {
+                if (t.nr_lines == lines_capacity)
+                {
+                    size_t c = lines_capacity ? lines_capacity * 2 : 4096;
+                    char **lines = (char **)realloc(t.lines, c * sizeof(char *));
+
+                    if (lines == NULL)
+                    {
+                        result = EVAL_RESULT_OOM;
+                        break;
+                    }
+                    t.lines = lines;
+                    lines_capacity = c;
+                }
+
+                block[i] = '\0';
+                if (i > start && block[i - 1] == '\r')
+                    block[i - 1] = '\0';
+                t.lines[t.nr_lines++] = block + start;
+                start = i + 1;
+            }
+        }
+
+        if (result != EVAL_RESULT_OK)
+            break;
+
+        if (t.nr_lines)
+        {
+            size_t needed = (t.nr_lines + EVAL_STREAM_CHUNK - 1) / EVAL_STREAM_CHUNK;
+
+            if (needed > nr_chunks)
+            {
+                EvalStreamChunk *chunks = (EvalStreamChunk *)realloc(t.chunks, needed * sizeof(EvalStreamChunk));
+
+                if (chunks == NULL)
+                {
+                    result = EVAL_RESULT_OOM;
+                    break;
+                }
+                memset(chunks + nr_chunks, 0x00, (needed - nr_chunks) * sizeof(EvalStreamChunk));
+                t.chunks = chunks;
+                nr_chunks = needed;
+            }
+
+            t.next = 0;
+            eval_thread_pool_run(pool, stream_task, &t);
+
+            for (i = 0; i < needed; i++)
+            {
+                EvalStreamChunk *c = t.chunks + i;
+
+                if (c->oom)
+                {
+                    result = EVAL_RESULT_OOM;
+                    break;
+                }
+                if (c->size && fwrite(c->data, 1, c->size, out) != c->size)
+                {
+                    result = EVAL_RESULT_IO_ERROR;
+                    break;
+                }
+                failed += c->nr_failed;
+            }
+        }
+
+        if (start < size)
+            memmove(block, block + start, size - start);
+        size = start < size ? size - start : 0;
+    }
+
+    if (result == EVAL_RESULT_OK && fflush(out) != 0)
+        result = EVAL_RESULT_IO_ERROR;
+
+    stream_free(&t, nr_chunks, block);
+    if (nr_failed)
+        *nr_failed = failed;
+
+    return result;
+}
+
+/*
+ * CSV.
+ *
+ * The first line names the columns, a variable named like a column reads the
+ * field of the current row. The data is never copied up front: every row is
+ * scanned only as far as the last column the program references, and a
+ * field is converted when the program reads it, to a number when the whole
+ * field is a number literal of the language and to a string otherwise. The
+ * data is split into chunks of about EVAL_CSV_CHUNK bytes at line boundaries
+ * (quoted fields may contain commas but not newlines), a round of chunks is
+ * evaluated in parallel and the output of every chunk is written in order.
+ */
+
+#define EVAL_CSV_CHUNK              (1 << 20)
+#define EVAL_CSV_CHUNKS_PER_WORKER  4
+#define EVAL_CSV_MAX_NUMBER         64
+
+typedef struct
+{
+    const char *begin;
+    const char *end;
+} EvalCsvField;
+
+typedef struct _EvalCsvTask EvalCsvTask;
+
+typedef struct
+{
+    const EvalCsvTask *task;
+    EvalCsvField *fields;
+    char pad[EVAL_CACHE_LINE];
+} EvalCsvCursor;
+
+struct _EvalCsvTask
+{
+    const char *data;
+    const EvalProgram *program;
+    EvalCsvMode mode;
+    EvalHooks hooks;
+
+    /* names of the referenced columns, slots maps a field index to one of them or -1 */
+    char **names;
+    size_t nr_columns;
+    long *slots;
+    size_t nr_slots;
+
+    size_t *bounds;
+    size_t nr_chunks;
+    EvalStreamChunk *chunks;
+    EvalCsvCursor *cursors;
+    EvalExecContext *contexts;
+    size_t next;
+};
+
+/* end of the field starting at p, quotes protect commas */
+static const char *csv_field_end(const char *p, const char *end)
+{
+    int quoted = 0;
+
+    for (; p < end; p++)
+    {
+        if (*p == '"')
+            quoted = !quoted;
+        else if (*p == ',' && !quoted)
+            break;
+    }
+
+    return p;
+}
+
+static EvalResult csv_field_value(const EvalCsvField *field, ExprValue *output)
+{
+    const char *begin = field->begin;
+    const char *end = field->end;
+    size_t len;
+    int escaped = 0;
+
+    if (end - begin >= 2 && *begin == '"' && end[-1] == '"')
+    {
+        const char *p;
+
+        begin++;
+        end--;
+        for (p = begin; p < end && !escaped; p++)
+            escaped = *p == '"';
+    }
+
+    len = (size_t)(end - begin);
+    if (len && len < EVAL_CSV_MAX_NUMBER && !escaped)
+    {
+        double value;
+
+        /* the grammar of number literals, not strtod(): "nan", "Infinity" or " 0x10" stay strings */
+        if (eval_number_parse(begin, len, &value) == EVAL_RESULT_OK)
+            return expr_value_set_number(output, value);
+    }
+
+    if (expr_value_set_string(output, begin, len) != EVAL_RESULT_OK)
+        return EVAL_RESULT_OOM;
+
+    if (escaped)
+    {
+        /* "" inside a quoted field is one quote */
+        char *str = output->v.str.str;
+        size_t i;
+        size_t j;
+
+        for (i = j = 0; i < len; i++, j++)
+        {
+            str[j] = str[i];
+            if (str[i] == '"' && i + 1 < len && str[i + 1] == '"')
+                i++;
+        }
+        str[j] = '\0';
+        output->v.str.size = j;
+    }
+
+    return EVAL_RESULT_OK;
+}
+
+static EvalResult csv_get_variable(const char *name, void *user_data, ExprValue *output)
+{
+    EvalCsvCursor *cursor = (EvalCsvCursor *)user_data;
+    const EvalCsvTask *t = cursor->task;
+    size_t i;
+
+    for (i = 0; i < t->nr_columns; i++)
+    {
+        if (strcmp(t->names[i], name) == 0)
+            return csv_field_value(cursor->fields + i, output);
+    }
+
+    return eval_default_hooks()->get_variable(name, NULL, output);
+}
+
+static EvalFunc csv_get_func(const char *name, void *user_data)
+{
+    (void)user_data;
+
+    return eval_default_hooks()->get_func(name, NULL);
+}
+
+/* records the referenced fields of the line [p, end) */
+static void csv_split(const EvalCsvTask *t, EvalCsvCursor *cursor, const char *p, const char *end)
+{
+    size_t i;
+
+    for (i = 0; i < t->nr_columns; i++)
+    {
+        cursor->fields[i].begin = cursor->fields[i].end = end;
+    }
+
+    for (i = 0; i < t->nr_slots && p <= end; i++)
+    {
+        const char *e = csv_field_end(p, end);
+
+        if (t->slots[i] >= 0)
+        {
+            cursor->fields[t->slots[i]].begin = p;
+            cursor->fields[t->slots[i]].end = e;
+        }
+        p = e + 1;
+    }
+}
+
+static void csv_chunk(EvalCsvTask *t, size_t worker, size_t index)
+{
+    EvalCsvCursor *cursor = t->cursors + worker;
+    EvalExecContext *ctx = t->contexts + worker;
+    EvalStreamChunk *c = t->chunks + index;
+    const char *p = t->data + t->bounds[index];
+    const char *end = t->data + t->bounds[index + 1];
+
+    c->size = 0;
+    c->nr_failed = 0;
+    while (p < end)
+    {
+        const char *nl = (const char *)memchr(p, '\n', (size_t)(end - p));
+        const char *next = nl ? nl + 1 : end;
+        const char *line_end = nl ? nl : end;
+        EvalResult result;
+        ExprValue value;
+
+        if (line_end > p && line_end[-1] == '\r')
+            line_end--;
+        if (line_end == p)
+        {
+            p = next;
+            continue;
+        }
+
+        csv_split(t, cursor, p, line_end);
+        expr_value_init(&value);
+        result = eval_program_execute_in(ctx, t->program, &t->hooks, cursor, &value);
+
+        if (t->mode == EVAL_CSV_RESULTS)
+        {
+            stream_format(c, result, &value);
+        }
+        else if (result != EVAL_RESULT_OK)
+        {
+            c->nr_failed++;
+        }
+        else if (value.type == EXPR_VALUE_TYPE_STRING ? value.v.str.size != 0 : value.v.val != 0)
+        {
+            char *out = stream_reserve(c, (size_t)(line_end - p) + 1);
+
+            if (out != NULL)
+            {
+                memcpy(out, p, (size_t)(line_end - p));
+                out[line_end - p] = '\n';
+                c->size += (size_t)(line_end - p) + 1;
+            }
+        }
+
+        if (result == EVAL_RESULT_OK)
+            expr_value_clear(&value);
+        p = next;
+    }
+}
+
+static void csv_task(void *arg, size_t worker)
+{
+    EvalCsvTask *t = (EvalCsvTask *)arg;
+
+    for (;;)
+    {
+        size_t index = EVAL_ATOMIC_ADD(&t->next, 1);
+
+        if (index >= t->nr_chunks)
+            break;
+
+        csv_chunk(t, worker, index);
+    }
+}
+
+/* looks up the referenced columns in the header line [p, end) */
+static EvalResult csv_header(EvalCsvTask *t, const char *p, const char *end)
+{
+    size_t nr_fields = 0;
+    const char *q;
+    size_t i;
+
+    if (end > p && end[-1] == '\r')
+        end--;
+
+    for (q = p; q <= end; q = csv_field_end(q, end) + 1)
+        nr_fields++;
+
+    t->names = (char **)calloc(nr_fields, sizeof(char *));
+    t->slots = (long *)calloc(nr_fields, sizeof(long));
+    if (t->names == NULL || t->slots == NULL)
+        return EVAL_RESULT_OOM;
+
+    for (i = 0, q = p; i < nr_fields; i++)
+    {
+        const char *e = csv_field_end(q, end);
+        const char *b = q;
+        size_t len;
+        char *name;
+
+        if (e - b >= 2 && *b == '"' && e[-1] == '"')
+        {
+            b++;
+            len = (size_t)(e - b) - 1;
+        }
+        else
+        {
+            len = (size_t)(e - b);
+        }
+
+        t->slots[i] = -1;
+        name = (char *)malloc(len + 1);
+        if (name == NULL)
+            return EVAL_RESULT_OOM;
+        memcpy(name, b, len);
+        name[len] = '\0';
+
+        if (eval_program_uses_variable(t->program, name))
+        {
+            t->slots[i] = (long)t->nr_columns;
+            t->names[t->nr_columns++] = name;
+            /* fields after the last referenced one are never scanned */
+            t->nr_slots = i + 1;
+        }
+        else
+        {
+            free(name);
+        }
+        q = e + 1;
+    }
+
+    return EVAL_RESULT_OK;
+}
+
+static void csv_free(EvalCsvTask *t, size_t nr_workers, size_t nr_chunks)
+{
+    size_t i;
+
+    for (i = 0; t->names && i < t->nr_columns; i++)
+    {
+        free(t->names[i]);
+    }
+    for (i = 0; t->cursors && i < nr_workers; i++)
+    {
+        free(t->cursors[i].fields);
+    }
+    for (i = 0; t->contexts && i < nr_workers; i++)
+    {
+        eval_exec_context_deinit(t->contexts + i);
+    }
+    for (i = 0; t->chunks && i < nr_chunks; i++)
+    {
+        free(t->chunks[i].data);
+    }
+    free(t->names);
+    free(t->slots);
+    free(t->bounds);
+    free(t->chunks);
+    free(t->cursors);
+    free(t->contexts);
+}
+
+EvalResult eval_csv(EvalThreadPool *pool, const char *data, size_t size, const EvalProgram *program,
+                    EvalCsvMode mode, FILE *out, size_t *nr_failed)
+{
+    size_t nr_workers = eval_thread_pool_size(pool);
+    size_t max_chunks = nr_workers * EVAL_CSV_CHUNKS_PER_WORKER;
+    const char *nl;
+    size_t pos;
+    size_t header;
+    EvalResult result;
+    EvalCsvTask t;
+    size_t failed = 0;
+    size_t i;
+
+    /* no header, no rows */
+    if (nr_failed)
+        *nr_failed = 0;
+    if (size == 0)
+        return EVAL_RESULT_OK;
+
+    nl = (const char *)memchr(data, '\n', size);
+    pos = nl ? (size_t)(nl - data) + 1 : size;
+
+    memset(&t, 0x00, sizeof(t));
+    t.data = data;
+    t.program = program;
+    t.mode = mode;
+    t.hooks.get_func = csv_get_func;
+    t.hooks.get_variable = csv_get_variable;
+    t.bounds = (size_t *)malloc((max_chunks + 1) * sizeof(size_t));
+    t.chunks = (EvalStreamChunk *)calloc(max_chunks, sizeof(EvalStreamChunk));
+    t.cursors = (EvalCsvCursor *)calloc(nr_workers, sizeof(EvalCsvCursor));
+    t.contexts = (EvalExecContext *)calloc(nr_workers, sizeof(EvalExecContext));
+
+    result = (t.bounds && t.chunks && t.cursors && t.contexts) ? EVAL_RESULT_OK : EVAL_RESULT_OOM;
+    if (result == EVAL_RESULT_OK)
+        result = csv_header(&t, data, nl ? nl : data + size);
+
+    for (i = 0; i < nr_workers && result == EVAL_RESULT_OK; i++)
+    {
+        t.cursors[i].task = &t;
+        t.cursors[i].fields = (EvalCsvField *)calloc(t.nr_columns + 1, sizeof(EvalCsvField));
+        if (t.cursors[i].fields == NULL)
+            result = EVAL_RESULT_OOM;
+    }
+
+    /* the header ends in '\n' like the rows, which lose their '\r' */
+    header = nl ? (size_t)(nl - data) : size;
+    if (header && data[header - 1] == '\r')
+        header--;
+    if (result == EVAL_RESULT_OK && mode == EVAL_CSV_FILTER && fwrite(data, 1, header, out) != header)
+        result = EVAL_RESULT_IO_ERROR;
+    if (result == EVAL_RESULT_OK && mode == EVAL_CSV_FILTER && fputc('\n', out) == EOF)
+        result = EVAL_RESULT_IO_ERROR;
+
+    while (pos < size && result == EVAL_RESULT_OK)
+    {
+        for (t.nr_chunks = 0; t.nr_chunks < max_chunks && pos < size; t.nr_chunks++)
+        {
+            size_t end = pos + EVAL_CSV_CHUNK;
+
+            if (end >= size)
+            {
+                end = size;
+            }
+            else
+            {
+                nl = (const char *)memchr(data + end, '\n', size - end);
+                end = nl ? (size_t)(nl - data) + 1 : size;
+            }
+            t.bounds[t.nr_chunks] = pos;
+            pos = end;
+        }
+        t.bounds[t.nr_chunks] = pos;
+
+        t.next = 0;
+        eval_thread_pool_run(pool, csv_task, &t);
+
+        for (i = 0; i < t.nr_chunks; i++)
+        {
+            EvalStreamChunk *c = t.chunks + i;
+
+            if (c->oom)
+            {
+                result = EVAL_RESULT_OOM;
+                break;
+            }
+            if (c->size && fwrite(c->data, 1, c->size, out) != c->size)
+            {
+                result = EVAL_RESULT_IO_ERROR;
+                break;
+            }
+            failed += c->nr_failed;
+        }
+    }
+
+    if (result == EVAL_RESULT_OK && fflush(out) != 0)
+        result = EVAL_RESULT_IO_ERROR;
+
+    csv_free(&t, nr_workers, max_chunks);
+    if (nr_failed)
+        *nr_failed = failed;
+
+    return result;
+}
@@ -0,0 +1,84 @@
+/**
+ * Eval - parallel helpers
+ *
+ * Batch entry points that spread work over a pool of threads. A pool of N
+ * threads runs work on N-1 worker threads plus the calling thread, so a pool
+ * of one thread (or a NULL pool) runs everything on the caller.
+ */
+
+#ifndef EVAL_PARALLEL_H
+#define EVAL_PARALLEL_H
+
+#include "eval.h"
+
+typedef struct _EvalThreadPool EvalThreadPool;
+
+EvalResult eval_thread_pool_create(size_t nr_threads, EvalThreadPool** pool);
+void eval_thread_pool_destroy(EvalThreadPool* pool);
+size_t eval_thread_pool_size(const EvalThreadPool* pool);
+
+/* compiles exprs[i] into programs[i] (NULL on failure) and stores each result code in results[i] when
+ * results is not NULL. Returns the result of the first failing expression in index order, so the
+ * outcome does not depend on the number of threads. */
+EvalResult eval_compile_batch(EvalThreadPool* pool, const char* const* exprs, size_t nr_exprs,
+                              EvalProgram** programs, EvalResult* results);
+
+/* executes program once per row, variables named like a column read the row's value and everything else
+ * goes through hooks, which must be thread-safe. outputs[i] receives the value for row i (overwritten like
+ * eval_execute() does) and results[i] its result code when results is not NULL. Rows are scheduled in chunks
+ * over per-thread ranges, idle threads steal half of the largest remaining range. */
+EvalResult eval_rows_execute(EvalThreadPool* pool, const EvalProgram* program, const EvalRowSet* rows,
+                             const EvalHooks* hooks, void* user_data, ExprValue* outputs, EvalResult* results);
+
+/* eval_rows_execute() with eight byte outputs, a quarter of the memory per row. Release them with
+ * eval_value_clear(). */
+EvalResult eval_rows_execute_values(EvalThreadPool* pool, const EvalProgram* program, const EvalRowSet* rows,
+                                    const EvalHooks* hooks, void* user_data, EvalValue* outputs,
+                                    EvalResult* results);
+
+typedef struct _EvalAggregate {
+    size_t count;
+    size_t count_true;
+    double sum;
+    double mean;
+    double min;
+    double max;
+    double variance;
+}EvalAggregate;
+
+/* evaluates program over all rows and reduces the values in the same pass: count_true counts non-zero
+ * numbers and non-empty strings, the other fields use the value as a number (variance is the population
+ * variance, mean/min/max/variance are NaN when no row evaluated). Rows that fail are left out and the
+ * result of the first failing row is returned. The result does not depend on the number of threads. */
+EvalResult eval_rows_aggregate(EvalThreadPool* pool, const EvalProgram* program, const EvalRowSet* rows,
+                               const EvalHooks* hooks, void* user_data, EvalAggregate* aggregate);
+
+/* evaluates a predicate over all rows into bitmap, which holds (nr_rows + 63) / 64 words, and counts the
+ * selected rows. Failing rows are not selected and the result of the first of them is returned. */
+EvalResult eval_rows_filter(EvalThreadPool* pool, const EvalProgram* program, const EvalRowSet* rows,
+                            const EvalHooks* hooks, void* user_data, EvalMask* bitmap, size_t* nr_selected);
+
+/* reads newline-delimited expressions from in until end of file, evaluates each of them with eval_execute()
+ * and writes one line per expression to out, in input order, in the format the eval command prints a single
+ * result ("number: ...", "string: ..." or the error text). Buffers are reused between blocks of input, lines
+ * of a block are evaluated in parallel. nr_failed receives the number of expressions that failed.
+ * Returns EVAL_RESULT_IO_ERROR when reading or writing fails. */
+EvalResult eval_stream(EvalThreadPool* pool, FILE* in, FILE* out, const EvalHooks* hooks, void* user_data,
+                       size_t* nr_failed);
+
+typedef enum _EvalCsvMode {
+    EVAL_CSV_RESULTS = 0,
+    EVAL_CSV_FILTER
+}EvalCsvMode;
+
+/* evaluates program once per row of the CSV data (a header line, then one row per line) and writes one result
+ * line per row to out (EVAL_CSV_RESULTS) or the header and the rows the program is true for (EVAL_CSV_FILTER).
+ * A variable named like a header column reads the row's field, as a number when the whole field is a number
+ * literal, possibly after a '-' (see eval_number_parse()), and as a string otherwise. Other variables and
+ * functions use the default hooks. Only the referenced columns are looked at, empty lines are skipped and quoted
+ * fields must not span lines. Output is in row order for any number of threads; nr_failed receives the number of
+ * rows that failed. Empty data has no header and writes nothing. */
+EvalResult eval_csv(EvalThreadPool* pool, const char* data, size_t size, const EvalProgram* program,
+                    EvalCsvMode mode, FILE* out, size_t* nr_failed);
+
+#endif /* EVAL_PARALLEL_H */
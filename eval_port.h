@@ -0,0 +1,194 @@
+/**
+ * Internal portability helpers shared by the library, its tools and benchmarks.
+ */
+
+#ifndef EVAL_PORT_H
+#define EVAL_PORT_H
+
+#include <stddef.h>
+
+#ifdef WIN32
+#   include <windows.h>
+#else
+#   include <time.h>
+#endif
+
+#ifdef _MSC_VER
+#   define EVAL_INLINE __inline
+#else
+#   define EVAL_INLINE __inline__
+#endif
+
+#ifdef _MSC_VER
+#   define EVAL_THREAD_LOCAL __declspec(thread)
+#else
+#   define EVAL_THREAD_LOCAL __thread
+#endif
+
+#ifdef _MSC_VER
+#   ifdef _WIN64
+#       define EVAL_ATOMIC_ADD(p, v) ((size_t)InterlockedExchangeAdd64((volatile LONGLONG *)(p), (LONGLONG)(v)))
+#   else
+#       define EVAL_ATOMIC_ADD(p, v) ((size_t)InterlockedExchangeAdd((volatile LONG *)(p), (LONG)(v)))
+#   endif
+#else
+#   define EVAL_ATOMIC_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#endif
+
+/* relaxed atomics on fixed size counters, the compare-and-swap and release/acquire pairs that publish a slot or a
+ * pointer, a spin lock on an unsigned int, and dropping a reference, which gives the count left */
+#ifdef _MSC_VER
+#   define EVAL_ATOMIC_ADD_U32(p, v) ((unsigned int)InterlockedExchangeAdd((volatile LONG *)(p), (LONG)(v)))
+#   define EVAL_ATOMIC_ADD_U64(p, v) ((unsigned long long)InterlockedExchangeAdd64((volatile LONGLONG *)(p), (LONGLONG)(v)))
+#   define EVAL_ATOMIC_LOAD_U32(p) (*(volatile unsigned int *)(p))
+#   define EVAL_ATOMIC_LOAD_U64(p) ((unsigned long long)InterlockedCompareExchange64((volatile LONGLONG *)(p), 0, 0))
+#   define EVAL_ATOMIC_STORE_U32(p, v) InterlockedExchange((volatile LONG *)(p), (LONG)(v))
+#   define EVAL_ATOMIC_STORE_U64(p, v) InterlockedExchange64((volatile LONGLONG *)(p), (LONGLONG)(v))
+#   define EVAL_ATOMIC_CAS_U64(p, expected, desired) \
+        (InterlockedCompareExchange64((volatile LONGLONG *)(p), (LONGLONG)(desired), (LONGLONG)(expected)) == (LONGLONG)(expected))
+#   define EVAL_ATOMIC_LOAD_ACQUIRE_U32(p) (*(volatile unsigned int *)(p))
+#   define EVAL_ATOMIC_STORE_RELEASE_U32(p, v) InterlockedExchange((volatile LONG *)(p), (LONG)(v))
+#   define EVAL_ATOMIC_LOAD_ACQUIRE_PTR(p) (*(void *volatile *)(p))
+#   define EVAL_ATOMIC_STORE_RELEASE_PTR(p, v) InterlockedExchangePointer((PVOID volatile *)(p), (PVOID)(v))
+#   define EVAL_SPIN_TRY_LOCK(p) (InterlockedExchange((volatile LONG *)(p), 1) == 0)
+#   define EVAL_SPIN_UNLOCK(p) InterlockedExchange((volatile LONG *)(p), 0)
+#   define EVAL_ATOMIC_RELEASE_REF(p) ((unsigned int)InterlockedDecrement((volatile LONG *)(p)))
+#else
+#   define EVAL_ATOMIC_ADD_U32(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#   define EVAL_ATOMIC_ADD_U64(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#   define EVAL_ATOMIC_LOAD_U32(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#   define EVAL_ATOMIC_LOAD_U64(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#   define EVAL_ATOMIC_STORE_U32(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#   define EVAL_ATOMIC_STORE_U64(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#   define EVAL_ATOMIC_CAS_U64(p, expected, desired) \
+        __atomic_compare_exchange_n((p), &(expected), (desired), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#   define EVAL_ATOMIC_LOAD_ACQUIRE_U32(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#   define EVAL_ATOMIC_STORE_RELEASE_U32(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#   define EVAL_ATOMIC_LOAD_ACQUIRE_PTR(p) ((void *)__atomic_load_n((p), __ATOMIC_ACQUIRE))
+#   define EVAL_ATOMIC_STORE_RELEASE_PTR(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#   define EVAL_SPIN_TRY_LOCK(p) (__atomic_exchange_n((p), 1u, __ATOMIC_ACQUIRE) == 0)
+#   define EVAL_SPIN_UNLOCK(p) __atomic_store_n((p), 0u, __ATOMIC_RELEASE)
+#   define EVAL_ATOMIC_RELEASE_REF(p) __atomic_sub_fetch((p), 1u, __ATOMIC_ACQ_REL)
+#endif
+
+/* a mutex that blocks a waiting thread, a condition variable waited on with one and a thread to join: Win32
+ * threads on Windows, pthreads elsewhere. EVAL_MUTEX_INITIALIZER sets up a static mutex, EVAL_MUTEX_INIT the
+ * others; a thread runs a function declared "static EVAL_THREAD_PROC f(void *arg)" that returns
+ * EVAL_THREAD_RETURN, and EVAL_THREAD_CREATE is non-zero when it started */
+#ifdef WIN32
+#   include <process.h>
+typedef SRWLOCK EvalMutex;
+typedef CONDITION_VARIABLE EvalCond;
+typedef HANDLE EvalThread;
+#   define EVAL_MUTEX_INITIALIZER SRWLOCK_INIT
+#   define EVAL_MUTEX_INIT(m) InitializeSRWLock(m)
+#   define EVAL_MUTEX_DESTROY(m) ((void)(m))
+#   define EVAL_MUTEX_LOCK(m) AcquireSRWLockExclusive(m)
+#   define EVAL_MUTEX_UNLOCK(m) ReleaseSRWLockExclusive(m)
+#   define EVAL_COND_INIT(c) InitializeConditionVariable(c)
+#   define EVAL_COND_DESTROY(c) ((void)(c))
+#   define EVAL_COND_WAIT(c, m) SleepConditionVariableSRW((c), (m), INFINITE, 0)
+#   define EVAL_COND_SIGNAL(c) WakeConditionVariable(c)
+#   define EVAL_COND_BROADCAST(c) WakeAllConditionVariable(c)
+#   define EVAL_THREAD_PROC unsigned __stdcall
+#   define EVAL_THREAD_RETURN 0
+#   define EVAL_THREAD_CREATE(t, proc, arg) ((*(t) = (HANDLE)_beginthreadex(NULL, 0, (proc), (arg), 0, NULL)) != NULL)
+#   define EVAL_THREAD_JOIN(t) (WaitForSingleObject((t), INFINITE), CloseHandle(t))
+#else
+#   include <pthread.h>
+typedef pthread_mutex_t EvalMutex;
+typedef pthread_cond_t EvalCond;
+typedef pthread_t EvalThread;
+#   define EVAL_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#   define EVAL_MUTEX_INIT(m) pthread_mutex_init((m), NULL)
+#   define EVAL_MUTEX_DESTROY(m) pthread_mutex_destroy(m)
+#   define EVAL_MUTEX_LOCK(m) pthread_mutex_lock(m)
+#   define EVAL_MUTEX_UNLOCK(m) pthread_mutex_unlock(m)
+#   define EVAL_COND_INIT(c) pthread_cond_init((c), NULL)
+#   define EVAL_COND_DESTROY(c) pthread_cond_destroy(c)
+#   define EVAL_COND_WAIT(c, m) pthread_cond_wait((c), (m))
+#   define EVAL_COND_SIGNAL(c) pthread_cond_signal(c)
+#   define EVAL_COND_BROADCAST(c) pthread_cond_broadcast(c)
+#   define EVAL_THREAD_PROC void *
+#   define EVAL_THREAD_RETURN NULL
+#   define EVAL_THREAD_CREATE(t, proc, arg) (pthread_create((t), NULL, (proc), (arg)) == 0)
+#   define EVAL_THREAD_JOIN(t) pthread_join((t), NULL)
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   define EVAL_HAVE_SSE2
+#   include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#   include <intrin.h>
+static EVAL_INLINE unsigned int eval_port_ctz64(unsigned long long x)
+{
+    unsigned long index;
+#   ifdef _WIN64
+    _BitScanForward64(&index, x);
+#   else
+    if (!_BitScanForward(&index, (unsigned long)x))
+    {
+        _BitScanForward(&index, (unsigned long)(x >> 32));
+        index += 32;
+    }
+#   endif
+    return (unsigned int)index;
+}
+#   define EVAL_CTZ64(x) eval_port_ctz64(x)
+static EVAL_INLINE unsigned int eval_port_clz64(unsigned long long x)
+{
+    unsigned long index;
+#   ifdef _WIN64
+    _BitScanReverse64(&index, x);
+#   else
+    if (_BitScanReverse(&index, (unsigned long)(x >> 32)))
+        index += 32;
+    else
+        _BitScanReverse(&index, (unsigned long)x);
+#   endif
+    return 63 - (unsigned int)index;
+}
+#   define EVAL_CLZ64(x) eval_port_clz64(x)
+#   define EVAL_POPCOUNT64(x) ((unsigned int)(__popcnt((unsigned int)(x)) + __popcnt((unsigned int)((x) >> 32))))
+#else
+#   define EVAL_CTZ64(x) ((unsigned int)__builtin_ctzll(x))
+#   define EVAL_CLZ64(x) ((unsigned int)__builtin_clzll(x))
+#   define EVAL_POPCOUNT64(x) ((unsigned int)__builtin_popcountll(x))
+#endif
+
+/* monotonic clock in nanoseconds */
+static EVAL_INLINE unsigned long long eval_port_now_ns(void)
+{
+#ifdef WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+
+    return (unsigned long long)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+#endif
+}
+
+/* the cheapest clock available, in unspecified units: the time stamp counter on x86, else nanoseconds */
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#   define EVAL_PORT_TICKS_ARE_NS 0
+#   define eval_port_ticks() ((unsigned long long)__rdtsc())
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define EVAL_PORT_TICKS_ARE_NS 0
+#   define eval_port_ticks() ((unsigned long long)__builtin_ia32_rdtsc())
+#else
+#   define EVAL_PORT_TICKS_ARE_NS 1
+#   define eval_port_ticks() eval_port_now_ns()
+#endif
+
+#endif /* EVAL_PORT_H */
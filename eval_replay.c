@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eval.h"
+#include "eval_port.h"
+
+/*
+ * eval_replay - re-runs a capture written between eval_capture_start() and
+ * eval_capture_stop(), checks that every evaluation gives the captured result
+ * and reports how long the workload takes. Variables and host functions come
+ * from the capture, so the numbers are the evaluator's own.
+ */
+
+#define EVAL_REPLAY_MAX_REPORTED    10
+
+int main(int argc, char* argv[])
+{
+    EvalReplay* replay = NULL;
+    const char* filename = NULL;
+    size_t nr_rounds = 10;
+    size_t nr_top = 0;
+    size_t nr_records;
+    size_t nr_mismatches = 0;
+    size_t nr_failed = 0;
+    unsigned long long best = 0;
+    unsigned long long total = 0;
+    EvalResult result;
+    size_t round;
+    size_t i;
+    int match;
+
+    for ( i = 1; i < (size_t)argc; i++ )
+    {
+        if ( strcmp(argv[i], "-n") == 0 && i + 1 < (size_t)argc )
+        {
+            nr_rounds = (size_t)atoi(argv[++i]);
+        }
+        else if ( strcmp(argv[i], "--top") == 0 && i + 1 < (size_t)argc )
+        {
+            nr_top = (size_t)atoi(argv[++i]);
+        }
+        else if ( filename == NULL )
+        {
+            filename = argv[i];
+        }
+        else
+        {
+            filename = NULL;
+            break;
+        }
+    }
+
+    if ( filename == NULL )
+    {
+        printf("Usage: eval_replay [-n rounds] [--top n] <capture>\n");
+        return 0;
+    }
+
+    result = eval_replay_open(filename, &replay);
+    if ( result != EVAL_RESULT_OK )
+    {
+        fprintf(stderr, "%s: %s\n", filename, eval_result_to_string(result));
+        return 1;
+    }
+    nr_records = eval_replay_size(replay);
+
+    /* the first pass checks, the timed ones only run */
+    for ( i = 0; i < nr_records; i++ )
+    {
+        result = eval_replay_execute(replay, i, &match);
+        nr_failed += result != EVAL_RESULT_OK;
+        if ( !match && nr_mismatches++ < EVAL_REPLAY_MAX_REPORTED )
+        {
+            fprintf(stderr, "mismatch %lu: %s (%s)\n", (unsigned long)i, eval_replay_expression(replay, i),
+                    eval_result_to_string(result));
+        }
+    }
+
+    if ( nr_top && eval_histograms_enable(nr_records) != EVAL_RESULT_OK )
+    {
+        nr_top = 0;
+    }
+
+    for ( round = 0; round < nr_rounds; round++ )
+    {
+        unsigned long long start = eval_port_now_ns();
+        unsigned long long elapsed;
+
+        for ( i = 0; i < nr_records; i++ )
+        {
+            eval_replay_execute(replay, i, &match);
+        }
+
+        elapsed = eval_port_now_ns() - start;
+        total += elapsed;
+        if ( round == 0 || elapsed < best )
+        {
+            best = elapsed;
+        }
+    }
+
+    printf("records     %lu, %lu of them errors\n", (unsigned long)nr_records, (unsigned long)nr_failed);
+    printf("mismatches  %lu\n", (unsigned long)nr_mismatches);
+    if ( nr_rounds && nr_records )
+    {
+        printf("rounds      %lu\n", (unsigned long)nr_rounds);
+        printf("best        %.3f ms, %.1f ns/eval\n", best / 1e6, (double)best / nr_records);
+        printf("mean        %.3f ms, %.1f ns/eval\n", total / 1e6 / nr_rounds,
+               (double)total / nr_rounds / nr_records);
+    }
+
+    if ( nr_top )
+    {
+        printf("\n");
+        eval_histograms_dump(stdout, EVAL_HISTOGRAM_BY_TOTAL, nr_top);
+        eval_histograms_disable();
+    }
+
+    eval_replay_destroy(replay);
+
+    return nr_mismatches ? 1 : 0;
+}
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eval.h"
+
+/*
+ * evalc - compiles a text file with one expression per line into a program
+ * image that eval_image_open() can map at startup. Empty lines and lines
+ * starting with '#' are skipped, so program indexes follow the remaining rules.
+ */
+
+int main(int argc, char* argv[])
+{
+    EvalProgram** programs = NULL;
+    size_t nr_programs = 0;
+    size_t capacity = 0;
+    size_t line_no = 0;
+    char line[4096];
+    FILE* in = NULL;
+    FILE* out = NULL;
+    EvalResult result = EVAL_RESULT_OK;
+    size_t i;
+
+    if ( argc < 3 )
+    {
+        printf("Usage: evalc <rules.txt> <output.img>\n");
+        return 0;
+    }
+
+    in = fopen(argv[1], "r");
+    if ( in == NULL )
+    {
+        fprintf(stderr, "%s: %s\n", argv[1], eval_result_to_string(EVAL_RESULT_IO_ERROR));
+        return 1;
+    }
+
+    while ( result == EVAL_RESULT_OK && fgets(line, sizeof(line), in) )
+    {
+        size_t len = strlen(line);
+
+        line_no++;
+        while ( len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r') )
+        {
+            line[--len] = '\0';
+        }
+
+        if ( len == 0 || line[0] == '#' )
+        {
+            continue;
+        }
+
+        if ( nr_programs == capacity )
+        {
+            EvalProgram** p;
+
+            capacity = capacity ? capacity * 2 : 64;
+            p = (EvalProgram**)realloc(programs, capacity * sizeof(EvalProgram*));
+            if ( p == NULL )
+            {
+                result = EVAL_RESULT_OOM;
+                break;
+            }
+            programs = p;
+        }
+
+        result = eval_compile(line, programs + nr_programs);
+        if ( result == EVAL_RESULT_OK )
+        {
+            nr_programs++;
+        }
+        else
+        {
+            fprintf(stderr, "%s:%lu: %s\n", argv[1], (unsigned long)line_no, eval_result_to_string(result));
+        }
+    }
+
+    fclose(in);
+
+    if ( result == EVAL_RESULT_OK )
+    {
+        out = fopen(argv[2], "wb");
+        result = out ? eval_image_write(out, (const EvalProgram* const*)programs, nr_programs) : EVAL_RESULT_IO_ERROR;
+        if ( out && fclose(out) != 0 )
+        {
+            result = EVAL_RESULT_IO_ERROR;
+        }
+
+        if ( result != EVAL_RESULT_OK )
+        {
+            fprintf(stderr, "%s: %s\n", argv[2], eval_result_to_string(result));
+            remove(argv[2]);
+        }
+    }
+
+    for ( i = 0; i < nr_programs; i++ )
+    {
+        eval_program_destroy(programs[i]);
+    }
+    free(programs);
+
+    return result == EVAL_RESULT_OK ? 0 : 1;
+}
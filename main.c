@@ -1,37 +1,231 @@
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "eval.h"
+#include "eval_parallel.h"
 
+#define EVAL_OUTPUT_BUFFER_SIZE     (1 << 20)
+
+static void usage(void)
+{
+    printf("Usage: eval [--capture <file>] <expression>\n");
+    printf("       eval [--capture <file>] [-j threads] -f <file>\n");
+    printf("       eval [--capture <file>] [-j threads] -\n");
+    printf("       eval [-j threads] [--filter] --csv <file> <expression>\n");
+}
+
+static int eval_one(const char* expression)
+{
+    EvalResult result;
+    ExprValue output;
+
+    expr_value_set_number(&output, 0);
+    result = eval_execute(expression, eval_default_hooks(), 0, &output);
+
+    if ( result == EVAL_RESULT_OK )
+    {
+        if(output.type == EXPR_VALUE_TYPE_STRING) {
+            printf("string: %s\n", output.v.str.str);
+        }else{
+            printf("number: %lf\n", output.v.val);
+        }
+        expr_value_clear(&output);
+    }
+    else
+    {
+        printf("%s\n", eval_result_to_string(result));
+        return 1;
+    }
+
+    return 0;
+}
+
+/* one result line per input line, in input order */
+static int eval_lines(const char* filename, size_t nr_threads)
+{
+    EvalThreadPool* pool = NULL;
+    EvalResult result;
+    size_t nr_failed = 0;
+    FILE* in = stdin;
+
+    if ( filename != NULL )
+    {
+        in = fopen(filename, "rb");
+        if ( in == NULL )
+        {
+            fprintf(stderr, "eval: cannot open %s\n", filename);
+            return 1;
+        }
+    }
+
+    result = eval_thread_pool_create(nr_threads, &pool);
+    if ( result == EVAL_RESULT_OK )
+    {
+        setvbuf(stdout, NULL, _IOFBF, EVAL_OUTPUT_BUFFER_SIZE);
+        result = eval_stream(pool, in, stdout, eval_default_hooks(), NULL, &nr_failed);
+        eval_thread_pool_destroy(pool);
+    }
+
+    if ( in != stdin )
+    {
+        fclose(in);
+    }
+
+    if ( result != EVAL_RESULT_OK )
+    {
+        fprintf(stderr, "eval: %s\n", eval_result_to_string(result));
+        return 1;
+    }
+
+    return nr_failed ? 1 : 0;
+}
+
+/* one result line per row, or the rows the expression is true for */
+static int eval_csv_file(const char* filename, const char* expression, EvalCsvMode mode, size_t nr_threads)
+{
+    EvalThreadPool* pool = NULL;
+    EvalProgram* program = NULL;
+    EvalMappedFile file;
+    EvalResult result;
+    size_t nr_failed = 0;
+
+    result = eval_compile(expression, &program);
+    if ( result != EVAL_RESULT_OK )
+    {
+        printf("%s\n", eval_result_to_string(result));
+        return 1;
+    }
+
+    result = eval_file_map(filename, &file);
+    if ( result != EVAL_RESULT_OK )
+    {
+        fprintf(stderr, "eval: cannot open %s\n", filename);
+        eval_program_destroy(program);
+        return 1;
+    }
+
+    result = eval_thread_pool_create(nr_threads, &pool);
+    if ( result == EVAL_RESULT_OK )
+    {
+        setvbuf(stdout, NULL, _IOFBF, EVAL_OUTPUT_BUFFER_SIZE);
+        result = eval_csv(pool, file.data, file.size, program, mode, stdout, &nr_failed);
+        eval_thread_pool_destroy(pool);
+    }
+
+    eval_file_unmap(&file);
+    eval_program_destroy(program);
+
+    if ( result != EVAL_RESULT_OK )
+    {
+        fprintf(stderr, "eval: %s\n", eval_result_to_string(result));
+        return 1;
+    }
+
+    return nr_failed ? 1 : 0;
+}
+
+/* a positive decimal count, nothing else */
+static int parse_threads(const char* text, size_t* nr_threads)
+{
+    char* end = NULL;
+    long n;
+
+    errno = 0;
+    n = strtol(text, &end, 10);
+    if ( end == text || *end != '\0' || errno == ERANGE || n <= 0 )
+    {
+        return 0;
+    }
+
+    *nr_threads = (size_t)n;
+
+    return 1;
+}
+
+/* captured calls are flushed whatever the outcome */
+static int finish(int status)
+{
+    EvalResult result = eval_capture_stop();
+
+    if ( result != EVAL_RESULT_OK )
+    {
+        fprintf(stderr, "eval: capture: %s\n", eval_result_to_string(result));
+        return 1;
+    }
+
+    return status;
+}
 
 int main(int argc, char* argv[])
 {
-    if ( argc >= 2 )
-    {
-        EvalResult result;
-        ExprValue output;
-        
-        expr_value_set_number(&output, 0);
-        result = eval_execute(argv[1], eval_default_hooks(), 0, &output);
-        
-        if ( result == EVAL_RESULT_OK )
-        {
-            if(output.type == EXPR_VALUE_TYPE_STRING) {
-                printf("string: %s\n", output.v.str.str);
-            }else{
-                printf("number: %lf\n", output.v.val);
+    const char* filename = NULL;
+    const char* csv = NULL;
+    EvalCsvMode mode = EVAL_CSV_RESULTS;
+    size_t nr_threads = 1;
+    int streaming = 0;
+    int i;
+
+    for ( i = 1; i < argc; i++ )
+    {
+        if ( strcmp(argv[i], "-j") == 0 && i + 1 < argc )
+        {
+            if ( !parse_threads(argv[++i], &nr_threads) )
+            {
+                fprintf(stderr, "eval: invalid thread count %s\n", argv[i]);
+                usage();
+                return finish(1);
+            }
+        }
+        else if ( strcmp(argv[i], "-f") == 0 && i + 1 < argc )
+        {
+            filename = argv[++i];
+            streaming = 1;
+        }
+        else if ( strcmp(argv[i], "-") == 0 )
+        {
+            filename = NULL;
+            streaming = 1;
+        }
+        else if ( strcmp(argv[i], "--csv") == 0 && i + 1 < argc )
+        {
+            csv = argv[++i];
+        }
+        else if ( strcmp(argv[i], "--filter") == 0 )
+        {
+            mode = EVAL_CSV_FILTER;
+        }
+        else if ( strcmp(argv[i], "--capture") == 0 && i + 1 < argc )
+        {
+            if ( eval_capture_start(argv[++i]) != EVAL_RESULT_OK )
+            {
+                fprintf(stderr, "eval: cannot create %s\n", argv[i]);
+                return 1;
             }
         }
+        else if ( !streaming && csv != NULL )
+        {
+            return finish(eval_csv_file(csv, argv[i], mode, nr_threads));
+        }
+        else if ( !streaming )
+        {
+            /* like the first version, arguments after the expression are ignored */
+            return finish(eval_one(argv[i]));
+        }
         else
         {
-            printf("%s\n", eval_result_to_string(result));
-            return 1;
+            usage();
+            return finish(1);
         }
     }
-    else
+
+    if ( streaming )
     {
-        printf("Usage: eval <expression>\n");
-        return 0;
+        return finish(eval_lines(filename, nr_threads));
     }
-    
-    return 0;
+
+    usage();
+
+    return finish(0);
 }
@@ -1,7 +1,10 @@
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 
 #include "eval.h"
+#include "eval_parallel.h"
+#include "eval_port.h"
 #include <assert.h>
 
 static void test_str(const char* expr, const char* expect) {
@@ -28,6 +31,1855 @@ static void test_number(const char* expr, double expect) {
     assert(output.type == EXPR_VALUE_TYPE_NUMBER && (output.v.val - expect) == 0); 
 }
 
+static EvalResult test_get_variable(const char* name, void* user_data, ExprValue* output) {
+    (void)user_data;
+    if(strcmp(name, "x") == 0) {
+        return expr_value_set_number(output, 5);
+    } else if(strcmp(name, "w") == 0) {
+        return expr_value_set_number(output, 100);
+    } else if(strcmp(name, "flag") == 0) {
+        return expr_value_set_number(output, 0);
+    } else if(strcmp(name, "theme") == 0) {
+        return expr_value_set_string(output, "dark", 4);
+    } else if(strcmp(name, "device_display_brightness") == 0) {
+        return expr_value_set_number(output, 7);
+    }
+
+    return EVAL_RESULT_UNDEFINED_VARIABLE;
+}
+
+static const EvalHooks* test_hooks(void) {
+    static EvalHooks hooks;
+    hooks.get_func = eval_default_hooks()->get_func;
+    hooks.get_variable = test_get_variable;
+
+    return &hooks;
+}
+
+static void test_specialize(const char* expr, const char* theme, const char* expect) {
+    EvalResult result;
+    EvalProgram* program = NULL;
+    EvalProgram* residual = NULL;
+    EvalProgram* reparsed = NULL;
+    EvalConstant constants[3];
+    ExprValue text;
+    ExprValue a;
+    ExprValue b;
+    ExprValue c;
+
+    expr_value_init(&text);
+    expr_value_init(&a);
+    expr_value_init(&b);
+    expr_value_init(&c);
+    constants[0].name = "w";
+    expr_value_init(&constants[0].value);
+    expr_value_set_number(&constants[0].value, 100);
+    constants[1].name = "flag";
+    expr_value_init(&constants[1].value);
+    constants[2].name = "theme";
+    expr_value_init(&constants[2].value);
+    expr_value_set_string(&constants[2].value, theme, strlen(theme));
+
+    result = eval_compile(expr, &program);
+    assert(result == EVAL_RESULT_OK);
+    result = eval_program_specialize(program, constants, 3, &residual);
+    assert(result == EVAL_RESULT_OK);
+    result = eval_program_to_string(residual, &text);
+    printf("%s => %s\n", expr, expr_value_get_string(&text));
+    assert(result == EVAL_RESULT_OK && strcmp(expr_value_get_string(&text), expect) == 0);
+
+    if(strcmp(theme, "dark") == 0) {
+        assert(eval_program_execute(program, test_hooks(), 0, &a) == EVAL_RESULT_OK);
+        assert(eval_program_execute(residual, test_hooks(), 0, &b) == EVAL_RESULT_OK);
+        assert(a.type == b.type);
+        assert(a.type == EXPR_VALUE_TYPE_STRING ? strcmp(a.v.str.str, b.v.str.str) == 0 : a.v.val == b.v.val);
+
+        /*the printed residual compiles back to the same result, to the last bit*/
+        assert(eval_compile(expr_value_get_string(&text), &reparsed) == EVAL_RESULT_OK);
+        assert(eval_program_execute(reparsed, test_hooks(), 0, &c) == EVAL_RESULT_OK);
+        assert(c.type == b.type);
+        assert(c.type == EXPR_VALUE_TYPE_STRING ? strcmp(c.v.str.str, b.v.str.str) == 0
+                                                : memcmp(&c.v.val, &b.v.val, sizeof(double)) == 0);
+        eval_program_destroy(reparsed);
+        expr_value_clear(&c);
+    }
+
+    expr_value_clear(&a);
+    expr_value_clear(&b);
+    expr_value_clear(&text);
+    expr_value_clear(&constants[0].value);
+    expr_value_clear(&constants[2].value);
+    eval_program_destroy(residual);
+    eval_program_destroy(program);
+}
+
+static void test_program(const char* expr) {
+    EvalProgram* program = NULL;
+    ExprValue a;
+    ExprValue b;
+
+    expr_value_init(&a);
+    expr_value_init(&b);
+    assert(eval_compile(expr, &program) == EVAL_RESULT_OK);
+    assert(eval_program_execute(program, test_hooks(), 0, &a) == EVAL_RESULT_OK);
+    assert(eval_execute(expr, test_hooks(), 0, &b) == EVAL_RESULT_OK);
+    assert(a.type == b.type);
+    assert(a.type == EXPR_VALUE_TYPE_STRING ? strcmp(a.v.str.str, b.v.str.str) == 0 : a.v.val == b.v.val);
+
+    expr_value_clear(&a);
+    expr_value_clear(&b);
+    eval_program_destroy(program);
+}
+
+static void test_image(void) {
+    const char* exprs[] = {"1 + 2 * 3", "toupper($theme) + \"/\" + $w", "$x > 3 && $w",
+                           "replace($theme, \"a\", $x) + find($theme, \"rk\") + substr($theme, $x - 4, 2) + matches($theme, \"k$\") + ($x not in (\"5\", 6))",
+                           "t = $theme + $x; n = strlen(t); t + n * 2"};
+    EvalProgram* programs[5];
+    EvalImage* image = NULL;
+    ExprValue a;
+    ExprValue b;
+    FILE* fp;
+    size_t i;
+
+    expr_value_init(&a);
+    expr_value_init(&b);
+    for(i = 0; i < 5; i++) {
+        assert(eval_compile(exprs[i], programs + i) == EVAL_RESULT_OK);
+    }
+
+    fp = fopen("eval_test.img", "wb");
+    assert(fp != NULL);
+    assert(eval_image_write(fp, (const EvalProgram* const*)programs, 5) == EVAL_RESULT_OK);
+    fclose(fp);
+
+    assert(eval_image_open("eval_test.img", &image) == EVAL_RESULT_OK);
+    assert(eval_image_count(image) == 5);
+    assert(eval_image_get(image, 5) == NULL);
+    for(i = 0; i < 5; i++) {
+        assert(eval_program_execute(eval_image_get(image, i), test_hooks(), 0, &a) == EVAL_RESULT_OK);
+        assert(eval_program_execute(programs[i], test_hooks(), 0, &b) == EVAL_RESULT_OK);
+        assert(a.type == b.type);
+        assert(a.type == EXPR_VALUE_TYPE_STRING ? strcmp(a.v.str.str, b.v.str.str) == 0 : a.v.val == b.v.val);
+        expr_value_clear(&a);
+        expr_value_clear(&b);
+        eval_program_destroy(programs[i]);
+    }
+    eval_image_close(image);
+
+    /*corrupted images are rejected*/
+    fp = fopen("eval_test.img", "r+b");
+    assert(fp != NULL);
+    fseek(fp, 60, SEEK_SET);
+    fputc(0x5a, fp);
+    fclose(fp);
+    assert(eval_image_open("eval_test.img", &image) == EVAL_RESULT_INVALID_IMAGE);
+    assert(eval_image_open("eval_test.missing", &image) == EVAL_RESULT_IO_ERROR);
+    remove("eval_test.img");
+}
+
+static void test_compile_batch(void) {
+    const char* exprs[] = {"1 + 2", "$x * 2", "(1 + 2", "toupper(\"a\")", "1 +* 2", "$w",
+                           "matches($x, \"^[0-9]+$\")", "matches($x, \"[\")"};
+    EvalProgram* programs[8];
+    EvalResult results[8];
+    EvalThreadPool* pool = NULL;
+    size_t nr_threads;
+    size_t i;
+
+    for(nr_threads = 1; nr_threads <= 4; nr_threads++) {
+        assert(eval_thread_pool_create(nr_threads, &pool) == EVAL_RESULT_OK);
+        assert(eval_thread_pool_size(pool) == nr_threads);
+        assert(eval_compile_batch(pool, exprs, 8, programs, results) == EVAL_RESULT_EXPECTED_CLOSE_BRACKET);
+        for(i = 0; i < 8; i++) {
+            EvalProgram* program = NULL;
+            assert(results[i] == eval_compile(exprs[i], &program));
+            assert((programs[i] == NULL) == (program == NULL));
+            eval_program_destroy(program);
+            eval_program_destroy(programs[i]);
+        }
+        eval_thread_pool_destroy(pool);
+    }
+}
+
+static void test_rows_execute(void) {
+    static double xs[1000];
+    static const char* themes[1000];
+    static ExprValue outputs[1000];
+    EvalColumn columns[2];
+    EvalRowSet rows;
+    EvalProgram* program = NULL;
+    EvalThreadPool* pool = NULL;
+    size_t nr_threads;
+    size_t i;
+
+    for(i = 0; i < 1000; i++) {
+        xs[i] = (double)i;
+        themes[i] = (i % 3) ? "dark" : (i % 2) ? NULL : "light";
+    }
+
+    columns[0].name = "x";
+    columns[0].type = EXPR_VALUE_TYPE_NUMBER;
+    columns[0].numbers = xs;
+    columns[0].strings = NULL;
+    columns[1].name = "theme";
+    columns[1].type = EXPR_VALUE_TYPE_STRING;
+    columns[1].numbers = NULL;
+    columns[1].strings = themes;
+    rows.nr_rows = 1000;
+    rows.nr_columns = 2;
+    rows.columns = columns;
+
+    assert(eval_compile("$x * 2 + strlen($theme) + $w", &program) == EVAL_RESULT_OK);
+    for(nr_threads = 1; nr_threads <= 4; nr_threads++) {
+        assert(eval_thread_pool_create(nr_threads, &pool) == EVAL_RESULT_OK);
+        assert(eval_rows_execute(pool, program, &rows, test_hooks(), 0, outputs, NULL) == EVAL_RESULT_OK);
+        for(i = 0; i < 1000; i++) {
+            size_t len = themes[i] ? strlen(themes[i]) : 0;
+            assert(outputs[i].type == EXPR_VALUE_TYPE_NUMBER && outputs[i].v.val == i * 2 + len + 100);
+        }
+        eval_thread_pool_destroy(pool);
+    }
+    eval_program_destroy(program);
+
+    /*variables that are neither columns nor known to the hooks fail per row*/
+    assert(eval_compile("$x + $missing", &program) == EVAL_RESULT_OK);
+    assert(eval_rows_execute(NULL, program, &rows, test_hooks(), 0, outputs, NULL) == EVAL_RESULT_UNDEFINED_VARIABLE);
+    eval_program_destroy(program);
+}
+
+static void test_rows_aggregate(void) {
+    static double xs[5000];
+    EvalColumn column;
+    EvalRowSet rows;
+    EvalAggregate base;
+    EvalAggregate aggregate;
+    EvalProgram* program = NULL;
+    EvalThreadPool* pool = NULL;
+    size_t nr_threads;
+    size_t i;
+
+    for(i = 0; i < 5000; i++) {
+        xs[i] = (double)i + 0.1;
+    }
+
+    column.name = "x";
+    column.type = EXPR_VALUE_TYPE_NUMBER;
+    column.numbers = xs;
+    column.strings = NULL;
+    rows.nr_rows = 1000;
+    rows.nr_columns = 1;
+    rows.columns = &column;
+
+    assert(eval_compile("$x - 0.1", &program) == EVAL_RESULT_OK);
+    assert(eval_rows_aggregate(NULL, program, &rows, NULL, 0, &aggregate) == EVAL_RESULT_OK);
+    assert(aggregate.count == 1000 && aggregate.count_true == 999);
+    assert(aggregate.sum == 499500 && aggregate.mean == 499.5);
+    assert(aggregate.min == 0 && aggregate.max == 999);
+    assert(aggregate.variance > 83333.2499 && aggregate.variance < 83333.2501);
+    eval_program_destroy(program);
+
+    /*same bits for any number of threads*/
+    rows.nr_rows = 5000;
+    assert(eval_compile("$x * 1.7 / 3", &program) == EVAL_RESULT_OK);
+    for(nr_threads = 1; nr_threads <= 4; nr_threads++) {
+        assert(eval_thread_pool_create(nr_threads, &pool) == EVAL_RESULT_OK);
+        assert(eval_rows_aggregate(pool, program, &rows, NULL, 0, &aggregate) == EVAL_RESULT_OK);
+        if(nr_threads == 1) {
+            base = aggregate;
+        }
+        assert(memcmp(&base, &aggregate, sizeof(aggregate)) == 0);
+        eval_thread_pool_destroy(pool);
+    }
+    eval_program_destroy(program);
+
+    assert(eval_compile("$x > 10 && $y", &program) == EVAL_RESULT_OK);
+    assert(eval_rows_aggregate(NULL, program, &rows, NULL, 0, &aggregate) == EVAL_RESULT_UNDEFINED_VARIABLE);
+    assert(aggregate.count == 0 && aggregate.mean != aggregate.mean);
+    eval_program_destroy(program);
+}
+
+static void test_rows_filter(void) {
+    static const char* PREDICATES[] = {
+        "$x > 3 && $s != \"maint\"", "$x * 2 - $y >= 1 || !$y", "-$x < $y / 3", "!($x == $y)", "$s", "!$s",
+        "$s < \"m\"", "($x > 1) + ($y > 1) == 2", "$x != $x", "1 && $x", "\"a\" == \"a\" && $y > 2",
+        "-($x > 2)", "~$x & 1", "$s + $x", "contains($s, \"a\") || endswith($s, \"t\")",
+        "$s in (\"ok\", \"\", 3) || $y", "($x not in (1, 2, -4)) && ($y in (0.5, \"3\"))", "($x > 2) in (1)",
+        "d = $x - $y; (d > 0) && (d < 3)"};
+    static const char* STATES[] = {"ok", "maint", "", NULL, "alarm"};
+    static double xs[1000];
+    static double ys[1000];
+    static const char* ss[1000];
+    static ExprValue outputs[1000];
+    static EvalMask bitmap[16];
+    static size_t indexes[1000];
+    EvalColumn columns[3];
+    EvalRowSet rows;
+    EvalThreadPool* pool = NULL;
+    volatile double zero = 0;
+    size_t p;
+    size_t i;
+
+    for(i = 0; i < 1000; i++) {
+        xs[i] = (i % 97 == 0) ? zero / zero : (double)(i % 13) - 4;
+        ys[i] = (double)(i % 7) * 0.5;
+        ss[i] = STATES[i % 5];
+    }
+
+    columns[0].name = "x";
+    columns[0].type = EXPR_VALUE_TYPE_NUMBER;
+    columns[0].numbers = xs;
+    columns[0].strings = NULL;
+    columns[1].name = "y";
+    columns[1].type = EXPR_VALUE_TYPE_NUMBER;
+    columns[1].numbers = ys;
+    columns[1].strings = NULL;
+    columns[2].name = "s";
+    columns[2].type = EXPR_VALUE_TYPE_STRING;
+    columns[2].numbers = NULL;
+    columns[2].strings = ss;
+    rows.nr_rows = 1000;
+    rows.nr_columns = 3;
+    rows.columns = columns;
+
+    assert(eval_thread_pool_create(3, &pool) == EVAL_RESULT_OK);
+    for(p = 0; p < sizeof(PREDICATES) / sizeof(*PREDICATES); p++) {
+        EvalProgram* program = NULL;
+        size_t nr_selected = 0;
+        size_t expected = 0;
+
+        assert(eval_compile(PREDICATES[p], &program) == EVAL_RESULT_OK);
+        assert(eval_rows_execute(NULL, program, &rows, NULL, 0, outputs, NULL) == EVAL_RESULT_OK);
+        assert(eval_rows_filter(pool, program, &rows, NULL, 0, bitmap, &nr_selected) == EVAL_RESULT_OK);
+
+        for(i = 0; i < 1000; i++) {
+            int truth = outputs[i].type == EXPR_VALUE_TYPE_STRING ? outputs[i].v.str.size != 0 : outputs[i].v.val != 0;
+            assert(truth == (int)((bitmap[i / 64] >> (i % 64)) & 1));
+            expected += truth;
+            expr_value_clear(outputs + i);
+        }
+        printf("filter %s: %u rows\n", PREDICATES[p], (unsigned int)nr_selected);
+        assert(nr_selected == expected);
+        assert(eval_bitmap_to_indexes(bitmap, 1000, indexes) == expected);
+        eval_program_destroy(program);
+    }
+    eval_thread_pool_destroy(pool);
+}
+
+static size_t read_all(FILE* fp, char* buff, size_t size) {
+    size_t n;
+
+    rewind(fp);
+    n = fread(buff, 1, size - 1, fp);
+    buff[n] = '\0';
+
+    return n;
+}
+
+static void test_stream(void) {
+    static char serial[1 << 16];
+    static char parallel[1 << 16];
+    const size_t long_size = (1 << 20) + 100;
+    EvalThreadPool* pool = NULL;
+    FILE* in = tmpfile();
+    FILE* out = tmpfile();
+    size_t nr_failed = 0;
+    size_t n;
+    size_t i;
+    char* line;
+
+    assert(in != NULL && out != NULL);
+    fputs("1 + 2\n\"a\" + \"b\"\r\n(1 +\n\ntoupper(\"x\")", in);
+    rewind(in);
+    assert(eval_stream(NULL, in, out, eval_default_hooks(), NULL, &nr_failed) == EVAL_RESULT_OK);
+    read_all(out, serial, sizeof(serial));
+    printf("%s", serial);
+    assert(strcmp(serial, "number: 3.000000\nstring: ab\nexpected term\nexpected term\nstring: X\n") == 0);
+    assert(nr_failed == 2);
+
+    /* a line longer than the read block */
+    line = (char*)malloc(long_size + 1);
+    memset(line, 'a', long_size);
+    line[0] = line[long_size - 2] = '"';
+    line[long_size - 1] = '\n';
+    line[long_size] = '\0';
+    fclose(in);
+    fclose(out);
+    in = tmpfile();
+    out = tmpfile();
+    fputs(line, in);
+    fputs("strlen(\"abc\")\n", in);
+    rewind(in);
+    assert(eval_stream(NULL, in, out, eval_default_hooks(), NULL, &nr_failed) == EVAL_RESULT_OK);
+    assert(nr_failed == 0);
+    fseek(out, (long)long_size + 6, SEEK_SET);
+    n = fread(serial, 1, sizeof(serial) - 1, out);
+    serial[n] = '\0';
+    assert(strcmp(serial, "number: 3.000000\n") == 0);
+    free(line);
+
+    /* output order does not depend on the number of threads */
+    fclose(in);
+    fclose(out);
+    in = tmpfile();
+    out = tmpfile();
+    for(i = 0; i < 2000; i++) {
+        if(i % 7 == 3) {
+            fprintf(in, "%u +\n", (unsigned int)i);
+        }else{
+            fprintf(in, "%u * 2 + strlen(\"%u\")\n", (unsigned int)i, (unsigned int)i);
+        }
+    }
+    rewind(in);
+    assert(eval_stream(NULL, in, out, eval_default_hooks(), NULL, &nr_failed) == EVAL_RESULT_OK);
+    assert(nr_failed == 286);
+    read_all(out, serial, sizeof(serial));
+
+    assert(eval_thread_pool_create(4, &pool) == EVAL_RESULT_OK);
+    fclose(out);
+    out = tmpfile();
+    rewind(in);
+    assert(eval_stream(pool, in, out, eval_default_hooks(), NULL, &nr_failed) == EVAL_RESULT_OK);
+    assert(nr_failed == 286);
+    read_all(out, parallel, sizeof(parallel));
+    assert(strcmp(serial, parallel) == 0);
+    assert(strncmp(serial, "number: 1.000000\nnumber: 3.000000\n", 34) == 0);
+
+    eval_thread_pool_destroy(pool);
+    fclose(in);
+    fclose(out);
+}
+
+static void test_csv(void) {
+    static const char DATA[] = "id,name,temp,\"note\"\r\n1,alpha,20.5,\"a, b\"\r\n2,beta,99,\"say \"\"hi\"\"\"\n\n3,\"gamma\",-4,x\n4,delta";
+    static const char TEXTS[] = "name\nNan\nInfinity\n 0x10\n1.\n+1\n1e\n\"1,5\"\n-1.5e2 \n16\n-.5\n2.5e2\n";
+    static char buff[1 << 16];
+    EvalThreadPool* pool = NULL;
+    EvalProgram* program = NULL;
+    FILE* out = tmpfile();
+    size_t nr_failed = 0;
+    size_t size = 0;
+    size_t i;
+    char* big;
+    char* serial;
+    char* parallel;
+    double number;
+
+    assert(eval_compile("$note + \"|\" + $name + \"|\" + ($temp * 2)", &program) == EVAL_RESULT_OK);
+    assert(eval_csv(NULL, DATA, sizeof(DATA) - 1, program, EVAL_CSV_RESULTS, out, &nr_failed) == EVAL_RESULT_OK);
+    read_all(out, buff, sizeof(buff));
+    printf("%s", buff);
+    assert(strcmp(buff, "string: a, b|alpha|41\nstring: say \"hi\"|beta|198\nstring: x|gamma|-8\nstring: |delta|*2\n") == 0);
+    assert(nr_failed == 0);
+    eval_program_destroy(program);
+
+    fclose(out);
+    out = tmpfile();
+    assert(eval_compile("$temp > 10", &program) == EVAL_RESULT_OK);
+    assert(eval_csv(NULL, DATA, sizeof(DATA) - 1, program, EVAL_CSV_FILTER, out, &nr_failed) == EVAL_RESULT_OK);
+    read_all(out, buff, sizeof(buff));
+    assert(strcmp(buff, "id,name,temp,\"note\"\n1,alpha,20.5,\"a, b\"\n2,beta,99,\"say \"\"hi\"\"\"\n") == 0);
+
+    /*empty data has no header to write, nor rows*/
+    fclose(out);
+    out = tmpfile();
+    nr_failed = 1;
+    assert(eval_csv(NULL, NULL, 0, program, EVAL_CSV_FILTER, out, &nr_failed) == EVAL_RESULT_OK && nr_failed == 0);
+    assert(read_all(out, buff, sizeof(buff)) == 0);
+    eval_program_destroy(program);
+
+    /*only number literals are numbers, whatever else strtod() would take*/
+    fclose(out);
+    out = tmpfile();
+    assert(eval_compile("$name + \"!\"", &program) == EVAL_RESULT_OK);
+    assert(eval_csv(NULL, TEXTS, sizeof(TEXTS) - 1, program, EVAL_CSV_RESULTS, out, &nr_failed) == EVAL_RESULT_OK);
+    read_all(out, buff, sizeof(buff));
+    assert(strcmp(buff, "string: Nan!\nstring: Infinity!\nstring:  0x10!\nstring: 1.!\nstring: +1!\nstring: 1e!\n"
+                        "string: 1,5!\nstring: -1.5e2 !\nstring: 16!\nstring: -0.500000!\nstring: 250!\n") == 0);
+    eval_program_destroy(program);
+    assert(eval_number_parse("-.5e1", 5, &number) == EVAL_RESULT_OK && number == -5);
+    assert(eval_number_parse("12x", 2, &number) == EVAL_RESULT_OK && number == 12);
+    assert(eval_number_parse("--1", 3, &number) == EVAL_RESULT_INVALID_LITERAL);
+    assert(eval_number_parse("-", 1, &number) == EVAL_RESULT_INVALID_LITERAL);
+
+    /* several chunks, the same output for any number of threads */
+    big = (char*)malloc(4 << 20);
+    size = (size_t)sprintf(big, "a,b,c\n");
+    for(i = 0; size < (3 << 20); i++) {
+        size += (size_t)sprintf(big + size, "%u,%s,%u.5\n", (unsigned int)i, (i % 3) ? "x" : "", (unsigned int)(i % 17));
+    }
+
+    fclose(out);
+    out = tmpfile();
+    assert(eval_compile("$c * 2 + $a", &program) == EVAL_RESULT_OK);
+    assert(eval_csv(NULL, big, size, program, EVAL_CSV_RESULTS, out, &nr_failed) == EVAL_RESULT_OK);
+    fseek(out, 0, SEEK_END);
+    serial = (char*)malloc((size_t)ftell(out) + 1);
+    read_all(out, serial, (size_t)ftell(out) + 1);
+    assert(strncmp(serial, "number: 1.000000\nnumber: 4.000000\n", 34) == 0);
+
+    assert(eval_thread_pool_create(4, &pool) == EVAL_RESULT_OK);
+    fclose(out);
+    out = tmpfile();
+    assert(eval_csv(pool, big, size, program, EVAL_CSV_RESULTS, out, &nr_failed) == EVAL_RESULT_OK);
+    assert(nr_failed == 0);
+    fseek(out, 0, SEEK_END);
+    assert(strlen(serial) == (size_t)ftell(out));
+    parallel = (char*)malloc((size_t)ftell(out) + 1);
+    read_all(out, parallel, (size_t)ftell(out) + 1);
+    assert(strcmp(serial, parallel) == 0);
+
+    eval_thread_pool_destroy(pool);
+    eval_program_destroy(program);
+    free(parallel);
+    free(serial);
+    free(big);
+    fclose(out);
+}
+
+static size_t nr_live_blocks = 0;
+static size_t nr_allocs = 0;
+
+static void* counting_alloc(size_t size, void* user_data) {
+    void* p = malloc(size);
+
+    (void)user_data;
+    nr_live_blocks += p != NULL;
+    nr_allocs += p != NULL;
+
+    return p;
+}
+
+static void* counting_realloc(void* ptr, size_t size, void* user_data) {
+    void* p = realloc(ptr, size);
+
+    (void)user_data;
+    nr_live_blocks += ptr == NULL && p != NULL;
+
+    return p;
+}
+
+static void counting_free(void* ptr, void* user_data) {
+    (void)user_data;
+    nr_live_blocks -= ptr != NULL;
+    free(ptr);
+}
+
+/*strings filled in by hand from malloc(), the way hooks did before strings had headers*/
+static void test_set_malloc_string(ExprValue* output, const char* str) {
+    size_t size = strlen(str);
+
+    output->type = EXPR_VALUE_TYPE_STRING;
+    output->v.str.str = (char*)malloc(size + 1);
+    memcpy(output->v.str.str, str, size + 1);
+    output->v.str.size = size;
+    output->v.str.capacity = size;
+}
+
+static EvalResult test_malloc_shout(const ExprValue* input, void* user_data, ExprValue* output) {
+    char buff[64];
+
+    (void)user_data;
+    snprintf(buff, sizeof(buff), "%s!", expr_value_get_string(input));
+    test_set_malloc_string(output, buff);
+
+    return EVAL_RESULT_OK;
+}
+
+static EvalFunc test_malloc_get_func(const char* name, void* user_data) {
+    (void)user_data;
+    return strcmp(name, "shout") == 0 ? test_malloc_shout : NULL;
+}
+
+static EvalResult test_malloc_get_variable(const char* name, void* user_data, ExprValue* output) {
+    (void)user_data;
+    test_set_malloc_string(output, name);
+
+    return EVAL_RESULT_OK;
+}
+
+static void test_malloc_strings(void) {
+    static EvalHooks hooks;
+    EvalProgram* program = NULL;
+    EvalValue value;
+    ExprValue output;
+
+    hooks.get_func = test_malloc_get_func;
+    hooks.get_variable = test_malloc_get_variable;
+    expr_value_init(&output);
+    assert(eval_execute("$abc + shout($x + \"y\") + $abc", &hooks, NULL, &output) == EVAL_RESULT_OK);
+    assert(strcmp(expr_value_get_string(&output), "abcxy!abc") == 0);
+    expr_value_clear(&output);
+    assert(eval_compile("shout(shout($long_variable_name)) + 1", &program) == EVAL_RESULT_OK);
+    assert(eval_program_execute(program, &hooks, NULL, &output) == EVAL_RESULT_OK);
+    assert(strcmp(expr_value_get_string(&output), "long_variable_name!!1") == 0);
+    expr_value_clear(&output);
+    eval_program_destroy(program);
+
+    /*and handed over directly*/
+    test_set_malloc_string(&output, "moved");
+    eval_value_from_expr(&value, &output);
+    assert(strcmp(eval_value_get_string(value), "moved") == 0 && !expr_value_is_string(&output));
+    eval_value_clear(&value);
+    test_set_malloc_string(&output, "replaced");
+    assert(expr_value_set_string(&output, "again", 5) == EVAL_RESULT_OK && output.owned);
+    expr_value_clear(&output);
+}
+
+static void test_allocator(void) {
+    static const EvalAllocator COUNTING = {counting_alloc, counting_realloc, counting_free, NULL};
+    EvalProgram* program = NULL;
+    ExprValue output;
+
+    eval_set_allocator(&COUNTING);
+    expr_value_init(&output);
+    assert(eval_execute("toupper(\"ab\") + 1", eval_default_hooks(), NULL, &output) == EVAL_RESULT_OK);
+    assert(nr_live_blocks == 1);
+    expr_value_clear(&output);
+    assert(nr_live_blocks == 0);
+
+    assert(eval_compile("$x * 2 + strlen(\"abc\")", &program) == EVAL_RESULT_OK);
+    assert(nr_live_blocks == 1);
+    assert(eval_program_execute(program, test_hooks(), NULL, &output) == EVAL_RESULT_OK);
+    assert(output.v.val == 13);
+    eval_program_destroy(program);
+    assert(nr_live_blocks == 0);
+    eval_set_allocator(NULL);
+}
+
+static size_t trace_counts[EVAL_EVENT_STRING_REALLOC + 1];
+
+static void test_trace(EvalEvent event, const char* name, size_t value, void* user_data) {
+    (void)name;
+    (void)value;
+    (void)user_data;
+    trace_counts[event]++;
+}
+
+static void test_stats(void) {
+    EvalProgram* program = NULL;
+    EvalOptions options;
+    EvalStats stats;
+    ExprValue output;
+
+    memset(&options, 0x00, sizeof(options));
+    memset(trace_counts, 0x00, sizeof(trace_counts));
+    options.stats = &stats;
+    options.trace = test_trace;
+
+    expr_value_init(&output);
+    assert(eval_execute_ex("toupper($theme) + strlen(\"abc\") + $x", test_hooks(), NULL, &options, &output) ==
+           EVAL_RESULT_OK);
+    assert(strcmp(output.v.str.str, "DARK35") == 0);
+    expr_value_clear(&output);
+
+    if(eval_stats_enabled()) {
+        printf("stats: %u tokens, depth %u, %u allocs, %u reallocs, %u bytes, %u ns\n", (unsigned int)stats.nr_tokens,
+               (unsigned int)stats.max_depth, (unsigned int)stats.nr_string_allocs,
+               (unsigned int)stats.nr_string_reallocs, (unsigned int)stats.string_bytes, (unsigned int)stats.total_ns);
+        assert(stats.nr_tokens == 12 && trace_counts[EVAL_EVENT_TOKEN] == 12);
+        assert(stats.max_depth == 2);
+        assert(stats.nr_get_variable == 2 && trace_counts[EVAL_EVENT_GET_VARIABLE] == 2);
+        assert(stats.nr_get_func == 2 && trace_counts[EVAL_EVENT_GET_FUNC] == 2);
+        assert(stats.nr_calls == 2 && trace_counts[EVAL_EVENT_CALL] == 2);
+        assert(stats.nr_string_allocs > 0 && stats.nr_string_allocs == trace_counts[EVAL_EVENT_STRING_ALLOC]);
+        assert(stats.nr_string_reallocs == trace_counts[EVAL_EVENT_STRING_REALLOC]);
+        assert(stats.total_ns >= stats.lex_ns && stats.total_ns >= stats.hook_ns + stats.call_ns);
+    }else{
+        assert(stats.nr_tokens == 0 && stats.nr_string_allocs == 0 && stats.total_ns == 0);
+        assert(trace_counts[EVAL_EVENT_TOKEN] == 0);
+    }
+
+    /* programs do not lex, the hooks are still counted */
+    memset(trace_counts, 0x00, sizeof(trace_counts));
+    assert(eval_compile("floor($x / 2) + $w", &program) == EVAL_RESULT_OK);
+    assert(eval_program_execute_ex(program, test_hooks(), NULL, &options, &output) == EVAL_RESULT_OK);
+    assert(output.v.val == 102);
+    assert(stats.nr_tokens == 0);
+    assert(stats.nr_get_variable == (eval_stats_enabled() ? 2 : 0));
+    assert(stats.nr_calls == (eval_stats_enabled() ? 1 : 0));
+    eval_program_destroy(program);
+
+    /* no options, no stats */
+    assert(eval_execute_ex("1 + 2", test_hooks(), NULL, NULL, &output) == EVAL_RESULT_OK);
+    assert(output.v.val == 3);
+}
+
+static void test_histograms(void) {
+    EvalHistogramEntry entries[4];
+    ExprValue output;
+    char expr[32];
+    int i;
+
+    expr_value_init(&output);
+    assert(eval_histograms_top(EVAL_HISTOGRAM_BY_P99, entries, 4) == 0);
+    assert(eval_histograms_enable(4) == EVAL_RESULT_OK);
+
+    for(i = 0; i < 10; i++) {
+        assert(eval_execute("1 + 2", test_hooks(), NULL, &output) == EVAL_RESULT_OK);
+    }
+    for(i = 0; i < 5; i++) {
+        assert(eval_execute_ex("$x * 3", test_hooks(), NULL, NULL, &output) == EVAL_RESULT_OK);
+    }
+    /* failures are timed too */
+    assert(eval_execute("1 +", test_hooks(), NULL, &output) != EVAL_RESULT_OK);
+
+    assert(eval_histograms_top(EVAL_HISTOGRAM_BY_TOTAL, entries, 4) == 3);
+    for(i = 0; i < 3; i++) {
+        assert(entries[i].p50_ns <= entries[i].p90_ns && entries[i].p90_ns <= entries[i].p99_ns);
+        assert(entries[i].p99_ns <= entries[i].max_ns);
+        assert(i == 0 || entries[i].total_ns <= entries[i - 1].total_ns);
+    }
+    for(i = 0; i < 3 && strcmp(entries[i].expr, "1 + 2") != 0; i++) {
+    }
+    assert(i < 3 && entries[i].count == 10);
+    for(i = 0; i < 3 && strcmp(entries[i].expr, "$x * 3") != 0; i++) {
+    }
+    assert(i < 3 && entries[i].count == 5);
+    eval_histograms_dump(stdout, EVAL_HISTOGRAM_BY_P99, 2);
+
+    /* counts go, the table stays */
+    eval_histograms_reset();
+    assert(eval_histograms_top(EVAL_HISTOGRAM_BY_TOTAL, entries, 4) == 0);
+    assert(eval_execute("1 + 2", test_hooks(), NULL, &output) == EVAL_RESULT_OK);
+    assert(eval_histograms_top(EVAL_HISTOGRAM_BY_TOTAL, entries, 4) == 1 && entries[0].count == 1);
+
+    /* 16 slots at least, 3 taken */
+    assert(eval_histograms_dropped() == 0);
+    for(i = 0; i < 20; i++) {
+        sprintf(expr, "%d + 1", i);
+        assert(eval_execute(expr, test_hooks(), NULL, &output) == EVAL_RESULT_OK);
+    }
+    assert(eval_histograms_dropped() == 7);
+
+    eval_histograms_disable();
+    assert(eval_execute("1 + 2", test_hooks(), NULL, &output) == EVAL_RESULT_OK);
+    assert(eval_histograms_top(EVAL_HISTOGRAM_BY_TOTAL, entries, 4) == 0);
+    assert(eval_histograms_dropped() == 0);
+}
+
+static size_t nr_twice_calls = 0;
+
+static EvalResult test_twice(const ExprValue* input, void* user_data, ExprValue* output) {
+    (void)user_data;
+    nr_twice_calls++;
+    return expr_value_set_number(output, input->v.val * 2);
+}
+
+static EvalFunc test_capture_get_func(const char* name, void* user_data) {
+    if(strcmp(name, "twice") == 0) {
+        return test_twice;
+    }
+
+    return eval_default_hooks()->get_func(name, user_data);
+}
+
+static void test_capture(void) {
+    static const char* EXPRS[] = {
+        "twice($x) + strlen($theme)",
+        "toupper($theme) + twice(3)",
+        "$nope + 1",
+        "twice(twice($w))",
+        "1 +"};
+    static const double TEN = 10;
+    static const double ELEVEN = 11;
+    static char data[4096];
+    static char deep[1024];
+    EvalReplay* replay = NULL;
+    EvalHooks hooks;
+    ExprValue output;
+    size_t nr_calls;
+    size_t size;
+    FILE* fp;
+    int match;
+    size_t i;
+
+    memset(&hooks, 0, sizeof(hooks));
+    hooks.get_func = test_capture_get_func;
+    hooks.get_variable = test_get_variable;
+    expr_value_init(&output);
+
+    assert(eval_capture_start("eval_test.cap") == EVAL_RESULT_OK);
+    for(i = 0; i < sizeof(EXPRS) / sizeof(*EXPRS); i++) {
+        if(eval_execute(EXPRS[i], &hooks, NULL, &output) == EVAL_RESULT_OK) {
+            expr_value_clear(&output);
+        }
+    }
+    /*calls nested deeper than the first 64 the capture makes room for*/
+    for(i = 0; i < 100; i++) {
+        strcat(deep, "twice(");
+    }
+    strcat(deep, "1");
+    for(i = 0; i < 100; i++) {
+        strcat(deep, ")");
+    }
+    eval_set_max_depth(0);
+    assert(eval_execute(deep, &hooks, NULL, &output) == EVAL_RESULT_OK && output.v.val == 1267650600228229401496703205376.0);
+    eval_set_max_depth(EVAL_MAX_STACK_DEPTH);
+    assert(eval_capture_stop() == EVAL_RESULT_OK);
+    assert(eval_capture_stop() == EVAL_RESULT_OK);
+    nr_calls = nr_twice_calls;
+    assert(nr_calls == 104);
+
+    /* host functions and variables come from the capture, builtins run */
+    assert(eval_replay_open("eval_test.cap", &replay) == EVAL_RESULT_OK);
+    assert(eval_replay_size(replay) == 6);
+    eval_set_max_depth(0);
+    assert(eval_replay_execute(replay, 5, &match) == EVAL_RESULT_OK && match);
+    eval_set_max_depth(EVAL_MAX_STACK_DEPTH);
+    for(i = 0; i < 5; i++) {
+        assert(strcmp(eval_replay_expression(replay, i), EXPRS[i]) == 0);
+        assert(eval_replay_execute(replay, i, &match) == (i == 2 ? EVAL_RESULT_UNDEFINED_VARIABLE :
+                                                          i == 4 ? EVAL_RESULT_EXPECTED_TERM : EVAL_RESULT_OK));
+        assert(match);
+    }
+    assert(nr_twice_calls == nr_calls);
+    eval_replay_destroy(replay);
+
+    /* twice($x) was 10, make it 11 */
+    fp = fopen("eval_test.cap", "r+b");
+    assert(fp != NULL);
+    size = read_all(fp, data, sizeof(data));
+    for(i = 0; i + sizeof(TEN) <= size && memcmp(data + i, &TEN, sizeof(TEN)) != 0; i++) {
+    }
+    assert(i + sizeof(TEN) <= size);
+    fseek(fp, (long)i, SEEK_SET);
+    fwrite(&ELEVEN, sizeof(ELEVEN), 1, fp);
+    fclose(fp);
+    assert(eval_replay_open("eval_test.cap", &replay) == EVAL_RESULT_OK);
+    assert(eval_replay_execute(replay, 0, &match) == EVAL_RESULT_OK && !match);
+    assert(eval_replay_execute(replay, 1, &match) == EVAL_RESULT_OK && match);
+    eval_replay_destroy(replay);
+
+    fp = fopen("eval_test.cap", "wb");
+    fputs("not a capture", fp);
+    fclose(fp);
+    assert(eval_replay_open("eval_test.cap", &replay) == EVAL_RESULT_INVALID_IMAGE && replay == NULL);
+    assert(eval_replay_open("eval_test.missing", &replay) == EVAL_RESULT_IO_ERROR);
+    remove("eval_test.cap");
+}
+
+/* holds the thread for input milliseconds */
+static EvalResult test_spin(const ExprValue* input, void* user_data, ExprValue* output) {
+    unsigned long long end = eval_port_now_ns() + (unsigned long long)(input->v.val * 1e6);
+    (void)user_data;
+    while(eval_port_now_ns() < end) {
+    }
+    return expr_value_set_number(output, input->v.val);
+}
+
+static EvalFunc test_budget_get_func(const char* name, void* user_data) {
+    if(strcmp(name, "spin") == 0) {
+        return test_spin;
+    }
+
+    return eval_default_hooks()->get_func(name, user_data);
+}
+
+static void test_budget_steps(const char* expr, EvalProgram* program, double expect) {
+    EvalBudget budget;
+    EvalOptions options;
+    ExprValue output;
+    size_t used;
+
+    memset(&options, 0x00, sizeof(options));
+    memset(&budget, 0x00, sizeof(budget));
+    options.budget = &budget;
+    expr_value_init(&output);
+
+    budget.max_steps = 1000;
+    assert((program ? eval_program_execute_ex(program, test_hooks(), NULL, &options, &output) :
+            eval_execute_ex(expr, test_hooks(), NULL, &options, &output)) == EVAL_RESULT_OK);
+    assert(output.v.val == expect);
+    assert(budget.steps_left > 0 && budget.steps_left < 1000 && budget.ns_left == 0);
+    used = 1000 - budget.steps_left;
+
+    /* exactly enough, then one short */
+    budget.max_steps = used;
+    assert((program ? eval_program_execute_ex(program, test_hooks(), NULL, &options, &output) :
+            eval_execute_ex(expr, test_hooks(), NULL, &options, &output)) == EVAL_RESULT_OK);
+    assert(output.v.val == expect && budget.steps_left == 0);
+    budget.max_steps = used - 1;
+    assert((program ? eval_program_execute_ex(program, test_hooks(), NULL, &options, &output) :
+            eval_execute_ex(expr, test_hooks(), NULL, &options, &output)) == EVAL_RESULT_BUDGET_EXCEEDED);
+    assert(budget.steps_left == 0);
+}
+
+static void test_budget(void) {
+    static char flat[4 * 10000 + 1];
+    EvalProgram* program = NULL;
+    EvalBudget budget;
+    EvalOptions options;
+    EvalHooks hooks;
+    ExprValue output;
+    size_t i;
+
+    test_budget_steps("floor($x / 2) + $w", NULL, 102);
+    assert(eval_compile("floor($x / 2) + $w", &program) == EVAL_RESULT_OK);
+    test_budget_steps(NULL, program, 102);
+    eval_program_destroy(program);
+
+    memset(&options, 0x00, sizeof(options));
+    memset(&budget, 0x00, sizeof(budget));
+    options.budget = &budget;
+    expr_value_init(&output);
+    memset(&hooks, 0, sizeof(hooks));
+    hooks.get_func = test_budget_get_func;
+    hooks.get_variable = test_get_variable;
+
+    /* long and flat */
+    for(i = 0; i < 10000; i++) {
+        strcpy(flat + i * 4, i ? " + 1" : "   1");
+    }
+    budget.max_steps = 100;
+    assert(eval_execute_ex(flat, &hooks, NULL, &options, &output) == EVAL_RESULT_BUDGET_EXCEEDED);
+    budget.max_steps = 0;
+    budget.timeout_ns = 10000000000ull;
+    assert(eval_execute_ex(flat, &hooks, NULL, &options, &output) == EVAL_RESULT_OK);
+    assert(output.v.val == 10000 && budget.ns_left > 0 && budget.ns_left < budget.timeout_ns);
+
+    /* a slow function is not interrupted, it is caught when it returns */
+    budget.timeout_ns = 1000000;
+    assert(eval_execute_ex("spin(2) + 1", &hooks, NULL, &options, &output) == EVAL_RESULT_BUDGET_EXCEEDED);
+    assert(budget.ns_left == 0);
+    budget.timeout_ns = 1000000000ull;
+    assert(eval_execute_ex("spin(0.1) + 1", &hooks, NULL, &options, &output) == EVAL_RESULT_OK);
+    assert(output.v.val == 1.1);
+
+    /* no budget, no limit */
+    options.budget = NULL;
+    assert(eval_execute_ex(flat, &hooks, NULL, &options, &output) == EVAL_RESULT_OK);
+    assert(strcmp(eval_result_to_string(EVAL_RESULT_BUDGET_EXCEEDED), "budget exceeded") == 0);
+}
+
+static EvalResult test_memory_get_variable(const char* name, void* user_data, ExprValue* output) {
+    static char big[1001];
+    if(strcmp(name, "big") == 0) {
+        memset(big, 'x', 1000);
+        return expr_value_set_string(output, big, 1000);
+    }
+
+    return test_get_variable(name, user_data, output);
+}
+
+static void test_memory(void) {
+    static const EvalAllocator COUNTING = {counting_alloc, counting_realloc, counting_free, NULL};
+    static const char* FAILING[] = {
+        "$big + (", "toupper($big) + $nope", "($big * 2) )", "strlen($big + $big) + nofunc(1)",
+        "tolower($big + 1 + ($big", "$big + $big +"};
+    const char* expr = "toupper($big) + \"-\" + ($big * 2)";
+    EvalProgram* program = NULL;
+    EvalBudget budget;
+    EvalOptions options;
+    EvalHooks hooks;
+    ExprValue output;
+    size_t peak;
+    size_t nr_ok = 0;
+    size_t i;
+
+    memset(&hooks, 0, sizeof(hooks));
+    hooks.get_func = eval_default_hooks()->get_func;
+    hooks.get_variable = test_memory_get_variable;
+    memset(&options, 0x00, sizeof(options));
+    memset(&budget, 0x00, sizeof(budget));
+    options.budget = &budget;
+    expr_value_init(&output);
+    eval_set_allocator(&COUNTING);
+
+    /* counted without a limit */
+    assert(eval_execute_ex(expr, &hooks, NULL, &options, &output) == EVAL_RESULT_OK);
+    assert(output.type == EXPR_VALUE_TYPE_STRING && output.v.str.size == 2003);
+    peak = budget.peak_bytes;
+    assert(peak >= 3 * 1000);
+    expr_value_clear(&output);
+    assert(nr_live_blocks == 0);
+
+    /* every limit below the peak fails cleanly */
+    for(i = 1; i <= peak; i += 61) {
+        budget.max_bytes = i;
+        assert(eval_execute_ex(expr, &hooks, NULL, &options, &output) == EVAL_RESULT_OOM);
+        assert(budget.peak_bytes <= i);
+        assert(nr_live_blocks == 0);
+    }
+    budget.max_bytes = peak;
+    assert(eval_execute_ex(expr, &hooks, NULL, &options, &output) == EVAL_RESULT_OK);
+    assert(budget.peak_bytes == peak);
+    expr_value_clear(&output);
+    assert(nr_live_blocks == 0);
+
+    assert(eval_compile(expr, &program) == EVAL_RESULT_OK);
+    for(i = 1; i <= peak + 61; i += 61) {
+        budget.max_bytes = i;
+        if(eval_program_execute_ex(program, &hooks, NULL, &options, &output) == EVAL_RESULT_OK) {
+            assert(output.v.str.size == 2003);
+            expr_value_clear(&output);
+            nr_ok++;
+        }
+        assert(nr_live_blocks == 1);
+    }
+    assert(nr_ok > 0 && nr_ok < i / 61);
+    eval_program_destroy(program);
+
+    /* errors part way through leave nothing behind */
+    for(i = 0; i < sizeof(FAILING) / sizeof(*FAILING); i++) {
+        assert(eval_execute(FAILING[i], &hooks, NULL, &output) != EVAL_RESULT_OK);
+        assert(nr_live_blocks == 0);
+    }
+
+    eval_set_allocator(NULL);
+}
+
+static void test_parse_error(const char* expr, EvalResult expect) {
+    EvalProgram* program = NULL;
+    ExprValue output;
+
+    expr_value_init(&output);
+    assert(eval_execute(expr, test_hooks(), 0, &output) == expect);
+    assert(output.type == EXPR_VALUE_TYPE_NUMBER);
+    assert(eval_compile(expr, &program) == expect && program == NULL);
+}
+
+static void test_lexer(void) {
+    char expr[400];
+    char expect[400];
+    size_t i;
+
+    /*escapes past the lexer's initial buffer, runs longer than a 16 byte scan*/
+    expr[0] = '"';
+    for(i = 0; i < 150; i++) {
+        expr[1 + i * 2] = '\\';
+        expr[2 + i * 2] = (char)('a' + i % 26);
+        expect[i] = (char)('a' + i % 26);
+    }
+    strcpy(expr + 301, "\" + \"tail\"");
+    strcpy(expect + 150, "tail");
+    test_str(expr, expect);
+    test_program(expr);
+
+    memset(expr, ' ', 100);
+    strcpy(expr + 100, "1 +\t\r\n                                      2");
+    test_number(expr, 3);
+
+    test_number("number(\"12345678901234567890123456789\") > 1", 1);
+    test_program("$device_display_brightness * 2");
+}
+
+static EvalSymbol test_symbols[2];
+static size_t nr_symbol_lookups;
+
+static EvalResult test_get_variable_symbol(EvalSymbol symbol, void* user_data, ExprValue* output) {
+    (void)user_data;
+    nr_symbol_lookups++;
+    if(symbol == test_symbols[0]) {
+        return expr_value_set_number(output, 6);
+    } else if(symbol == test_symbols[1]) {
+        return expr_value_set_number(output, 7);
+    }
+
+    return EVAL_RESULT_UNDEFINED_VARIABLE;
+}
+
+static void test_symbol(void) {
+    const char* name = "a_name_well_past_the_old_sixteen_byte_limit";
+    EvalProgram* program = NULL;
+    EvalSymbol symbol;
+    EvalHooks hooks;
+    ExprValue output;
+
+    assert(eval_symbol_intern(name, strlen(name), &symbol) == EVAL_RESULT_OK);
+    assert(symbol != EVAL_SYMBOL_NONE && strcmp(eval_symbol_name(symbol), name) == 0);
+    assert(eval_symbol_intern(name, strlen(name), &test_symbols[0]) == EVAL_RESULT_OK && test_symbols[0] == symbol);
+    assert(eval_symbol_intern(name, 6, &test_symbols[0]) == EVAL_RESULT_OK && test_symbols[0] != symbol);
+    assert(strcmp(eval_symbol_name(test_symbols[0]), "a_name") == 0);
+    assert(eval_symbol_name(EVAL_SYMBOL_NONE) == NULL);
+    assert(eval_symbol_intern("rate", 4, &test_symbols[1]) == EVAL_RESULT_OK);
+
+    /*the symbol hooks win over the name hooks*/
+    memset(&hooks, 0, sizeof(hooks));
+    hooks.get_func = eval_default_hooks()->get_func;
+    hooks.get_variable = test_get_variable;
+    hooks.get_variable_symbol = test_get_variable_symbol;
+    expr_value_init(&output);
+    assert(eval_execute("$a_name * $rate + sqrt(4)", &hooks, NULL, &output) == EVAL_RESULT_OK);
+    assert(output.v.val == 44 && nr_symbol_lookups == 2);
+    assert(eval_execute("$x", &hooks, NULL, &output) == EVAL_RESULT_UNDEFINED_VARIABLE);
+
+    assert(eval_compile("$a_name * $rate", &program) == EVAL_RESULT_OK);
+    assert(eval_program_execute(program, &hooks, NULL, &output) == EVAL_RESULT_OK);
+    assert(output.v.val == 42 && nr_symbol_lookups == 5);
+    eval_program_destroy(program);
+
+    /*the builtins answer by symbol and by name*/
+    symbol = EVAL_SYMBOL_NONE;
+    assert(eval_symbol_intern("PI", 2, &symbol) == EVAL_RESULT_OK);
+    assert(eval_default_hooks()->get_variable_symbol(symbol, NULL, &output) == EVAL_RESULT_OK);
+    assert(output.v.val > 3.14 && output.v.val < 3.15);
+    assert(eval_default_hooks()->get_func("sqrt", NULL) != NULL);
+    assert(eval_default_hooks()->get_func(name, NULL) == NULL);
+}
+
+static void test_value(void) {
+    static const char* names[3] = {"ab", NULL, "a string longer than a value"};
+    EvalValue values[3];
+    EvalColumn column;
+    EvalRowSet rows;
+    EvalExecContext ctx;
+    EvalProgram* program = NULL;
+    ExprValue output;
+    const char* str;
+    EvalValue v;
+    size_t i;
+
+    assert(sizeof(EvalValue) == 8);
+    v = 0;
+    assert(!eval_value_is_string(v) && eval_value_get_number(v) == 0 && eval_value_get_string(v) == NULL);
+    assert(eval_value_get_number(eval_value_number(-2.5)) == -2.5);
+    assert(eval_value_get_number(eval_value_int(-7)) == -7);
+    v = eval_value_number(0.0 / 0.0);
+    assert(!eval_value_is_string(v) && eval_value_get_number(v) != eval_value_get_number(v));
+
+    assert(eval_value_set_string(&v, "12", 2) == EVAL_RESULT_OK);
+    assert(eval_value_is_string(v) && eval_value_get_size(v) == 2 && eval_value_get_number(v) == 12);
+    assert(eval_value_set_string(&v, "hello", 5) == EVAL_RESULT_OK);
+    assert(strcmp(eval_value_get_string(v), "hello") == 0 && eval_value_get_size(v) == 5);
+
+    /*strings move between the two forms without a copy*/
+    str = eval_value_get_string(v);
+    expr_value_init(&output);
+    eval_value_to_expr(&v, &output);
+    assert(v == 0 && expr_value_is_string(&output) && expr_value_get_string(&output) == str);
+    assert(expr_value_get_size(&output) == 5);
+    eval_value_from_expr(&v, &output);
+    assert(!expr_value_is_string(&output) && eval_value_get_string(v) == str);
+    eval_value_clear(&v);
+    assert(v == 0);
+
+    assert(eval_compile("$name + \"-\" + strlen($name)", &program) == EVAL_RESULT_OK);
+    column.name = "name";
+    column.type = EXPR_VALUE_TYPE_STRING;
+    column.numbers = NULL;
+    column.strings = names;
+    rows.nr_rows = 3;
+    rows.nr_columns = 1;
+    rows.columns = &column;
+    memset(values, 0, sizeof(values));
+    assert(eval_rows_execute_values(NULL, program, &rows, eval_default_hooks(), NULL, values, NULL) == EVAL_RESULT_OK);
+    assert(strcmp(eval_value_get_string(values[0]), "ab-2") == 0);
+    assert(strcmp(eval_value_get_string(values[1]), "-0") == 0);
+    assert(strcmp(eval_value_get_string(values[2]), "a string longer than a value-28") == 0);
+    for(i = 0; i < 3; i++) {
+        eval_value_clear(values + i);
+    }
+    eval_program_destroy(program);
+
+    assert(eval_compile("(1 + 2) * 4", &program) == EVAL_RESULT_OK);
+    eval_exec_context_init(&ctx);
+    assert(eval_program_execute_value_in(&ctx, program, NULL, NULL, &v) == EVAL_RESULT_OK);
+    assert(!eval_value_is_string(v) && eval_value_get_number(v) == 12);
+    eval_exec_context_deinit(&ctx);
+    eval_program_destroy(program);
+}
+
+/*a fake slow store: $slow_<n> arrives n ticks after it is asked for, fetch(n) answers n * 10 once n ticks passed*/
+typedef struct _TestRequest {
+    int now;
+    int ready;
+    int waiting;
+} TestRequest;
+
+static EvalResult test_slow_get_variable(const char* name, void* user_data, ExprValue* output) {
+    TestRequest* r = (TestRequest*)user_data;
+    if(strncmp(name, "slow_", 5) != 0) {
+        return test_get_variable(name, user_data, output);
+    }
+    r->ready = r->now + atoi(name + 5);
+    return EVAL_RESULT_PENDING;
+}
+
+static EvalResult test_fetch(const ExprValue* input, void* user_data, ExprValue* output) {
+    TestRequest* r = (TestRequest*)user_data;
+    double n = expr_value_get_number(input);
+    if(!r->waiting) {
+        r->waiting = 1;
+        r->ready = r->now + (int)n;
+    }
+    if(r->now < r->ready) {
+        return EVAL_RESULT_PENDING;
+    }
+    r->waiting = 0;
+    return expr_value_set_number(output, n * 10);
+}
+
+static EvalFunc test_slow_get_func(const char* name, void* user_data) {
+    if(strcmp(name, "fetch") == 0) {
+        return test_fetch;
+    }
+    return eval_default_hooks()->get_func(name, user_data);
+}
+
+static void test_async(void) {
+    const char* exprs[4] = {"$slow_3 + $slow_1 * 2", "fetch(2) + fetch(1) + $x", "\"id-\" + $slow_2", "1 + 2"};
+    EvalContinuation* continuations[4];
+    TestRequest requests[4];
+    char deep[128];
+    ExprValue outputs[4];
+    EvalProgram* program = NULL;
+    EvalHooks hooks;
+    ExprValue value;
+    size_t nr_pending = 0;
+    size_t i;
+    int now;
+
+    memset(&hooks, 0, sizeof(hooks));
+    hooks.get_func = test_slow_get_func;
+    hooks.get_variable = test_slow_get_variable;
+    memset(requests, 0, sizeof(requests));
+
+    /*one thread keeps all of them in flight and resumes each when its value arrives*/
+    for(i = 0; i < 4; i++) {
+        expr_value_init(outputs + i);
+        assert(eval_execute_async(exprs[i], &hooks, requests + i, outputs + i, continuations + i) ==
+               (i < 3 ? EVAL_RESULT_PENDING : EVAL_RESULT_OK));
+        assert((continuations[i] != NULL) == (i < 3));
+        nr_pending += continuations[i] != NULL;
+    }
+    assert(strcmp(eval_continuation_name(continuations[0]), "slow_3") == 0);
+    assert(strcmp(eval_continuation_name(continuations[1]), "fetch") == 0);
+
+    for(now = 1; nr_pending; now++) {
+        assert(now < 10);
+        for(i = 0; i < 4; i++) {
+            EvalResult result;
+            if(continuations[i] == NULL || requests[i].ready > now) {
+                continue;
+            }
+            requests[i].now = now;
+            if(strncmp(eval_continuation_name(continuations[i]), "slow_", 5) == 0) {
+                expr_value_init(&value);
+                expr_value_set_number(&value, atoi(eval_continuation_name(continuations[i]) + 5));
+                result = eval_continuation_resume(continuations[i], &value, outputs + i);
+            } else {
+                result = eval_continuation_resume(continuations[i], NULL, outputs + i);
+            }
+            if(result != EVAL_RESULT_PENDING) {
+                assert(result == EVAL_RESULT_OK);
+                continuations[i] = NULL;
+                nr_pending--;
+            }
+        }
+    }
+    assert(now <= 6);
+    assert(expr_value_get_number(outputs + 0) == 5);
+    assert(expr_value_get_number(outputs + 1) == 35);
+    assert(strcmp(expr_value_get_string(outputs + 2), "id-2") == 0);
+    assert(expr_value_get_number(outputs + 3) == 3);
+    for(i = 0; i < 4; i++) {
+        expr_value_clear(outputs + i);
+    }
+
+    /*a program is shared by its continuations, abandoned ones free what they hold*/
+    assert(eval_compile("\"held \" + $slow_1", &program) == EVAL_RESULT_OK);
+    assert(eval_program_execute_async(program, &hooks, requests, outputs, continuations) == EVAL_RESULT_PENDING);
+    assert(eval_program_execute_async(program, &hooks, requests, outputs, continuations + 1) == EVAL_RESULT_PENDING);
+    eval_continuation_destroy(continuations[0]);
+    expr_value_init(&value);
+    expr_value_set_string(&value, "x", 1);
+    assert(eval_continuation_resume(continuations[1], &value, outputs) == EVAL_RESULT_OK);
+    assert(strcmp(expr_value_get_string(outputs), "held x") == 0);
+    expr_value_clear(outputs);
+    eval_program_destroy(program);
+
+    /*locals are on the stack, so they are kept while it waits*/
+    assert(eval_execute_async("s = \"v\" + $x; t = s + $slow_1; s + t", &hooks, requests, outputs, continuations) ==
+           EVAL_RESULT_PENDING);
+    expr_value_init(&value);
+    expr_value_set_string(&value, "!", 1);
+    assert(eval_continuation_resume(continuations[0], &value, outputs) == EVAL_RESULT_OK);
+    assert(strcmp(expr_value_get_string(outputs), "v5v5!") == 0);
+    expr_value_clear(outputs);
+
+    /*deeper than the stack kept on the caller's stack*/
+    strcpy(deep, "$slow_1");
+    for(i = 0; i < 20; i++) {
+        memmove(deep + 4, deep, strlen(deep) + 1);
+        memcpy(deep, "1 +(", 4);
+        strcat(deep, ")");
+    }
+    eval_set_max_depth(0);
+    assert(eval_execute_async(deep, &hooks, requests, outputs, continuations) == EVAL_RESULT_PENDING);
+    eval_set_max_depth(EVAL_MAX_STACK_DEPTH);
+    expr_value_init(&value);
+    expr_value_set_number(&value, 1);
+    assert(eval_continuation_resume(continuations[0], &value, outputs) == EVAL_RESULT_OK);
+    assert(expr_value_get_number(outputs) == 21);
+
+    /*the blocking calls report it as a failure*/
+    assert(eval_execute("1 + $slow_1", &hooks, requests, outputs) == EVAL_RESULT_PENDING);
+    assert(eval_execute_async("1 +", &hooks, requests, outputs, continuations) == EVAL_RESULT_EXPECTED_TERM);
+    assert(continuations[0] == NULL);
+    assert(strcmp(eval_result_to_string(EVAL_RESULT_PENDING), "pending") == 0);
+}
+
+static size_t nr_measure_calls = 0;
+
+static EvalResult test_measure(const ExprValue* input, void* user_data, ExprValue* output) {
+    (void)user_data;
+    nr_measure_calls++;
+    if(input->type == EXPR_VALUE_TYPE_STRING) {
+        return expr_value_set_number(output, input->v.str.size * 7);
+    }
+    return expr_value_set_string(output, "wide", 4);
+}
+
+/*drops everything kept now and then while other threads read it*/
+static EvalResult test_churn(const ExprValue* input, void* user_data, ExprValue* output) {
+    char buff[32];
+
+    (void)user_data;
+    if((unsigned int)input->v.val % 5 == 0) {
+        eval_func_memo_invalidate(NULL);
+    }
+    sprintf(buff, "w%u", (unsigned int)input->v.val);
+    return expr_value_set_string(output, buff, strlen(buff));
+}
+
+static EvalFunc test_memo_get_func(const char* name, void* user_data) {
+    if(strcmp(name, "measure") == 0) {
+        return test_measure;
+    }
+    if(strcmp(name, "churn") == 0) {
+        return test_churn;
+    }
+    return eval_default_hooks()->get_func(name, user_data);
+}
+
+static void test_memo(void) {
+    static char buff[1 << 17];
+    EvalThreadPool* pool = NULL;
+    EvalProgram* program = NULL;
+    size_t nr_failed = 0;
+    FILE* in;
+    FILE* out;
+    EvalMemoStats stats;
+    EvalHooks hooks;
+    ExprValue output;
+    char expr[64];
+    size_t i;
+
+    memset(&hooks, 0, sizeof(hooks));
+    hooks.get_func = test_memo_get_func;
+    hooks.get_variable = test_get_variable;
+    expr_value_init(&output);
+    assert(eval_func_memo_stats(test_measure, &stats) == EVAL_RESULT_UNDEFINED_FUNCTION);
+    assert(eval_func_set_pure(test_measure, 3) == EVAL_RESULT_OK);
+
+    /*the second call with the same argument is answered from the table*/
+    assert(eval_execute("measure(\"abc\") + measure(\"abc\") + measure($x) + measure($x)", &hooks, NULL, &output)
+           == EVAL_RESULT_OK);
+    assert(strcmp(expr_value_get_string(&output), "42widewide") == 0 && nr_measure_calls == 2);
+    expr_value_clear(&output);
+    assert(eval_func_memo_stats(test_measure, &stats) == EVAL_RESULT_OK);
+    assert(stats.hits == 2 && stats.misses == 2 && stats.capacity == 4 && stats.size <= 2);
+
+    /*the type and the bits of the argument are the key*/
+    assert(eval_execute("measure(\"5\") + measure(-0) + measure(0)", &hooks, NULL, &output) == EVAL_RESULT_OK);
+    assert(nr_measure_calls == 5);
+    expr_value_clear(&output);
+
+    /*compiled programs share the table*/
+    assert(eval_compile("measure($theme)", &program) == EVAL_RESULT_OK);
+    assert(eval_program_execute(program, &hooks, NULL, &output) == EVAL_RESULT_OK);
+    assert(eval_program_execute(program, &hooks, NULL, &output) == EVAL_RESULT_OK);
+    assert(output.v.val == 28 && nr_measure_calls == 6);
+
+    eval_func_memo_invalidate(test_measure);
+    assert(eval_program_execute(program, &hooks, NULL, &output) == EVAL_RESULT_OK);
+    assert(nr_measure_calls == 7);
+    eval_func_memo_invalidate(NULL);
+    assert(eval_func_memo_stats(test_measure, &stats) == EVAL_RESULT_OK && stats.size == 0);
+    eval_program_destroy(program);
+
+    /*the table stays bounded*/
+    for(i = 0; i < 100; i++) {
+        sprintf(expr, "measure(%u) + measure(%u)", (unsigned int)i, (unsigned int)i);
+        assert(eval_execute(expr, &hooks, NULL, &output) == EVAL_RESULT_OK);
+        expr_value_clear(&output);
+    }
+    assert(eval_func_memo_stats(test_measure, &stats) == EVAL_RESULT_OK);
+    assert(stats.size <= stats.capacity && stats.evictions > 0);
+
+    assert(eval_func_set_pure(test_measure, 0) == EVAL_RESULT_OK);
+    assert(eval_func_memo_stats(test_measure, &stats) == EVAL_RESULT_UNDEFINED_FUNCTION);
+    i = nr_measure_calls;
+    assert(eval_execute("measure(1) + measure(1)", &hooks, NULL, &output) == EVAL_RESULT_OK);
+    assert(nr_measure_calls == i + 2);
+    expr_value_clear(&output);
+
+    /*threads hit, store and invalidate the same table at once*/
+    assert(eval_func_set_pure(test_churn, 8) == EVAL_RESULT_OK);
+    in = tmpfile();
+    out = tmpfile();
+    for(i = 0; i < 4000; i++) {
+        fprintf(in, "churn(%u) + churn(%u)\n", (unsigned int)(i % 16), (unsigned int)(i % 16));
+    }
+    rewind(in);
+    assert(eval_thread_pool_create(4, &pool) == EVAL_RESULT_OK);
+    assert(eval_stream(pool, in, out, &hooks, NULL, &nr_failed) == EVAL_RESULT_OK);
+    assert(nr_failed == 0);
+    eval_thread_pool_destroy(pool);
+    read_all(out, buff, sizeof(buff));
+    assert(strncmp(buff, "string: w0w0\nstring: w1w1\n", 26) == 0 && strstr(buff, "w15w15\nstring: w0w0\n") != NULL);
+    assert(eval_func_memo_stats(test_churn, &stats) == EVAL_RESULT_OK && stats.hits + stats.misses == 8000);
+    assert(eval_func_set_pure(test_churn, 0) == EVAL_RESULT_OK);
+    fclose(in);
+    fclose(out);
+}
+
+static char test_expected_byte(const char* func, char c, char separator) {
+    if(strcmp(func, "toupper") == 0) {
+        return (c >= 'a' && c <= 'z') ? (char)(c - 32) : c;
+    } else if(strcmp(func, "tolower") == 0) {
+        return (c >= 'A' && c <= 'Z') ? (char)(c + 32) : c;
+    }
+    return (c == '/' || c == '\\') ? separator : c;
+}
+
+static void test_transform(void) {
+    static const char* FUNCS[3] = {"toupper", "tolower", "path"};
+    static const EvalAllocator COUNTING = {counting_alloc, counting_realloc, counting_free, NULL};
+    static char text[80][81];
+    static const char* strings[80];
+    static ExprValue outputs[80];
+    char expr[32];
+    EvalColumn column;
+    EvalRowSet rows;
+    EvalProgram* program = NULL;
+    ExprValue input;
+    ExprValue output;
+    char separator;
+    size_t before;
+    size_t f;
+    size_t i;
+    size_t j;
+
+    /*every length around the 16 byte blocks, with letters, separators and bytes from 0x80 up at every offset*/
+    for(i = 0; i < 80; i++) {
+        for(j = 0; j < i; j++) {
+            text[i][j] = "aZ/\\m@[`{\x80\xe1\xc3zA9"[(i + j) % 15];
+        }
+        text[i][i] = '\0';
+        strings[i] = text[i];
+    }
+    column.name = "s";
+    column.type = EXPR_VALUE_TYPE_STRING;
+    column.numbers = NULL;
+    column.strings = strings;
+    rows.nr_rows = 80;
+    rows.nr_columns = 1;
+    rows.columns = &column;
+
+    expr_value_init(&output);
+    assert(eval_execute("path(\"/\")", eval_default_hooks(), NULL, &output) == EVAL_RESULT_OK);
+    separator = expr_value_get_string(&output)[0];
+    expr_value_clear(&output);
+
+    for(f = 0; f < 3; f++) {
+        EvalFunc func = eval_default_hooks()->get_func(FUNCS[f], NULL);
+
+        /*a temporary of the evaluator is changed in place, the caller's copy is left alone*/
+        sprintf(expr, "%s($s)", FUNCS[f]);
+        assert(eval_compile(expr, &program) == EVAL_RESULT_OK);
+        memset(outputs, 0, sizeof(outputs));
+        assert(eval_rows_execute(NULL, program, &rows, eval_default_hooks(), NULL, outputs, NULL) == EVAL_RESULT_OK);
+        for(i = 0; i < 80; i++) {
+            expr_value_init(&input);
+            expr_value_set_string(&input, text[i], i);
+            expr_value_init(&output);
+            assert(func(&input, NULL, &output) == EVAL_RESULT_OK);
+            assert(output.v.str.size == i && outputs[i].v.str.size == i && strcmp(input.v.str.str, text[i]) == 0);
+            for(j = 0; j < i; j++) {
+                char c = test_expected_byte(FUNCS[f], text[i][j], separator);
+                assert(output.v.str.str[j] == c && outputs[i].v.str.str[j] == c);
+            }
+            expr_value_clear(&input);
+            expr_value_clear(&output);
+            expr_value_clear(outputs + i);
+        }
+        eval_program_destroy(program);
+    }
+
+    /*no copy is made of an argument the evaluator owns*/
+    eval_set_allocator(&COUNTING);
+    before = nr_allocs;
+    assert(eval_execute("$theme + \"/x\"", test_hooks(), NULL, &output) == EVAL_RESULT_OK);
+    expr_value_clear(&output);
+    i = nr_allocs - before;
+    before = nr_allocs;
+    assert(eval_execute("path(toupper($theme + \"/x\"))", test_hooks(), NULL, &output) == EVAL_RESULT_OK);
+    assert(nr_allocs - before == i && strcmp(expr_value_get_string(&output), "DARK/X") == 0);
+    expr_value_clear(&output);
+    eval_set_allocator(NULL);
+}
+
+static void test_search(void) {
+    static const EvalAllocator COUNTING = {counting_alloc, counting_realloc, counting_free, NULL};
+    static const char* EXPRS[] = {"contains($theme, \"ar\")", "find($theme, \"k\")", "startswith($theme, \"da\")",
+                                  "endswith($theme, \"rk\")", "substr($theme, 1, 2)", "matches($theme, \"^d[a-z]+$\")"};
+    char haystack[100];
+    char needle[40];
+    char expr[320];
+    EvalProgram* program = NULL;
+    EvalProgram* plain = NULL;
+    ExprValue output;
+    size_t before;
+    size_t m;
+    size_t o;
+    size_t i;
+
+    /*needles of every length ending at every offset around the 16 byte blocks, among near misses*/
+    expr_value_init(&output);
+    for(m = 1; m < 40; m++) {
+        memset(needle, 'a', m - 1);
+        needle[m - 1] = 'b';
+        needle[m] = '\0';
+        for(o = 0; o + m <= 96; o++) {
+            memset(haystack, 'a', 96);
+            haystack[o + m - 1] = 'b';
+            haystack[96] = '\0';
+
+            sprintf(expr, "find(\"%s\", \"%s\") * 2 + contains(\"%s\", \"%sc\")", haystack, needle, haystack, needle);
+            assert(eval_execute(expr, eval_default_hooks(), NULL, &output) == EVAL_RESULT_OK);
+            assert(output.v.val == (double)o * 2);
+            test_program(expr);
+
+            /*a needle worked out at run time*/
+            sprintf(expr, "find(\"%s\", \"\" + \"%s\")", haystack, needle);
+            test_program(expr);
+        }
+    }
+
+    /*a single argument goes to the hooks*/
+    assert(eval_execute("contains(\"a\")", eval_default_hooks(), NULL, &output) == EVAL_RESULT_UNDEFINED_FUNCTION);
+
+    /*only the variable's value is allocated when the answer is a number or a piece of it;
+      literal patterns are compiled once per process, before counting since they are never freed*/
+    for(i = 0; i < sizeof(EXPRS) / sizeof(*EXPRS); i++) {
+        assert(eval_compile(EXPRS[i], &program) == EVAL_RESULT_OK);
+        eval_program_destroy(program);
+    }
+    eval_set_allocator(&COUNTING);
+    assert(eval_compile("$theme", &plain) == EVAL_RESULT_OK);
+    assert(eval_program_execute(plain, test_hooks(), NULL, &output) == EVAL_RESULT_OK);
+    expr_value_clear(&output);
+    before = nr_allocs;
+    assert(eval_program_execute(plain, test_hooks(), NULL, &output) == EVAL_RESULT_OK);
+    expr_value_clear(&output);
+    m = nr_allocs - before;
+    for(i = 0; i < sizeof(EXPRS) / sizeof(*EXPRS); i++) {
+        assert(eval_compile(EXPRS[i], &program) == EVAL_RESULT_OK);
+        before = nr_allocs;
+        assert(eval_program_execute(program, test_hooks(), NULL, &output) == EVAL_RESULT_OK);
+        assert(nr_allocs - before == m);
+        expr_value_clear(&output);
+        eval_program_destroy(program);
+    }
+    eval_program_destroy(plain);
+    eval_set_allocator(NULL);
+}
+
+static EvalResult test_pattern_get_variable(const char* name, void* user_data, ExprValue* output) {
+    const char* pattern = (const char*)user_data;
+
+    if(strcmp(name, "p") == 0) {
+        return expr_value_set_string(output, pattern, strlen(pattern));
+    }
+
+    return EVAL_RESULT_UNDEFINED_VARIABLE;
+}
+
+/*-1 for a pattern that does not compile*/
+static double test_match(const char* subject, const char* pattern) {
+    static EvalHooks hooks;
+    EvalResult result;
+    ExprValue output;
+    size_t size = strlen(subject) + 32;
+    char* expr = (char*)malloc(size);
+
+    hooks.get_variable = test_pattern_get_variable;
+    snprintf(expr, size, "matches(\"%s\", $p)", subject);
+    expr_value_init(&output);
+    result = eval_execute(expr, &hooks, (void*)pattern, &output);
+    assert(result == EVAL_RESULT_OK || result == EVAL_RESULT_INVALID_PATTERN);
+    free(expr);
+
+    return result == EVAL_RESULT_OK ? output.v.val : -1;
+}
+
+static void test_regex(void) {
+    static const EvalAllocator COUNTING = {counting_alloc, counting_realloc, counting_free, NULL};
+    size_t n = 100000;
+    char* subject = (char*)malloc(n + 1);
+    EvalThreadPool* pool = NULL;
+    EvalProgram* program = NULL;
+    size_t nr_failed = 0;
+    size_t live;
+    FILE* in;
+    FILE* out;
+    EvalSymbol before;
+    EvalSymbol after;
+    int expect;
+    size_t i;
+
+    /*backslashes only come from variables, the lexer drops them from literals*/
+    assert(test_match("ab_1.25 ", "^\\w+\\.\\d{2}\\s$") == 1);
+    assert(test_match("ab 1.25", "^\\w+\\.\\d{2}") == 0);
+    assert(test_match("a+b", "^[\\w+]+$") == 1);
+    assert(test_match("tab\tx", "\\t[^\\D]?x") == 1);
+
+    /*patterns a backtracking matcher takes exponential time over finish in one pass*/
+    memset(subject, 'x', n);
+    subject[n] = '\0';
+    assert(test_match(subject, "(x+x+)+y") == 0);
+    assert(test_match(subject, "(x*)*y") == 0);
+    assert(test_match(subject, "^(x|xx)+$") == 1);
+    assert(test_match(subject, "^(x?){50}x{50}$") == 0);
+    assert(test_match(subject, "x{1000}$") == 1);
+
+    /*"an a 12 from the end" needs thousands of DFA states, the NFA runs instead*/
+    for(i = 0; i < n; i++) {
+        subject[i] = (char)((i * 7 / 3) % 5 ? 'b' : 'a');
+    }
+    expect = subject[n - 13] == 'a';
+    assert(test_match(subject, "a(a|b){12}$") == expect);
+    subject[n - 13] = (char)(expect ? 'b' : 'a');
+    assert(test_match(subject, "a(a|b){12}$") == !expect);
+    assert(test_match(subject, "(a|b)*a(a|b){12}") == 1);
+
+    /*patterns too big to compile are refused*/
+    assert(test_match("x", "(a{1000}){1000}") == -1);
+    assert(test_match("x", "a{1001}") == -1);
+    assert(strcmp(eval_result_to_string(EVAL_RESULT_INVALID_PATTERN), "invalid pattern") == 0);
+
+    /*patterns from variables are cached per thread, not interned: symbols go on from where they were*/
+    assert(eval_symbol_intern("regex_before", 12, &before) == EVAL_RESULT_OK);
+    for(i = 0; i < 20000; i++) {
+        char pattern[32];
+
+        snprintf(pattern, sizeof(pattern), "^p%u$", (unsigned int)i);
+        assert(test_match("p7", pattern) == (i == 7));
+    }
+    assert(test_match("p7", "^p7$") == 1 && test_match("p7", "(") == -1 && test_match("p7", "(") == -1);
+    assert(eval_symbol_intern("regex_after", 11, &after) == EVAL_RESULT_OK);
+    assert(after == before + 1);
+
+    /*literal patterns are interned apart from names*/
+    assert(eval_compile("matches(\"p7\", \"^regex_literal$\")", &program) == EVAL_RESULT_OK);
+    eval_program_destroy(program);
+    assert(eval_symbol_intern("regex_last", 10, &before) == EVAL_RESULT_OK);
+    assert(before == after + 1);
+
+    /*a thread gives its cached patterns back when it is done, pool workers before they exit*/
+    eval_thread_cleanup();
+    live = nr_live_blocks;
+    eval_set_allocator(&COUNTING);
+    assert(test_match("p7", "^p7$") == 1);
+    assert(nr_live_blocks == live + 2);
+    eval_thread_cleanup();
+    assert(nr_live_blocks == live);
+    eval_set_allocator(NULL);
+    in = tmpfile();
+    out = tmpfile();
+    for(i = 0; i < 100; i++) {
+        fprintf(in, "matches(\"p%u\", \"^p\" + %u + \"$\")\n", (unsigned int)i, (unsigned int)i);
+    }
+    rewind(in);
+    assert(eval_thread_pool_create(4, &pool) == EVAL_RESULT_OK);
+    assert(eval_stream(pool, in, out, eval_default_hooks(), NULL, &nr_failed) == EVAL_RESULT_OK);
+    assert(nr_failed == 0);
+    eval_thread_pool_destroy(pool);
+    fclose(in);
+    fclose(out);
+    free(subject);
+}
+
+static EvalResult test_subject_get_variable(const char* name, void* user_data, ExprValue* output) {
+    const ExprValue* subject = (const ExprValue*)user_data;
+
+    if(strcmp(name, "v") == 0) {
+        if(subject->type == EXPR_VALUE_TYPE_STRING) {
+            return expr_value_set_string(output, subject->v.str.str, subject->v.str.size);
+        }
+        return expr_value_set_number(output, subject->v.val);
+    }
+
+    return EVAL_RESULT_UNDEFINED_VARIABLE;
+}
+
+static void test_membership(void) {
+    static const char* STRINGS[] = {"s0", "s7", "s99", "s100", "7", "7.000000", "0.500000", "nan", "", "1e999"};
+    static const double NUMBERS[] = {0, -0.0, 7, 42, 99, 100, 0.5, -3, 1e300};
+    /*then NaN, -1 where the text of the subject depends on the C library*/
+    static const int EXPECT[] = {1, 1, 1, 0, 1, 0, 1, 1, 0, -1, 1, 1, 1, 1, 1, 0, 1, 1, 0, -1};
+    static EvalHooks hooks;
+    size_t size = 4096;
+    char* expr = (char*)malloc(size);
+    size_t len = 0;
+    int negate;
+    size_t i;
+
+    /*more items than fit inline, duplicates, a string and a number with the same text*/
+    len += snprintf(expr + len, size - len, "$v in (");
+    for(i = 0; i < 100; i++) {
+        len += snprintf(expr + len, size - len, "%u, \"s%u\", ", (unsigned int)i, (unsigned int)i);
+    }
+    snprintf(expr + len, size - len, "7, \"s7\", -3, \"0.500000\", \"nan\", -0, 1e999)");
+    hooks.get_variable = test_subject_get_variable;
+
+    for(negate = 0; negate < 2; negate++) {
+        EvalProgram* program = NULL;
+        volatile double zero = 0;
+        ExprValue subject;
+        ExprValue a;
+        ExprValue b;
+
+        if(negate) {
+            memmove(expr + 7, expr + 3, strlen(expr + 3) + 1);
+            memcpy(expr + 3, "not ", 4);
+        }
+        assert(eval_compile(expr, &program) == EVAL_RESULT_OK);
+
+        for(i = 0; i < sizeof(STRINGS) / sizeof(*STRINGS) + sizeof(NUMBERS) / sizeof(*NUMBERS) + 1; i++) {
+            expr_value_init(&subject);
+            if(i < sizeof(STRINGS) / sizeof(*STRINGS)) {
+                expr_value_set_string(&subject, STRINGS[i], strlen(STRINGS[i]));
+            } else if(i < sizeof(STRINGS) / sizeof(*STRINGS) + sizeof(NUMBERS) / sizeof(*NUMBERS)) {
+                expr_value_set_number(&subject, NUMBERS[i - sizeof(STRINGS) / sizeof(*STRINGS)]);
+            } else {
+                expr_value_set_number(&subject, zero / zero);
+            }
+
+            /*compiled lookups agree with reading the list item by item*/
+            expr_value_init(&a);
+            expr_value_init(&b);
+            assert(eval_program_execute(program, &hooks, &subject, &a) == EVAL_RESULT_OK);
+            assert(eval_execute(expr, &hooks, &subject, &b) == EVAL_RESULT_OK);
+            assert(a.type == EXPR_VALUE_TYPE_NUMBER && b.type == EXPR_VALUE_TYPE_NUMBER && a.v.val == b.v.val);
+            if(EXPECT[i] >= 0) {
+                assert(a.v.val == (EXPECT[i] != negate));
+            }
+            expr_value_clear(&subject);
+        }
+        eval_program_destroy(program);
+    }
+    free(expr);
+}
+
+static size_t nr_variable_calls = 0;
+
+static EvalResult test_counting_get_variable(const char* name, void* user_data, ExprValue* output) {
+    nr_variable_calls++;
+    return test_get_variable(name, user_data, output);
+}
+
+static void test_locals(void) {
+    const char* expr = "w = $w - 2 * $x; h = w * 2; w + h + w * h";
+    static EvalHooks hooks;
+    EvalProgram* program = NULL;
+    ExprValue text;
+    ExprValue a;
+    char* many = (char*)malloc(4096);
+    size_t len = 0;
+    size_t i;
+
+    hooks.get_func = eval_default_hooks()->get_func;
+    hooks.get_variable = test_counting_get_variable;
+    expr_value_init(&text);
+    expr_value_init(&a);
+
+    /*host variables are asked for once each, locals never*/
+    assert(eval_execute(expr, &hooks, 0, &a) == EVAL_RESULT_OK);
+    assert(a.type == EXPR_VALUE_TYPE_NUMBER && a.v.val == 16470 && nr_variable_calls == 2);
+    assert(eval_compile(expr, &program) == EVAL_RESULT_OK);
+    nr_variable_calls = 0;
+    assert(eval_program_execute(program, &hooks, 0, &a) == EVAL_RESULT_OK);
+    assert(a.type == EXPR_VALUE_TYPE_NUMBER && a.v.val == 16470 && nr_variable_calls == 2);
+    eval_program_destroy(program);
+
+    /*$name is still the host variable and name() still the function*/
+    test_program("w = 1; $w + w");
+    test_program("sin = 1; sin(0) + sin");
+    test_program("t = toupper($theme); n = strlen(t); t + \"/\" + n * 2 + (n in (4))");
+    test_program("x = $x; x = x * x; x = x + 1; x");
+    test_program("$x; \"a\" + $theme; 3");
+
+    /*slots past the inline arrays, printed the way they were written*/
+    len += snprintf(many + len, 4096 - len, "v0 = 1; ");
+    for(i = 1; i < 100; i++) {
+        len += snprintf(many + len, 4096 - len, "v%u = v%u + 1; ", (unsigned int)i, (unsigned int)i - 1);
+    }
+    snprintf(many + len, 4096 - len, "v99 + v0");
+    assert(eval_execute(many, &hooks, 0, &a) == EVAL_RESULT_OK && a.v.val == 101);
+    assert(eval_compile(many, &program) == EVAL_RESULT_OK);
+    assert(eval_program_execute(program, &hooks, 0, &a) == EVAL_RESULT_OK && a.v.val == 101);
+    assert(eval_program_to_string(program, &text) == EVAL_RESULT_OK);
+    assert(strcmp(expr_value_get_string(&text), many) == 0);
+    eval_program_destroy(program);
+
+    expr_value_clear(&text);
+    free(many);
+}
+
+static void test_depth(void) {
+    size_t n = 100000;
+    char* expr = (char*)malloc(n * 9 + 2);
+    char* p = expr;
+    EvalProgram* program = NULL;
+    ExprValue a;
+    ExprValue b;
+    double expect = 1;
+    size_t i;
+
+    expr_value_init(&a);
+    expr_value_init(&b);
+
+    /*the default limit*/
+    assert(eval_get_max_depth() == EVAL_MAX_STACK_DEPTH);
+    test_number("(((((((1)))))))", 1);
+    test_parse_error("((((((((1))))))))", EVAL_RESULT_STACK_OVERFLOW);
+    test_parse_error("number(number(number(number(number(number(number(number(1))))))))", EVAL_RESULT_STACK_OVERFLOW);
+
+    eval_set_max_depth(3);
+    test_number("(1+(2))", 3);
+    test_parse_error("((1+(2)))", EVAL_RESULT_STACK_OVERFLOW);
+
+    /*no limit: brackets, calls and pending operators all far past the inline stacks*/
+    eval_set_max_depth(0);
+    for(i = 0; i < n; i++) {
+        strcpy(p, i % 2 ? "1+(" : "-number(");
+        p += strlen(p);
+    }
+    *p++ = '1';
+    for(i = n; i > 0; i--) {
+        expect = (i - 1) % 2 ? 1 + expect : -expect;
+        *p++ = ')';
+    }
+    *p = '\0';
+
+    assert(eval_execute(expr, test_hooks(), 0, &a) == EVAL_RESULT_OK);
+    assert(a.type == EXPR_VALUE_TYPE_NUMBER && a.v.val == expect);
+    assert(eval_compile(expr, &program) == EVAL_RESULT_OK);
+    assert(eval_program_execute(program, test_hooks(), 0, &b) == EVAL_RESULT_OK);
+    assert(b.type == EXPR_VALUE_TYPE_NUMBER && b.v.val == expect);
+    eval_program_destroy(program);
+
+    /*an error deep inside still releases everything*/
+    expr[n * 9 / 2] = '@';
+    test_parse_error(expr, EVAL_RESULT_ILLEGAL_CHARACTER);
+
+    eval_set_max_depth(EVAL_MAX_STACK_DEPTH);
+    free(expr);
+}
+
 int main()
 {
     /*string -> number*/
@@ -96,6 +1948,149 @@ int main()
     test_str("toupper(\"aBc\")", "ABC");
     test_str("toupper(\"It Is Upper\")", "IT IS UPPER");
 
+    test_number("contains(\"hello world\", \"o w\")", 1);
+    test_number("contains(\"hello\", \"\")", 1);
+    test_number("contains(12345, 34)", 1);
+    test_number("startswith(\"hello\", \"he\") + startswith(\"he\", \"hello\")", 1);
+    test_number("endswith(\"hello\", \"llo\") + endswith(\"hello\", \"hell\")", 1);
+    test_number("find(\"hello world\", \"world\")", 6);
+    test_number("find(\"hello\", \"lo!\")", -1);
+    test_str("replace(\"a/b/c\", \"/\", \"::\")", "a::b::c");
+    test_str("replace(\"aaaa\", \"aa\", \"b\")", "bb");
+    test_str("replace(\"abc\", \"\", \"x\")", "abc");
+    test_str("replace(2024, 2, 3)", "3034");
+    test_str("replace(123, \"x\", \"y\") + 1", "1231");
+    test_str("replace(5, \"\", \"x\") + 1", "51");
+    test_str("substr(\"hello\", 1, 3)", "ell");
+    test_str("substr(\"hello\", -3)", "llo");
+    test_str("substr(\"hello\", 4, 10) + substr(\"hello\", 9)", "o");
+    test_str("substr(12345, 1, 2)", "23");
+    test_number("matches(\"btn_12\", \"^btn_[0-9]+$\") + matches(\"btn_12x\", \"^btn_[0-9]+$\")", 1);
+    test_number("matches(\"a.b\", \"a[.]b\") + matches(\"axb\", \"a[.]b\")", 1);
+    test_number("matches(\"x-ok\", \"(ok|fine)$\") + matches(\"\", \"^$\") + matches(\"a\", \"^$\")", 2);
+    test_number("matches(\"aaab\", \"^a{2,3}b\") + matches(\"ab\", \"a{2,}b\") + matches(\"]\", \"[]]\")", 2);
+    test_number("matches(\"Menu\", \"^[^a-z][a-z]*$\") + matches(\"key\", \"(?:k|z)e?y\") + matches(\"x\", \"a*\")", 3);
+    test_number("matches(2024, \"^20[0-9]{2}$\")", 1);
+    test_number("2 in (1, 2, 3) + (\"b\" in (\"a\", \"b\")) + (\"c\" not in (\"a\", \"b\"))", 3);
+    test_number("5 in (\"5\", \"x\") + (\"5\" in (5)) + (5 in ()) + (0 in (-0)) + (\"a\" in (1, 2))", 3);
+    test_number("-4 in (3, -4) + (\"1.500000\" in (1.5)) + (1.5 not in (\"1.500000\"))", 2);
+    test_number("1 + 2 in (3)", 1);
+    test_number("a = 2; b = a * 3; a + b", 8);
+    test_number("x = 1; x = x + 1; x * 10", 20);
+    test_str("s = \"ab\"; s + s", "abab");
+
+    /*compiled programs*/
+    test_program("1 + 2 * 3 - -$x");
+    test_program("toupper($theme) + \"/\" + strlen($theme) * 2");
+    test_program("!($x > 3) || ~$w & 255");
+    test_program("1 - 2 - 3 + 4 * 5 - 6 / 3 * 2");
+    test_program("1 < 2 == 1 + 1 * -(2 - 3)");
+    test_program("-strlen(\"abc\") * 2 + ~1 - !!$x");
+    test_program("\"a\" + 1 * 2 - (3 | 4) & 5");
+    test_program("-(-(-(1 + $x)) * 2) / ~-number(\"7\")");
+    test_program("contains($theme, \"ar\") + find(toupper($theme), \"A\" + \"R\") * 2 - endswith($theme, $theme)");
+    test_program("replace($theme + $theme, \"a\", $x) + substr($theme, -$x + 3, find($theme, \"k\"))");
+    test_program("matches($theme, \"^d[a-z]+k$\") * 2 + matches($w, \"^1\" + \"0+$\")");
+    test_program("$theme in (\"light\", \"dark\") * 2 + ($x not in (1, 2, \"5\")) + ($w in (100, \"x\"))");
+    test_program("w = $w - 2 * $x; h = w * 2; w + h");
+
+    /*parser*/
+    test_parse_error("", EVAL_RESULT_EXPECTED_TERM);
+    test_parse_error("1 +", EVAL_RESULT_EXPECTED_TERM);
+    test_parse_error("(1 + 2", EVAL_RESULT_EXPECTED_CLOSE_BRACKET);
+    test_parse_error("(1 2)", EVAL_RESULT_EXPECTED_CLOSE_BRACKET);
+    test_parse_error("1 + 2)", EVAL_RESULT_UNEXPECTED_CHAR);
+    test_parse_error("1 2", EVAL_RESULT_UNEXPECTED_CHAR);
+    test_parse_error("strlen 1", EVAL_RESULT_EXPECTED_OPEN_BRACKET);
+    test_parse_error("strlen(1", EVAL_RESULT_EXPECTED_CLOSE_BRACKET);
+    test_parse_error("1 + ()", EVAL_RESULT_EXPECTED_TERM);
+    test_parse_error("contains(\"a\", \"b\", \"c\")", EVAL_RESULT_UNDEFINED_FUNCTION);
+    test_parse_error("strlen(\"a\", \"b\")", EVAL_RESULT_UNDEFINED_FUNCTION);
+    test_parse_error("1, 2", EVAL_RESULT_UNEXPECTED_CHAR);
+    test_parse_error("(1, 2)", EVAL_RESULT_EXPECTED_CLOSE_BRACKET);
+    test_parse_error("matches(\"a\", \"(a\")", EVAL_RESULT_INVALID_PATTERN);
+    test_parse_error("matches(\"a\", \"[z-a]\")", EVAL_RESULT_INVALID_PATTERN);
+    test_parse_error("matches(\"a\", \"*a\")", EVAL_RESULT_INVALID_PATTERN);
+    test_parse_error("matches(\"a\", \"a{3,2}\")", EVAL_RESULT_INVALID_PATTERN);
+    test_parse_error("2 in 1", EVAL_RESULT_EXPECTED_OPEN_BRACKET);
+    test_parse_error("2 in (1", EVAL_RESULT_EXPECTED_CLOSE_BRACKET);
+    test_parse_error("2 in (1 2)", EVAL_RESULT_EXPECTED_CLOSE_BRACKET);
+    test_parse_error("2 in (1,)", EVAL_RESULT_UNEXPECTED_CHAR);
+    test_parse_error("2 in ($x)", EVAL_RESULT_UNEXPECTED_CHAR);
+    test_parse_error("2 in (-\"a\")", EVAL_RESULT_UNEXPECTED_CHAR);
+    test_parse_error("2 not (1)", EVAL_RESULT_UNEXPECTED_CHAR);
+    test_parse_error("a = 1;", EVAL_RESULT_EXPECTED_TERM);
+    test_parse_error("a = ; 1", EVAL_RESULT_EXPECTED_TERM);
+    test_parse_error("a = 1; (a; 2)", EVAL_RESULT_EXPECTED_CLOSE_BRACKET);
+    test_parse_error("sin = sin + 1; sin", EVAL_RESULT_EXPECTED_OPEN_BRACKET);
+    test_parse_error("a = 1; sin", EVAL_RESULT_EXPECTED_OPEN_BRACKET);
+    test_parse_error("strlen(sin = 1)", EVAL_RESULT_EXPECTED_OPEN_BRACKET);
+    test_depth();
+
+    /*lexer*/
+    test_str("\"a\\\"b\"", "a\"b");
+    test_str("\"a\\\\\\\"b\"", "a\"b");
+    test_str("\"x\\ny\" + \"\"", "xny");
+    test_str("\"0123456789abcdefghijklmnopqrstuvwxyz\" + \"!\"", "0123456789abcdefghijklmnopqrstuvwxyz!");
+    test_number("(1 >= 1) + (2 <= 2) + (1 != 2) + (1 == 1) + (1 = 1) + !0 + ((1 || 0) && (1 | 2))", 7);
+    test_parse_error("\"open", EVAL_RESULT_INVALID_LITERAL);
+    test_parse_error("\"open\\", EVAL_RESULT_INVALID_LITERAL);
+    test_parse_error("\"open\\\"", EVAL_RESULT_INVALID_LITERAL);
+    test_parse_error("1 # 2", EVAL_RESULT_ILLEGAL_CHARACTER);
+    test_lexer();
+    test_symbol();
+    test_value();
+    test_async();
+    test_memo();
+    test_transform();
+    test_search();
+    test_regex();
+    test_membership();
+    test_locals();
+
+    /*partial evaluation*/
+    test_specialize("$w * 2 + $x", "dark", "200 + $x");
+    test_specialize("$flag && ($x > 3)", "dark", "0");
+    test_specialize("$flag && $x > 3", "dark", "0 && $x > 3");
+    test_specialize("$flag && $x", "dark", "0 && $x");
+    test_specialize("$theme + \"-\" + $x", "dark", "\"dark-\" + $x");
+    test_specialize("$x + \"a\" + \"b\"", "dark", "$x + \"ab\"");
+    test_specialize("$theme == \"dark\" || $x", "dark", "1");
+    test_specialize("$theme == \"dark\" || $x", "light", "0 || $x");
+    test_specialize("($x - $w) * -(1 + 2)", "dark", "($x - 100) * -3");
+    test_specialize("-$x + sin($w - 100)", "dark", "-$x + sin(0)");
+    test_specialize("replace($theme, \"a\", \"o\") + find($x, 5)", "dark", "\"dork\" + find($x, 5)");
+    test_specialize("substr($theme, 1, $x) + contains($theme, $x)", "dark", "substr(\"dark\", 1, $x) + contains(\"dark\", $x)");
+    test_specialize("matches($theme, \"^d\") + matches($x, \"^[0-9]$\")", "dark", "1 + matches($x, \"^[0-9]$\")");
+    test_specialize("$theme in (\"dark\", 2) + ($x not in (1, -2.5, \"a\\\"b\"))", "dark",
+                    "1 + $x not in (1, -2.5, \"a\\\"b\")");
+    test_specialize("v = $w * 2; u = v + $x; u - v", "dark", "v = 200; u = 200 + $x; u - 200");
+    test_specialize("v = $w * 2; v / 4", "dark", "50");
+    /*what a constant decides is dropped unevaluated, failures and all ($undefined is not a variable)*/
+    test_specialize("$w > 1 || $undefined", "light", "1");
+    test_specialize("x = $undefined; $w", "light", "100");
+    test_specialize("7 || \"X y\" / 3 - 1000.0 + $x", "dark", "-999.6666666666666 + $x");
+    test_specialize("$w * 0.1 + $w / 7 * 1e-300 + 0.3 + $x", "dark", "10.3 + $x");
+    test_specialize("$w / 3 + $w * 1.1 + $x", "dark", "143.33333333333334 + $x");
+
+    /*program images*/
+    test_image();
+
+    /*parallel*/
+    test_compile_batch();
+    test_rows_execute();
+    test_rows_aggregate();
+    test_rows_filter();
+    test_stream();
+    test_csv();
+    test_allocator();
+    test_malloc_strings();
+    test_stats();
+    test_histograms();
+    test_capture();
+    test_budget();
+    test_memory();
+
     return 0;
 }
 